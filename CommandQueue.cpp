@@ -19,53 +19,107 @@
 
 CommandQueue commandQueue;    //FIFO Queue
 
-int CommandQueue::head = 0;
-int CommandQueue::sendTail = 0;
-int CommandQueue::tail = 0;
-String CommandQueue::commandBuffer[COMMAND_BUFFER_SIZE];
-
-int CommandQueue::getFreeSlots() {
-  int freeSlots = COMMAND_BUFFER_SIZE - 1;
-
-  int next = tail;
-  while (next != head) {
-    --freeSlots;
-    next = nextBufferSlot(next);
-  }
+uint16_t CommandQueue::head = 0;
+uint16_t CommandQueue::sendTail = 0;
+uint16_t CommandQueue::tail = 0;
+uint16_t CommandQueue::usedBytes = 0;
+uint8_t CommandQueue::count = 0;
+uint8_t CommandQueue::sendCount = 0;
+uint32_t CommandQueue::pushed = 0;
+uint32_t CommandQueue::acknowledged = 0;
+char CommandQueue::buffer[COMMAND_BUFFER_SIZE];
+
+uint16_t CommandQueue::getFreeBytes() {
+  uint16_t space;
+  if (count == 0)
+    space = COMMAND_BUFFER_SIZE;
+  else if (head > tail)
+    space = max(COMMAND_BUFFER_SIZE - head, (int)tail);
+  else if (head < tail)
+    space = tail - head;
+  else
+    space = 0;    // Full
 
-  return freeSlots;
+  return space <= 2 ? 0 : space - 2;
 }
 
 // Tries to Add a command to the queue, returns true if possible
-bool CommandQueue::push(const String command) {
-  int next = nextBufferSlot(head);
-  if (next == tail || command == "")
+bool CommandQueue::push(const char *command, size_t length) {
+  if (length == 0 || length > COMMAND_MAX_LENGTH || count == 255)
+    return false;
+
+  const uint16_t size = length + 2;
+  uint16_t start = head;
+  uint16_t wasted = 0;
+  if (count == 0)
+    start = head = sendTail = tail = 0;
+  else if (head > tail) {
+    if (COMMAND_BUFFER_SIZE - head < size) {   // Does not fit at the end, try at the start
+      if (tail < size)
+        return false;
+      wasted = COMMAND_BUFFER_SIZE - head;
+      start = 0;
+    }
+  }
+  else if (tail - head < size)    // Also when full (head == tail)
     return false;
 
-  commandBuffer[head] = command;
-  head = next;
+  if (wasted)
+    buffer[head] = 0;   // Wrap marker
+  buffer[start] = length;
+  memcpy(buffer + start + 1, command, length);
+  buffer[start + 1 + length] = '\0';
+
+  head = start + size;
+  if (head >= COMMAND_BUFFER_SIZE)
+    head = 0;
+  usedBytes += size + wasted;
+  ++count;
+  ++sendCount;
+  ++pushed;
 
   return true;
 }
 
 // Returns the next command to be sent, and advances to the next
-String CommandQueue::popSend() {
-  if (sendTail == head)
-    return String();
+CommandView CommandQueue::popSend() {
+  if (sendCount == 0)
+    return CommandView();
+
+  sendTail = commandAt(sendTail);
+  const CommandView command = viewAt(sendTail);
+  sendTail = nextCommand(sendTail);
+  --sendCount;
 
-  const String command = commandBuffer[sendTail];
-  sendTail = nextBufferSlot(sendTail);
-  
   return command;
 }
 
 // Returns the last command sent if it was received by the printer, otherwise returns empty
-String CommandQueue::popAcknowledge() {
+CommandView CommandQueue::popAcknowledge() {
   if (isAckEmpty())
-    return String();
+    return CommandView();
 
-  const String command = commandBuffer[tail];
-  tail = nextBufferSlot(tail);
+  const CommandView command = viewAt(tail);
+  usedBytes -= command.length() + 2;
+  tail = nextCommand(tail);
+  --count;
+  ++acknowledged;
+  if (count > 0 && buffer[tail] == 0) {
+    usedBytes -= COMMAND_BUFFER_SIZE - tail;   // Release the unused end
+    tail = 0;
+  }
 
   return command;
 }
+
+void CommandQueue::rewindSend(uint8_t index) {
+  const uint8_t sent = count - sendCount;
+  if (index >= sent)
+    return;
+
+  uint16_t next = tail;
+  for (uint8_t i = 0; i < index; i++)
+    next = commandAt(nextCommand(next));
+  sendTail = next;
+  sendCount += sent - index;
+}
@@ -17,48 +17,132 @@
 
 #pragma once
 
-#define COMMAND_BUFFER_SIZE   10
+#define COMMAND_BUFFER_SIZE   1024    // Bytes for the queued commands, each one takes its length + 2
+#define COMMAND_MAX_LENGTH    254     // Longer commands are rejected
 
 #include <Arduino.h>
 
+// A command inside the queue buffer. It is not a copy: a command returned by
+// peekSend() or popSend() is valid until it is acknowledged, and one returned
+// by popAcknowledge() is valid until the next push().
+class CommandView {
+  private:
+    const char *str;
+    uint8_t len;
+
+  public:
+    CommandView() : str(""), len(0) {}
+    CommandView(const char *s, uint8_t l) : str(s), len(l) {}
+
+    inline const char *c_str() const { return str; }
+    inline size_t length() const { return len; }
+    inline bool isEmpty() const { return len == 0; }
+    inline char operator[](size_t index) const { return index < len ? str[index] : 0; }
+
+    inline bool startsWith(const char *prefix) const {
+      return strncmp(str, prefix, strlen(prefix)) == 0;
+    }
+    inline bool operator==(const char *other) const {
+      return strcmp(str, other) == 0;
+    }
+    inline bool operator!=(const char *other) const {
+      return !(*this == other);
+    }
+};
+
+// FIFO of commands stored one after another in a fixed ring buffer as
+// [length][chars][\0], so nothing is allocated when commands come and go.
+// A command never wraps around the end of the buffer: if it does not fit
+// there, a 0 length marks the rest as unused and it is placed at the start.
 class CommandQueue {
   private:
-    static int head, sendTail, tail;
-    static String commandBuffer[COMMAND_BUFFER_SIZE];
+    static uint16_t head, sendTail, tail;       // Byte offsets in buffer
+    static uint16_t usedBytes;                  // Including the unused end when wrapped
+    static uint8_t count, sendCount;            // Queued commands and how many of them were not sent yet
+    static uint32_t pushed, acknowledged;       // Commands ever pushed and acknowledged
+    static char buffer[COMMAND_BUFFER_SIZE];
+
+    // Follows the wrap marker, if any, of the command at index
+    static inline uint16_t commandAt(uint16_t index) {
+      return buffer[index] == 0 ? 0 : index;
+    }
 
-    // Returns the next buffer slot (after index slot) if it's in between the size of the buffer
-    static inline int nextBufferSlot(int index) {
-      int next = index + 1;
-  
+    static inline uint16_t nextCommand(uint16_t index) {
+      uint16_t next = index + (uint8_t)buffer[index] + 2;
       return next >= COMMAND_BUFFER_SIZE ? 0 : next;
     }
 
+    static inline CommandView viewAt(uint16_t index) {
+      return CommandView(buffer + index + 1, (uint8_t)buffer[index]);
+    }
+
   public:
     // Check if buffer is empty
     static inline bool isEmpty() {
-      return head == tail;
+      return count == 0;
     }
 
     // Returns true if the command to be sent was the last sent (so there is no pending response)
     static inline bool isAckEmpty() {
-      return tail == sendTail;
+      return count == sendCount;
+    }
+
+    static inline uint8_t getCount() {
+      return count;
+    }
+
+    // Commands sent and still waiting for their ok
+    static inline uint8_t getSentCount() {
+      return count - sendCount;
+    }
+
+    static inline uint16_t getUsedBytes() {
+      return usedBytes;
     }
 
-    static int getFreeSlots();
+    // Returns the length of the longest command that fits now (up to COMMAND_MAX_LENGTH can be pushed)
+    static uint16_t getFreeBytes();
+
+    // Sequence number of the last command pushed, the first one is 1
+    static inline uint32_t getPushedCount() {
+      return pushed;
+    }
+
+    // Sequence number of the last command acknowledged: the ones up to it are done
+    static inline uint32_t getAcknowledgedCount() {
+      return acknowledged;
+    }
 
     static inline void clear() {
-      head = sendTail = tail;
+      head = sendTail = tail = usedBytes = 0;
+      count = sendCount = 0;
+      acknowledged = pushed;    // Dropped, they will not be done
     }
 
-    static bool push(const String command);
+    static bool push(const char *command, size_t length);
+    static inline bool push(const char *command) {
+      return push(command, strlen(command));
+    }
+    static inline bool push(const String &command) {
+      return push(command.c_str(), command.length());
+    }
 
     // If there is a command pending to be sent returns it
-    inline static String peekSend() {
-      return (sendTail == head) ? String() : commandBuffer[sendTail];
+    static inline CommandView peekSend() {
+      return sendCount == 0 ? CommandView() : viewAt(commandAt(sendTail));
     }
-    
-    static String popSend();
-    static String popAcknowledge();
+
+    // The oldest command sent and waiting for its ok
+    static inline CommandView peekAcknowledge() {
+      return isAckEmpty() ? CommandView() : viewAt(tail);
+    }
+
+    static CommandView popSend();
+    static CommandView popAcknowledge();
+
+    // Makes the sent command number index (0 is the oldest waiting for its ok) and
+    // the ones after it pending to be sent again
+    static void rewindSend(uint8_t index);
 };
 
 extern CommandQueue commandQueue;
@@ -0,0 +1,531 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FileIndex.h"
+#include <new>
+
+#define FILE_INDEX_MAGIC   0x4950574e   // "NWPI"
+#define FILE_INDEX_VERSION 2
+#define FILE_INDEX_REMOVED 0x0000ffff   // Table entry of a removed record
+
+static_assert(sizeof(FileIndexEntry) == 128, "Records do not cross sectors");
+
+FileIndex fileIndex;
+
+// FNV-1a
+uint32_t FileIndex::hash(const char *name, size_t length) {
+  uint32_t h = 2166136261u;
+  while (length--) {
+    h ^= (uint8_t)*name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+uint32_t FileIndex::nameHash(const char *name, size_t length, uint16_t parent) {
+  return hash(name, min(length, (size_t)FILE_INDEX_NAME_LENGTH)) + length + parent * 2246822519u;
+}
+
+uint32_t FileIndex::nameHash(const FileIndexEntry &entry) {
+  return nameHash(entry.name, entry.nameLength, entry.parent);
+}
+
+uint32_t FileIndex::fileHash(const FileIndexEntry &entry) {
+  return nameHash(entry) + entry.size * 2654435761u + entry.mtime * 40503u + entry.dirIndex;
+}
+
+void FileIndex::makeEntry(FileWrapper &gcodeFile, const String &name, uint16_t parent, FileIndexEntry &entry) {
+  memset(&entry, 0, sizeof(entry));
+  entry.flags = gcodeFile.isDirectory() ? FILE_INDEX_DIRECTORY : 0;
+  entry.size = entry.flags & FILE_INDEX_DIRECTORY ? 0 : gcodeFile.size();
+  entry.mtime = gcodeFile.getModificationTime();
+  entry.dirIndex = gcodeFile.dirIndex();
+  entry.parent = parent;
+  entry.nameLength = min(name.length(), (unsigned int)255);
+  memcpy(entry.name, name.c_str(), min((size_t)entry.nameLength, (size_t)FILE_INDEX_NAME_LENGTH));
+}
+
+bool FileIndex::isIndexed(const String &name, bool directory) {
+  return name.length() > 0 && name[0] != '.' && name.indexOf('/') == -1 && (directory || name.indexOf(".gcode") != -1);
+}
+
+bool FileIndex::readEntry(uint16_t record, FileIndexEntry &entry) {
+  return record < records && file.seek((record + 1) * sizeof(FileIndexEntry)) &&
+         file.read((uint8_t *)&entry, sizeof(entry)) == sizeof(entry);
+}
+
+bool FileIndex::writeEntry(uint16_t record, const FileIndexEntry &entry) {
+  return file.seek((record + 1) * sizeof(FileIndexEntry)) &&
+         file.write((const uint8_t *)&entry, sizeof(entry)) == sizeof(entry);
+}
+
+bool FileIndex::writeHeader() {
+  Header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = FILE_INDEX_MAGIC;
+  header.version = FILE_INDEX_VERSION;
+  header.records = records;
+  header.count = count;
+  header.signature = signature;
+  header.generation = generation;
+  const bool ok = file.seek(0) && file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header);
+  file.flush();
+  return ok;
+}
+
+bool FileIndex::begin() {
+  end();
+  storageFS.mkdir(GCODE_CACHE_DIR);   // Fails when it already exists
+  file = storageFS.open(FILE_INDEX_PATH, "r+");
+  if (!file)
+    file = storageFS.open(FILE_INDEX_PATH, "w+");
+  if (!file)
+    return false;
+
+  Header header;
+  if (file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+      header.magic == FILE_INDEX_MAGIC && header.version == FILE_INDEX_VERSION &&
+      file.size() >= (header.records + 1u) * sizeof(FileIndexEntry)) {
+    records = header.records;
+    signature = header.signature;
+    generation = header.generation;
+  }
+  else {
+    // Orders left by another index could be taken for the ones of this
+    generation = 1;
+    for (uint8_t sort = 0; sort < FILE_SORTS; sort++)
+      FileOrder::remove((FileSort)sort);
+    if (!writeHeader())       // Records are added after it
+      return false;
+  }
+  for (uint8_t sort = 0; sort < FILE_SORTS; sort++)
+    orders[sort].begin((FileSort)sort, generation);
+  stale = !load() || scanSignature() != signature;
+
+  return true;
+}
+
+void FileIndex::end() {
+  file.close();
+  for (FileOrder &order : orders)
+    order.end();
+  delete[] table;
+  table = nullptr;
+  tableMask = tableUsed = 0;
+  records = count = freeRecords = freeHint = 0;
+  signature = generation = 0;
+  stale = true;
+}
+
+// Counts the records and checks them against the signature
+bool FileIndex::load() {
+  count = freeRecords = 0;
+  freeHint = records;
+  uint32_t sum = 0;
+  FileIndexEntry entry;
+  bool ok = file.seek(sizeof(FileIndexEntry));
+  for (uint16_t record = 0; ok && record < records; record++) {
+    ok = file.read((uint8_t *)&entry, sizeof(entry)) == sizeof(entry);
+    if (!ok)
+      break;
+    if (entry.nameLength == 0) {
+      freeRecords++;
+      freeHint = min(freeHint, record);
+      continue;
+    }
+    count++;
+    sum += fileHash(entry);
+  }
+  buildTable();
+
+  return ok && sum == signature;
+}
+
+// Room for twice the records, then filled with the names of the records
+void FileIndex::buildTable() {
+  delete[] table;
+  table = nullptr;
+  uint32_t size = 64;
+  while (size < 2u * (records + 1))
+    size *= 2;
+  if (ESP.getFreeHeap() >= size * sizeof(uint32_t) + FILE_INDEX_HEAP_RESERVE)
+    table = new (std::nothrow) uint32_t[size]();
+  tableMask = table ? size - 1 : 0;
+  tableUsed = 0;
+
+  FileIndexEntry entry;
+  for (uint16_t record = 0; table && record < records; record++)
+    if (readEntry(record, entry) && entry.nameLength > 0)
+      tableInsert(nameHash(entry), record);
+}
+
+// Adds up fileHash() of what is under dir. With update the records are made to
+// match, else only those of its directories are looked up.
+uint32_t FileIndex::scan(FileWrapper &dir, uint16_t parent, uint8_t depth, bool update, uint8_t *seen, uint16_t oldRecords) {
+  uint32_t sum = 0;
+  FileIndexEntry entry;
+  FileWrapper child;
+  while ((child = dir.openNextFile())) {
+    const String name = child.name();
+    const bool directory = child.isDirectory();
+    if (isIndexed(name, directory) && (!directory || depth < FILE_INDEX_MAX_DEPTH)) {
+      makeEntry(child, name, parent, entry);
+      int32_t record = -1;
+      if (update)
+        record = updateRecord(entry, seen, oldRecords);
+      else if (directory)
+        record = findRecord(name.c_str(), entry.nameLength, parent);
+      if (!update || record >= 0)
+        sum += fileHash(entry);
+      if (directory && record >= 0)
+        sum += scan(child, record, depth + 1, update, seen, oldRecords);
+    }
+    child.close();
+  }
+
+  return sum;
+}
+
+uint32_t FileIndex::scanSignature() {
+  FileWrapper dir = storageFS.open("/");
+  const uint32_t sum = dir ? scan(dir, FILE_INDEX_ROOT, 0, false, nullptr, 0) : 0;
+  dir.close();
+  return sum;
+}
+
+void FileIndex::tableInsert(uint32_t nameHash, uint16_t record) {
+  if (!table)
+    return;
+  if (2u * (tableUsed + 1) > tableMask + 1) {
+    buildTable();   // Bigger, without the removed records, and with this one already written
+    return;
+  }
+  uint32_t i = nameHash & tableMask;
+  while (table[i] != 0 && table[i] != FILE_INDEX_REMOVED)
+    i = (i + 1) & tableMask;
+  if (table[i] == 0)
+    tableUsed++;
+  table[i] = (nameHash & 0xffff0000) | (record + 1);
+}
+
+void FileIndex::tableErase(uint32_t nameHash, uint16_t record) {
+  if (!table)
+    return;
+  const uint32_t value = (nameHash & 0xffff0000) | (record + 1);
+  for (uint32_t i = nameHash & tableMask; table[i] != 0; i = (i + 1) & tableMask)
+    if (table[i] == value) {
+      table[i] = FILE_INDEX_REMOVED;
+      return;
+    }
+}
+
+int32_t FileIndex::findRecord(const char *name, size_t length, uint16_t parent) {
+  FileIndexEntry entry;
+  const size_t stored = min(length, (size_t)FILE_INDEX_NAME_LENGTH);
+  const uint32_t h = nameHash(name, length, parent);
+  auto matches = [&](uint16_t record) {
+    return readEntry(record, entry) && entry.nameLength == length && entry.parent == parent &&
+           memcmp(entry.name, name, stored) == 0;
+  };
+
+  if (table) {
+    for (uint32_t i = h & tableMask; table[i] != 0; i = (i + 1) & tableMask)
+      if (table[i] != FILE_INDEX_REMOVED && (table[i] & 0xffff0000) == (h & 0xffff0000) && matches((table[i] & 0xffff) - 1))
+        return (table[i] & 0xffff) - 1;
+    return -1;
+  }
+  if (orders[FileSortName].isValid())
+    return findByName(name, length, parent);
+  for (uint16_t record = 0; record < records; record++)
+    if (matches(record))
+      return record;
+  return -1;
+}
+
+// A binary search of the order by name, among the directories and then the files
+int32_t FileIndex::findByName(const char *name, size_t length, uint16_t parent) {
+  FileOrder &order = orders[FileSortName];
+  FileIndexEntry key, entry;
+  memset(&key, 0, sizeof(key));
+  key.parent = parent;
+  key.nameLength = length;
+  memcpy(key.name, name, min(length, (size_t)FILE_INDEX_NAME_LENGTH));
+  for (uint8_t flags : { FILE_INDEX_DIRECTORY, 0 }) {
+    key.flags = flags;
+    const uint32_t position = order.lowerBound(*this, 0, order.size(), [&](const FileIndexEntry &other, uint16_t record) {
+      return FileOrder::compare(FileSortName, other, record, key, 0) < 0;
+    });
+    const int32_t record = order.get(position);
+    if (record >= 0 && get(record, entry) && FileOrder::compare(FileSortName, entry, 0, key, 0) == 0)
+      return record;
+  }
+  return -1;
+}
+
+// A free record, or a new one at the end
+int32_t FileIndex::newRecord() {
+  FileIndexEntry entry;
+  for (uint16_t record = freeHint; freeRecords > 0 && record < records; record++)
+    if (readEntry(record, entry) && entry.nameLength == 0) {
+      freeRecords--;
+      freeHint = record + 1;
+      return record;
+    }
+  if (records >= FILE_INDEX_MAX_RECORDS)
+    return -1;
+  freeHint = records + 1;
+  return records++;
+}
+
+void FileIndex::freeRecord(uint16_t record) {
+  FileIndexEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  writeEntry(record, entry);
+  freeRecords++;
+  freeHint = min(freeHint, record);
+}
+
+bool FileIndex::refresh() {
+  if (!file)
+    return false;
+  if (stale)
+    rebuild();
+  return true;
+}
+
+// The record of entry, written or updated, -1 when the index is full
+int32_t FileIndex::updateRecord(const FileIndexEntry &entry, uint8_t *seen, uint16_t oldRecords) {
+  FileIndexEntry old;
+  int32_t record = seen ? findRecord(entry.name, entry.nameLength, entry.parent) : -1;
+  if (record >= oldRecords || (record >= 0 && (seen[record / 8] & (1 << (record % 8)))))
+    record = -1;    // Another file with the same first FILE_INDEX_NAME_LENGTH characters
+  if (record < 0) {
+    record = newRecord();
+    if (record < 0 || !writeEntry(record, entry))
+      return -1;
+    count++;
+    tableInsert(nameHash(entry), record);
+  }
+  else if (!readEntry(record, old) || memcmp(&old, &entry, sizeof(entry)) != 0)
+    writeEntry(record, entry);
+  if (seen && record < oldRecords)
+    seen[record / 8] |= 1 << (record % 8);
+
+  return record;
+}
+
+bool FileIndex::rebuild() {
+  if (!file)
+    return false;
+
+  // Sorted again when asked for
+  for (FileOrder &order : orders)
+    order.invalidate();
+
+  // Records not seen in the directories are freed at the end. Without the hash
+  // table, finding each file would be a scan of the index: it is written again.
+  uint8_t *seen = table ? new (std::nothrow) uint8_t[records / 8 + 1]() : nullptr;
+  if (!seen) {
+    records = count = freeRecords = freeHint = 0;
+    buildTable();
+  }
+  const uint16_t oldRecords = records;
+  FileWrapper dir = storageFS.open("/");
+  const uint32_t sum = dir ? scan(dir, FILE_INDEX_ROOT, 0, true, seen, oldRecords) : 0;
+  dir.close();
+
+  FileIndexEntry old;
+  for (uint16_t record = 0; seen && record < oldRecords; record++)
+    if (!(seen[record / 8] & (1 << (record % 8))) && readEntry(record, old) && old.nameLength > 0) {
+      tableErase(nameHash(old), record);
+      freeRecord(record);
+      count--;
+    }
+  if (!seen) {
+    if (file.size() > (records + 1u) * sizeof(FileIndexEntry))
+      file.truncate((records + 1u) * sizeof(FileIndexEntry));
+    buildTable();
+  }
+  delete[] seen;
+
+  stale = false;
+  signature = sum;
+  generation++;
+  return writeHeader();
+}
+
+bool FileIndex::get(uint16_t record, FileIndexEntry &entry) {
+  return readEntry(record, entry) && entry.nameLength > 0;
+}
+
+int32_t FileIndex::find(const String &path) {
+  const int slash = path.lastIndexOf('/');
+  const int32_t parent = findDirectory(slash > 0 ? path.substring(0, slash) : "");
+  const String name = path.substring(slash + 1);
+  return parent >= 0 && name.length() > 0 ? findRecord(name.c_str(), name.length(), parent) : -1;
+}
+
+int32_t FileIndex::findDirectory(const String &path) {
+  uint16_t parent = FILE_INDEX_ROOT;
+  FileIndexEntry entry;
+  for (int start = 0, end; start < (int)path.length(); start = end + 1) {
+    end = path.indexOf('/', start);
+    if (end == -1)
+      end = path.length();
+    if (end == start)
+      continue;
+    const int32_t record = findRecord(path.c_str() + start, end - start, parent);
+    if (record < 0 || !get(record, entry) || !entry.isDirectory())
+      return -1;
+    parent = record;
+  }
+  return parent;
+}
+
+int32_t FileIndex::findId(const String &id) {
+  if (id.length() != 12)
+    return -1;
+  char *end;
+  const uint32_t record = strtoul(id.substring(0, 4).c_str(), &end, 16);
+  if (*end)
+    return -1;
+  const uint32_t h = strtoul(id.substring(4).c_str(), &end, 16);
+  FileIndexEntry entry;
+  if (*end || record >= records || !get(record, entry) || nameHash(entry) != h)
+    return -1;
+
+  // The record has to be the one of its directory entry, or the files changed behind our back
+  FileWrapper dir = storageFS.open(getDirectoryPath(entry.parent));
+  FileWrapper gcodeFile = dir.openEntry(entry.dirIndex);
+  const bool same = gcodeFile && gcodeFile.isDirectory() == entry.isDirectory() &&
+                    (entry.isDirectory() || gcodeFile.size() == entry.size) &&
+                    strncmp(gcodeFile.name().c_str(), entry.name, FILE_INDEX_NAME_LENGTH) == 0;
+  gcodeFile.close();
+  dir.close();
+  if (!same) {
+    stale = true;
+    return -1;
+  }
+
+  return record;
+}
+
+String FileIndex::getId(uint16_t record, const FileIndexEntry &entry) {
+  char id[13];
+  snprintf(id, sizeof(id), "%04x%08x", record, (unsigned int)nameHash(entry));
+  return id;
+}
+
+String FileIndex::getName(const FileIndexEntry &entry) {
+  if (entry.nameLength <= FILE_INDEX_NAME_LENGTH)
+    return entry.name;
+
+  FileWrapper dir = storageFS.open(getDirectoryPath(entry.parent));
+  FileWrapper gcodeFile = dir.openEntry(entry.dirIndex);
+  const String name = gcodeFile ? gcodeFile.name() : String(entry.name);
+  gcodeFile.close();
+  dir.close();
+  return name;
+}
+
+String FileIndex::getDirectoryPath(uint16_t parent) {
+  String path = "/";
+  FileIndexEntry entry;
+  for (uint8_t depth = 0; parent != FILE_INDEX_ROOT && depth <= FILE_INDEX_MAX_DEPTH && get(parent, entry); depth++) {
+    path = "/" + getName(entry) + path;
+    parent = entry.parent;
+  }
+  return path;
+}
+
+FileOrder *FileIndex::getOrder(FileSort sort) {
+  FileOrder &order = orders[sort];
+  if (!file || (!order.isValid() && !order.build(*this, generation)))
+    return nullptr;
+  return &order;
+}
+
+void FileIndex::ordersInsert(uint16_t record, const FileIndexEntry &entry) {
+  for (FileOrder &order : orders)
+    order.insert(*this, record, entry, generation);
+}
+
+void FileIndex::ordersErase(uint16_t record, const FileIndexEntry &entry) {
+  for (FileOrder &order : orders)
+    order.erase(*this, record, entry, generation);
+}
+
+bool FileIndex::add(const String &path) {
+  const int slash = path.lastIndexOf('/');
+  const String dirPath = slash > 0 ? path.substring(0, slash) : "";
+  const String name = path.substring(slash + 1);
+  int32_t parent = findDirectory(dirPath);
+  if (parent < 0 && dirPath.length() > 0 && add(dirPath))
+    parent = findDirectory(dirPath);
+  if (!file || parent < 0)
+    return false;
+  FileWrapper gcodeFile = storageFS.open(path.startsWith("/") ? path : "/" + path);
+  if (!gcodeFile || !isIndexed(name, gcodeFile.isDirectory()))
+    return false;
+  FileIndexEntry entry, old;
+  makeEntry(gcodeFile, name, parent, entry);
+  gcodeFile.close();
+
+  generation++;
+  int32_t record = findRecord(name.c_str(), entry.nameLength, parent);
+  if (record >= 0 && readEntry(record, old)) {
+    signature -= fileHash(old);
+    ordersErase(record, old);
+    if (!writeEntry(record, entry))
+      return false;
+  }
+  else {
+    record = newRecord();
+    if (record < 0 || !writeEntry(record, entry))
+      return false;
+    count++;
+    tableInsert(nameHash(entry), record);
+  }
+  signature += fileHash(entry);
+  ordersInsert(record, entry);
+
+  return writeHeader();
+}
+
+// Also the records under a directory, before it
+void FileIndex::removeRecord(uint16_t record, const FileIndexEntry &entry) {
+  FileIndexEntry child;
+  for (uint16_t other = 0; entry.isDirectory() && other < records; other++)
+    if (readEntry(other, child) && child.nameLength > 0 && child.parent == record)
+      removeRecord(other, child);
+  signature -= fileHash(entry);
+  ordersErase(record, entry);
+  tableErase(nameHash(entry), record);
+  freeRecord(record);
+  count--;
+}
+
+bool FileIndex::remove(const String &path) {
+  FileIndexEntry entry;
+  const int32_t record = find(path);
+  if (!file || record < 0 || !readEntry(record, entry))
+    return false;
+  generation++;
+  removeRecord(record, entry);
+
+  return writeHeader();
+}
@@ -0,0 +1,166 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define FILE_INDEX_PATH         GCODE_CACHE_DIR "/files.idx"
+#define FILE_INDEX_NAME_LENGTH  113     // Longer names are read from the directory entry of the file
+#define FILE_INDEX_MAX_RECORDS  65000
+#define FILE_INDEX_MAX_DEPTH    8       // Directories deeper than this are not indexed
+#define FILE_INDEX_HEAP_RESERVE 24000   // Heap left to the rest of the firmware by the hash table of names
+#define FILE_INDEX_ROOT         0xffff  // Parent of the records of the root directory
+#define FILE_INDEX_DIRECTORY    0x01    // Flag of the records of directories
+
+#include "StorageFS.h"
+#include "GcodeCompactor.h"
+#include "FileOrder.h"
+
+// A G-code file or a directory of the index, as its record is stored
+struct FileIndexEntry {
+  uint32_t size;                            // 0 for a directory
+  uint32_t mtime;
+  uint16_t dirIndex;                        // Entry of the file in its directory
+  uint16_t parent;                          // Record of its directory
+  uint8_t nameLength;                       // 0 for a free record
+  uint8_t flags;
+  char name[FILE_INDEX_NAME_LENGTH + 1];    // Cut at FILE_INDEX_NAME_LENGTH
+
+  inline bool isDirectory() const {
+    return flags & FILE_INDEX_DIRECTORY;
+  }
+};
+
+// The G-code files of the SD and its directories, in a file of records of the
+// same size after a header. Hidden ones, with names starting with a dot like
+// GCODE_CACHE_DIR, are left out. A record keeps its number while its file
+// exists: the number is in the id of the file, so finding a file by id is a
+// single read. Names are found through a hash table kept in RAM when the heap
+// allows it, else through the order by name.
+//
+// Uploads and deletes update the index with add() and remove(). Files changed
+// behind its back, on a PC, are noticed by begin() from a signature of the
+// directories, or when a record does not match its directory entry any more;
+// the index is then rebuilt by the next refresh().
+//
+// The records are listed sorted by the FileOrder of each FileSort, updated
+// along with the index, and built again when asked for after a rebuild.
+class FileIndex {
+  private:
+    struct Header {
+      uint32_t magic;
+      uint16_t version;
+      uint16_t records;
+      uint16_t count;
+      uint16_t reserved;
+      uint32_t signature;
+      uint32_t generation;                  // Changed with every record
+      uint8_t padding[sizeof(FileIndexEntry) - 20];
+    };
+
+    FileWrapper file;
+    uint16_t records = 0, count = 0;
+    uint16_t freeRecords = 0, freeHint = 0;   // No free record before freeHint
+    uint32_t signature = 0;                   // Sum of fileHash() of the records
+    uint32_t generation = 0;
+    bool stale = true;
+    uint32_t *table = nullptr;                // High half of the name hash, and record + 1
+    uint32_t tableMask = 0;
+    uint16_t tableUsed = 0;                   // Removed records included
+    FileOrder orders[FILE_SORTS];
+
+    static uint32_t hash(const char *name, size_t length);
+    static uint32_t nameHash(const char *name, size_t length, uint16_t parent);
+    static uint32_t nameHash(const FileIndexEntry &entry);
+    static uint32_t fileHash(const FileIndexEntry &entry);
+    static void makeEntry(FileWrapper &gcodeFile, const String &name, uint16_t parent, FileIndexEntry &entry);
+    static bool isIndexed(const String &name, bool directory);
+    bool readEntry(uint16_t record, FileIndexEntry &entry);
+    bool writeEntry(uint16_t record, const FileIndexEntry &entry);
+    bool writeHeader();
+    bool load();
+    void buildTable();
+    void tableInsert(uint32_t nameHash, uint16_t record);
+    void tableErase(uint32_t nameHash, uint16_t record);
+    int32_t findRecord(const char *name, size_t length, uint16_t parent);
+    int32_t findByName(const char *name, size_t length, uint16_t parent);
+    int32_t newRecord();
+    void freeRecord(uint16_t record);
+    int32_t updateRecord(const FileIndexEntry &entry, uint8_t *seen, uint16_t oldRecords);
+    void removeRecord(uint16_t record, const FileIndexEntry &entry);
+    void ordersInsert(uint16_t record, const FileIndexEntry &entry);
+    void ordersErase(uint16_t record, const FileIndexEntry &entry);
+    uint32_t scan(FileWrapper &dir, uint16_t parent, uint8_t depth, bool update, uint8_t *seen, uint16_t oldRecords);
+    uint32_t scanSignature();
+
+  public:
+    // Opens the index, stale when there is none or the files changed
+    bool begin();
+    void end();
+    // Rebuilds the index when it is stale, false when there is none
+    bool refresh();
+    // Updates the records from the files of the directories, keeping their numbers
+    // when the hash table allows to find them, else writing them again
+    bool rebuild();
+
+    inline void invalidate() {
+      stale = true;
+    }
+
+    inline bool isStale() const {
+      return stale;
+    }
+
+    // Records, free ones included
+    inline uint16_t getRecords() const {
+      return records;
+    }
+
+    // Files and directories
+    inline uint16_t getCount() const {
+      return count;
+    }
+
+    inline uint32_t getGeneration() const {
+      return generation;
+    }
+
+    // False for a free record
+    bool get(uint16_t record, FileIndexEntry &entry);
+    // The record of a file or directory, -1 if it is not indexed
+    int32_t find(const String &path);
+    // The record of a directory, FILE_INDEX_ROOT for the root, -1 if it is not indexed
+    int32_t findDirectory(const String &path);
+    // The record of an id given by getId(), -1 if it is not the one of a file
+    int32_t findId(const String &id);
+    static String getId(uint16_t record, const FileIndexEntry &entry);
+    // The whole name, also when it is longer than the record holds
+    String getName(const FileIndexEntry &entry);
+    // The path of a directory, ending with '/'
+    String getDirectoryPath(uint16_t parent);
+    inline String getPath(const FileIndexEntry &entry) {
+      return getDirectoryPath(entry.parent) + getName(entry);
+    }
+    // The order of sort, sorted again if needed, nullptr when it cannot be
+    FileOrder *getOrder(FileSort sort);
+
+    // Indexes the file or directory, with the directories above it, or updates its record
+    bool add(const String &path);
+    // Takes the file out of the index, or the directory with all it has
+    bool remove(const String &path);
+};
+
+extern FileIndex fileIndex;
@@ -0,0 +1,171 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FileListStream.h"
+
+FileListStream::FileListStream(const FileListQuery &query) : query(query), cursor(query.index) {
+  order = fileIndex.getOrder(query.sort);
+  if (!order)
+    ranges[rangeCount++] = { 0, fileIndex.getRecords() };
+  else {
+    const uint16_t parent = query.directory;
+    const uint32_t first = order->lowerBound(fileIndex, 0, order->size(), [&](const FileIndexEntry &entry, uint16_t) {
+      return entry.parent < parent;
+    });
+    const uint32_t last = order->lowerBound(fileIndex, first, order->size(), [&](const FileIndexEntry &entry, uint16_t) {
+      return entry.parent <= parent;
+    });
+    if (query.sort == FileSortName && query.prefix.length() > 0) {
+      // The names with the prefix are together among the directories, and among the files
+      const char *prefix = query.prefix.c_str();
+      const size_t length = query.prefix.length();
+      const uint32_t files = order->lowerBound(fileIndex, first, last, [](const FileIndexEntry &entry, uint16_t) {
+        return entry.isDirectory();
+      });
+      for (const Range &group : { Range{ first, files }, Range{ files, last } }) {
+        const uint32_t from = order->lowerBound(fileIndex, group.first, group.last, [&](const FileIndexEntry &entry, uint16_t) {
+          return FileOrder::comparePrefix(entry, prefix, length) < 0;
+        });
+        const uint32_t to = order->lowerBound(fileIndex, from, group.last, [&](const FileIndexEntry &entry, uint16_t) {
+          return FileOrder::comparePrefix(entry, prefix, length) <= 0;
+        });
+        ranges[rangeCount++] = { from, to };
+      }
+    }
+    else
+      ranges[rangeCount++] = { first, last };
+  }
+  for (uint8_t i = 0; i < rangeCount; i++)
+    total += ranges[i].last - ranges[i].first;
+}
+
+size_t FileListStream::read(uint8_t *buffer, size_t maxLen) {
+  size_t n = 0;
+  while (n < maxLen) {
+    if (piecePos == pieceLength && !makePiece())
+      break;
+
+    const size_t len = min(maxLen - n, (size_t)(pieceLength - piecePos));
+    memcpy(buffer + n, piece + piecePos, len);
+    piecePos += len;
+    n += len;
+  }
+
+  return n;
+}
+
+// The position of the entry n of the listing
+uint32_t FileListStream::position(uint32_t n) const {
+  if (query.reverse)
+    n = total - 1 - n;
+  for (uint8_t i = 0; i < rangeCount; i++) {
+    if (n < ranges[i].last - ranges[i].first)
+      return ranges[i].first + n;
+    n -= ranges[i].last - ranges[i].first;
+  }
+  return 0;
+}
+
+static bool containsIgnoringCase(const String &text, const String &part) {
+  for (int i = 0; i + part.length() <= text.length(); i++)
+    if (strncasecmp(text.c_str() + i, part.c_str(), part.length()) == 0)
+      return true;
+  return false;
+}
+
+bool FileListStream::matches() {
+  if (entry.parent != query.directory)
+    return false;
+  name = fileIndex.getName(entry);
+  return (query.prefix.length() == 0 ||
+          (name.length() >= query.prefix.length() && strncasecmp(name.c_str(), query.prefix.c_str(), query.prefix.length()) == 0)) &&
+         (query.search.length() == 0 || containsIgnoringCase(name, query.search));
+}
+
+bool FileListStream::nextEntry() {
+  while (cursor < total && (query.limit == 0 || listed < query.limit)) {
+    const uint32_t position = this->position(cursor++);
+    const int32_t found = order ? order->get(position) : (int32_t)position;
+    if (found >= 0 && fileIndex.get(found, entry) && matches()) {
+      record = found;
+      namePos = 0;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void FileListStream::add(const char *text) {
+  const size_t len = min(strlen(text), sizeof(piece) - pieceLength);
+  memcpy(piece + pieceLength, text, len);
+  pieceLength += len;
+}
+
+bool FileListStream::makePiece() {
+  pieceLength = piecePos = 0;
+  switch (stage) {
+    case Start:
+      add("{");
+      stage = Files;
+      break;
+
+    case Files:
+      if (nextEntry()) {
+        add(listed == 0 ? "\"files\":[{\"name\":\"" : ",{\"name\":\"");
+        stage = Name;
+      }
+      else {
+        char next[24];
+        snprintf(next, sizeof(next), "\"next\":%u}", (unsigned int)cursor);
+        add(listed > 0 ? "]," : "");
+        add(next);
+        stage = Done;
+      }
+      break;
+
+    case Name:
+      // Escaped, a few bytes at a time: an escape takes up to 6
+      while (namePos < name.length() && (size_t)pieceLength + 6 <= sizeof(piece)) {
+        const char c = name[namePos++];
+        if (c == '"' || c == '\\') {
+          piece[pieceLength++] = '\\';
+          piece[pieceLength++] = c;
+        }
+        else if ((uint8_t)c < 0x20)
+          pieceLength += snprintf(piece + pieceLength, 7, "\\u%04x", (uint8_t)c);
+        else
+          piece[pieceLength++] = c;
+      }
+      if (namePos == name.length())
+        stage = Fields;
+      break;
+
+    case Fields:
+      pieceLength = snprintf(piece, sizeof(piece), "\",\"size\":%u,\"date\":%u,\"id\":\"%s\"%s}",
+                             (unsigned int)entry.size, (unsigned int)entry.mtime,
+                             FileIndex::getId(record, entry).c_str(), entry.isDirectory() ? ",\"dir\":true" : "");
+      listed++;
+      stage = Files;
+      break;
+
+    case Done:
+      return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,77 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define FILE_LIST_PIECE_SIZE 96       // JSON made ahead of the response buffer
+
+#include "FileIndex.h"
+
+// What a listing of the file index asks for
+struct FileListQuery {
+  uint16_t directory = FILE_INDEX_ROOT;   // Record of the directory listed
+  FileSort sort = FileSortName;
+  bool reverse = false;
+  String prefix;                          // Names starting with it, ignoring case
+  String search;                          // Names with it anywhere, ignoring case
+  uint32_t index = 0;                     // Entries of the listing skipped, the next of a previous page
+  uint16_t limit = 0;                     // Files given at most, 0 for all
+};
+
+// The JSON of a page of a directory of the file index, {"files":[...],"next":n},
+// made while the response is sent: read() gives as many bytes as fit in the
+// buffer of a chunked response, reading the records as it goes. A page of any
+// number of files takes the same memory. Without files there is no "files" key.
+//
+// The entries come from the positions of the directory in the FileOrder of
+// the sort, only those with the prefix when sorting by name. Without the order
+// all the records are read.
+class FileListStream {
+  private:
+    enum Stage : uint8_t {
+      Start, Files, Name, Fields, Done
+    };
+
+    struct Range {
+      uint32_t first, last;
+    };
+
+    FileListQuery query;
+    FileOrder *order;
+    Range ranges[2];
+    uint8_t rangeCount = 0;
+    uint32_t total = 0, cursor;             // Positions of the ranges, and the next one in the listing
+    Stage stage = Start;
+    uint16_t record = 0, listed = 0;
+    FileIndexEntry entry;
+    String name;
+    uint16_t namePos = 0;
+    char piece[FILE_LIST_PIECE_SIZE];
+    uint8_t pieceLength = 0, piecePos = 0;
+
+    uint32_t position(uint32_t n) const;
+    bool matches();
+    bool nextEntry();
+    bool makePiece();
+    void add(const char *text);
+
+  public:
+    FileListStream(const FileListQuery &query);
+
+    // Up to maxLen bytes of JSON, 0 once it is all given
+    size_t read(uint8_t *buffer, size_t maxLen);
+};
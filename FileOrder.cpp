@@ -0,0 +1,336 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FileOrder.h"
+#include "FileIndex.h"
+#include <new>
+#include <stddef.h>
+
+#define FILE_ORDER_MAGIC    0x4f50574e  // "NWPO"
+#define FILE_ORDER_VERSION  1
+#define FILE_ORDER_KEY_SIZE 16          // Bytes of a record with all but the name
+
+static_assert(offsetof(FileIndexEntry, name) <= FILE_ORDER_KEY_SIZE, "The key has the fields of a record");
+
+// Items of a sort being built: the key, the whole record when sorting by
+// name, followed by the record number
+static FileSort sortingBy = FileSortName;
+static size_t sortingKeySize = FILE_ORDER_KEY_SIZE;
+
+static inline uint16_t itemRecord(const void *item) {
+  return *(const uint32_t *)((const uint8_t *)item + sortingKeySize);
+}
+
+static int compareItems(const void *a, const void *b) {
+  return FileOrder::compare(sortingBy, *(const FileIndexEntry *)a, itemRecord(a), *(const FileIndexEntry *)b, itemRecord(b));
+}
+
+int FileOrder::compare(FileSort sort, const FileIndexEntry &a, uint16_t recordA, const FileIndexEntry &b, uint16_t recordB) {
+  if (a.parent != b.parent)
+    return a.parent < b.parent ? -1 : 1;
+  if (a.isDirectory() != b.isDirectory())
+    return a.isDirectory() ? -1 : 1;
+
+  switch (sort) {
+    case FileSortName: {
+      const size_t lengthA = min((size_t)a.nameLength, (size_t)FILE_INDEX_NAME_LENGTH);
+      const size_t lengthB = min((size_t)b.nameLength, (size_t)FILE_INDEX_NAME_LENGTH);
+      for (size_t i = 0; i < min(lengthA, lengthB); i++) {
+        const int c = tolower((uint8_t)a.name[i]) - tolower((uint8_t)b.name[i]);
+        if (c != 0)
+          return c;
+      }
+      if (a.nameLength != b.nameLength)
+        return a.nameLength < b.nameLength ? -1 : 1;
+      const int c = memcmp(a.name, b.name, lengthA);
+      if (c != 0)
+        return c;
+      break;
+    }
+
+    case FileSortSize:
+      if (a.size != b.size)
+        return a.size < b.size ? -1 : 1;
+      break;
+
+    default:
+      if (a.mtime != b.mtime)
+        return a.mtime < b.mtime ? -1 : 1;
+      break;
+  }
+
+  return recordA == recordB ? 0 : recordA < recordB ? -1 : 1;
+}
+
+int FileOrder::comparePrefix(const FileIndexEntry &entry, const char *prefix, size_t length) {
+  const size_t stored = min((size_t)entry.nameLength, (size_t)FILE_INDEX_NAME_LENGTH);
+  for (size_t i = 0; i < length; i++) {
+    if (i == stored)
+      return entry.nameLength > stored ? 0 : -1;    // The rest of a long name is not in the record
+    const int c = tolower((uint8_t)entry.name[i]) - tolower((uint8_t)prefix[i]);
+    if (c != 0)
+      return c;
+  }
+  return 0;
+}
+
+const char *FileOrder::getSortName(FileSort sort) {
+  switch (sort) {
+    case FileSortName: return "name";
+    case FileSortSize: return "size";
+    default:           return "date";
+  }
+}
+
+bool FileOrder::begin(FileSort sort, uint32_t generation) {
+  end();
+  this->sort = sort;
+  const String path = String(FILE_ORDER_PATH) + getSortName(sort);
+  file = storageFS.open(path, "r+");
+  if (!file)
+    file = storageFS.open(path, "w+");
+  if (!file)
+    return false;
+
+  Header header;
+  valid = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+          header.magic == FILE_ORDER_MAGIC && header.version == FILE_ORDER_VERSION &&
+          header.sort == sort && header.generation == generation &&
+          file.size() >= sizeof(header) + header.length * sizeof(uint16_t);
+  if (valid) {
+    length = header.length;
+    this->generation = generation;
+  }
+
+  return true;
+}
+
+void FileOrder::end() {
+  file.close();
+  length = generation = 0;
+  valid = false;
+}
+
+void FileOrder::remove(FileSort sort) {
+  storageFS.remove(String(FILE_ORDER_PATH) + getSortName(sort));
+}
+
+// An order that is not valid is left without magic, not to be taken for one after a restart
+bool FileOrder::writeHeader() {
+  Header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = valid ? FILE_ORDER_MAGIC : 0;
+  header.version = FILE_ORDER_VERSION;
+  header.sort = sort;
+  header.length = length;
+  header.generation = generation;
+  const bool ok = file.seek(0) && file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header);
+  file.flush();
+  return ok;
+}
+
+int32_t FileOrder::get(uint32_t position) {
+  uint16_t record;
+  if (position >= length || !file.seek(sizeof(Header) + position * sizeof(record)) ||
+      file.read((uint8_t *)&record, sizeof(record)) != sizeof(record))
+    return -1;
+  return record;
+}
+
+bool FileOrder::setRecord(uint32_t position, uint16_t record) {
+  return file.seek(sizeof(Header) + position * sizeof(record)) &&
+         file.write((const uint8_t *)&record, sizeof(record)) == sizeof(record);
+}
+
+// Copies count positions, overlapping ones included
+bool FileOrder::move(uint32_t from, uint32_t to, uint32_t count) {
+  uint8_t buffer[128];
+  const uint32_t block = sizeof(buffer) / sizeof(uint16_t);
+  bool ok = true;
+  for (uint32_t done = 0; ok && done < count; done += block) {
+    const uint32_t n = min(block, count - done);
+    // From the end when moving forward, not to write over what is still to be read
+    const uint32_t offset = to > from ? count - done - n : done;
+    const size_t bytes = n * sizeof(uint16_t);
+    ok = file.seek(sizeof(Header) + (from + offset) * sizeof(uint16_t)) && file.read(buffer, bytes) == (int)bytes &&
+         file.seek(sizeof(Header) + (to + offset) * sizeof(uint16_t)) && file.write(buffer, bytes) == bytes;
+  }
+  return ok;
+}
+
+uint32_t FileOrder::lowerBound(FileIndex &index, uint32_t first, uint32_t last,
+                               std::function<bool(const FileIndexEntry &entry, uint16_t record)> before) {
+  FileIndexEntry entry;
+  while (first < last) {
+    const uint32_t middle = first + (last - first) / 2;
+    const int32_t record = get(middle);
+    if (record >= 0 && index.get(record, entry) && before(entry, record))
+      first = middle + 1;
+    else
+      last = middle;
+  }
+  return first;
+}
+
+bool FileOrder::insert(FileIndex &index, uint16_t record, const FileIndexEntry &entry, uint32_t generation) {
+  if (!valid)
+    return false;
+  const uint32_t position = lowerBound(index, 0, length, [&](const FileIndexEntry &other, uint16_t otherRecord) {
+    return compare(sort, other, otherRecord, entry, record) < 0;
+  });
+  valid = move(position, position + 1, length - position) && setRecord(position, record);
+  if (valid) {
+    length++;
+    this->generation = generation;
+  }
+  return writeHeader() && valid;
+}
+
+bool FileOrder::erase(FileIndex &index, uint16_t record, const FileIndexEntry &entry, uint32_t generation) {
+  if (!valid)
+    return false;
+  const uint32_t position = lowerBound(index, 0, length, [&](const FileIndexEntry &other, uint16_t otherRecord) {
+    return compare(sort, other, otherRecord, entry, record) < 0;
+  });
+  valid = get(position) == record && move(position + 1, position, length - position - 1);
+  if (valid) {
+    length--;
+    this->generation = generation;
+  }
+  return writeHeader() && valid;
+}
+
+// The records, sorted in runs of capacity items written one after the other
+bool FileOrder::writeRuns(FileIndex &index, FileWrapper &runs, uint8_t *buffer, uint32_t capacity, size_t itemSize, uint32_t &items) {
+  FileIndexEntry entry;
+  uint32_t n = 0;
+  bool ok = runs.seek(0);
+  items = 0;
+  for (uint32_t record = 0; ok && record <= index.getRecords(); record++) {
+    const bool last = record == index.getRecords();
+    if (!last && index.get(record, entry)) {
+      uint8_t *item = buffer + n * itemSize;
+      memcpy(item, &entry, sortingKeySize);
+      *(uint32_t *)(item + sortingKeySize) = record;
+      n++;
+    }
+    if (n > 0 && (n == capacity || last)) {
+      qsort(buffer, n, itemSize, compareItems);
+      ok = runs.write(buffer, n * itemSize) == n * itemSize;
+      items += n;
+      n = 0;
+    }
+  }
+  return ok;
+}
+
+// Merges the runs of runLength items of from, two by two, into to
+bool FileOrder::merge(FileWrapper &from, FileWrapper &to, uint32_t runLength, uint32_t items, uint8_t *buffer, uint32_t capacity, size_t itemSize) {
+  struct Run {
+    uint8_t *buffer;
+    uint32_t next, end;         // Items not read yet
+    uint32_t count, pos;        // Items read, and the first not merged yet
+  };
+
+  // The buffer is shared by both runs and the merged items
+  const uint32_t part = capacity / 3;
+  uint8_t *out = buffer + 2 * part * itemSize;
+  bool ok = to.seek(0);
+  for (uint32_t start = 0; ok && start < items; start += 2 * runLength) {
+    const uint32_t middle = min(start + runLength, items), end = min(start + 2 * runLength, items);
+    Run runs[2] = {
+      { buffer, start, middle, 0, 0 },
+      { buffer + part * itemSize, middle, end, 0, 0 }
+    };
+    uint32_t merged = 0;
+    while (ok) {
+      for (Run &run : runs)
+        if (run.pos == run.count && run.next < run.end) {
+          run.count = min(part, run.end - run.next);
+          run.pos = 0;
+          ok = ok && from.seek(run.next * itemSize) && from.read(run.buffer, run.count * itemSize) == (int)(run.count * itemSize);
+          run.next += run.count;
+        }
+      const uint8_t *a = runs[0].pos < runs[0].count ? runs[0].buffer + runs[0].pos * itemSize : nullptr;
+      const uint8_t *b = runs[1].pos < runs[1].count ? runs[1].buffer + runs[1].pos * itemSize : nullptr;
+      if (!ok || (!a && !b))
+        break;
+      const bool first = a && (!b || compareItems(a, b) <= 0);
+      memcpy(out + merged * itemSize, first ? a : b, itemSize);
+      runs[first ? 0 : 1].pos++;
+      if (++merged == part) {
+        ok = to.write(out, merged * itemSize) == merged * itemSize;
+        merged = 0;
+      }
+    }
+    if (ok && merged > 0)
+      ok = to.write(out, merged * itemSize) == merged * itemSize;
+  }
+  return ok;
+}
+
+bool FileOrder::build(FileIndex &index, uint32_t generation) {
+  if (!file)
+    return false;
+  valid = false;
+  length = 0;
+  this->generation = 0;
+  sortingBy = sort;
+  sortingKeySize = sort == FileSortName ? sizeof(FileIndexEntry) : FILE_ORDER_KEY_SIZE;
+  const size_t itemSize = sortingKeySize + sizeof(uint32_t);
+
+  const uint32_t heap = ESP.getFreeHeap();
+  const uint32_t capacity = heap > FILE_ORDER_HEAP_RESERVE ? min((uint32_t)FILE_ORDER_SORT_MEMORY, heap - FILE_ORDER_HEAP_RESERVE) / itemSize : 0;
+  uint8_t *buffer = capacity >= 3 ? new (std::nothrow) uint8_t[capacity * itemSize] : nullptr;
+  if (!buffer)
+    return false;
+
+  FileWrapper runs = storageFS.open(FILE_ORDER_RUNS_PATH, "w+");
+  FileWrapper merged = storageFS.open(FILE_ORDER_MERGE_PATH, "w+");
+  uint32_t items = 0;
+  bool ok = runs && merged && writeHeader() && file.truncate(sizeof(Header)) &&
+            writeRuns(index, runs, buffer, capacity, itemSize, items);
+  FileWrapper *from = &runs, *to = &merged;
+  for (uint32_t runLength = capacity; ok && runLength < items; runLength *= 2) {
+    ok = merge(*from, *to, runLength, items, buffer, capacity, itemSize);
+    std::swap(from, to);
+  }
+
+  // Only the record numbers of the sorted items are kept
+  uint16_t *records = (uint16_t *)buffer;
+  ok = ok && from->seek(0) && file.seek(sizeof(Header));
+  for (uint32_t done = 0; ok && done < items; ) {
+    const uint32_t n = min(capacity, items - done);
+    ok = from->read(buffer, n * itemSize) == (int)(n * itemSize);
+    for (uint32_t i = 0; ok && i < n; i++)
+      records[i] = itemRecord(buffer + i * itemSize);
+    ok = ok && file.write(buffer, n * sizeof(uint16_t)) == n * sizeof(uint16_t);
+    done += n;
+  }
+  delete[] buffer;
+  runs.close();
+  merged.close();
+  storageFS.remove(FILE_ORDER_RUNS_PATH);
+  storageFS.remove(FILE_ORDER_MERGE_PATH);
+
+  if (ok) {
+    length = items;
+    this->generation = generation;
+  }
+  valid = ok;
+  return writeHeader() && valid;
+}
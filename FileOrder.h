@@ -0,0 +1,105 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define FILE_ORDER_PATH         GCODE_CACHE_DIR "/files.by-"   // Followed by the name of the sort
+#define FILE_ORDER_RUNS_PATH    GCODE_CACHE_DIR "/files.runs"  // Runs of a sort being built
+#define FILE_ORDER_MERGE_PATH   GCODE_CACHE_DIR "/files.merge"
+#define FILE_ORDER_SORT_MEMORY  16384   // Most heap taken by a sort being built
+#define FILE_ORDER_HEAP_RESERVE 20000   // Heap left to the rest of the firmware by it
+
+#include "StorageFS.h"
+#include "GcodeCompactor.h"
+#include <functional>
+
+enum FileSort : uint8_t {
+  FileSortName, FileSortSize, FileSortDate, FILE_SORTS
+};
+
+struct FileIndexEntry;
+class FileIndex;
+
+// The records of the file index in the order of a sort, in a file of record
+// numbers: by directory, its directories before its files, then by name
+// (ignoring case), size or modification time, and by record number. So the
+// records of a directory take consecutive positions, and with names, those
+// starting with a prefix too.
+//
+// The index keeps it up to date with insert() and erase(). When it is not,
+// build() sorts the records again on the SD: runs as big as the heap allows
+// are sorted in RAM, then merged two by two.
+class FileOrder {
+  private:
+    struct Header {
+      uint32_t magic;
+      uint16_t version;
+      uint8_t sort;
+      uint8_t reserved;
+      uint32_t length;
+      uint32_t generation;                    // The one of the index it was made for
+    };
+
+    FileWrapper file;
+    FileSort sort = FileSortName;
+    uint32_t length = 0, generation = 0;
+    bool valid = false;
+
+    bool writeHeader();
+    bool setRecord(uint32_t position, uint16_t record);
+    bool move(uint32_t from, uint32_t to, uint32_t count);
+    bool writeRuns(FileIndex &index, FileWrapper &runs, uint8_t *buffer, uint32_t capacity, size_t itemSize, uint32_t &items);
+    bool merge(FileWrapper &from, FileWrapper &to, uint32_t runLength, uint32_t items, uint8_t *buffer, uint32_t capacity, size_t itemSize);
+
+  public:
+    // The position of entry a against entry b, like strcmp()
+    static int compare(FileSort sort, const FileIndexEntry &a, uint16_t recordA, const FileIndexEntry &b, uint16_t recordB);
+    // 0 when the name starts with prefix, ignoring case, else its side of the names that do
+    static int comparePrefix(const FileIndexEntry &entry, const char *prefix, size_t length);
+    static const char *getSortName(FileSort sort);
+    // Deletes the file of the order of sort
+    static void remove(FileSort sort);
+
+    // Opens the order of sort, valid if it was made for generation of the index
+    bool begin(FileSort sort, uint32_t generation);
+    void end();
+
+    inline bool isValid() const {
+      return valid;
+    }
+
+    inline void invalidate() {
+      valid = false;
+    }
+
+    inline uint32_t size() const {
+      return length;
+    }
+
+    // The record at position, -1 if it cannot be read
+    int32_t get(uint32_t position);
+    // The first position from first to last whose record is not before(), that
+    // is true for the records up to some position and false after it
+    uint32_t lowerBound(FileIndex &index, uint32_t first, uint32_t last,
+                        std::function<bool(const FileIndexEntry &entry, uint16_t record)> before);
+
+    // Sorts the records of the index
+    bool build(FileIndex &index, uint32_t generation);
+    // Puts the record in its position, or takes it out while it still has entry
+    bool insert(FileIndex &index, uint16_t record, const FileIndexEntry &entry, uint32_t generation);
+    bool erase(FileIndex &index, uint16_t record, const FileIndexEntry &entry, uint32_t generation);
+};
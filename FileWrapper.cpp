@@ -30,8 +30,12 @@ size_t FileWrapper::write(const uint8_t *buf, size_t len) {
 }
 
 void FileWrapper::flush() {
-  if (sdFile)
+  if (sdFile) {
     sdFile.sync();
+    if (written)
+      StorageFS::resized(charged, sdFile.fileSize());
+    charged = sdFile.fileSize();
+  }
 }
 
 int FileWrapper::available() {
@@ -62,8 +66,8 @@ int FileWrapper::read() {
 String FileWrapper::name() {
   if (Name.length()<=0) {
     if (sdFile) {
-      char str[64];
-      sdFile.getName(str, 64);
+      char str[256];    // Long file names have up to 255 characters
+      sdFile.getName(str, sizeof(str));
       Name = String(str);
     }
   }
@@ -76,23 +80,38 @@ uint32_t FileWrapper::size() {
   return 0;
 }
 
-time_t FileWrapper::getCreationTime() {
-  time_t creation_time;
+static time_t fatTime(uint16_t fatDate, uint16_t fatTime) {
   tm time;
+  time.tm_year = sdfat::FAT_YEAR(fatDate) - 1900;
+  time.tm_mon = sdfat::FAT_MONTH(fatDate) - 1;
+  time.tm_mday = sdfat::FAT_DAY(fatDate);
+  time.tm_hour = sdfat::FAT_HOUR(fatTime);
+  time.tm_min = sdfat::FAT_MINUTE(fatTime);
+  time.tm_sec = sdfat::FAT_SECOND(fatTime);
+  time.tm_isdst = -1;
+  //strptime(output.getString().c_str(), "%Y-%m-%d %H:%M:%S", &time);
+  return mktime(&time);
+}
+
+time_t FileWrapper::getCreationTime() {
+  if (sdFile) {
+    sdfat::dir_t dir;
+    if (!sdFile.dirEntry(&dir)) {
+      return 0;
+    }
+    return fatTime(dir.creationDate, dir.creationTime);
+  }
+
+  return 0;
+}
+
+time_t FileWrapper::getModificationTime() {
   if (sdFile) {
     sdfat::dir_t dir;
     if (!sdFile.dirEntry(&dir)) {
       return 0;
     }
-    time.tm_year = sdfat::FAT_YEAR(dir.creationDate) - 1900;
-    time.tm_mon = sdfat::FAT_MONTH(dir.creationDate) - 1;
-    time.tm_mday = sdfat::FAT_DAY(dir.creationDate);
-    time.tm_hour = sdfat::FAT_HOUR(dir.creationTime);
-    time.tm_min = sdfat::FAT_MINUTE(dir.creationTime);
-    time.tm_sec = sdfat::FAT_SECOND(dir.creationTime);
-    //strptime(output.getString().c_str(), "%Y-%m-%d %H:%M:%S", &time);
-    creation_time = mktime(&time);
-    return creation_time;
+    return fatTime(dir.lastWriteDate, dir.lastWriteTime);
   }
 
   return 0;
@@ -146,9 +165,26 @@ String FileWrapper::readStringUntilToBack(char eol, uint32_t pos) {
   return String("");
 }
 
+bool FileWrapper::truncate(uint32_t length) {
+  if (sdFile)
+    return sdFile.truncate(length);
+
+  return false;
+}
+
+bool FileWrapper::contiguousRange(uint32_t &firstSector, uint32_t &lastSector) {
+  if (sdFile)
+    return sdFile.contiguousRange(&firstSector, &lastSector);
+
+  return false;
+}
+
 bool FileWrapper::close() {
   bool ret = false;
   if (sdFile) {
+    if (written)
+      StorageFS::resized(charged, sdFile.fileSize());
+    written = false;
     ret = sdFile.close();
     sdFile = sdfat::File();
   }
@@ -165,6 +201,22 @@ FileWrapper FileWrapper::openNextFile() {
   return fw;
 }
 
+FileWrapper FileWrapper::openEntry(uint16_t index) {
+  FileWrapper fw = FileWrapper();
+
+  if (sdFile) {
+    fw.sdFile.open(&sdFile, index, sdfat::O_READ);
+  }
+  return fw;
+}
+
+uint16_t FileWrapper::dirIndex() {
+  if (sdFile)
+    return sdFile.dirIndex();
+
+  return 0;
+}
+
 bool FileWrapper::isGcode() {
   return name().indexOf(".gcode") != -1;
 }
@@ -33,6 +33,8 @@ class FileWrapper : public Stream {
   private:
     sdfat::File sdFile;
     String Name;
+    bool written = false;     // Opened to write, its size is charged to the free space at close()
+    uint32_t charged = 0;     // Size last charged to the free space
   public:
     // Print methods
     virtual size_t write(uint8_t datum);
@@ -52,9 +54,13 @@ class FileWrapper : public Stream {
     String name();
     uint32_t size();
     time_t getCreationTime();
+    time_t getModificationTime();
     int read(uint8_t *buf, size_t size);
     String readStringUntil(char eol);
     String readStringUntilToBack(char eol, uint32_t pos);
+    bool truncate(uint32_t length);
+    // The sectors of a file in consecutive clusters, false for a fragmented one
+    bool contiguousRange(uint32_t &firstSector, uint32_t &lastSector);
     bool close();
 
     inline bool isDirectory() {
@@ -62,5 +68,9 @@ class FileWrapper : public Stream {
     }
 
     FileWrapper openNextFile();
+    // The file of entry index of this directory, opened without looking for its name
+    FileWrapper openEntry(uint16_t index);
+    // The entry of this file in its directory
+    uint16_t dirIndex();
     bool isGcode();
 };
@@ -0,0 +1,98 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FirmwareDialect.h"
+
+// "[MP] " is in every table: packing is asked for from any firmware whose M115 reports Cap:MEATPACK
+static const ResponsePrefix marlinPrefixes[] = {
+  RESPONSE_PREFIX("ok", Ok),
+  RESPONSE_PREFIX("T", Temperature),
+  RESPONSE_PREFIX(" T", Temperature),
+  RESPONSE_PREFIX("B:", Temperature),
+  RESPONSE_PREFIX("X:", Position),
+  RESPONSE_PREFIX("echo:busy", Busy),
+  RESPONSE_PREFIX("echo: cold extrusion prevented", ColdExtrusion),
+  RESPONSE_PREFIX("echo:Unknown command:", UnknownCommand),
+  RESPONSE_PREFIX("Error:", Error),
+  RESPONSE_PREFIX("Resend:", Resend),
+  RESPONSE_PREFIX("rs ", Resend),
+  RESPONSE_PREFIX("wait", Wait),
+  RESPONSE_PREFIX("//action:", Action),
+  RESPONSE_PREFIX("[MP] ", MeatPack),
+};
+
+static const ResponsePrefix prusaPrefixes[] = {
+  RESPONSE_PREFIX("ok", Ok),
+  RESPONSE_PREFIX("T", Temperature),
+  RESPONSE_PREFIX(" T", Temperature),
+  RESPONSE_PREFIX("X:", Position),
+  RESPONSE_PREFIX("echo:busy", Busy),
+  RESPONSE_PREFIX("echo: cold extrusion prevented", ColdExtrusion),
+  RESPONSE_PREFIX("echo:Unknown command:", UnknownCommand),
+  RESPONSE_PREFIX("Error:", Error),
+  RESPONSE_PREFIX("Resend:", Resend),
+  RESPONSE_PREFIX("wait", Wait),
+  RESPONSE_PREFIX("// action:", Action),
+  RESPONSE_PREFIX("[MP] ", MeatPack),
+};
+
+static const ResponsePrefix repRapPrefixes[] = {
+  RESPONSE_PREFIX("ok", Ok),
+  RESPONSE_PREFIX("T", Temperature),
+  RESPONSE_PREFIX("X:", Position),
+  RESPONSE_PREFIX("Error:", Error),
+  RESPONSE_PREFIX("rs ", Resend),
+  RESPONSE_PREFIX("Resend:", Resend),
+  RESPONSE_PREFIX("//action:", Action),
+  RESPONSE_PREFIX("[MP] ", MeatPack),
+};
+
+static const ResponsePrefix klipperPrefixes[] = {
+  RESPONSE_PREFIX("ok", Ok),
+  RESPONSE_PREFIX("B:", Temperature),
+  RESPONSE_PREFIX("T", Temperature),
+  RESPONSE_PREFIX("X:", Position),
+  RESPONSE_PREFIX("!! ", Error),
+  RESPONSE_PREFIX("// action:", Action),
+  RESPONSE_PREFIX("[MP] ", MeatPack),
+};
+
+#define DIALECT_PREFIXES(prefixes) prefixes, sizeof(prefixes) / sizeof(prefixes[0])
+
+static const FirmwareDialect dialects[] = {
+  // Type, name, prefixes, heating reports, numbered tools, line numbers, fatal errors
+  { FirmwareType::Marlin, "Marlin", DIALECT_PREFIXES(marlinPrefixes), false, false, true, true },
+  { FirmwareType::Prusa, "Prusa", DIALECT_PREFIXES(prusaPrefixes), true, false, true, true },
+  // Its errors are about a command, the print goes on
+  { FirmwareType::RepRapFirmware, "RepRapFirmware", DIALECT_PREFIXES(repRapPrefixes), false, false, true, false },
+  // Line numbers are taken but never checked
+  { FirmwareType::Klipper, "Klipper", DIALECT_PREFIXES(klipperPrefixes), false, true, false, false },
+};
+
+const FirmwareDialect &FirmwareDialect::get(FirmwareType type) {
+  return dialects[(uint8_t)type];
+}
+
+const FirmwareDialect &FirmwareDialect::fromName(const char *firmwareName) {
+  if (strstr(firmwareName, "Prusa-Firmware"))
+    return get(FirmwareType::Prusa);
+  if (strstr(firmwareName, "RepRapFirmware"))
+    return get(FirmwareType::RepRapFirmware);
+  if (strstr(firmwareName, "Klipper"))
+    return get(FirmwareType::Klipper);
+  return get(FirmwareType::Marlin);
+}
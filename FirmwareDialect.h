@@ -0,0 +1,46 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "PrinterResponse.h"
+
+enum class FirmwareType : uint8_t {
+  Marlin, Prusa, RepRapFirmware, Klipper
+};
+
+// How a firmware talks, picked by the FIRMWARE_NAME of its M115 answer. The
+// responses are only matched against the lines it sends, and the fallbacks
+// for the reports of other firmwares are left out.
+struct FirmwareDialect {
+  FirmwareType type;
+  const char *name;
+  const ResponsePrefix *prefixes;     // Of the lines it sends
+  uint8_t prefixCount;
+  bool heatingReports;                // "T:180.3 E:0 B:55.1" while heating, without targets
+  bool numberedTools;                 // A single extruder is reported as T0:, not T:
+  bool lineNumbers;                   // Takes "N<line> ...*<checksum>" and asks to resend the bad ones
+  bool fatalErrors;                   // An "Error:" not about a line means the printer stopped
+
+  inline ResponseType classify(const char *line, uint16_t length) const {
+    return PrinterResponse::classify(line, length, prefixes, prefixCount);
+  }
+
+  static const FirmwareDialect &get(FirmwareType type);
+  // The dialect of a FIRMWARE_NAME, Marlin for the ones not known
+  static const FirmwareDialect &fromName(const char *firmwareName);
+};
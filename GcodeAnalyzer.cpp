@@ -0,0 +1,319 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "GcodeAnalyzer.h"
+#include <float.h>
+
+enum CommentField : uint8_t {
+  EstimatedTime, TimeElapsed, FilamentMetres, FilamentLength, FilamentVolume, FilamentWeight,
+  LayerHeight, LayerCount, LayerMarker
+};
+
+// Comments of the slicers, matched at the start of the text after ';'
+static const struct {
+  const char *key;
+  CommentField field;
+} commentKeys[] = {
+  { "TIME:", EstimatedTime },                                     // Cura
+  { "TIME_ELAPSED:", TimeElapsed },                               // Cura, at the end of each layer
+  { "estimated printing time (normal mode) =", EstimatedTime },   // PrusaSlicer, SuperSlicer, OrcaSlicer
+  { "Build time:", EstimatedTime },                               // Simplify3D
+  { "Filament used:", FilamentMetres },                           // Cura
+  { "filament used [mm] =", FilamentLength },                     // PrusaSlicer...
+  { "Filament length:", FilamentLength },                         // Simplify3D
+  { "filament used [cm3] =", FilamentVolume },                    // PrusaSlicer...
+  { "filament used [g] =", FilamentWeight },                      // PrusaSlicer...
+  { "Plastic weight:", FilamentWeight },                          // Simplify3D
+  { "Layer height:", LayerHeight },                               // Cura
+  { "layer_height =", LayerHeight },                              // PrusaSlicer...
+  { "layerHeight,", LayerHeight },                                // Simplify3D
+  { "LAYER_COUNT:", LayerCount },                                 // Cura
+  { "total layer number:", LayerCount },                          // OrcaSlicer
+  { "LAYER:", LayerMarker },                                      // Cura
+  { "LAYER_CHANGE", LayerMarker },                                // PrusaSlicer...
+};
+
+void GcodeAnalyzer::begin(const String &tempFilename) {
+  layers.close();
+  storageFS.mkdir(GCODE_CACHE_DIR);   // Fails when it already exists
+  tempName = GcodeLayerIndex::layersPath(tempFilename);
+  layers = storageFS.open(tempName, "w");
+  failed = !layers;
+  metadata = GcodeMetadata();
+  metadata.minX = metadata.minY = metadata.minZ = FLT_MAX;
+  metadata.maxX = metadata.maxY = metadata.maxZ = -FLT_MAX;
+  lineLength = 0;
+  skipping = false;
+  originalPos = lineStart = lines = 0;
+  layerRecords = elapsed = 0;
+  m73Total = -1;
+  timed = hasLayer = layerExtruded = false;
+  state = GcodeState();
+  extruded = false;
+  layerMarkers = moveLayers = 0;
+  layerZ[0] = layerZ[1] = 0;
+}
+
+void GcodeAnalyzer::write(const uint8_t *data, size_t len) {
+  while (len > 0) {
+    const uint8_t *eol = (const uint8_t *)memchr(data, '\n', len);
+    const size_t n = eol ? eol - data : len;
+    if (!skipping) {
+      if (lineLength + n > GCODE_MAX_LINE_LENGTH)
+        skipping = true;    // Too long to be a command, as GcodeReader does
+      else {
+        memcpy(line + lineLength, data, n);
+        lineLength += n;
+      }
+    }
+    originalPos += n;
+    if (!eol)
+      break;
+    ++originalPos;
+    endLine();
+    data = eol + 1;
+    len -= n + 1;
+  }
+}
+
+void GcodeAnalyzer::endLine() {
+  if (!skipping) {
+    line[lineLength] = '\0';
+    const char *semicolon = strchr(line, ';');
+    if (semicolon)
+      comment(semicolon + 1);
+    const uint16_t length = GcodeReader::strip(line, lineLength);
+    if (length > 0)
+      command(line, length);
+  }
+  skipping = false;
+  lineLength = 0;
+  lineStart = originalPos;
+  ++lines;
+}
+
+// The sum of the numbers of text, for the lengths of each extruder
+static float parseSum(const char *text) {
+  float sum = 0;
+  while (*text) {
+    char *end;
+    const float value = strtof(text, &end);
+    if (end == text)
+      ++text;
+    else {
+      sum += value;
+      text = end;
+    }
+  }
+  return sum;
+}
+
+// Seconds of "3723", "1h 2m 3s", "1d 2h", "1 hours 2 minutes"...
+static uint32_t parseDuration(const char *text) {
+  float seconds = 0;
+  while (*text) {
+    char *end;
+    const float value = strtof(text, &end);
+    if (end == text) {
+      ++text;
+      continue;
+    }
+    text = end;
+    while (*text == ' ')
+      ++text;
+    switch (tolower(*text)) {
+      case 'd': seconds += value * 86400; break;
+      case 'h': seconds += value * 3600; break;
+      case 'm': seconds += value * 60; break;
+      default: seconds += value; break;
+    }
+  }
+  return seconds > 0 ? (uint32_t)(seconds + 0.5f) : 0;
+}
+
+void GcodeAnalyzer::comment(const char *text) {
+  while (*text == ' ' || *text == '\t')
+    ++text;
+  for (const auto &key : commentKeys) {
+    const size_t length = strlen(key.key);
+    if (strncmp(text, key.key, length) != 0)
+      continue;
+
+    const char *value = text + length;
+    switch (key.field) {
+      case EstimatedTime: metadata.estimatedTime = parseDuration(value); break;
+      case TimeElapsed: setElapsed(atof(value)); break;
+      case FilamentMetres: metadata.filamentLength = parseSum(value) * 1000; break;
+      case FilamentLength: metadata.filamentLength = parseSum(value); break;
+      case FilamentVolume: metadata.filamentVolume = parseSum(value); break;
+      case FilamentWeight: metadata.filamentWeight = parseSum(value); break;
+      case LayerHeight: metadata.layerHeight = atof(value); break;
+      case LayerCount: metadata.layerCount = atol(value); break;
+      case LayerMarker:
+        if (layerMarkers++ == 0) {
+          layerRecords = 0;   // The comments tell the layers better than the moves before them
+          hasLayer = false;
+        }
+        addLayer(state);
+        break;
+    }
+    return;
+  }
+}
+
+void GcodeAnalyzer::command(char *text, uint16_t length) {
+  text[length] = '\0';
+  if (toupper(text[0]) == 'M' && atoi(text + 1) == 117)
+    return;   // A message, its words are not parameters
+
+  const GcodeState before = state;
+  if (state.apply(text))
+    move(before);
+  if (metadata.extruderTemperature == 0)
+    metadata.extruderTemperature = state.extruderTarget;    // The first ones set
+  if (metadata.bedTemperature == 0)
+    metadata.bedTemperature = state.bedTarget;
+
+  float remaining;
+  if (toupper(text[0]) == 'M' && atoi(text + 1) == 73 && GcodeState::getWord(text, 'R', remaining)) {
+    if (m73Total < 0)
+      m73Total = remaining * 60;
+    setElapsed(max(0L, (long)(m73Total - remaining * 60)));
+  }
+}
+
+void GcodeAnalyzer::move(const GcodeState &before) {
+  using Axis = GcodeState::Axis;
+  const float *from = before.position, *to = state.position;
+
+  // Only moves laying filament count: not travels, retractions or primes.
+  // One above all the others starts a layer.
+  if (to[Axis::E] > from[Axis::E] && (to[Axis::X] != from[Axis::X] || to[Axis::Y] != from[Axis::Y])) {
+    if (!extruded || to[Axis::Z] > metadata.maxZ + 0.001f) {
+      if (moveLayers < 2)
+        layerZ[moveLayers] = to[Axis::Z];
+      ++moveLayers;
+      if (layerMarkers == 0)
+        addLayer(before);
+    }
+    layerExtruded = true;
+    metadata.minX = min(metadata.minX, min(from[Axis::X], to[Axis::X]));
+    metadata.maxX = max(metadata.maxX, max(from[Axis::X], to[Axis::X]));
+    metadata.minY = min(metadata.minY, min(from[Axis::Y], to[Axis::Y]));
+    metadata.maxY = max(metadata.maxY, max(from[Axis::Y], to[Axis::Y]));
+    metadata.minZ = min(metadata.minZ, to[Axis::Z]);
+    metadata.maxZ = max(metadata.maxZ, to[Axis::Z]);
+    extruded = true;
+  }
+}
+void GcodeAnalyzer::setElapsed(uint32_t seconds) {
+  elapsed = seconds;
+  timed = true;
+  if (hasLayer && !layerExtruded)
+    layer.time = seconds;   // Slicers tell the time a bit after the layer change
+}
+
+void GcodeAnalyzer::addLayer(const GcodeState &at) {
+  writeLayer();
+  layer = { lineStart, lines, elapsed, at };
+  hasLayer = true;
+  layerExtruded = false;
+}
+
+void GcodeAnalyzer::writeLayer() {
+  if (!hasLayer)
+    return;
+  if (!layers || !layers.seek(layerRecords * sizeof(layer)) ||
+      layers.write((const uint8_t *)&layer, sizeof(layer)) != sizeof(layer))
+    failed = true;
+  ++layerRecords;
+  hasLayer = false;
+}
+
+const GcodeMetadata &GcodeAnalyzer::finish(uint32_t fileSize) {
+  if (lineLength > 0 || skipping)
+    endLine();    // Last line without end of line
+
+  metadata.magic = GCODE_METADATA_MAGIC;
+  metadata.fileSize = fileSize;
+  if (metadata.estimatedTime == 0 && m73Total > 0)
+    metadata.estimatedTime = m73Total;
+  if (metadata.layerCount == 0)
+    metadata.layerCount = layerMarkers > 0 ? layerMarkers : moveLayers;
+  if (metadata.layerHeight == 0 && moveLayers >= 2)
+    metadata.layerHeight = layerZ[1] - layerZ[0];
+  if (!extruded)
+    metadata.minX = metadata.minY = metadata.minZ = metadata.maxX = metadata.maxY = metadata.maxZ = 0;
+
+  writeLayer();
+  if (layers) {
+    const uint32_t size = layerRecords * sizeof(GcodeLayer);
+    const GcodeLayersTrailer trailer = {
+      layerRecords, fileSize, timed ? (metadata.estimatedTime > 0 ? metadata.estimatedTime : elapsed) : 0, GCODE_LAYERS_MAGIC
+    };
+    if (layerRecords == 0 || !layers.seek(size) ||
+        layers.write((const uint8_t *)&trailer, sizeof(trailer)) != sizeof(trailer) ||
+        (layers.size() > size + sizeof(trailer) && !layers.truncate(size + sizeof(trailer))))
+      failed = true;
+    layers.close();
+  }
+
+  return metadata;
+}
+
+void GcodeAnalyzer::discard() {
+  layers.close();
+  if (tempName.length() > 0) {
+    storageFS.remove(tempName);
+    tempName = "";
+  }
+}
+
+bool GcodeAnalyzer::install(const String &gcodePath) {
+  remove(gcodePath);
+  FileWrapper file = storageFS.open(metadataPath(gcodePath), "w");
+  bool ok = file && file.write((const uint8_t *)&metadata, sizeof(metadata)) == sizeof(metadata);
+  file.close();
+  // The metadata is kept without the layer index when it could not be written
+  if (ok && !failed && !storageFS.rename(tempName, GcodeLayerIndex::layersPath(gcodePath)))
+    storageFS.remove(GcodeLayerIndex::layersPath(gcodePath));
+  discard();
+  if (!ok)
+    remove(gcodePath);
+
+  return ok;
+}
+
+void GcodeAnalyzer::remove(const String &gcodePath) {
+  storageFS.remove(metadataPath(gcodePath));
+  storageFS.remove(GcodeLayerIndex::layersPath(gcodePath));
+}
+
+bool GcodeAnalyzer::load(const String &gcodePath, uint32_t fileSize, GcodeMetadata &metadata) {
+  FileWrapper file = storageFS.open(metadataPath(gcodePath));
+  if (!file)
+    return false;
+
+  GcodeMetadata read;
+  const bool ok = file.size() == sizeof(read) && file.read((uint8_t *)&read, sizeof(read)) == sizeof(read) &&
+                  read.magic == GCODE_METADATA_MAGIC && read.fileSize == fileSize;
+  file.close();
+  if (ok)
+    metadata = read;
+
+  return ok;
+}
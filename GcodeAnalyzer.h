@@ -0,0 +1,102 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define GCODE_METADATA_MAGIC 0x4d47574eUL   // "NWGM", first bytes of a metadata file
+
+#include "GcodeLayers.h"
+#include "GcodeState.h"
+
+// What is known of a G-code file before printing it, 0 when it is not
+struct GcodeMetadata {
+  uint32_t magic = 0;
+  uint32_t fileSize = 0;                    // Of the file it was taken from
+  uint32_t estimatedTime = 0;               // Seconds, as the slicer estimated them
+  uint32_t layerCount = 0;
+  float filamentLength = 0;                 // mm
+  float filamentVolume = 0;                 // cm3
+  float filamentWeight = 0;                 // g
+  float layerHeight = 0;                    // mm
+  float extruderTemperature = 0;            // First ones set, ºC
+  float bedTemperature = 0;
+  float minX = 0, minY = 0, minZ = 0;       // Box of the extruding moves
+  float maxX = 0, maxY = 0, maxZ = 0;
+};
+
+// Takes the metadata of a G-code file from its bytes while it is received, in
+// a single pass: the comments of the slicers (Cura, PrusaSlicer and its forks,
+// Simplify3D) give the times and the filament, the commands the temperatures,
+// the box of the extruding moves and, without layer comments, the layers.
+// The metadata is kept in the cache, next to the compacted copy.
+//
+// The layer index of the file is written as the layers are found: a
+// GcodeLayer for each, then a GcodeLayersTrailer. Their times come from Cura's
+// ";TIME_ELAPSED:" or from the "M73 R" remaining minutes of PrusaSlicer.
+class GcodeAnalyzer {
+  private:
+    GcodeMetadata metadata;
+    char line[GCODE_MAX_LINE_LENGTH + 1];
+    uint16_t lineLength = 0;
+    bool skipping = false;
+    uint32_t originalPos = 0, lineStart = 0, lines = 0;
+
+    FileWrapper layers;
+    String tempName;
+    uint32_t layerRecords = 0;
+    GcodeLayer layer;                       // Written at the next one: a time can still come before it extrudes
+    bool hasLayer = false, layerExtruded = false;
+    uint32_t elapsed = 0;                   // Slicer seconds printed before the current line
+    int32_t m73Total = -1;                  // Seconds of the first "M73 R", -1 if there is none
+    bool timed = false, failed = false;
+
+    GcodeState state;
+    bool extruded = false;                  // Any extruding move, for the box
+    uint32_t layerMarkers = 0, moveLayers = 0;
+    float layerZ[2];                        // Of the first two layers found by the moves
+
+    void endLine();
+    void comment(const char *text);
+    void command(char *text, uint16_t length);
+    void move(const GcodeState &before);
+    void addLayer(const GcodeState &at);
+    void writeLayer();
+    void setElapsed(uint32_t seconds);
+
+  public:
+    // Starts with tempFilename, the uploaded file being written
+    void begin(const String &tempFilename);
+    void write(const uint8_t *data, size_t len);
+    // Completes the metadata and the layer index of a file of fileSize bytes
+    const GcodeMetadata &finish(uint32_t fileSize);
+    // Drops the layer index started by begin()
+    void discard();
+
+    inline const GcodeMetadata &getMetadata() const {
+      return metadata;
+    }
+
+    inline static String metadataPath(const String &gcodePath) {
+      return GcodeCompactor::cachePath(gcodePath) + ".meta";
+    }
+
+    // Keeps the finished metadata and layer index as the ones of gcodePath
+    bool install(const String &gcodePath);
+    static void remove(const String &gcodePath);
+    // The metadata of gcodePath if it was taken from a file of fileSize bytes
+    static bool load(const String &gcodePath, uint32_t fileSize, GcodeMetadata &metadata);
+};
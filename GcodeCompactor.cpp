@@ -0,0 +1,218 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "GcodeCompactor.h"
+
+bool GcodeCompactor::begin(const String &tempFilename, uint32_t preallocate) {
+  file.close();
+  map.close();
+  storageFS.mkdir(GCODE_CACHE_DIR);   // Fails when it already exists
+  tempName = cachePath(tempFilename);
+  file = storageFS.open(tempName, "w", preallocate);
+  map = storageFS.open(tempName + ".map", "w");
+  lineLength = outLength = 0;
+  skipping = failed = false;
+  compactPos = nextSync = 0;
+  originalPos = lineStart = lines = 0;
+
+  return file && map;
+}
+
+void GcodeCompactor::write(const uint8_t *data, size_t len) {
+  if (!file || !map)
+    return;
+
+  while (len > 0) {
+    const uint8_t *eol = (const uint8_t *)memchr(data, '\n', len);
+    const size_t n = eol ? eol - data : len;
+    if (!skipping) {
+      if (lineLength + n > GCODE_MAX_LINE_LENGTH)
+        skipping = true;    // Too long to be a command, as GcodeReader does
+      else {
+        memcpy(line + lineLength, data, n);
+        lineLength += n;
+      }
+    }
+    originalPos += n;
+    if (!eol)
+      break;
+    ++originalPos;
+    endLine();
+    data = eol + 1;
+    len -= n + 1;
+  }
+}
+
+void GcodeCompactor::endLine() {
+  if (!skipping) {
+    uint16_t length = GcodeReader::strip(line, lineLength);
+    if (length > 0) {
+      length = compact(line, length);
+      if (length <= COMMAND_MAX_LENGTH)
+        emit(line, length);
+    }
+  }
+  skipping = false;
+  lineLength = 0;
+  lineStart = originalPos;
+  ++lines;
+}
+
+void GcodeCompactor::emit(const char *text, uint16_t length) {
+  if (compactPos >= nextSync) {
+    const GcodeSyncPoint sync = { compactPos, lineStart, lines };
+    if (map.write((const uint8_t *)&sync, sizeof(sync)) != sizeof(sync))
+      failed = true;
+    nextSync = (compactPos / GCODE_BLOCK_SIZE + 1) * GCODE_BLOCK_SIZE;
+  }
+
+  compactPos += length + 1;
+  while (length > 0) {
+    const uint16_t n = min((uint16_t)(GCODE_BLOCK_SIZE - outLength), length);
+    memcpy(out + outLength, text, n);
+    outLength += n;
+    text += n;
+    length -= n;
+    if (outLength == GCODE_BLOCK_SIZE)
+      flushOut();
+  }
+  out[outLength++] = '\n';
+  if (outLength == GCODE_BLOCK_SIZE)
+    flushOut();
+}
+
+void GcodeCompactor::flushOut() {
+  if (outLength > 0 && file.write((const uint8_t *)out, outLength) != outLength)
+    failed = true;
+  outLength = 0;
+}
+
+// Shortens the numbers and spaces of a G command in place, returns the new length
+uint16_t GcodeCompactor::compact(char *text, uint16_t length) {
+  if (text[0] != 'G')
+    return length;    // M117 messages, file names, ... are kept as they are
+
+  uint16_t out = 0, i = 0;
+  while (i < length) {
+    while (i < length && (text[i] == ' ' || text[i] == '\t'))
+      ++i;
+    if (i == length)
+      break;
+    if (out > 0)
+      text[out++] = ' ';
+
+    const uint16_t word = out;
+    bool number = true, decimals = false;
+    for (; i < length && text[i] != ' ' && text[i] != '\t'; i++) {
+      const char c = text[i];
+      if (out > word) {
+        if (c == '.')
+          decimals = true;
+        else if (!isdigit(c) && c != '-' && c != '+')
+          number = false;
+      }
+      text[out++] = c;
+    }
+    if (number && decimals) {
+      while (text[out - 1] == '0')
+        --out;
+      if (text[out - 1] == '.')
+        --out;
+      if (out == word + 1 || text[out - 1] == '-' || text[out - 1] == '+')
+        text[out++] = '0';    // "X0.000" is "X0", not "X"
+    }
+  }
+
+  return out;
+}
+
+bool GcodeCompactor::finish() {
+  if (!file || !map)
+    return false;
+
+  if (lineLength > 0 || skipping)
+    endLine();    // Last line without end of line
+  flushOut();
+  if (file.size() > compactPos && !file.truncate(compactPos))
+    failed = true;
+  const GcodeSyncPoint end = { compactPos, originalPos, lines };
+  const uint32_t trailer[3] = { GCODE_MAP_MAGIC, originalPos, compactPos };
+  if (map.write((const uint8_t *)&end, sizeof(end)) != sizeof(end) ||
+      map.write((const uint8_t *)trailer, sizeof(trailer)) != sizeof(trailer))
+    failed = true;
+  file.close();
+  map.close();
+
+  return !failed;
+}
+
+void GcodeCompactor::discard() {
+  file.close();
+  map.close();
+  if (tempName.length() > 0) {
+    storageFS.remove(tempName);
+    storageFS.remove(tempName + ".map");
+    tempName = "";
+  }
+}
+
+bool GcodeCompactor::install(const String &gcodePath) {
+  remove(gcodePath);
+  const bool ok = storageFS.rename(tempName, cachePath(gcodePath)) &&
+                  storageFS.rename(tempName + ".map", mapPath(gcodePath));
+  if (!ok) {
+    discard();
+    remove(gcodePath);
+  }
+  tempName = "";
+
+  return ok;
+}
+
+void GcodeCompactor::remove(const String &gcodePath) {
+  storageFS.remove(cachePath(gcodePath));
+  storageFS.remove(mapPath(gcodePath));
+}
+
+bool GcodeCompactor::open(GcodeReader &reader, const String &gcodePath, uint32_t originalSize, uint32_t pos) {
+  FileWrapper map = storageFS.open(mapPath(gcodePath));
+  if (!map)
+    return false;
+
+  const uint32_t size = map.size();
+  uint32_t trailer[3];
+  if (size < 2 * sizeof(GcodeSyncPoint) || size % sizeof(GcodeSyncPoint) != 0 || !map.seek(size - sizeof(trailer)) ||
+      map.read((uint8_t *)trailer, sizeof(trailer)) != sizeof(trailer) ||
+      trailer[0] != GCODE_MAP_MAGIC || trailer[1] != originalSize) {
+    map.close();
+    return false;   // Not a map, or the one of a different file
+  }
+
+  FileWrapper compacted = storageFS.open(cachePath(gcodePath));
+  if (!compacted || compacted.size() != trailer[2]) {
+    compacted.close();
+    map.close();
+    return false;
+  }
+
+  if (!reader.open(compacted, pos) || !reader.setMap(map)) {
+    reader.close();
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,72 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define GCODE_CACHE_DIR "/.cache"     // Compacted copies of the uploaded files and their maps
+
+#include "StorageFS.h"
+#include "GcodeReader.h"
+
+// Writes a compacted copy of a G-code file while it is being received: no
+// comments, blank lines, repeated spaces or trailing zeros in the numbers of
+// G commands. A map file keeps a GcodeSyncPoint every GCODE_BLOCK_SIZE bytes
+// of compacted file, and a trailer with both sizes, so progress can still be
+// given in the original file.
+class GcodeCompactor {
+  private:
+    FileWrapper file, map;
+    String tempName;
+    char line[GCODE_MAX_LINE_LENGTH + 1];
+    uint16_t lineLength = 0;
+    bool skipping = false;
+    char out[GCODE_BLOCK_SIZE];     // Compacted bytes not written yet
+    uint16_t outLength = 0;
+    uint32_t compactPos = 0, nextSync = 0;
+    uint32_t originalPos = 0, lineStart = 0, lines = 0;
+    bool failed = false;
+
+    void endLine();
+    void emit(const char *text, uint16_t length);
+    void flushOut();
+    static uint16_t compact(char *text, uint16_t length);
+
+  public:
+    // Starts the compacted copy of tempFilename, the uploaded file being written,
+    // in consecutive clusters of the preallocate bytes it can take at most
+    bool begin(const String &tempFilename, uint32_t preallocate = 0);
+    void write(const uint8_t *data, size_t len);
+    // Completes the copy, false when something could not be written
+    bool finish();
+    // Drops the copy started by begin()
+    void discard();
+    // Makes the finished copy the one of gcodePath
+    bool install(const String &gcodePath);
+
+    inline static String cachePath(const String &gcodePath) {
+      return GCODE_CACHE_DIR + gcodePath;
+    }
+
+    inline static String mapPath(const String &gcodePath) {
+      return cachePath(gcodePath) + ".map";
+    }
+
+    static void remove(const String &gcodePath);
+    // Opens the compacted copy of gcodePath if it is the one of this original,
+    // read from pos of the copy on
+    static bool open(GcodeReader &reader, const String &gcodePath, uint32_t originalSize, uint32_t pos = 0);
+};
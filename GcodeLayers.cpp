@@ -0,0 +1,98 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "GcodeLayers.h"
+
+bool GcodeLayerIndex::open(const String &gcodePath, uint32_t fileSize) {
+  close();
+  file = storageFS.open(layersPath(gcodePath));
+  if (!file)
+    return false;
+
+  const uint32_t size = file.size();
+  GcodeLayersTrailer trailer;
+  if (size < sizeof(trailer) || !file.seek(size - sizeof(trailer)) ||
+      file.read((uint8_t *)&trailer, sizeof(trailer)) != sizeof(trailer) ||
+      trailer.magic != GCODE_LAYERS_MAGIC || trailer.fileSize != fileSize || trailer.count == 0 ||
+      size != trailer.count * sizeof(GcodeLayer) + sizeof(trailer) || !read(0, next)) {
+    close();
+    return false;
+  }
+
+  count = trailer.count;
+  this->fileSize = fileSize;
+  totalTime = trailer.totalTime;
+  return true;
+}
+
+void GcodeLayerIndex::close() {
+  file.close();
+  count = started = startTime = 0;
+}
+
+bool GcodeLayerIndex::read(uint32_t layer, GcodeLayer &record) {
+  return file.seek(layer * sizeof(GcodeLayer)) &&
+         file.read((uint8_t *)&record, sizeof(record)) == sizeof(record);
+}
+
+void GcodeLayerIndex::update(uint32_t position, uint32_t printTime) {
+  while (started < count && position >= next.offset) {
+    current = next;
+    if (started++ == 0)
+      startTime = printTime;
+    if (started == count || !read(started, next))
+      next = { fileSize, 0, totalTime };    // The end of the file ends the last layer
+  }
+}
+
+// The part of the current layer printed
+float GcodeLayerIndex::getFraction(uint32_t position) const {
+  if (position <= current.offset || next.offset <= current.offset)
+    return 0;
+  return min(1.0f, (float)(position - current.offset) / (next.offset - current.offset));
+}
+
+float GcodeLayerIndex::getCompletion(uint32_t position) const {
+  if (started == 0)
+    return 0;
+
+  const float fraction = getFraction(position);
+  const float completion = totalTime > 0 ? (current.time + fraction * ((float)next.time - current.time)) / totalTime
+                                         : (started - 1 + fraction) / count;
+  return min(100.0f, max(0.0f, completion * 100));
+}
+
+int32_t GcodeLayerIndex::getTimeLeft(uint32_t position, uint32_t printTime) const {
+  if (started == 0)
+    return -1;
+
+  const float printed = printTime - startTime;    // Since the first layer, heating is behind
+  const float fraction = getFraction(position);
+  if (totalTime > 0) {
+    // What the slicer says is left, at the pace of the print so far
+    const float estimated = current.time + fraction * ((float)next.time - current.time);
+    float left = max(0.0f, totalTime - estimated);
+    if (estimated >= GCODE_PACE_MIN_TIME && printed > 0)
+      left *= min(4.0f, max(0.25f, printed / estimated));
+    return left;
+  }
+
+  const float layers = started - 1 + fraction;
+  if (layers <= 0)
+    return -1;
+  return printed / layers * (count - layers);
+}
@@ -0,0 +1,91 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define GCODE_LAYERS_MAGIC    0x4c43574eUL  // "NWCL", last bytes of a layer index
+#define GCODE_PACE_MIN_TIME   60      // Seconds of the slicer estimate printed before the real pace is used
+
+#include "GcodeCompactor.h"
+#include "GcodeState.h"
+
+// Where a layer starts in the original file: its first line, the seconds of
+// the slicer estimate printed before it and the state the lines before leave,
+// to start a print there
+struct GcodeLayer {
+  uint32_t offset, line, time;
+  GcodeState state;
+};
+
+// Last bytes of a layer index, after its layers
+struct GcodeLayersTrailer {
+  uint32_t count;
+  uint32_t fileSize;                  // Of the file it was taken from
+  uint32_t totalTime;                 // Slicer estimate, 0 if the layers have no times
+  uint32_t magic;
+};
+
+// Follows a print through the layer index of its file, written by GcodeAnalyzer
+// when the file was uploaded. Only the current and next layers are kept in
+// RAM, the next one is read when the print gets to it.
+//
+// The completion and the time left go by the slicer times of the layers, so
+// slow first layers do not make the rest look slow. Without times, they go by
+// the layers printed.
+class GcodeLayerIndex {
+  private:
+    FileWrapper file;
+    uint32_t count = 0, fileSize = 0, totalTime = 0;
+    uint32_t started = 0;             // Layers the print got to
+    uint32_t startTime = 0;           // Print time when it got to the first one
+    GcodeLayer current, next;
+
+    bool read(uint32_t layer, GcodeLayer &record);
+    float getFraction(uint32_t position) const;
+
+  public:
+    inline static String layersPath(const String &gcodePath) {
+      return GcodeCompactor::cachePath(gcodePath) + ".layers";
+    }
+
+    // Opens the index of gcodePath if it was taken from a file of fileSize bytes
+    bool open(const String &gcodePath, uint32_t fileSize);
+    void close();
+
+    inline bool isOpen() {
+      return file;
+    }
+
+    inline uint32_t getCount() const {
+      return count;
+    }
+
+    // The layer being printed from 1, 0 before the first one
+    inline uint32_t getLayer() const {
+      return started;
+    }
+
+    // Moves to the layer of position, printTime being the seconds printing
+    void update(uint32_t position, uint32_t printTime);
+    float getCompletion(uint32_t position) const;
+    // Seconds left, -1 if they cannot be told yet
+    int32_t getTimeLeft(uint32_t position, uint32_t printTime) const;
+    // Layer n from 0 of the index
+    inline bool get(uint32_t n, GcodeLayer &layer) {
+      return n < count && read(n, layer);
+    }
+};
@@ -0,0 +1,281 @@
+/* 
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "GcodeReader.h"
+
+#include <new>
+
+bool GcodeReader::open(const FileWrapper &gcodeFile, uint32_t pos, uint32_t line) {
+  file = gcodeFile;
+  start = end = 0;
+  position = pos;
+  lineNumber = line;
+  skipping = false;
+  outOfMemory = false;
+  map.close();
+  mapped = false;
+  closeGzip();
+  eof = !file || !file.seek(pos);
+  if (eof)
+    return false;
+  uint32_t lastSector;
+  raw = file.contiguousRange(firstSector, lastSector);
+  fileSize = file.size();
+
+  if (pos > 0) {
+    // A deflate stream cannot be taken up in the middle
+    uint8_t magic[2];
+    if (!file.seek(0) || file.read(magic, 2) != 2 || GzipInflater::isGzip(magic, 2) || !file.seek(pos)) {
+      close();
+      return false;
+    }
+  }
+  else {
+    // The first block tells a gzip file
+    fill();
+    if (end >= 2 && GzipInflater::isGzip((const uint8_t *)buffer, end)) {
+      raw = false;    // The compressed bytes are read through the file system
+      if (!openGzip()) {
+        close();
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool GcodeReader::canInflate() {
+  return ESP.getFreeHeap() >= sizeof(GzipSource) + GZIP_MAX_WINDOW + GZIP_HEAP_RESERVE;
+}
+
+// Starts inflating with the first block, read in the buffer
+bool GcodeReader::openGzip() {
+  uint8_t trailer[4];
+  const uint32_t size = file.size();
+  if (size < 18 || !file.seek(size - 4) || file.read(trailer, 4) != 4 || !file.seek(end))
+    return false;
+
+  gzip = new (std::nothrow) GzipSource;
+  // Any distance of the stream has to be in the window, there is no inflated file to read it from
+  if (!gzip || !gzip->inflater.begin(nullptr, nullptr, GZIP_MAX_WINDOW)) {
+    delete gzip;
+    gzip = nullptr;
+    outOfMemory = true;
+    return false;
+  }
+  gzip->size = trailer[0] | (uint32_t)trailer[1] << 8 | (uint32_t)trailer[2] << 16 | (uint32_t)trailer[3] << 24;
+  memcpy(gzip->input, buffer, end);
+  gzip->end = end;
+  end = 0;
+
+  return true;
+}
+
+bool GcodeReader::setMap(const FileWrapper &mapFile) {
+  map = mapFile;
+  mapped = map && map.seek(0);
+  if (!mapped)
+    return false;
+  mapRecords = map.size() / sizeof(GcodeSyncPoint) - 1;   // Without the trailer
+  syncIndex = syncCount = 0;
+  syncFrom = syncTo = { 0, 0, 0 };
+  originalPosition = originalLine = 0;
+  mapPosition();
+
+  return true;
+}
+
+void GcodeReader::close() {
+  file.close();
+  map.close();
+  mapped = false;
+  closeGzip();
+  raw = false;
+  start = end = 0;
+  eof = true;
+}
+
+void GcodeReader::closeGzip() {
+  if (gzip) {
+    gzip->inflater.end();
+    delete gzip;
+    gzip = nullptr;
+  }
+}
+
+// Moves what is left to the front and reads up to the next block boundary of the file
+void GcodeReader::fill() {
+  if (start > 0) {
+    memmove(buffer, buffer + start, end - start);
+    end -= start;
+    start = 0;
+  }
+  if (gzip) {
+    inflate();
+    return;
+  }
+
+  if (raw && readRaw())
+    return;
+
+  const uint32_t filePos = position + end;
+  const size_t len = GCODE_BLOCK_SIZE - filePos % GCODE_BLOCK_SIZE;
+  const int n = file.read((uint8_t *)buffer + end, len);
+  if (n <= 0)
+    eof = true;
+  else
+    end += n;
+}
+
+// Reads up to GCODE_RAW_BLOCKS blocks from the card, false when the file has to be read instead
+bool GcodeReader::readRaw() {
+  const uint32_t filePos = position + end;
+  if (filePos >= fileSize) {
+    eof = true;
+    return true;
+  }
+  if (filePos % GCODE_BLOCK_SIZE != 0)
+    return false;   // Opened in the middle of a block, read up to its end first
+
+  const uint32_t left = fileSize - filePos;
+  const uint8_t blocks = min((uint32_t)GCODE_RAW_BLOCKS, (left + GCODE_BLOCK_SIZE - 1) / GCODE_BLOCK_SIZE);
+  if (!storageFS.readSectors(firstSector + filePos / GCODE_BLOCK_SIZE, (uint8_t *)buffer + end, blocks)) {
+    raw = false;    // Read through the file system from here on
+    if (!file.seek(filePos))
+      eof = true;
+    return eof;
+  }
+  end += min(left, (uint32_t)blocks * GCODE_BLOCK_SIZE);
+
+  return true;
+}
+
+// Inflates the next GCODE_BLOCK_SIZE bytes at most, reading the compressed file a block at a time
+void GcodeReader::inflate() {
+  GzipInflater &inflater = gzip->inflater;
+  size_t n;
+  while ((n = inflater.read((uint8_t *)buffer + end, GCODE_BLOCK_SIZE)) == 0) {
+    if (inflater.isDone() || inflater.failed()) {
+      eof = true;
+      return;
+    }
+    if (gzip->start == gzip->end) {
+      const int r = file.read(gzip->input, GCODE_BLOCK_SIZE);
+      gzip->start = 0;
+      gzip->end = r > 0 ? r : 0;
+    }
+    // A short block is the last one of the file
+    const size_t used = inflater.feed(gzip->input + gzip->start, gzip->end - gzip->start, gzip->end < GCODE_BLOCK_SIZE);
+    gzip->start += used;
+    gzip->consumed += used;
+  }
+  end += n;
+}
+
+// Finds the original position of the compact one, the file is read forward only
+void GcodeReader::mapPosition() {
+  while (position > syncTo.compact) {
+    if (syncIndex == syncCount) {
+      const uint8_t n = min(mapRecords, (uint32_t)GCODE_MAP_READ);
+      const int bytes = n * sizeof(GcodeSyncPoint);
+      if (n == 0 || map.read((uint8_t *)syncBuffer, bytes) != bytes) {
+        mapRecords = 0;
+        break;
+      }
+      mapRecords -= n;
+      syncIndex = 0;
+      syncCount = n;
+    }
+    syncFrom = syncTo;
+    syncTo = syncBuffer[syncIndex++];
+  }
+  if (position >= syncTo.compact || syncTo.compact == syncFrom.compact) {
+    originalPosition = syncTo.original;
+    originalLine = syncTo.line;
+  }
+  else {
+    const uint32_t done = position - syncFrom.compact, span = syncTo.compact - syncFrom.compact;
+    originalPosition = syncFrom.original + (uint64_t)(syncTo.original - syncFrom.original) * done / span;
+    originalLine = syncFrom.line + (uint64_t)(syncTo.line - syncFrom.line) * done / span;
+  }
+}
+
+uint16_t GcodeReader::strip(char *line, uint16_t length) {
+  uint16_t out = 0;
+  bool inComment = false;
+  for (uint16_t i = 0; i < length; i++) {
+    const char c = line[i];
+    if (inComment) {
+      if (c == ')')
+        inComment = false;
+    }
+    else if (c == ';')
+      break;
+    else if (c == '(')
+      inComment = true;
+    else if (out > 0 || (c != ' ' && c != '\t' && c != '\r'))
+      line[out++] = c;
+  }
+  while (out > 0 && (line[out - 1] == ' ' || line[out - 1] == '\t' || line[out - 1] == '\r'))
+    --out;
+
+  return out;
+}
+
+CommandView GcodeReader::readLine() {
+  for (;;) {
+    char *eol = (char *)memchr(buffer + start, '\n', end - start);
+    if (!eol) {
+      if (end - start >= GCODE_MAX_LINE_LENGTH) {
+        // Too long to be a command, drop it up to its end
+        position += end - start;
+        start = end;
+        skipping = true;
+      }
+      if (!eof) {
+        fill();
+        continue;
+      }
+      if (start == end) {
+        if (mapped)
+          mapPosition();
+        return CommandView();
+      }
+      eol = buffer + end;   // Last line without end of line
+    }
+
+    char *line = buffer + start;
+    uint16_t length = eol - line;
+    const uint16_t consumed = eol < buffer + end ? length + 1 : length;
+    start += consumed;
+    position += consumed;
+    ++lineNumber;
+    if (skipping) {
+      skipping = false;
+      continue;
+    }
+
+    length = strip(line, length);
+    if (length > 0 && length <= COMMAND_MAX_LENGTH) {
+      line[length] = '\0';
+      if (mapped)
+        mapPosition();
+      return CommandView(line, length);
+    }
+  }
+}
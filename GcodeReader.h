@@ -0,0 +1,163 @@
+/* 
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define GCODE_BLOCK_SIZE      512     // SD sector, the file is read in whole aligned blocks
+#define GCODE_MAX_LINE_LENGTH 256     // Longer lines are skipped
+#define GCODE_MAP_MAGIC       0x4d43574eUL  // "NWCM", last bytes of a compacted file map
+#define GCODE_MAP_READ        8       // Sync points read from the map at a time
+#define GCODE_RAW_BLOCKS      2       // Blocks read at a time from a file in consecutive clusters
+
+#include "StorageFS.h"
+#include "CommandQueue.h"
+#include "GzipInflater.h"
+
+// A point where a compacted file and its original are in step: the first
+// compact bytes come from the first original bytes and lines.
+struct GcodeSyncPoint {
+  uint32_t compact, original, line;
+};
+
+// Reads the G-code lines of a file to be printed. The file is read a block at
+// a time into a fixed buffer where comments (';' and '(...)'), surrounding
+// spaces and blank lines are removed, so readLine() gives the commands with
+// no allocation and no per byte SD reads.
+//
+// When a file compacted by GcodeCompactor is read with its map, positions and
+// line numbers are given in the original file, interpolated between the
+// sync points of the map.
+//
+// A file in consecutive clusters, as uploads are written when their size is
+// known, is read with raw multi-block reads that skip the FAT and the cache.
+//
+// A gzip file is inflated while it is read, with a fixed 32 KB window as there
+// is no inflated copy to read older bytes from. Its positions are in the
+// compressed file, estimated from the bytes inflated so far; completion is
+// given from the inflated bytes and size.
+class GcodeReader {
+  private:
+    struct GzipSource {
+      GzipInflater inflater;
+      uint8_t input[GCODE_BLOCK_SIZE];    // Compressed bytes not inflated yet
+      uint16_t start = 0, end = 0;
+      uint32_t consumed = 0;              // Compressed bytes inflated
+      uint32_t size = 0;                  // Inflated size, from the gzip trailer
+    };
+
+    FileWrapper file;
+    char buffer[GCODE_RAW_BLOCKS * GCODE_BLOCK_SIZE + GCODE_MAX_LINE_LENGTH + 1];
+    uint16_t start = 0, end = 0;    // Unread data in buffer
+    uint32_t position = 0;          // File position of buffer[start]
+    uint32_t firstSector = 0, fileSize = 0;
+    bool raw = false;               // The file is read with StorageFS::readSectors()
+    uint32_t lineNumber = 0;        // File lines read, commands or not
+    bool eof = true, skipping = false;
+    bool outOfMemory = false;       // The last open() found a gzip file without heap to inflate it
+
+    FileWrapper map;
+    bool mapped = false;
+    uint32_t mapRecords = 0;        // Sync points not read yet
+    GcodeSyncPoint syncBuffer[GCODE_MAP_READ];
+    uint8_t syncIndex = 0, syncCount = 0;
+    GcodeSyncPoint syncFrom, syncTo;
+    uint32_t originalPosition = 0, originalLine = 0;
+
+    GzipSource *gzip = nullptr;
+
+    void fill();
+    bool readRaw();
+    void inflate();
+    void mapPosition();
+    bool openGzip();
+    void closeGzip();
+
+  public:
+    // There is heap to inflate a gzip file while reading it, about 53 KB
+    static bool canInflate();
+
+    inline ~GcodeReader() {
+      closeGzip();
+    }
+
+    // Reads from pos on, the start of the line number line. A gzip file is
+    // only read from its start.
+    bool open(const FileWrapper &gcodeFile, uint32_t pos = 0, uint32_t line = 0);
+    // Gives original positions from now on, the map was checked by the caller
+    bool setMap(const FileWrapper &mapFile);
+    void close();
+
+    // Removes comments and surrounding spaces in place, returns the new length
+    static uint16_t strip(char *line, uint16_t length);
+
+    inline operator bool() {
+      return file;
+    }
+
+    // True when every line has been read
+    inline bool isEnd() const {
+      return eof && start == end;
+    }
+
+    // Returns the next command, or an empty one at the end of the file. It
+    // points into the buffer so it is only valid until the next call.
+    CommandView readLine();
+
+    // File position after the last line read
+    inline uint32_t getPosition() const {
+      if (gzip)
+        return gzip->inflater.getSize() ? (uint64_t)gzip->consumed * position / gzip->inflater.getSize() : 0;
+      return mapped ? originalPosition : position;
+    }
+
+    // Position after the last line read in the file itself, the compacted one when mapped
+    inline uint32_t getFilePosition() const {
+      return position;
+    }
+
+    // Percent of the file read, fileSize is the size of the original file
+    inline float getCompletion(uint32_t fileSize) const {
+      if (gzip)
+        return gzip->size ? (float)position / (float)gzip->size * 100.0 : 100.0;
+      return fileSize ? (float)getPosition() / (float)fileSize * 100.0 : 100.0;
+    }
+
+    inline uint32_t getLineNumber() const {
+      return mapped ? originalLine : lineNumber;
+    }
+
+    inline bool isCompacted() const {
+      return mapped;
+    }
+
+    inline bool isGzip() const {
+      return gzip;
+    }
+
+    inline bool isRaw() const {
+      return raw;
+    }
+
+    inline bool isOutOfMemory() const {
+      return outOfMemory;
+    }
+
+    // The gzip file could not be inflated up to its end
+    inline bool failed() const {
+      return gzip && gzip->inflater.failed();
+    }
+};
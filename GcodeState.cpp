@@ -0,0 +1,87 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "GcodeState.h"
+
+bool GcodeState::getWord(const char *command, char letter, float &value) {
+  // The words after the command code
+  for (const char *p = command + 1; *p; p++) {
+    if (toupper(*p) != letter)
+      continue;
+    char *end;
+    value = strtof(p + 1, &end);
+    return end != p + 1;
+  }
+  return false;
+}
+
+bool GcodeState::apply(const char *command) {
+  const char code = toupper(command[0]);
+  if (code != 'G' && code != 'M')
+    return false;
+
+  const int number = atoi(command + 1);
+  float value;
+  if (code == 'G') {
+    switch (number) {
+      case 0: case 1: case 2: case 3:
+        for (uint8_t axis = X; axis < AXES; axis++) {
+          if (getWord(command, "XYZE"[axis], value))
+            position[axis] = relative || (axis == E && relativeE) ? position[axis] + value : value;
+        }
+        if (getWord(command, 'F', value))
+          feedrate = value;
+        return true;
+      case 28: {
+        bool any = false;
+        for (uint8_t axis = X; axis <= Z; axis++)
+          any |= strchr(command + 3, "XYZ"[axis]) != nullptr;
+        for (uint8_t axis = X; axis <= Z; axis++)
+          if (!any || strchr(command + 3, "XYZ"[axis]))
+            position[axis] = 0;
+        break;
+      }
+      case 90: relative = false; break;
+      case 91: relative = true; break;
+      case 92:
+        for (uint8_t axis = X; axis < AXES; axis++)
+          if (getWord(command, "XYZE"[axis], value))
+            position[axis] = value;
+        break;
+    }
+  }
+  else {
+    switch (number) {
+      case 82: relativeE = false; break;
+      case 83: relativeE = true; break;
+      case 104: case 109:
+        if (getWord(command, 'S', value) || getWord(command, 'R', value))
+          extruderTarget = value;
+        break;
+      case 140: case 190:
+        if (getWord(command, 'S', value) || getWord(command, 'R', value))
+          bedTarget = value;
+        break;
+      case 106:
+        fan = getWord(command, 'S', value) ? constrain(value, 0, 255) : 255;
+        break;
+      case 107: fan = 0; break;
+    }
+  }
+
+  return false;
+}
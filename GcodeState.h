@@ -0,0 +1,40 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+// The modal state of a printer as the G-code it runs leaves it: positions,
+// absolute or relative moves and extrusion, feedrate, target temperatures
+// and fan. It is kept as it is in checkpoints and layer indexes.
+struct GcodeState {
+  enum Axis : uint8_t {
+    X, Y, Z, E, AXES
+  };
+
+  float position[AXES] = { 0, 0, 0, 0 };
+  float feedrate = 0;                       // mm/min, 0 until a move gives it
+  float extruderTarget = 0, bedTarget = 0;  // ºC
+  uint8_t fan = 0;                          // M106 speed, 0 to 255
+  bool relative = false, relativeE = false;
+
+  // Applies a command without comments, ending in '\0'. True for the moves, G0 to G3.
+  bool apply(const char *command);
+  // The value of the word letter of a command, false if it has none
+  static bool getWord(const char *command, char letter, float &value);
+};
@@ -0,0 +1,487 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "GzipInflater.h"
+
+// Bits a decoding step can take at most: a distance code and its extra bits
+#define GZIP_STEP_BITS  28
+// Bytes a decoding step can inflate at most: the longest copy
+#define GZIP_STEP_BYTES 258
+
+#define GZIP_FHCRC      0x02
+#define GZIP_FEXTRA     0x04
+#define GZIP_FNAME      0x08
+#define GZIP_FCOMMENT   0x10
+
+static const uint16_t lengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t lengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distanceBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t distanceExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const uint8_t codeLengthOrder[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+static const uint32_t crcTable[16] = {   // CRC-32 of each nibble
+  0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+  0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+bool GzipInflater::begin(Output output, History history, uint32_t minWindow) {
+  end();
+
+  // The biggest window that leaves GZIP_HEAP_RESERVE free
+  const uint32_t heap = ESP.getFreeHeap();
+  uint32_t size = GZIP_MAX_WINDOW;
+  while (size > minWindow && size + GZIP_HEAP_RESERVE > heap)
+    size /= 2;
+  if (size + GZIP_HEAP_RESERVE > heap || !(window = (uint8_t *)malloc(size))) {
+    state = Failed;
+    return false;
+  }
+
+  windowSize = size;
+  this->output = output;
+  this->history = history;
+  total = flushed = historyReads = 0;
+  crc = 0xffffffff;
+  state = Header;
+  headerStep = 0;
+  lastBlock = overrun = false;
+  bits = bitCount = 0;
+  trailerCount = 0;
+
+  return true;
+}
+
+void GzipInflater::end() {
+  free(window);
+  window = nullptr;
+  windowSize = 0;
+}
+
+bool GzipInflater::write(const uint8_t *data, size_t len, bool final) {
+  if (!window || !output)
+    return false;
+
+  in = data;
+  inLeft = len;
+  inflate(final);
+  if (state != Failed)
+    flush();
+  in = nullptr;
+  inLeft = 0;
+
+  return state != Failed;
+}
+
+size_t GzipInflater::feed(const uint8_t *data, size_t len, bool final) {
+  if (!window || output)
+    return 0;
+
+  in = data;
+  inLeft = len;
+  inflate(final);
+  in = nullptr;
+  len -= inLeft;
+  inLeft = 0;
+
+  return len;
+}
+
+size_t GzipInflater::read(uint8_t *data, size_t len) {
+  size_t done = 0;
+  while (done < len && flushed < total) {
+    const uint32_t start = flushed & (windowSize - 1);
+    const uint32_t n = min(min(total - flushed, windowSize - start), (uint32_t)(len - done));
+    memcpy(data + done, window + start, n);
+    flushed += n;
+    done += n;
+  }
+
+  return done;
+}
+
+// Decodes the input, false when it stopped because the window has no room
+bool GzipInflater::inflate(bool final) {
+  while (state != Done && state != Failed) {
+    if (!output && total - flushed > windowSize - GZIP_STEP_BYTES)
+      return false;   // Until read()
+    if (state == Header) {
+      if (inLeft == 0)
+        break;
+      --inLeft;
+      header(*in++);
+      continue;
+    }
+    fillBits();
+    // Until the last bytes, a step only runs when it cannot run out of bits
+    if (bitCount < GZIP_STEP_BITS && !final && state != Stored && state != Trailer)
+      break;
+    if (!step())
+      break;
+    if (overrun)
+      fail();
+  }
+  if (final && state != Done)
+    fail();     // Truncated
+
+  return true;
+}
+
+void GzipInflater::fillBits() {
+  while (bitCount < 32 && inLeft > 0) {
+    bits |= (uint64_t)*in++ << bitCount;
+    bitCount += 8;
+    --inLeft;
+  }
+}
+
+uint32_t GzipInflater::getBits(uint8_t count) {
+  if (count > bitCount) {
+    overrun = true;
+    bits = bitCount = 0;
+    return 0;
+  }
+  const uint32_t value = bits & ((1UL << count) - 1);
+  bits >>= count;
+  bitCount -= count;
+  return value;
+}
+
+// Skips to the next byte boundary, as stored blocks and the trailer start there
+void GzipInflater::alignBits() {
+  bits >>= bitCount % 8;
+  bitCount -= bitCount % 8;
+}
+
+// Canonical Huffman code of the given lengths, as counts per length and symbols by code
+void GzipInflater::buildTree(Tree &tree, const uint8_t *lengths, uint16_t count) {
+  uint16_t offsets[16];
+  memset(tree.counts, 0, sizeof(tree.counts));
+  for (uint16_t i = 0; i < count; i++)
+    tree.counts[lengths[i]]++;
+  tree.counts[0] = 0;
+
+  uint16_t sum = 0;
+  for (uint8_t i = 0; i < 16; i++) {
+    offsets[i] = sum;
+    sum += tree.counts[i];
+  }
+  for (uint16_t i = 0; i < count; i++)
+    if (lengths[i])
+      tree.symbols[offsets[lengths[i]]++] = i;
+}
+
+void GzipInflater::buildFixedTrees() {
+  memset(lengths, 8, 144);
+  memset(lengths + 144, 9, 256 - 144);
+  memset(lengths + 256, 7, 280 - 256);
+  memset(lengths + 280, 8, 288 - 280);
+  buildTree(literalTree, lengths, 288);
+  memset(lengths, 5, 30);
+  buildTree(distanceTree, lengths, 30);
+}
+
+int GzipInflater::decodeSymbol(const Tree &tree) {
+  int code = 0, first = 0, index = 0;
+  for (uint8_t length = 1; length < 16; length++) {
+    code |= getBits(1);
+    const int count = tree.counts[length];
+    if (code - first < count)
+      return tree.symbols[index + code - first];
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+
+  return -1;    // Not a code of this tree
+}
+
+bool GzipInflater::header(uint8_t c) {
+  if (headerStep < 10) {
+    // ID1 ID2 CM FLG MTIME(4) XFL OS
+    if ((headerStep == 0 && c != 0x1f) || (headerStep == 1 && c != 0x8b) ||
+        (headerStep == 2 && c != 8) || (headerStep == 3 && (c & 0xe0)))
+      return fail();
+    if (headerStep == 3)
+      headerFlags = c;
+    if (headerStep == 9)
+      nextHeaderField();
+    else
+      ++headerStep;
+    return true;
+  }
+
+  switch (headerStep) {
+    case 10:  // Extra field length
+      headerLeft = c;
+      headerStep = 11;
+      break;
+    case 11:
+      headerLeft |= c << 8;
+      headerStep = 12;
+      if (headerLeft == 0)
+        nextHeaderField();
+      break;
+    case 12:  // Extra field
+    case 15:  // Header CRC
+      if (--headerLeft == 0)
+        nextHeaderField();
+      break;
+    case 13:  // File name
+    case 14:  // Comment
+      if (c == 0)
+        nextHeaderField();
+      break;
+  }
+
+  return true;
+}
+
+void GzipInflater::nextHeaderField() {
+  if (headerStep < 10 && (headerFlags & GZIP_FEXTRA))
+    headerStep = 10;
+  else if (headerStep < 13 && (headerFlags & GZIP_FNAME))
+    headerStep = 13;
+  else if (headerStep < 14 && (headerFlags & GZIP_FCOMMENT))
+    headerStep = 14;
+  else if (headerStep < 15 && (headerFlags & GZIP_FHCRC)) {
+    headerStep = 15;
+    headerLeft = 2;
+  }
+  else
+    state = BlockHeader;
+}
+
+// Decodes the next piece of the stream. False when it failed or needs more input.
+bool GzipInflater::step() {
+  switch (state) {
+    case BlockHeader: {
+      lastBlock = getBits(1);
+      const uint8_t type = getBits(2);
+      if (type == 0) {
+        alignBits();
+        state = StoredLength;
+      }
+      else if (type == 1) {
+        buildFixedTrees();
+        state = Literals;
+      }
+      else if (type == 2)
+        state = TableSizes;
+      else
+        return fail();
+      break;
+    }
+
+    case StoredLength:
+      storedLeft = getBits(16);
+      state = StoredCheck;
+      break;
+
+    case StoredCheck:
+      if ((getBits(16) ^ 0xffff) != storedLeft)
+        return fail();
+      state = Stored;
+      break;
+
+    case Stored:
+      while (storedLeft > 0 && (output || total - flushed < windowSize)) {
+        if (bitCount >= 8)
+          put(getBits(8));
+        else if (inLeft > 0) {
+          put(*in++);
+          --inLeft;
+        }
+        else
+          return false;
+        --storedLeft;
+      }
+      if (storedLeft > 0)
+        break;    // Until read()
+      if (lastBlock)
+        state = Trailer;
+      else
+        state = BlockHeader;
+      break;
+
+    case TableSizes:
+      literalCodes = getBits(5) + 257;
+      distanceCodes = getBits(5) + 1;
+      lengthCodes = getBits(4) + 4;
+      if (literalCodes > 286 || distanceCodes > 30)
+        return fail();
+      memset(lengths, 0, 19);
+      lengthIndex = 0;
+      state = CodeLengthCodes;
+      break;
+
+    case CodeLengthCodes:
+      lengths[codeLengthOrder[lengthIndex++]] = getBits(3);
+      if (lengthIndex == lengthCodes) {
+        // The distance tree is not needed until the code lengths are read
+        buildTree(distanceTree, lengths, 19);
+        lengthIndex = 0;
+        state = CodeLengths;
+      }
+      break;
+
+    case CodeLengths: {
+      const int symbol = decodeSymbol(distanceTree);
+      uint8_t length = 0;
+      uint16_t repeat = 1;
+      if (symbol < 0)
+        return fail();
+      if (symbol < 16)
+        length = symbol;
+      else if (symbol == 16) {
+        if (lengthIndex == 0)
+          return fail();
+        length = lengths[lengthIndex - 1];
+        repeat = 3 + getBits(2);
+      }
+      else if (symbol == 17)
+        repeat = 3 + getBits(3);
+      else
+        repeat = 11 + getBits(7);
+      if (lengthIndex + repeat > literalCodes + distanceCodes)
+        return fail();
+      memset(lengths + lengthIndex, length, repeat);
+      lengthIndex += repeat;
+      if (lengthIndex == literalCodes + distanceCodes) {
+        buildTree(literalTree, lengths, literalCodes);
+        buildTree(distanceTree, lengths + literalCodes, distanceCodes);
+        state = Literals;
+      }
+      break;
+    }
+
+    case Literals: {
+      int symbol = decodeSymbol(literalTree);
+      if (symbol < 0)
+        return fail();
+      if (symbol < 256)
+        put(symbol);
+      else if (symbol == 256) {
+        if (lastBlock) {
+          alignBits();
+          state = Trailer;
+        }
+        else
+          state = BlockHeader;
+      }
+      else {
+        symbol -= 257;
+        if (symbol >= 29)
+          return fail();
+        copyLength = lengthBase[symbol] + getBits(lengthExtra[symbol]);
+        state = Distance;
+      }
+      break;
+    }
+
+    case Distance: {
+      const int symbol = decodeSymbol(distanceTree);
+      if (symbol < 0 || symbol >= 30)
+        return fail();
+      if (!copy(distanceBase[symbol] + getBits(distanceExtra[symbol]), copyLength))
+        return false;
+      state = Literals;
+      break;
+    }
+
+    case Trailer:
+      // CRC-32 and size of the inflated data
+      while (trailerCount < 8) {
+        if (bitCount >= 8)
+          trailer[trailerCount++] = getBits(8);
+        else if (inLeft > 0) {
+          trailer[trailerCount++] = *in++;
+          --inLeft;
+        }
+        else
+          return false;
+      }
+      if ((crc ^ 0xffffffff) != (trailer[0] | (uint32_t)trailer[1] << 8 | (uint32_t)trailer[2] << 16 | (uint32_t)trailer[3] << 24) ||
+          total != (trailer[4] | (uint32_t)trailer[5] << 8 | (uint32_t)trailer[6] << 16 | (uint32_t)trailer[7] << 24))
+        return fail();
+      state = Done;
+      break;
+
+    default:
+      return false;
+  }
+
+  return true;
+}
+
+inline void GzipInflater::put(uint8_t c) {
+  if (total - flushed == windowSize)
+    flush();    // Before its oldest byte is replaced
+  window[total & (windowSize - 1)] = c;
+  ++total;
+  crc ^= c;
+  crc = (crc >> 4) ^ crcTable[crc & 15];
+  crc = (crc >> 4) ^ crcTable[crc & 15];
+}
+
+bool GzipInflater::copy(uint32_t distance, uint16_t length) {
+  if (distance > total)
+    return fail();
+
+  if (distance <= windowSize) {
+    for (; length > 0; length--)
+      put(window[(total - distance) & (windowSize - 1)]);
+  }
+  else {
+    // Older than the window: everything is flushed, read it back
+    uint8_t data[258];
+    flush();
+    if (!history || !history(total - distance, data, length))
+      return fail();
+    ++historyReads;
+    for (uint16_t i = 0; i < length; i++)
+      put(data[i]);
+  }
+
+  return true;
+}
+
+void GzipInflater::flush() {
+  while (output && flushed < total) {
+    const uint32_t start = flushed & (windowSize - 1);
+    const uint32_t n = min(total - flushed, windowSize - start);
+    output(window + start, n);
+    flushed += n;
+  }
+}
+
+bool GzipInflater::fail() {
+  state = Failed;
+  return false;
+}
@@ -0,0 +1,130 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define GZIP_MAX_WINDOW   32768       // Deflate distances reach 32 KB back
+#define GZIP_MIN_WINDOW   4096
+#define GZIP_HEAP_RESERVE 20000       // Heap left to the rest of the firmware while inflating
+
+#include <Arduino.h>
+
+// Inflates a gzip stream given in pieces of any size, as they are received.
+//
+// The window of past output is as big as the heap allows, up to 32 KB. Deflate
+// can copy from further back than a smaller window holds; those bytes are asked
+// to the History callback, that reads them from where the output was written.
+//
+// Without an Output callback the inflated bytes are kept in the window until
+// read(): feed() stops taking input while the window has no room for them.
+class GzipInflater {
+  public:
+    typedef void (*Output)(const uint8_t *data, size_t len);
+    // Reads len bytes of output that started at position
+    typedef bool (*History)(uint32_t position, uint8_t *data, size_t len);
+
+    static inline bool isGzip(const uint8_t *data, size_t len) {
+      return len >= 2 && data[0] == 0x1f && data[1] == 0x8b;
+    }
+
+    // False when there is not heap enough for a window of minWindow bytes
+    bool begin(Output output, History history = nullptr, uint32_t minWindow = GZIP_MIN_WINDOW);
+    void end();
+
+    // Inflates the next bytes, final with the last ones. False on error.
+    bool write(const uint8_t *data, size_t len, bool final = false);
+
+    // Without Output: inflates what fits in the window, returns the bytes of data taken
+    size_t feed(const uint8_t *data, size_t len, bool final = false);
+    // Without Output: takes up to len inflated bytes
+    size_t read(uint8_t *data, size_t len);
+
+    inline bool isDone() const {
+      return state == Done;
+    }
+
+    inline bool failed() const {
+      return state == Failed;
+    }
+
+    // Inflated bytes
+    inline uint32_t getSize() const {
+      return total;
+    }
+
+    inline uint32_t getWindowSize() const {
+      return windowSize;
+    }
+
+    // Copies that needed History
+    inline uint32_t getHistoryReads() const {
+      return historyReads;
+    }
+
+  private:
+    struct Tree {
+      uint16_t counts[16];            // Codes of each length
+      uint16_t symbols[288];          // Sorted by code
+    };
+
+    enum State : uint8_t {
+      Header, BlockHeader, StoredLength, StoredCheck, Stored, TableSizes, CodeLengthCodes, CodeLengths,
+      Literals, Distance, Trailer, Done, Failed
+    };
+
+    Output output = nullptr;
+    History history = nullptr;
+    uint8_t *window = nullptr;
+    uint32_t windowSize = 0;
+    uint32_t total = 0, flushed = 0;  // Output bytes inflated and given to output() or read()
+    uint32_t crc = 0, historyReads = 0;
+
+    State state = Done;
+    bool lastBlock = false;
+    const uint8_t *in = nullptr;
+    size_t inLeft = 0;
+    uint64_t bits = 0;                // Input bits not decoded yet, first in the lowest
+    uint8_t bitCount = 0;
+    bool overrun = false;             // More bits were taken than the input had
+
+    // Header, stored blocks and trailer
+    uint8_t headerFlags = 0, headerStep = 0;
+    uint16_t headerLeft = 0;
+    uint32_t storedLeft = 0;
+    uint8_t trailer[8], trailerCount = 0;
+
+    // Dynamic tables
+    Tree literalTree, distanceTree;
+    uint16_t literalCodes = 0, distanceCodes = 0, lengthCodes = 0, lengthIndex = 0;
+    uint8_t lengths[288 + 32];
+    uint16_t copyLength = 0;
+
+    void fillBits();
+    uint32_t getBits(uint8_t count);
+    void alignBits();
+    int decodeSymbol(const Tree &tree);
+    static void buildTree(Tree &tree, const uint8_t *lengths, uint16_t count);
+    void buildFixedTrees();
+    bool header(uint8_t c);
+    void nextHeaderField();
+    bool step();
+    void put(uint8_t c);
+    bool copy(uint32_t distance, uint16_t length);
+    void flush();
+    bool fail();
+    bool inflate(bool final);
+};
@@ -0,0 +1,50 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MeatPack.h"
+
+size_t MeatPack::pack(const char *line, size_t length, uint8_t *out) {
+  size_t n = 0;
+  // The end of line is the last character; after it the printer ignores the
+  // second half of the byte, so an odd count is completed with another one
+  for (size_t i = 0; i <= length; i += 2) {
+    const char first = i < length ? line[i] : '\n';
+    const char second = i + 1 < length ? line[i + 1] : '\n';
+    const uint8_t firstCode = code(first), secondCode = code(second);
+    out[n++] = (secondCode << 4) | firstCode;
+    if (firstCode == 0xF)
+      out[n++] = first;
+    if (secondCode == 0xF)
+      out[n++] = second;
+  }
+
+  return n;
+}
+
+size_t MeatPack::packedLength(const char *line, size_t length) {
+  size_t n = length / 2 + 1;
+  for (size_t i = 0; i < length; i++)
+    if (code(line[i]) == 0xF)
+      ++n;
+
+  return n;
+}
+
+void MeatPack::sendCommand(Print &serial, Command command) {
+  const uint8_t signal[3] = { MEATPACK_SIGNAL, MEATPACK_SIGNAL, command };
+  serial.write(signal, sizeof(signal));
+}
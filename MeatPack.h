@@ -0,0 +1,60 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#define MEATPACK_SIGNAL 0xFF            // Twice before a MeatPack command, also the byte of two unpacked characters
+
+// Packs G-code lines as Marlin MeatPack expects them: the 15 most used
+// characters ("0123456789. \nGX") take 4 bits, two per byte, and any other one
+// is sent as is after the byte that holds the one it pairs with.
+class MeatPack {
+  public:
+    enum Command : uint8_t {
+      QueryConfig = 0xF8,
+      ResetAll = 0xF9,
+      DisablePacking = 0xFA,
+      EnablePacking = 0xFB
+    };
+
+    // Bytes that pack() needs for a line of length characters
+    static constexpr size_t maxPackedLength(size_t length) {
+      return (length + 1) * 3 / 2 + 1;
+    }
+
+    // Packs line and its end of line into out, returns the bytes to send
+    static size_t pack(const char *line, size_t length, uint8_t *out);
+    // What pack() would return
+    static size_t packedLength(const char *line, size_t length);
+    static void sendCommand(Print &serial, Command command);
+
+    // 4 bit code of c, 0xF when it is not packed
+    static inline uint8_t code(const char c) {
+      if (c >= '0' && c <= '9')
+        return c - '0';
+      switch (c) {
+        case '.':  return 10;
+        case ' ':  return 11;
+        case '\n': return 12;
+        case 'G':  return 13;
+        case 'X':  return 14;
+        default:   return 0xF;
+      }
+    }
+};
@@ -0,0 +1,132 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PrintCheckpoint.h"
+
+static_assert(sizeof(PrintCheckpointRecord) == GCODE_BLOCK_SIZE, "A checkpoint is written in one sector");
+
+// FNV-1a
+uint32_t PrintCheckpoint::checksum(const PrintCheckpointRecord &record) {
+  const uint8_t *p = (const uint8_t *)&record;
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < offsetof(PrintCheckpointRecord, checksum); i++) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+bool PrintCheckpoint::begin(const String &path, uint32_t fileSize, uint32_t offset, uint32_t line, bool compacted) {
+  end();
+  if (path.length() >= sizeof(PrintCheckpointRecord::path))
+    return false;
+
+  this->path = path;
+  this->fileSize = fileSize;
+  this->compacted = compacted;
+  this->offset = savedOffset = offset;
+  this->line = line;
+  markStart = markCount = 0;
+  sequence = savedTime = 0;
+  // All its sectors are written now, checkpoints only overwrite them
+  storageFS.mkdir(GCODE_CACHE_DIR);   // Fails when it already exists
+  file = storageFS.open(CHECKPOINT_PATH, "w", CHECKPOINT_SLOTS * GCODE_BLOCK_SIZE);
+  PrintCheckpointRecord empty;
+  memset((void *)&empty, 0, sizeof(empty));
+  for (uint8_t slot = 0; file && slot < CHECKPOINT_SLOTS; slot++)
+    if (file.write((const uint8_t *)&empty, sizeof(empty)) != sizeof(empty))
+      file.close();
+  if (file)
+    file.flush();
+
+  return file;
+}
+
+void PrintCheckpoint::end() {
+  if (file) {
+    file.close();
+    storageFS.remove(CHECKPOINT_PATH);
+  }
+  markCount = 0;
+}
+
+void PrintCheckpoint::mark(uint32_t sequence, uint32_t offset, uint32_t line) {
+  if (markCount == CHECKPOINT_MARKS)
+    acknowledge(marks[markStart].sequence);   // Not expected, the print reads ahead less than that
+  marks[(markStart + markCount++) % CHECKPOINT_MARKS] = { sequence, offset, line };
+}
+
+void PrintCheckpoint::acknowledge(uint32_t sequence) {
+  while (markCount > 0 && (int32_t)(sequence - marks[markStart].sequence) >= 0) {
+    offset = marks[markStart].offset;
+    line = marks[markStart].line;
+    markStart = (markStart + 1) % CHECKPOINT_MARKS;
+    --markCount;
+  }
+}
+
+bool PrintCheckpoint::update(uint32_t printTime, const GcodeState &state) {
+  if (!file || offset == savedOffset || printTime - savedTime < CHECKPOINT_INTERVAL)
+    return false;
+  return save(printTime, state);
+}
+
+bool PrintCheckpoint::save(uint32_t printTime, const GcodeState &state) {
+  if (!file)
+    return false;
+
+  PrintCheckpointRecord record;
+  memset((void *)&record, 0, sizeof(record));
+  record.magic = CHECKPOINT_MAGIC;
+  record.sequence = ++sequence;
+  record.fileSize = fileSize;
+  record.offset = offset;
+  record.line = line;
+  record.printTime = printTime;
+  record.compacted = compacted;
+  record.state = state;
+  strcpy(record.path, path.c_str());
+  record.checksum = checksum(record);
+
+  savedOffset = offset;
+  savedTime = printTime;
+  const bool ok = file.seek((sequence % CHECKPOINT_SLOTS) * sizeof(record)) &&
+                  file.write((const uint8_t *)&record, sizeof(record)) == sizeof(record);
+  file.flush();
+  return ok;
+}
+
+bool PrintCheckpoint::load(PrintCheckpointRecord &record) {
+  FileWrapper file = storageFS.open(CHECKPOINT_PATH);
+  if (!file)
+    return false;
+
+  bool found = false;
+  PrintCheckpointRecord slot;
+  for (uint8_t i = 0; i < CHECKPOINT_SLOTS; i++) {
+    if (file.read((uint8_t *)&slot, sizeof(slot)) != sizeof(slot))
+      break;
+    if (slot.magic == CHECKPOINT_MAGIC && slot.checksum == checksum(slot) &&
+        memchr(slot.path, '\0', sizeof(slot.path)) && (!found || (int32_t)(slot.sequence - record.sequence) > 0)) {
+      record = slot;
+      found = true;
+    }
+  }
+  file.close();
+
+  return found;
+}
@@ -0,0 +1,97 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define CHECKPOINT_PATH      GCODE_CACHE_DIR "/print.ckpt"
+#define CHECKPOINT_MAGIC     0x4b43574eUL   // "NWCK", first bytes of a checkpoint
+#define CHECKPOINT_SLOTS     4        // Checkpoints written in turn, each in its own sector
+#define CHECKPOINT_INTERVAL  30       // Seconds of printing between checkpoints
+#define CHECKPOINT_MARKS     32       // Print commands in the queue followed at most
+
+#include "GcodeCompactor.h"
+#include "GcodeState.h"
+
+// Where a print was when the printer acknowledged the last of its commands,
+// one sector of the checkpoint file
+struct PrintCheckpointRecord {
+  uint32_t magic;
+  uint32_t sequence;                  // The highest one of the valid records is the last
+  uint32_t fileSize;
+  uint32_t offset, line;              // After the last command done, offset in the file read
+  uint32_t printTime;                 // Seconds
+  GcodeState state;
+  char path[256];
+  uint8_t compacted;                  // The compacted copy of path was read, line is estimated
+  uint8_t reserved[GCODE_BLOCK_SIZE - 6 * sizeof(uint32_t) - sizeof(GcodeState) - 256 - 1 - sizeof(uint32_t)];
+  uint32_t checksum;                  // Of the bytes before it, a torn write does not match
+};
+
+// Keeps where the print is, so it can be resumed after a power loss or a
+// reboot. Each command read from the file is marked with its sequence number
+// in the CommandQueue and the position after it; once the printer
+// acknowledges it, that position and the GcodeState of the acknowledged
+// commands are what a checkpoint records. A print of the compacted copy is
+// followed in the copy: only its positions are at the start of a line.
+//
+// The checkpoints take CHECKPOINT_SLOTS sectors written in turn, so one cut
+// while it is written leaves the one before. They are written at most every
+// CHECKPOINT_INTERVAL seconds, one sector each, into a file allocated when
+// the print starts.
+class PrintCheckpoint {
+  private:
+    struct Mark {
+      uint32_t sequence, offset, line;
+    };
+
+    FileWrapper file;
+    String path;
+    uint32_t fileSize = 0, sequence = 0;
+    bool compacted = false;
+    Mark marks[CHECKPOINT_MARKS];
+    uint8_t markStart = 0, markCount = 0;
+    uint32_t offset = 0, line = 0;      // Of the last print command done
+    uint32_t savedOffset = 0, savedTime = 0;
+
+    static uint32_t checksum(const PrintCheckpointRecord &record);
+
+  public:
+    // Starts following the print of path, or of its compacted copy, from offset and line
+    bool begin(const String &path, uint32_t fileSize, uint32_t offset = 0, uint32_t line = 0, bool compacted = false);
+    // The print ended, there is nothing to resume
+    void end();
+
+    inline operator bool() {
+      return file;
+    }
+
+    // The command with sequence number leaves the print at offset and line
+    void mark(uint32_t sequence, uint32_t offset, uint32_t line);
+    // The commands up to sequence number were done by the printer
+    void acknowledge(uint32_t sequence);
+
+    inline uint32_t getOffset() const {
+      return offset;
+    }
+
+    // Writes a checkpoint when CHECKPOINT_INTERVAL passed since the last one and the print moved on
+    bool update(uint32_t printTime, const GcodeState &state);
+    bool save(uint32_t printTime, const GcodeState &state);
+
+    // The last checkpoint written, false if there is none
+    static bool load(PrintCheckpointRecord &record);
+};
@@ -17,6 +17,18 @@
 
 #include "StorageFS.h"
 #include "CommandQueue.h"
+#include "FileIndex.h"
+#include "FileListStream.h"
+#include "FirmwareDialect.h"
+#include "GcodeAnalyzer.h"
+#include "GcodeCompactor.h"
+#include "GcodeState.h"
+#include "PrintCheckpoint.h"
+#include "PrinterResponse.h"
+#include "GzipInflater.h"
+#include "SectorWriter.h"
+#include "UploadQueue.h"
+#include "MeatPack.h"
 
 // On ESP8266 use the normal Serial() for now, but name it PrinterSerial for compatibility with ESP32
 // On ESP32, use Serial1 (rather than the normal Serial0 which prints stuff during boot that confuses the printer)
@@ -39,20 +51,37 @@ HardwareSerial PrinterSerial(1);
 #define PRINTER_RX_BUFFER_SIZE 0        // This is printer firmware 'RX_BUFFER_SIZE'. If such parameter is unknown please use 0
 #define TEMPERATURE_REPORT_INTERVAL 2   // Ask the printer for its temperatures status every 2 seconds
 #define KEEPALIVE_INTERVAL 2500         // Marlin defaults to 2 seconds, get a little of margin
+#define USE_CHECKSUMS false             // Send "N<line> <command>*<checksum>" and replay on "Resend:", costs ~8 bytes per line
+#define USE_MEATPACK true               // Pack the commands when the printer reports Cap:MEATPACK, ~40% fewer serial bytes
+#define MEATPACK_TIMEOUT 1000           // Time to wait for the printer to confirm packing
+#define MAX_COMMANDS_IN_FLIGHT 16       // Upper limit for the printer BUFSIZE learned from ADVANCED_OK
+#define COMMAND_RESERVED_BYTES 256      // Queue space that printing leaves free for "service" commands (M117, M73, ...)
+#define PRINT_QUEUE_FILL 16             // Commands read ahead from the file on each loop() pass while printing
+#define PRINT_FILL_TIME_US 2000         // Time limit for reading them
+#ifdef ESP32
+#define INFLATE_UPLOADS false           // Keep gzip uploads compressed and inflate them while printing, true stores them inflated
+#else
+#define INFLATE_UPLOADS true            // An ESP8266 has not the heap to inflate them while printing, see GcodeReader::canInflate()
+#endif
+#define UPLOAD_WRITE_TIME_US 4000       // Time limit for writing received upload bytes to the SD on each loop() pass
+#define RECOVERY_Z_LIFT 2               // mm the nozzle is raised off the print to home X and Y when resuming
 const uint32_t serialBauds[] = { 115200, 57600, 250000, 500000, 921600 };
 //const uint32_t serialBauds[] = { 115200 };
 
 #define API_VERSION     "0.1"
 #define VERSION         "0.7.2"
 
-#define MAX_FILES_PER_LIST  10 // Maximum number of files sent by the file listing json
+#define MAX_FILES_PER_LIST  10 // Files in a page of the file listing json without n, n=0 lists them all
 
 #define MIN_HEAP_TO_SERVICE 18000
 
 // Information from M115
+const FirmwareDialect *firmware = &FirmwareDialect::get(FirmwareType::Marlin);   // Until the printer tells its own
 String fwMachineType = "Unknown";
 uint8_t fwExtruders = 1;
 bool fwAutoreportTempCap = false, fwProgressCap = false, fwBuildPercentCap = false;
+bool fwAdvancedOkCap = false;   // Also set by the first "ok P<n> B<n>", Marlin does not list it in M115
+bool fwMeatPackCap = false;
 
 // Printer status
 bool printerConnected = false,
@@ -61,34 +90,72 @@ bool printerConnected = false,
      printPause = false,
      restartPrint = false,
      cancelPrint = false,
+     recoverPrint = false,  // Resume the print of the checkpoint
      autoreportTempEnabled = false;
+uint32_t startLayer = 0;        // Layer from 1 the next print starts at, 0 for the whole file
+bool zHomed = false;            // Z was homed since the printer connected, and its stepper was not disabled since
 
 uint32_t printStartTime = 0;
 uint32_t printTime = 0;
 float printCompletion = 0.0;
+GcodeLayerIndex printLayers;    // Of the file being printed, when it has one
+String printingFullname = "";   // Read by sectors while it prints: it and its copies are not removed or replaced
+GcodeState printerState;        // As the commands acknowledged by the printer left it
+PrintCheckpoint checkpoint;     // Of the print, to resume it after a reboot
+String recoveryFullname = "";   // File of a print cut by a reboot, its checkpoint can resume it
+uint32_t recoveryLine = 0, recoveryPrintTime = 0;
 
 // Serial communication
-String lastCommandSent = "", lastReceivedResponse = "";
+char lastCommandSent[COMMAND_MAX_LENGTH + 1] = "";
+ResponseLines responseLines;    // Received from the printer
+String m115MachineType = "";    // Of the M115 answer being received, empty until its line arrives
 uint32_t lastPrintedLine = 0;
+uint32_t queueStarvations = 0, queueStarvedPasses = 0;    // Printing and the printer was ready, but nothing was queued to send
 
 uint8_t serialBaudIndex = 0;
 uint16_t printerUsedBuffer = 0;
+
+// Reported by ADVANCED_OK: "ok P<free planner blocks> B<free command buffer slots>"
+uint8_t printerPlannerFree = 0, printerBufferFree = 0;
+uint8_t printerBufsize = 1;     // Commands that can be in flight, learned from the B values seen
+uint8_t printerSlotsFree = 1;   // Of the command buffer: the B of the last ok, less the commands sent since
+int32_t printerOkLineNumber = -1;   // "ok N<line>" of a numbered command, -1 if not numbered
+
+// Line numbers and checksums
+bool useChecksums = USE_CHECKSUMS;
+uint32_t nextLineNumber = 1;
+uint32_t replayLineNumber = 0;  // Replaying from this line after a "Resend:", 0 if not
+uint8_t skipOks = 0;            // Coming oks that do not acknowledge a sent command: after "Resend:" or garbage received by the printer
+bool replayAfterTimeout = false;
 uint32_t serialReceiveTimeoutTimer = 0;
 
+// Lines are sent numbered, when the firmware checks them
+inline bool numberedLines() {
+  return useChecksums && firmware->lineNumbers;
+}
+
+// MeatPack, the printer answers the commands with "[MP] <version> ON|OFF ESP|NSP"
+bool meatPackActive = false;
+bool meatPackRequested = false;   // Nothing is sent until the printer confirms or MEATPACK_TIMEOUT
+uint32_t meatPackTimer = 0;
+
 // Uploaded file information
 String uploadedFullname = "";
 size_t uploadedFileSize = 0, filePos = 0;
+bool uploadRejected = false;    // The last upload did not fit in the SD
+bool uploadReplacesPrint = false;   // The last upload was not stored, it has the name of the file being printed
+// Upload being received, its bytes wait in uploadQueue until loop() writes them
+UploadQueue uploadQueue;
+size_t uploadWritten = 0;       // Bytes of the queued upload given to writeUpload(), 0 before it starts
+uint32_t uploadOverflows = 0;   // Uploads dropped because the queue had no room for their bytes
+bool printFillPending = false;  // The print could not read all the commands it wanted, it goes first to the SD
 time_t uploadedFileCreationTime = 0;
+GcodeMetadata jobMetadata;      // Of the uploaded file, taken while it was received
 
 // Temperature for printer status reporting
 #define TEMP_COMMAND      "M105"
 #define AUTOTEMP_COMMAND  "M155 S"
 
-struct Temperature {
-  int actual, target;
-  //String actual, target;
-};
-
 uint32_t temperatureTimer;
 
 Temperature toolTemperature[MAX_SUPPORTED_EXTRUDERS];
@@ -109,79 +176,53 @@ inline void setLed(const bool status) {
   #endif
 }
 
-bool isFloat(const String value) {
-  for (uint i = 0; i < value.length(); ++i) {
-    char ch = value[i];
-    if (ch != ' ' && ch != '.' && ch != '-' && !isDigit(ch))
-      return false;
-  }
-
+// Parse Marlin ADVANCED_OK responses like "ok N123 P15 B3"
+bool parseAdvancedOk(const char *response) {
+  const char *p = strstr(response, " P"), *b = strstr(response, " B");
+  if (!p || !b || !isDigit(p[2]) || !isDigit(b[2]))
+    return false;
+
+  const char *n = strstr(response, " N");
+  printerOkLineNumber = (n && n < p && isDigit(n[2])) ? atol(n + 2) : -1;
+  printerPlannerFree = atoi(p + 2);
+  printerBufferFree = atoi(b + 2);
+  // B is counted with the acknowledged command still in the buffer
+  if (printerBufferFree + 1 > printerBufsize)
+    printerBufsize = min(printerBufferFree + 1, (int)MAX_COMMANDS_IN_FLIGHT);
+  printerSlotsFree = min(printerBufferFree + 1, (int)printerBufsize);
+  fwAdvancedOkCap = true;
   return true;
 }
 
 // Parse temperatures from printer responses like
 // ok T:32.8 /0.0 B:31.8 /0.0 T0:32.8 /0.0 @:0 B@:0
-bool parseTemp(const String response, const String whichTemp, Temperature *temperature) {
-  int tpos = response.indexOf(whichTemp + ":");
-  if (tpos != -1) { // This response contains a temperature
-    int slashpos = response.indexOf(" /", tpos);
-    int spacepos = response.indexOf(" ", slashpos + 1);
-    // if match mask T:xxx.xx /xxx.xx
-    if (slashpos != -1 && spacepos != -1) {
-      String actual = response.substring(tpos + whichTemp.length() + 1, slashpos);
-      String target = response.substring(slashpos + 2, spacepos);
-      if (isFloat(actual) && isFloat(target)) {
-        temperature->actual = actual.toFloat()*100;
-        temperature->target = target.toFloat()*100;
-        return true;
-      }
+// or from Prusa firmware while heating, without targets
+// T:32.8 E:0 B:31.8
+bool parseTemperatures(const char *response) {
+  static_assert(MAX_SUPPORTED_EXTRUDERS <= RESPONSE_MAX_TOOLS, "Every extruder has its temperature in a report");
+  TemperatureReport report;
+  if (!PrinterResponse::parseTemperatures(response, report))
+    return false;
+
+  bool tempResponse = false;
+  for (int t = 0; t < fwExtruders; t++) {
+    // A single extruder is reported as the active one, but by Klipper
+    const uint8_t sensor = fwExtruders == 1 && !firmware->numberedTools ? TemperatureReport::ACTIVE : TemperatureReport::TOOL0 + t;
+    if (report.hasTarget(sensor)) {
+      toolTemperature[t] = sensor == TemperatureReport::ACTIVE ? report.active : report.tools[t];
+      tempResponse = true;
     }
   }
-
-  return false;
-}
-
-// Parse temperatures from prusa firmare (sent when heating)
-// ok T:32.8 E:0 B:31.8
-bool parsePrusaHeatingTemp(const String response, const String whichTemp, Temperature *temperature) {
-  int tpos = response.indexOf(whichTemp + ":");
-  if (tpos != -1) { // This response contains a temperature
-    int spacepos = response.indexOf(" ", tpos);
-    if (spacepos == -1)
-      spacepos = response.length();
-    String actual = response.substring(tpos + whichTemp.length() + 1, spacepos);
-    if (isFloat(actual)) {
-      temperature->actual = actual.toFloat()*100;
-
-      return true;
-    }
-  }
-
-  return false;
-}
-
-int8_t parsePrusaHeatingExtruder(const String response) {
-  Temperature tmpTemperature;
-
-  return parsePrusaHeatingTemp(response, "E", &tmpTemperature) ? tmpTemperature.actual/100 : -1;
-}
-
-bool parseTemperatures(const String response) {
-  bool tempResponse;
-
-  if (fwExtruders == 1)
-    tempResponse = parseTemp(response, "T", &toolTemperature[0]);
-  else {
-    tempResponse = false;
-    for (int t = 0; t < fwExtruders; t++)
-      tempResponse |= parseTemp(response, "T" + String(t), &toolTemperature[t]);
+  if (report.hasTarget(TemperatureReport::BED)) {
+    bedTemperature = report.bed;
+    tempResponse = true;
   }
-  tempResponse |= parseTemp(response, "B", &bedTemperature);
-  if (!tempResponse) {
-    // Parse Prusa heating temperatures
-    int e = parsePrusaHeatingExtruder(response);
-    tempResponse = e >= 0 && e < MAX_SUPPORTED_EXTRUDERS && parsePrusaHeatingTemp(response, "T", &toolTemperature[e]);
-    tempResponse |= parsePrusaHeatingTemp(response, "B", &bedTemperature);
+  if (!tempResponse && firmware->heatingReports && report.heatingTool >= 0 && report.has(TemperatureReport::ACTIVE)) {
+    if (report.heatingTool < MAX_SUPPORTED_EXTRUDERS)
+      toolTemperature[report.heatingTool].actual = report.active.actual;
+    if (report.has(TemperatureReport::BED))
+      bedTemperature.actual = report.bed.actual;
+    tempResponse = true;
   }
 
   return tempResponse;
@@ -189,9 +230,9 @@ bool parseTemperatures(const String response) {
 
 // Parse position responses from printer like
 // X:-33.00 Y:-10.00 Z:5.00 E:37.95 Count X:-3300 Y:-1000 Z:2000
-inline bool parsePosition(const String response) {
-  return response.indexOf("X:") != -1 && response.indexOf("Y:") != -1 &&
-         response.indexOf("Z:") != -1 && response.indexOf("E:") != -1;
+inline bool parsePosition(const char *response) {
+  PositionReport position;
+  return PrinterResponse::parsePosition(response, position);
 }
 
 inline void lcd(const String text) {
@@ -206,40 +247,89 @@ inline String getUploadedFilename() {
   return uploadedFullname == "" ? "Unknown" : uploadedFullname.substring(1);
 }
 
+// Seconds left of the print, by its layers when the file has a layer index, -1 if they cannot be told yet
+int32_t getPrintTimeLeft() {
+  const int32_t left = printLayers.isOpen() ? printLayers.getTimeLeft(filePos, printTime) : -1;
+  if (left >= 0 || printCompletion <= 0)
+    return left;
+  return printTime / printCompletion * (100 - printCompletion);
+}
+
+void initUploadedFilename(String filename);
+
+// Brings the printer to the state a print left, to go on from there: heated,
+// homed in X and Y, its nozzle where it stopped, and the modes, extruder
+// position, fan and feedrate of the print. When it lost power, the nozzle is
+// taken to be at the Z of the state, as it was not homed.
+void pushPrintState(const GcodeState &state, bool lostPower) {
+  using Axis = GcodeState::Axis;
+  if (state.bedTarget > 0)
+    commandQueue.push("M140 S" + String(state.bedTarget, 0));
+  if (state.extruderTarget > 0)
+    commandQueue.push("M104 S" + String(state.extruderTarget, 0));
+  if (state.bedTarget > 0)
+    commandQueue.push("M190 S" + String(state.bedTarget, 0));
+  if (state.extruderTarget > 0)
+    commandQueue.push("M109 S" + String(state.extruderTarget, 0));
+  if (lostPower)
+    commandQueue.push("G92 Z" + String(state.position[Axis::Z], 3));   // The nozzle did not move, Z is not homed so it does not go down on the print
+  commandQueue.push("G91");
+  commandQueue.push("G1 Z" + String(RECOVERY_Z_LIFT) + " F600");
+  commandQueue.push("G90");
+  commandQueue.push("G28 X Y");
+  commandQueue.push("G1 X" + String(state.position[Axis::X], 3) + " Y" + String(state.position[Axis::Y], 3) + " F3000");
+  commandQueue.push("G1 Z" + String(state.position[Axis::Z], 3) + " F600");
+  commandQueue.push("G92 E" + String(state.position[Axis::E], 5));
+  commandQueue.push(state.relativeE ? "M83" : "M82");
+  if (state.relative)
+    commandQueue.push("G91");
+  commandQueue.push(state.fan > 0 ? "M106 S" + String(state.fan) : String("M107"));
+  if (state.feedrate > 0)
+    commandQueue.push("G1 F" + String(state.feedrate, 0));
+}
+
 void handlePrint() {
-  static FileWrapper gcodeFile;
+  static GcodeReader gcodeReader;
   static float prevM73Completion = 0.0, prevM532Completion = 0.0;
 
   if (isPrinting) {
     const bool abortPrint = (restartPrint || cancelPrint);
-    if (abortPrint || !gcodeFile.available()) {
-      gcodeFile.close();
+    if (abortPrint || gcodeReader.isEnd()) {
       if (fwProgressCap)
         commandQueue.push("M530 S0");
       if (!abortPrint) {
-        lcd("Complete");
+        lcd(gcodeReader.failed() ? "Error inflating file" : "Complete");
       }
+      gcodeReader.close();
+      printLayers.close();
+      checkpoint.end();
       printPause = false;
       isPrinting = false;
+      printingFullname = "";
     }
     else if (!printPause) {
       printTime = (ms - printStartTime) / 1000;
-      if (commandQueue.getFreeSlots() > 4) {    // Keep some space for "service" commands
-        ++lastPrintedLine;
-        String line = gcodeFile.readStringUntil('\n'); // The G-Code line being worked on
-        filePos += line.length()+1; // readStringUntil does not include the eol char.
+      const uint32_t fillStart = micros();
+      while (commandQueue.getFreeBytes() > COMMAND_RESERVED_BYTES &&    // Keep some space for "service" commands
+             commandQueue.getCount() < PRINT_QUEUE_FILL && !gcodeReader.isEnd() &&
+             micros() - fillStart < PRINT_FILL_TIME_US) {
+        const CommandView line = gcodeReader.readLine(); // The G-Code line being worked on, without comments
+        lastPrintedLine = gcodeReader.getLineNumber();
+        filePos = gcodeReader.getPosition();
         if (filePos > uploadedFileSize)
           filePos = uploadedFileSize;
-        int pos = line.indexOf(';');
-        if (line.length() > 0 && pos != 0 && line[0] != '(' && line[0] != '\r') {
-          if (pos != -1)
-            line = line.substring(0, pos);
-          commandQueue.push(line);
-        }
+        if (!line.isEmpty() && commandQueue.push(line.c_str(), line.length()))
+          checkpoint.mark(commandQueue.getPushedCount(), gcodeReader.isCompacted() ? gcodeReader.getFilePosition() : filePos,
+                          lastPrintedLine);
 
         // Send to printer completion (if supported)
-        printCompletion = (float)filePos / (float)uploadedFileSize * 100.0;
-        if (fwBuildPercentCap && (printCompletion - prevM73Completion >= 1 || (uint8_t)printCompletion == 100)) {
+        if (printLayers.isOpen()) {
+          printLayers.update(filePos, printTime);
+          printCompletion = printLayers.getCompletion(filePos);
+        }
+        else
+          printCompletion = gcodeReader.getCompletion(uploadedFileSize);   // Of the inflated bytes for a gzip file
+        if (fwBuildPercentCap && (printCompletion - prevM73Completion >= 1 || ((uint8_t)printCompletion == 100 && prevM73Completion < 100))) {
           commandQueue.push("M73 P" + String((int)printCompletion));
           prevM73Completion = printCompletion;
         }
@@ -248,23 +338,76 @@ void handlePrint() {
           prevM532Completion = printCompletion;
         }
       }
+      printFillPending = commandQueue.getFreeBytes() > COMMAND_RESERVED_BYTES &&
+                         commandQueue.getCount() < PRINT_QUEUE_FILL && !gcodeReader.isEnd();
+      // Where the printer is, when the print is ahead of it and the SD is free
+      checkpoint.acknowledge(commandQueue.getAcknowledgedCount());
+      if (!printFillPending)
+        checkpoint.update(printTime, printerState);
     }
   }
 
-  if (!isPrinting && (startPrint || restartPrint)) {
-    startPrint = restartPrint = false;
+  if (!isPrinting || printPause)
+    printFillPending = false;
+
+  if (!isPrinting && (startPrint || restartPrint || recoverPrint)) {
+    const bool recover = recoverPrint;
+    const uint32_t layer = recover ? 0 : startLayer;
+    startPrint = restartPrint = recoverPrint = false;
+    startLayer = 0;
 
     filePos = 0;
+    printCompletion = 0.0;
     lastPrintedLine = 0;
+    queueStarvations = queueStarvedPasses = 0;
     prevM73Completion = prevM532Completion = 0.0;
 
-    gcodeFile = storageFS.open(uploadedFullname);
-    if (!gcodeFile)
-      lcd("Can't open file");
+    // Starting at a layer reads the original file, its index has the positions in it. A checkpoint is
+    // taken up in the file it was saved from, only there its position is the start of a line.
+    PrintCheckpointRecord record;
+    GcodeLayer layerStart;
+    bool opened;
+    if (recover) {
+      opened = PrintCheckpoint::load(record);
+      if (opened) {
+        initUploadedFilename(String(record.path).substring(1));
+        opened = uploadedFileSize == record.fileSize &&
+                 (record.compacted ? GcodeCompactor::open(gcodeReader, uploadedFullname, uploadedFileSize, record.offset)
+                                   : gcodeReader.open(storageFS.open(uploadedFullname), record.offset, record.line));
+      }
+    }
+    else if (layer > 0) {
+      opened = printLayers.open(uploadedFullname, uploadedFileSize) && printLayers.get(layer - 1, layerStart) &&
+               gcodeReader.open(storageFS.open(uploadedFullname), layerStart.offset, layerStart.line);
+      record.offset = layerStart.offset;
+      record.line = layerStart.line;
+      record.printTime = 0;
+      record.state = layerStart.state;
+      record.compacted = false;
+    }
+    else
+      opened = GcodeCompactor::open(gcodeReader, uploadedFullname, uploadedFileSize) ||   // Stream the compacted copy when there is one
+               gcodeReader.open(storageFS.open(uploadedFullname));
+    recoveryFullname = "";
+
+    if (!opened)
+      lcd(gcodeReader.isOutOfMemory() ? "No memory to inflate file" : "Can't open file");
     else {
       lcd("Printing...");
       playSound();
+      printLayers.open(uploadedFullname, uploadedFileSize);
       printStartTime = ms;
+      if (recover || layer > 0) {
+        filePos = gcodeReader.getPosition();   // In the original file
+        lastPrintedLine = record.line;
+        printStartTime -= record.printTime * 1000;
+        printerState = record.state;
+        pushPrintState(record.state, recover);
+        checkpoint.begin(uploadedFullname, uploadedFileSize, record.offset, record.line, record.compacted);
+      }
+      else if (!gcodeReader.isGzip())   // A deflate stream cannot be resumed at a position
+        checkpoint.begin(uploadedFullname, uploadedFileSize, 0, 0, gcodeReader.isCompacted());
+      printingFullname = uploadedFullname;
       isPrinting = true;
       if (fwProgressCap) {
         commandQueue.push("M530 S1 L0");
@@ -293,18 +436,48 @@ bool loadUploadedFullname() {
 }
 
 
-void handleUpload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
+inline bool isPrintingFile(const String &path) {
+  return isPrinting && path == printingFullname;
+}
+
+// The metadata of the uploaded file, none if it was not taken from this file
+void loadJobMetadata() {
+  if (!GcodeAnalyzer::load(uploadedFullname, uploadedFileSize, jobMetadata))
+    jobMetadata = GcodeMetadata();
+}
+
+// Writes the uploaded bytes from index on to the card, called from loop() with the queued ones
+void writeUpload(const String &filename, const size_t contentLength, size_t index, const uint8_t *data, size_t len, bool final) {
   static uint8_t receivecount = 0;
   static String lastUploadedFullname = "";
   static String tempFilename = "";
   static size_t tmpFileSize = 0;
-  static FileWrapper file;
+  static SectorWriter writer;
+  static GcodeCompactor compactor;
+  static GcodeAnalyzer analyzer;
+  static GzipInflater inflater;
+  static bool inflating = false, compacting = false;
 
   if (!index) {
+    const String previousFullname = uploadedFullname;
     int pos = filename.lastIndexOf("/");
     uploadedFullname = pos == -1 ? "/" + filename : filename.substring(pos);
+    // A gzip file is stored inflated, under the name it had before being compressed,
+    // or as it comes to be inflated while printing when there is heap for that
+    const bool gzip = GzipInflater::isGzip(data, len);
+    inflating = gzip && (INFLATE_UPLOADS || !GcodeReader::canInflate());
+    compacting = !gzip || inflating;
+    if (inflating && uploadedFullname.endsWith(".gz"))
+      uploadedFullname.remove(uploadedFullname.length() - 3);
     if (uploadedFullname.length() > storageFS.getMaxPathLength())
       uploadedFullname = "/received.gcode";   // TODO maybe a different solution
+    uploadReplacesPrint = isPrintingFile(uploadedFullname);
+    if (uploadReplacesPrint) {
+      // Its clusters would be freed under the print
+      uploadedFullname = previousFullname;
+      lcd("Can't replace file being printed");
+      return;
+    }
 
     if (lastUploadedFullname != uploadedFullname) {
       // Uncomment next code if you want to remove the last file
@@ -316,10 +489,33 @@ void handleUpload(AsyncWebServerRequest *request, String filename, size_t index,
     receivecount++;
     receivecount = receivecount % 4; // We can receive 4 temporary files
     tempFilename = String("/tmp")+String(receivecount);
-    file = storageFS.open(tempFilename, "w"); // create or truncate file
-    if (file) {
+    // In consecutive clusters when its size is known, so it can be printed with raw sector reads
+    const uint32_t expectedSize = inflating ? 0 : contentLength;
+    writer.begin(storageFS.open(tempFilename, inflating ? "w+" : "w", expectedSize)); // create or truncate file
+    // Deflate copies from up to 32 KB back, what does not fit in RAM is read again from the file
+    static_assert(WRITE_BUFFER_SIZE + 258 <= GZIP_MIN_WINDOW, "History has to be on the card already");
+    if (writer && inflating && !inflater.begin([](const uint8_t *data, size_t len) {
+          writer.write(data, len);
+          compactor.write(data, len);
+          analyzer.write(data, len);
+        }, [](uint32_t position, uint8_t *data, size_t len) {
+          FileWrapper &file = writer.getFile();
+          const uint32_t end = file.size();
+          const bool ok = file.seek(position) && file.read(data, len) == (int)len;
+          file.seek(end);
+          return ok;
+        })) {
+      writer.getFile().close();
+      storageFS.remove(tempFilename);
+      lcd("No memory to inflate file");
+    }
+    else if (writer) {
       lcd("Receiving: "+uploadedFullname);
       lastUploadedFullname = uploadedFullname;
+      if (compacting) {
+        compactor.begin(tempFilename, storageFS.getFreeSpace() > expectedSize ? expectedSize : 0);
+        analyzer.begin(tempFilename);
+      }
     } else {
       lcd("Error receiving file");
     }
@@ -328,34 +524,181 @@ void handleUpload(AsyncWebServerRequest *request, String filename, size_t index,
   //if (receivecount > 1)
   //  return;
 
-  if (file) {
-    len = file.write(data, len);
-    file.flush();
+  if (writer) {
+    if (!inflating) {
+      len = writer.write(data, len);
+      if (compacting) {
+        compactor.write(data, len);
+        analyzer.write(data, len);
+      }
+    }
+    else if (!inflater.write(data, len, final)) {
+      writer.getFile().close();
+      storageFS.remove(tempFilename);
+      compactor.discard();
+      analyzer.discard();
+      lcd("Error inflating file");
+    }
   }
 
   if (final) { // upload finished
-    if (file) {
-      //uploadedFileCreationTime = file.getCreationTime();
+    bool received = writer;
+    if (writer) {
+      //uploadedFileCreationTime = writer.getFile().getCreationTime();
       uploadedFileCreationTime = DateTime.getTime();
-      file.close();
+      if (!writer.close()) {
+        received = false;
+        storageFS.remove(tempFilename);
+        lcd("Error receiving file");
+      }
     }
+    const bool compacted = received && compacting && compactor.finish();
 
-    tmpFileSize = index + len;
-    // Early solution: A small size can tell us that there are not a gcode file
-    // Why: Cura send us two additional files with "true" or "false" inside.
-    // The word "true" and "false" have less than 5 characters so we can be sure that
-    // a file bigger than that is the real one.
-    if (tmpFileSize > 5) {
+    tmpFileSize = inflating ? inflater.getSize() : index + len;
+    inflater.end();
+    if (received && tmpFileSize > 5) {
       storageFS.remove(uploadedFullname);
       storageFS.rename(tempFilename, uploadedFullname);
+      fileIndex.add(uploadedFullname);
       uploadedFileSize = tmpFileSize;
       saveUploadedFullname();
+      if (!compacted || !compactor.install(uploadedFullname))
+        GcodeCompactor::remove(uploadedFullname);   // Not the copy of this file any more
+      analyzer.finish(tmpFileSize);
+      if (!compacted || !analyzer.install(uploadedFullname)) {
+        analyzer.discard();
+        GcodeAnalyzer::remove(uploadedFullname);
+      }
+      loadJobMetadata();
+    }
+    else {
+      compactor.discard();
+      analyzer.discard();
     }
   }
   else
     tmpFileSize = 0;
 }
 
+// The response of /api/files/local, once the upload is written
+void respondUpload(AsyncWebServerRequest *request) {
+  if (NoHeapToService(request)) return;
+  // https://docs.octoprint.org/en/master/api/files.html?highlight=api%2Ffiles%2Flocal#upload-file-or-create-folder
+  if (uploadRejected) {
+    request->send(507, "text/plain", "Not enough space on SD");
+    return;
+  }
+  if (uploadReplacesPrint) {
+    request->send(409, "text/plain", "File is being printed");
+    return;
+  }
+  lcd("Received");
+  playSound();
+
+  // We are not using
+  // if (request->hasParam("print", true))
+  // due to https://github.com/fieldOfView/Cura-OctoPrintPlugin/issues/156
+  
+  startPrint = printerConnected && !isPrinting && uploadedFullname != "";
+
+  // OctoPrint sends 201 here; https://github.com/fieldOfView/Cura-OctoPrintPlugin/issues/155#issuecomment-596110996
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  DynamicJsonDocument doc(512);
+  doc["files"]["local"]["name"] = getUploadedFilename();
+  doc["files"]["local"]["time"] = uploadedFileCreationTime;
+  doc["files"]["local"]["size"] = uploadedFileSize;
+  doc["files"]["local"]["origin"] = "local";
+  doc["done"] = true;
+
+  serializeJson(doc, *response);
+  response->setCode(201);
+  request->send(response);
+  /*request->send(201, "application/json", "{\r\n"
+                                         "  \"files\": {\r\n"
+                                         "    \"local\": {\r\n"
+                                         "      \"name\": \"" + getUploadedFilename() + "\",\r\n"
+                                         "      \"origin\": \"local\"\r\n"
+                                         "    }\r\n"
+                                         "  },\r\n"
+                                         "  \"done\": true\r\n"
+                                         "}");*/
+}
+
+// Writes queued upload bytes for up to timeLimitUs, and ends the upload once the last ones are written
+void writeUploadQueue(const uint32_t timeLimitUs) {
+  static bool started = false;
+  if (!uploadQueue.isActive())
+    return;
+
+  if (!started) {
+    started = true;
+    // The request is a little bigger than the file. Nothing is written when it does not fit.
+    uploadRejected = uploadQueue.contentLength > storageFS.getFreeSpace();
+    uploadReplacesPrint = false;
+    if (uploadRejected) {
+      lcd("Not enough space on SD");
+      uploadQueue.fail();
+    }
+  }
+
+  const uint32_t writeStart = micros();
+  const uint8_t *data;
+  size_t len;
+  bool final = false;
+  while (!uploadQueue.isFailed() && (len = uploadQueue.peek(data)) > 0) {
+    len = min(len, (size_t)WRITE_BUFFER_SIZE);
+    final = uploadQueue.isComplete() && len == uploadQueue.size();
+    writeUpload(uploadQueue.filename, uploadQueue.contentLength, uploadWritten, data, len, final);
+    uploadWritten += len;
+    uploadQueue.pop(len);
+    if (uploadReplacesPrint)
+      uploadQueue.fail();   // Not worth receiving
+    if (final)
+      break;
+    if (micros() - writeStart >= timeLimitUs)
+      return;
+  }
+  if (!uploadQueue.isComplete())
+    return;
+
+  if (uploadQueue.isFailed())
+    uploadQueue.fail();   // What is left is dropped
+  else if (!final)
+    writeUpload(uploadQueue.filename, uploadQueue.contentLength, uploadWritten, nullptr, 0, true);
+  uploadWritten = 0;
+  started = false;
+  AsyncWebServerRequest *request = uploadQueue.end();
+  if (request)
+    respondUpload(request);
+}
+
+// Runs in the TCP callbacks: the bytes are queued, loop() writes them
+void handleUpload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
+  // Early solution: A small size can tell us that there are not a gcode file
+  // Why: Cura send us two additional files with "true" or "false" inside.
+  // They come in a single piece of less than 5 characters, so they are left in RAM.
+  if (!index && final && len <= 5)
+    return;
+
+  AsyncClient *client = request ? request->client() : nullptr;
+  if (!index) {
+    if (!uploadQueue.begin(client, filename, request ? request->contentLength() : 0)) {
+      lcd("Busy, upload not received");   // The last one is still being written, or there is no heap
+      return;
+    }
+    if (request)
+      request->onDisconnect([client]() { uploadQueue.disconnect(client); });
+  }
+
+  if (!uploadQueue.push(client, data, len)) {
+    // The sender did not wait for the window, or nothing acknowledges the segments
+    uploadOverflows++;
+    lcd("Error receiving file");
+  }
+  if (final)
+    uploadQueue.finish(client);
+}
+
 int apiJobHandler(JsonObject root) {
   const char* command = root["command"];
   if (command != NULL) {
@@ -367,8 +710,28 @@ int apiJobHandler(JsonObject root) {
     else if (strcmp(command, "start") == 0) {
       if (isPrinting || !printerConnected || uploadedFullname == "")
         return 409;
+      // From the start of a layer, by the layer index of the file
+      const int layer = root["layer"].as<int>();
+      if (layer > 0) {
+        GcodeLayerIndex layers;
+        const bool found = layers.open(uploadedFullname, uploadedFileSize) && (uint32_t)layer <= layers.getCount();
+        layers.close();
+        if (!found)
+          return 400;
+        // The nozzle goes to the Z of the layer as the printer has it, homing Z would take it down on the print
+        if (!zHomed && !root["trustZ"].as<bool>())
+          return 412;
+      }
+      else if (layer < 0)
+        return 400;
+      startLayer = layer;
       startPrint = true;
     }
+    else if (strcmp(command, "recover") == 0) {
+      if (isPrinting || !printerConnected || recoveryFullname == "")
+        return 409;
+      recoverPrint = true;
+    }
     else if (strcmp(command, "restart") == 0) {
       if (!printPause)
         return 409;
@@ -400,8 +763,11 @@ String M115ExtractString(const String response, const String field) {
     spos += field.length() + 1;
     int epos = response.indexOf(':', spos);
     if (epos == -1) {
+      // Last field of the response
       epos = response.indexOf('\n', spos);
-      return response.substring(spos, epos-1);
+      String value = response.substring(spos, epos == -1 ? response.length() : epos);
+      value.trim();
+      return value;
     }
     else {
       while ((epos > spos) && (response[epos] != ' ') && (response[epos] != '\n'))
@@ -421,6 +787,52 @@ bool M115ExtractBool(const String response, const String field, const bool onErr
   return result == "" ? onErrorValue : (result == "1" ? true : false);
 }
 
+// Takes the firmware and its capabilities from a line of the M115 answer, as they arrive:
+// FIRMWARE_NAME:Marlin ... MACHINE_TYPE:Ender-3 EXTRUDER_COUNT:1 UUID:...
+// Cap:AUTOREPORT_TEMP:1
+// Klipper answers on the line of the ok: "ok FIRMWARE_NAME:Klipper FIRMWARE_VERSION:..."
+void parseM115Line(const char *line) {
+  if (strncmp(line, "Cap:", 4) == 0) {
+    const String cap = line;
+    if (cap.startsWith("Cap:AUTOREPORT_TEMP:"))
+      fwAutoreportTempCap = M115ExtractBool(cap, "AUTOREPORT_TEMP");
+    else if (cap.startsWith("Cap:PROGRESS:"))
+      fwProgressCap = M115ExtractBool(cap, "Cap:PROGRESS");
+    else if (cap.startsWith("Cap:BUILD_PERCENT:"))
+      fwBuildPercentCap = M115ExtractBool(cap, "Cap:BUILD_PERCENT");
+    else if (cap.startsWith("Cap:ADVANCED_OK:"))
+      fwAdvancedOkCap |= M115ExtractBool(cap, "Cap:ADVANCED_OK");
+    else if (cap.startsWith("Cap:MEATPACK:"))
+      fwMeatPackCap = M115ExtractBool(cap, "Cap:MEATPACK");
+  }
+  else if (strstr(line, "FIRMWARE_NAME:") || strstr(line, "MACHINE_TYPE:")) {
+    const String info = line;
+    String name = M115ExtractString(info, "FIRMWARE_NAME");
+    name.trim();    // "FIRMWARE_NAME: RepRapFirmware for Duet..."
+    firmware = &FirmwareDialect::fromName(name.c_str());
+    m115MachineType = M115ExtractString(info, "MACHINE_TYPE");
+    if (m115MachineType == "")
+      m115MachineType = name;   // Klipper and RepRapFirmware do not tell it
+    const String value = M115ExtractString(info, "EXTRUDER_COUNT");
+    fwExtruders = value == "" ? 1 : min(value.toInt(), (long)MAX_SUPPORTED_EXTRUDERS);
+    fwAutoreportTempCap = fwProgressCap = fwBuildPercentCap = fwMeatPackCap = false;   // Until their Cap: lines
+  }
+}
+
+// The last lines received, oldest first
+String getLastResponse() {
+  String response = "";
+  for (int n = RESPONSE_RECENT_LINES - 1; n >= 0; n--) {
+    const char *line = responseLines.getRecent(n);
+    if (line) {
+      if (response != "")
+        response += '\n';
+      response += line;
+    }
+  }
+  return response;
+}
+
 inline String getDeviceName() {
   #if defined(ESP8266)
     return fwMachineType + " (" + String(ESP.getChipId(), HEX) + ")";
@@ -443,6 +855,11 @@ static bool detectPrinter() {
       // Start printer detection
       telnetSend("Starting printer detection...");
       serialBaudIndex = 0;
+      fwAdvancedOkCap = fwMeatPackCap = false;
+      firmware = &FirmwareDialect::get(FirmwareType::Marlin);
+      meatPackActive = meatPackRequested = false;
+      printerBufsize = printerSlotsFree = 1;
+      zHomed = false;
       printerDetectionState = 10;
       break;
 
@@ -460,6 +877,12 @@ static bool detectPrinter() {
         #endif
       }
       //telnetSend("Trying M115...");
+      if (USE_MEATPACK && nM115 > 0) {
+        // Maybe the printer still unpacks what a previous session sent, on its own line for the ones that do not
+        MeatPack::sendCommand(PrinterSerial, MeatPack::DisablePacking);
+        PrinterSerial.write('\n');
+      }
+      m115MachineType = "";
       commandQueue.push("M115"); // M115 - Firmware Info
       printerDetectionState = 20;
       //delay(50);
@@ -469,8 +892,7 @@ static bool detectPrinter() {
       telnetSend("Check printer response...");
       // Check if there is a printer response
       if (commandQueue.isEmpty()) {
-        String value = M115ExtractString(lastReceivedResponse, "MACHINE_TYPE");
-        if (value == "") {
+        if (m115MachineType == "") {
           telnetSend("no value");
           if (nM115++ >= REPEAT_M115_TIMES) {
             nM115 = 0;
@@ -485,15 +907,19 @@ static bool detectPrinter() {
         }
         else {
           telnetSend("Connected");
-
-          fwMachineType = value;
-          value = M115ExtractString(lastReceivedResponse, "EXTRUDER_COUNT");
-          fwExtruders = value == "" ? 1 : min(value.toInt(), (long)MAX_SUPPORTED_EXTRUDERS);
-          fwAutoreportTempCap = M115ExtractBool(lastReceivedResponse, "AUTOREPORT_TEMP");
-          fwProgressCap = M115ExtractBool(lastReceivedResponse, "Cap:PROGRESS");
-          fwBuildPercentCap = M115ExtractBool(lastReceivedResponse, "Cap:BUILD_PERCENT");
-          //M115ExtractBool(lastReceivedResponse, "Cap:SDCARD");
-          //M115ExtractBool(lastReceivedResponse, "Cap:ARCS");
+          nM115 = 0;    // A later detection tries this baud again first
+          if (numberedLines())
+            commandQueue.push("M110 N0");   // Start line numbers
+
+          fwMachineType = m115MachineType;
+          m115MachineType = "";
+          if (USE_MEATPACK && fwMeatPackCap) {
+            MeatPack::sendCommand(PrinterSerial, MeatPack::EnablePacking);
+            meatPackRequested = true;
+            meatPackTimer = ms;
+          }
+          //M115ExtractBool(line, "Cap:SDCARD");
+          //M115ExtractBool(line, "Cap:ARCS");
 
           String text = WiFiService.getCurrentIP().toString() + " " + storageFS.getActiveFS();
           lcd(text);
@@ -617,20 +1043,37 @@ void initUploadedFilename(String filename = "") {
           file = dir.openNextFile();
         }
         dir.close();
+        if (file)
+          uploadedFullname = "/" + file.name();
       }
     }
   }
 
   if (file) {
-    uploadedFullname = "/" + file.name();
     uploadedFileCreationTime = file.getCreationTime();
     uploadedFileSize = file.size();
     file.close();
     saveUploadedFullname();
+    loadJobMetadata();
   } 
 }
 
 
+// A print cut by a reboot, to offer resuming it from its last checkpoint
+void loadRecovery() {
+  PrintCheckpointRecord record;
+  recoveryFullname = "";
+  if (!PrintCheckpoint::load(record))
+    return;
+  FileWrapper file = storageFS.open(record.path);
+  if (file && !file.isDirectory() && file.size() == record.fileSize) {
+    recoveryFullname = record.path;
+    recoveryLine = record.line;
+    recoveryPrintTime = record.printTime;
+  }
+  file.close();
+}
+
 inline String getState() {
   if (!printerConnected)
     return "Discovering printer";
@@ -648,39 +1091,20 @@ inline String stringify(bool value) {
   return value ? "true" : "false";
 }
 
-inline void filesList(DynamicJsonDocument &doc, uint16_t index, String id = "") {
-    MD5Builder md5;
-    FileWrapper file;
-    FileWrapper dir = storageFS.open("/");
-    uint16_t i = 0;
-    uint8_t count = 0;
-    if (dir) {
-      file = dir.openNextFile();
-      while (file) {
-          if (file.isGcode() && !file.isDirectory())
-          {
-            if (i>=index)
-            {
-              md5.begin();
-              md5.add(file.name());
-              md5.calculate();
-              if (id == "" || (id != "" && id == md5.toString())) {
-                doc["files"][count]["name"] = file.name();
-                doc["files"][count]["size"] = file.size();
-                doc["files"][count]["id"] = md5.toString();
-                count++;
-              }
-            }
-            i++;
-          }
-          file.close();
-          if (count < MAX_FILES_PER_LIST)
-            file = dir.openNextFile();
-      }
-      dir.close();
-    }
+inline void fileJson(DynamicJsonDocument &doc, uint8_t n, uint16_t record, const FileIndexEntry &entry) {
+  doc["files"][n]["name"] = fileIndex.getName(entry);
+  doc["files"][n]["size"] = entry.size;
+  doc["files"][n]["date"] = entry.mtime;
+  doc["files"][n]["id"] = FileIndex::getId(record, entry);
+}
 
-    doc["next"] = i;
+// The file of id, not a directory
+inline bool findFile(DynamicJsonDocument &doc, const String &id, FileIndexEntry &entry) {
+  const int32_t found = fileIndex.findId(id);
+  if (found < 0 || !fileIndex.get(found, entry) || entry.isDirectory())
+    return false;
+  fileJson(doc, 0, found, entry);
+  return true;
 }
 
 #ifndef DISABLE_LOGGING
@@ -703,6 +1127,7 @@ void PrinterSetup() {
   }
   #endif
 
+  fileIndex.begin();
   commandQueue.clear();
 
   for (int t = 0; t < MAX_SUPPORTED_EXTRUDERS; t++)
@@ -710,6 +1135,7 @@ void PrinterSetup() {
   bedTemperature = { 0, 0 };
   
   initUploadedFilename();
+  loadRecovery();
 
   // Info page
   webServer.on("/info", HTTP_GET, [](AsyncWebServerRequest * request) {
@@ -723,19 +1149,31 @@ void PrinterSetup() {
         message += "Uploaded file: " + getUploadedFilename() + "\n"
                    "Uploaded file size: " + String(uploadedFileSize) + "\n";
       }
+      message += "Queue starvations: " + String(queueStarvations) + " (" + String(queueStarvedPasses) + " loop passes)\n";
+      message += "Upload queue overflows: " + String(uploadOverflows) + "\n";
     }
     message += "\n"
-               "Last command sent: " + lastCommandSent + "\n"
-               "Last received response: " + lastReceivedResponse + "\n";
+               "Last command sent: " + String(lastCommandSent) + "\n"
+               "Last received response: " + getLastResponse() + "\n"
+               "Response lines cut: " + String(responseLines.getTruncatedCount()) + "\n";
     if (printerConnected) {
       message += "\n"
+                 "Firmware: " + String(firmware->name) + "\n"
                  "EXTRUDER_COUNT: " + String(fwExtruders) + "\n"
                  "AUTOREPORT_TEMP: " + stringify(fwAutoreportTempCap);
       if (fwAutoreportTempCap)
         message += " Enabled: " + stringify(autoreportTempEnabled);
       message += "\n"
                  "PROGRESS: " + stringify(fwProgressCap) + "\n"
-                 "BUILD_PERCENT: " + stringify(fwBuildPercentCap) + "\n";
+                 "BUILD_PERCENT: " + stringify(fwBuildPercentCap) + "\n"
+                 "ADVANCED_OK: " + stringify(fwAdvancedOkCap);
+      if (fwAdvancedOkCap)
+        message += " BUFSIZE: " + String(printerBufsize) + " Planner free: " + String(printerPlannerFree) + " Buffer free: " + String(printerBufferFree);
+      message += "\n"
+                 "MEATPACK: " + stringify(fwMeatPackCap);
+      if (fwMeatPackCap)
+        message += " Enabled: " + stringify(meatPackActive);
+      message += "\n";
     }
     message += "</pre>";
     request->send(200, "text/html", message);
@@ -778,7 +1216,7 @@ void PrinterSetup() {
     doc["state"] = getState();
     doc["printing"] = isPrinting;
     doc["lastCommand"] = lastCommandSent;
-    doc["lastResponse"] = lastReceivedResponse;
+    doc["lastResponse"] = getLastResponse();
 
     //doc["free_heap"] = ESP.getFreeHeap();
     //doc["filesystem"] = storageFS.getActiveFS();
@@ -787,7 +1225,7 @@ void PrinterSetup() {
     doc["uploaded_file"]["name"] = getUploadedFilename();
     doc["uploaded_file"]["size"] = uploadedFileSize;
     //doc["last_command_sent"] = lastCommandSent;
-    //doc["last_received_response"] = lastReceivedResponse;
+    //doc["last_received_response"] = getLastResponse();
     //doc["EXTRUDER_COUNT"] = fwExtruders;
     //doc["AUTOREPORT_TEMP"] = fwAutoreportTempCap;
     //doc["AUTOREPORT_TEMP_ENABLED"] = autoreportTempEnabled;
@@ -796,7 +1234,16 @@ void PrinterSetup() {
     doc["print_completion"] = String(printCompletion);
     
     doc["printing_time"]["elapsed"] = printTime;
-    doc["printing_time"]["remaining"] = (printCompletion > 0) ? printTime / printCompletion * (100 - printCompletion) : 0;
+    doc["printing_time"]["remaining"] = max(0, getPrintTimeLeft());
+    if (isPrinting && printLayers.isOpen()) {
+      doc["print_layer"]["current"] = printLayers.getLayer();
+      doc["print_layer"]["count"] = printLayers.getCount();
+    }
+    if (recoveryFullname != "") {
+      doc["recovery"]["name"] = recoveryFullname.substring(1);
+      doc["recovery"]["line"] = recoveryLine;
+      doc["recovery"]["printing_time"] = recoveryPrintTime;
+    }
 
     doc["bed_temperature"]["actual"] = bedTemperature.actual/100.0;
     doc["bed_temperature"]["target"] = bedTemperature.target/100.0;
@@ -818,17 +1265,48 @@ void PrinterSetup() {
 
   webServer.on("/files/list", HTTP_GET, [&](AsyncWebServerRequest *request) {
     if (NoHeapToService(request)) return;
-    uint16_t index = 0;
+    FileListQuery query;
+    query.limit = MAX_FILES_PER_LIST;
     if (request->hasParam("i")) {
       AsyncWebParameter *p = request->getParam("i");
-      index = p->value().toInt();
+      query.index = p->value().toInt();
+    }
+    if (request->hasParam("n")) {
+      AsyncWebParameter *p = request->getParam("n");
+      query.limit = p->value().toInt();
+    }
+    if (request->hasParam("s")) {
+      AsyncWebParameter *p = request->getParam("s");
+      for (uint8_t sort = 0; sort < FILE_SORTS; sort++)
+        if (p->value() == FileOrder::getSortName((FileSort)sort))
+          query.sort = (FileSort)sort;
+    }
+    if (request->hasParam("r")) {
+      AsyncWebParameter *p = request->getParam("r");
+      query.reverse = p->value() == "1";
+    }
+    if (request->hasParam("p")) {
+      AsyncWebParameter *p = request->getParam("p");
+      query.prefix = p->value();
+    }
+    if (request->hasParam("q")) {
+      AsyncWebParameter *p = request->getParam("q");
+      query.search = p->value();
     }
 
-    AsyncResponseStream *response = request->beginResponseStream("application/json");
-    DynamicJsonDocument doc(2048);
-    filesList(doc, index);
-    serializeJson(doc, *response);
-    request->send(response);
+    fileIndex.refresh();
+    const int32_t directory = fileIndex.findDirectory(request->hasParam("d") ? request->getParam("d")->value() : "/");
+    if (directory < 0) {
+      request->send(404, "text/plain", "Directory not found");
+      return;
+    }
+    query.directory = directory;
+
+    // Written from the index while it is sent, so the page size does not matter
+    std::shared_ptr<FileListStream> list = std::make_shared<FileListStream>(query);
+    request->send(request->beginChunkedResponse("application/json", [list](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      return list->read(buffer, maxLen);
+    }));
   });
 
   webServer.on("/files/delete", HTTP_GET, [&](AsyncWebServerRequest *request) {
@@ -838,13 +1316,21 @@ void PrinterSetup() {
       AsyncWebParameter *p = request->getParam("id");
       id = p->value();
     }
-    AsyncResponseStream *response = request->beginResponseStream("application/json");
     DynamicJsonDocument doc(1024);
-    filesList(doc, 0, id);
-    if (doc["files"][0]["id"] == id) {
-      String filename = doc["files"][0]["name"];
-      storageFS.remove("/"+filename);
+    FileIndexEntry entry;
+    if (findFile(doc, id, entry)) {
+      const String path = fileIndex.getPath(entry);
+      if (isPrintingFile(path)) {
+        // Its clusters, or those of its copies, would be freed under the print
+        request->send(409, "text/plain", "File is being printed");
+        return;
+      }
+      storageFS.remove(path);
+      GcodeCompactor::remove(path);
+      GcodeAnalyzer::remove(path);
+      fileIndex.remove(path);
     }
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
     serializeJson(doc, *response);
     request->send(response);
   });
@@ -858,10 +1344,9 @@ void PrinterSetup() {
     }
     AsyncResponseStream *response = request->beginResponseStream("application/json");
     DynamicJsonDocument doc(1024);
-    filesList(doc, 0, id);
-    if (doc["files"][0]["id"] == id) {
-      initUploadedFilename(doc["files"][0]["name"]);
-    }
+    FileIndexEntry entry;
+    if (findFile(doc, id, entry))
+      initUploadedFilename(fileIndex.getPath(entry).substring(1));
     serializeJson(doc, *response);
     request->send(response);
   });
@@ -1017,38 +1502,12 @@ void PrinterSetup() {
   // File Operations
   // For Slic3r OctoPrint compatibility
   webServer.on("/api/files/local", HTTP_POST, [](AsyncWebServerRequest * request) {
-    if (NoHeapToService(request)) return;
-    // https://docs.octoprint.org/en/master/api/files.html?highlight=api%2Ffiles%2Flocal#upload-file-or-create-folder
-    lcd("Received");
-    playSound();
-
-    // We are not using
-    // if (request->hasParam("print", true))
-    // due to https://github.com/fieldOfView/Cura-OctoPrintPlugin/issues/156
-    
-    startPrint = printerConnected && !isPrinting && uploadedFullname != "";
-
-    // OctoPrint sends 201 here; https://github.com/fieldOfView/Cura-OctoPrintPlugin/issues/155#issuecomment-596110996
-    AsyncResponseStream *response = request->beginResponseStream("application/json");
-    DynamicJsonDocument doc(512);
-    doc["files"]["local"]["name"] = getUploadedFilename();
-    doc["files"]["local"]["time"] = uploadedFileCreationTime;
-    doc["files"]["local"]["size"] = uploadedFileSize;
-    doc["files"]["local"]["origin"] = "local";
-    doc["done"] = true;
-
-    serializeJson(doc, *response);
-    response->setCode(201);
-    request->send(response);
-    /*request->send(201, "application/json", "{\r\n"
-                                           "  \"files\": {\r\n"
-                                           "    \"local\": {\r\n"
-                                           "      \"name\": \"" + getUploadedFilename() + "\",\r\n"
-                                           "      \"origin\": \"local\"\r\n"
-                                           "    }\r\n"
-                                           "  },\r\n"
-                                           "  \"done\": true\r\n"
-                                           "}");*/
+    if (uploadQueue.isRefused(request->client())) {
+      request->send(409, "text/plain", "Busy, upload not received");
+      return;
+    }
+    if (!uploadQueue.respondLater(request))
+      respondUpload(request);
   }, handleUpload);
 
   // Pending: http://docs.octoprint.org/en/master/api/files.html#retrieve-all-files
@@ -1065,7 +1524,9 @@ void PrinterSetup() {
     // http://docs.octoprint.org/en/master/api/job.html#retrieve-information-about-the-current-job
     int32_t printTimeLeft = 0;
     if (isPrinting) {
-      printTimeLeft = (printCompletion > 0) ? printTime / printCompletion * (100 - printCompletion) : INT32_MAX;
+      printTimeLeft = getPrintTimeLeft();
+      if (printTimeLeft < 0)
+        printTimeLeft = INT32_MAX;
     }
     AsyncResponseStream *response = request->beginResponseStream("application/json");
     DynamicJsonDocument doc(2048);
@@ -1078,14 +1539,38 @@ void PrinterSetup() {
     //strftime(str, 32, "%Y-%m-%d %H:%M:%S", time);
     doc["job"]["file"]["date"] = uploadedFileCreationTime;
 
-    //doc["job"]["estimatedPrintTime"] = estimatedPrintTime;
-    doc["job"]["filament"] = "";
+    // Taken from the file while it was uploaded
+    if (jobMetadata.estimatedTime > 0)
+      doc["job"]["estimatedPrintTime"] = jobMetadata.estimatedTime;
+    if (jobMetadata.filamentLength > 0) {
+      doc["job"]["filament"]["tool0"]["length"] = jobMetadata.filamentLength;
+      doc["job"]["filament"]["tool0"]["volume"] = jobMetadata.filamentVolume;
+    }
+    else
+      doc["job"]["filament"] = "";
+    if (jobMetadata.magic == GCODE_METADATA_MAGIC) {
+      doc["job"]["analysis"]["layers"] = jobMetadata.layerCount;
+      doc["job"]["analysis"]["layerHeight"] = jobMetadata.layerHeight;
+      doc["job"]["analysis"]["filamentWeight"] = jobMetadata.filamentWeight;
+      doc["job"]["analysis"]["extruderTemperature"] = jobMetadata.extruderTemperature;
+      doc["job"]["analysis"]["bedTemperature"] = jobMetadata.bedTemperature;
+      doc["job"]["analysis"]["printingArea"]["minX"] = jobMetadata.minX;
+      doc["job"]["analysis"]["printingArea"]["minY"] = jobMetadata.minY;
+      doc["job"]["analysis"]["printingArea"]["minZ"] = jobMetadata.minZ;
+      doc["job"]["analysis"]["printingArea"]["maxX"] = jobMetadata.maxX;
+      doc["job"]["analysis"]["printingArea"]["maxY"] = jobMetadata.maxY;
+      doc["job"]["analysis"]["printingArea"]["maxZ"] = jobMetadata.maxZ;
+    }
 
     doc["progress"]["completion"] = printCompletion;
     doc["progress"]["filepos"] = filePos;
     doc["progress"]["printTime"] = printTime;
     doc["progress"]["printTimeLeft"] = printTimeLeft;
-    doc["progress"]["printTimeLeftOrigin"] = "linear";
+    doc["progress"]["printTimeLeftOrigin"] = isPrinting && printLayers.isOpen() ? "estimate" : "linear";
+    if (isPrinting && printLayers.isOpen()) {
+      doc["progress"]["layer"] = printLayers.getLayer();
+      doc["progress"]["layers"] = printLayers.getCount();
+    }
 
     doc["state"] = getState();
 
@@ -1273,95 +1758,332 @@ inline void restartSerialTimeout() {
   serialReceiveTimeoutTimer = ms;
 }
 
+// Sends a line to the printer, packed when MeatPack is enabled. Returns the bytes
+// it takes in the printer RX buffer.
+uint16_t writeLine(const char *line, const size_t length) {
+  if (meatPackActive) {
+    static uint8_t packed[MeatPack::maxPackedLength(COMMAND_MAX_LENGTH + 18)];
+    const size_t n = MeatPack::pack(line, length, packed);
+    PrinterSerial.write(packed, n);
+    return n;
+  }
+  PrinterSerial.println(line);
+  return length + 2;
+}
+
+// Writes "N<number> <command>*<checksum>" to line, the checksum is the XOR of all the chars before '*'
+int numberLine(char (&line)[COMMAND_MAX_LENGTH + 18], const uint32_t number, const CommandView &command) {
+  int len = snprintf(line, sizeof(line) - 5, "N%lu %s", (unsigned long)number, command.c_str());
+  uint8_t checksum = 0;
+  for (int i = 0; i < len; i++)
+    checksum ^= line[i];
+  return len + snprintf(line + len, 5, "*%u", checksum);
+}
+
+// Bytes that writeLine() took for command, sent as line number when numbered
+uint16_t sentLength(const CommandView &command, const bool numbered, const uint32_t number) {
+  if (!numbered)
+    return meatPackActive ? MeatPack::packedLength(command.c_str(), command.length()) : command.length() + 2;
+
+  char line[COMMAND_MAX_LENGTH + 18];
+  const int len = numberLine(line, number, command);
+  return meatPackActive ? MeatPack::packedLength(line, len) : len + 2;
+}
+
+// Sends "N<line> <command>*<checksum>", returns what writeLine() took
+uint16_t sendNumbered(const CommandView &command) {
+  if (command.startsWith("M110 N"))
+    nextLineNumber = atol(command.c_str() + 6);
+
+  char line[COMMAND_MAX_LENGTH + 18];
+  return writeLine(line, numberLine(line, nextLineNumber++, command));
+}
+
+// Goes back to send again from line as asked by "Resend: <line>"
+void resendFrom(const uint32_t line) {
+  if (!fwAdvancedOkCap)
+    ++skipOks;   // With ADVANCED_OK the line number in the ok tells what it acknowledges
+  if (line == replayLineNumber && !replayAfterTimeout)
+    return;   // Already replaying, the printer also rejected what was in flight after it
+
+  uint32_t first = nextLineNumber - commandQueue.getSentCount();
+  if (replayAfterTimeout) {
+    // The printer got the lines before it but their ok were lost
+    while (first < line && !commandQueue.isAckEmpty()) {
+      printerState.apply(commandQueue.popAcknowledge().c_str());
+      ++first;
+    }
+    replayAfterTimeout = false;
+  }
+  if (line < first) {
+    // Its command is not kept any more: numbering on from there would skip it
+    telnetSend("#RESEND " + String(line) + " LOST#");
+    if (isPrinting) {
+      lcd("Line lost, print stopped");
+      cancelPrint = true;
+    }
+    return;
+  }
+  if (line < nextLineNumber)
+    commandQueue.rewindSend(line - first);
+  nextLineNumber = line;
+  replayLineNumber = line;
+  printerUsedBuffer = 0;
+  printerSlotsFree = printerBufsize;    // The printer dropped what it got after the line
+  telnetSend("#RESEND " + String(line) + "#");
+}
+
+// Parse "Resend: 123" (Marlin) and "rs N123" (Repetier, Smoothie)
+bool parseResend(const char *response) {
+  const char *str = response;
+  if (strncmp(str, "Resend:", 7) == 0)
+    str += 7;
+  else if (strncmp(str, "rs ", 3) == 0)
+    str += 3;
+  else
+    return false;
+  while (*str == ' ' || *str == 'N')
+    ++str;
+  if (!isDigit(*str))
+    return false;
+
+  resendFrom(atol(str));
+  return true;
+}
+
+// Z is homed by G28, with Z or no axis, and lost when M18/M84 disable its stepper
+void trackZHomed(const CommandView &command) {
+  const char *line = command.c_str();
+  const bool home = command.startsWith("G28"),
+             off = (command.startsWith("M18") || command.startsWith("M84")) && !strchr(line, 'S');   // M84 S sets a timeout
+  if ((home || off) && (command[3] == ' ' || command[3] == 0) && (strchr(line + 3, 'Z') || !strpbrk(line + 3, "XYE")))
+    zHomed = home;
+}
+
 void SendCommands() {
-  String command = commandQueue.peekSend();  //gets the next command to be sent
-  if (command != "") {
-    bool noResponsePending = commandQueue.isAckEmpty();
-    if (noResponsePending || printerUsedBuffer < PRINTER_RX_BUFFER_SIZE * 3 / 4) {  // Let's use no more than 75% of printer RX buffer
-      if (noResponsePending)
-        restartSerialTimeout();   // Receive timeout has to be reset only when sending a command and no pending response is expected
-      PrinterSerial.println(command); // Send to 3D Printer
-      printerUsedBuffer += command.length();
-      lastCommandSent = command;
-      commandQueue.popSend();
-
-      telnetSend(">" + command);
+  static bool starved = false;
+  if (meatPackRequested) {
+    if (ms - meatPackTimer < MEATPACK_TIMEOUT)
+      return;
+    MeatPack::sendCommand(PrinterSerial, MeatPack::DisablePacking);   // No answer, go on unpacked
+    meatPackRequested = false;
+  }
+  for (;;) {    // Send as many commands as the printer can take
+    const CommandView command = commandQueue.peekSend();  //gets the next command to be sent
+    const bool noResponsePending = commandQueue.isAckEmpty();
+    bool canSend;
+    if (fwAdvancedOkCap)
+      canSend = printerSlotsFree > 0 && commandQueue.getSentCount() < printerBufsize;   // Keep the printer command buffer full
+    else
+      canSend = printerUsedBuffer < PRINTER_RX_BUFFER_SIZE * 3 / 4;  // Let's use no more than 75% of printer RX buffer
+    if (!noResponsePending && !canSend)
+      return;
+
+    if (command.isEmpty()) {
+      if (isPrinting && !printPause) {    // The printer is ready but the file was not read fast enough
+        ++queueStarvedPasses;
+        if (!starved)
+          ++queueStarvations;
+        starved = true;
+      }
+      return;
     }
+    starved = false;
+
+    const bool numbered = numberedLines() && printerConnected;
+    if (numbered && !noResponsePending && command.startsWith("M110"))
+      return;   // Line numbers restart, wait until everything sent before was acknowledged
+    if (noResponsePending)
+      restartSerialTimeout();   // Receive timeout has to be reset only when sending a command and no pending response is expected
+    if (numbered)
+      printerUsedBuffer += sendNumbered(command);
+    else
+      printerUsedBuffer += writeLine(command.c_str(), command.length()); // Send to 3D Printer
+    if (printerSlotsFree > 0)
+      --printerSlotsFree;
+    memcpy(lastCommandSent, command.c_str(), command.length() + 1);
+    trackZHomed(command);
+    commandQueue.popSend();
+
+    telnetSend('>', command.c_str());
+  }
+}
+
+// The oldest command sent has been processed by the printer
+void acknowledgeCommand() {
+  const uint32_t lineNumber = nextLineNumber - commandQueue.getSentCount();
+  const CommandView acknowledged = commandQueue.popAcknowledge();     // Go on with next command
+  printerState.apply(acknowledged.c_str());
+  if (acknowledged.startsWith(TEMP_COMMAND))
+    parseTemperatures(responseLines.getLine());
+  else if (fwAutoreportTempCap && acknowledged.startsWith(AUTOTEMP_COMMAND))
+    autoreportTempEnabled = (acknowledged[6] != '0');
+
+  unsigned int cmdLen = sentLength(acknowledged, numberedLines() && printerConnected, lineNumber);
+  printerUsedBuffer = printerUsedBuffer > cmdLen ? printerUsedBuffer - cmdLen : 0;
+  if (!commandQueue.isAckEmpty())
+    restartSerialTimeout();   // The printer is alive, the timeout is for the next command in flight
+  if (replayLineNumber && nextLineNumber - commandQueue.getSentCount() > replayLineNumber)
+    replayLineNumber = 0;     // The replayed line was acknowledged
+  replayAfterTimeout = false;
+}
+
+// Sends again what was not acknowledged, if the printer already got it then it will ask for the right line
+void replaySent() {
+  nextLineNumber -= commandQueue.getSentCount();
+  commandQueue.rewindSend(0);
+  printerSlotsFree = printerBufsize;
+  replayAfterTimeout = true;
+  replayLineNumber = 0;
+}
+
+// The handlers of the responses by their type tell what the line was, for telnet
+
+const char *onOk(const char *line) {
+  const bool advanced = parseAdvancedOk(line);
+  if (advanced && numberedLines() && printerConnected) {
+    // The ok tells the line it acknowledges, so lost oks and the ones of Resend or of
+    // unnumbered garbage received by the printer do not break the count
+    if (printerOkLineNumber >= 0) {
+      while (!commandQueue.isAckEmpty() && nextLineNumber - commandQueue.getSentCount() <= (uint32_t)printerOkLineNumber)
+        acknowledgeCommand();
+    }
+    else if (commandQueue.peekAcknowledge().startsWith(TEMP_COMMAND))
+      acknowledgeCommand();   // M105 answers "ok T:..." by itself
+    return "ok";
+  }
+  if (skipOks > 0) {
+    --skipOks;
+    return "resend ok";
+  }
+  if (!advanced && printerSlotsFree < printerBufsize)
+    ++printerSlotsFree;   // An ok without P and B, like the one of M105, frees its slot
+  acknowledgeCommand();
+  return "ok";
+}
+
+const char *onError(const char *line) {
+  if (strstr(line, "Last Line:"))
+    return "line error";    // Followed by "Resend:"
+  if (!firmware->fatalErrors)
+    return "error";
+  cancelPrint = true;
+  return "ERROR";
+}
+
+// A line broken by noise leaves a piece that the printer runs and acknowledges too
+const char *onUnknownCommand(const char *line) {
+  const char *quote = strchr(line, '"');
+  const CommandView oldest = commandQueue.peekAcknowledge();
+  if (numberedLines() && !fwAdvancedOkCap && quote && strncmp(quote + 1, oldest.c_str(), oldest.length()) != 0)
+    ++skipOks;
+  return "unknown";
+}
+
+// Marlin with NO_TIMEOUTS: it ran all it got and nothing came for a while, so
+// the oks of the commands still waiting for one were lost
+const char *onWait() {
+  if (commandQueue.isAckEmpty())
+    return "idle";
+  if (numberedLines())
+    replaySent();   // Or the lines, the printer tells which ones it did not get
+  else {
+    while (!commandQueue.isAckEmpty())
+      acknowledgeCommand();
+  }
+  return "lost ok";
+}
+
+// Host actions: "//action:pause", "//action:resume", "//action:cancel"...
+const char *onAction(const char *line) {
+  const char *action = strchr(line, ':') + 1;
+  if (strncmp(action, "pause", 5) == 0) {     // Also "paused", the printer did it itself
+    if (isPrinting)
+      printPause = true;
+  }
+  else if (strncmp(action, "resume", 6) == 0) {
+    if (isPrinting)
+      printPause = false;
+  }
+  else if (strncmp(action, "cancel", 6) == 0) {
+    if (isPrinting)
+      cancelPrint = true;
+  }
+  return "action";
+}
+
+const char *handleResponse(ResponseType type, const char *line) {
+  if (!printerConnected)
+    parseM115Line(line);
+  if (type == ResponseType::Ok)
+    return onOk(line);
+  if (!printerConnected)
+    return "discovering";
+
+  switch (type) {
+    case ResponseType::Temperature:
+      if (parseTemperatures(line))
+        return "autotemp";
+      break;
+    case ResponseType::Position:
+      if (parsePosition(line))
+        return "position";
+      break;
+    case ResponseType::Busy:
+      return "busy";
+    case ResponseType::Error:
+      return onError(line);
+    case ResponseType::Resend:
+      if (parseResend(line))
+        return "resend";
+      break;
+    case ResponseType::Wait:
+      return onWait();
+    case ResponseType::Action:
+      return onAction(line);
+    case ResponseType::MeatPack:
+      meatPackActive = strstr(line, " ON ") != nullptr;
+      meatPackRequested = false;
+      return "meatpack";
+    case ResponseType::ColdExtrusion:
+      // To do: Pause sending gcode, or do something similar
+      return "cold extrusion";
+    case ResponseType::UnknownCommand:
+      return onUnknownCommand(line);
+    default:
+      break;
   }
+  return "wait more";
 }
 
-static String serialResponse = "";
-static int lineStartPos = 0;
 void ReceiveResponses() {
   while (PrinterSerial.available() > 0) {
-  //while (false) {
-    //yield();
-    char ch = (char)PrinterSerial.read();
-    if (ch == '\r') continue;
-    serialResponse += String(ch);
-    if (ch == '\n')
-    { // new line
-      bool incompleteResponse = false;
-      String responseDetail = "";
-
-      if (serialResponse.startsWith("ok") || serialResponse.endsWith("ok\n")) {
-        if (lastCommandSent.startsWith(TEMP_COMMAND))
-          parseTemperatures(serialResponse);
-        else if (fwAutoreportTempCap && lastCommandSent.startsWith(AUTOTEMP_COMMAND))
-          autoreportTempEnabled = (lastCommandSent[6] != '0');
-
-        unsigned int cmdLen = commandQueue.popAcknowledge().length();     // Go on with next command
-        printerUsedBuffer = max(printerUsedBuffer - cmdLen, 0u);
-        responseDetail = "ok";
-      }
-      else if (printerConnected) {
-        if (parseTemperatures(serialResponse))
-          responseDetail = "autotemp";
-        else if (parsePosition(serialResponse))
-          responseDetail = "position";
-        else if (serialResponse.startsWith("echo:busy"))
-          responseDetail = "busy";
-        else if (serialResponse.startsWith("echo: cold extrusion prevented")) {
-          // To do: Pause sending gcode, or do something similar
-          responseDetail = "cold extrusion";
-        }
-        else if (serialResponse.startsWith("Error:")) {
-          cancelPrint = true;
-          responseDetail = "ERROR";
-        }
-        else {
-          incompleteResponse = true;
-          responseDetail = "wait more";
-        }
-      } else {
-          incompleteResponse = true;
-          responseDetail = "discovering";
-      }
+    if (!responseLines.push((char)PrinterSerial.read()))
+      continue;
+
+    // A new line
+    const char *line = responseLines.getLine();
+
+    const char *responseDetail = handleResponse(firmware->classify(line, responseLines.getLength()), line);
 
-      int responseLength = serialResponse.length();
 #ifdef TELNET_CUSTOM_FORMAT
-      telnetSend("<" + serialResponse.substring(lineStartPos, responseLength - 1) + "#" + responseDetail + "#");
+    telnetSend("<" + String(line) + "#" + responseDetail + "#");
 #else
-      telnetSend(serialResponse.substring(lineStartPos, responseLength - 1));
+    telnetSend(line);
 #endif
-      if (incompleteResponse)
-        lineStartPos = responseLength;
-      else {
-        lastReceivedResponse = serialResponse;
-        lineStartPos = 0;
-        serialResponse = "";
-      }
-      restartSerialTimeout();
-    }
+    if (strcmp(responseDetail, "autotemp") != 0 || strstr(line, " W:"))
+      restartSerialTimeout();   // Temperature autoreports do not tell that the printer is working on a command
   }
 
   if (!commandQueue.isAckEmpty() && ((ms - serialReceiveTimeoutTimer) > KEEPALIVE_INTERVAL)) {  // Command has been lost by printer, buffer has been freed
-    if (printerConnected)
+    if (printerConnected) {
       telnetSend("#TIMEOUT#");
+      if (numberedLines())
+        replaySent();
+    }
     else
       commandQueue.clear();
-    lineStartPos = 0;
-    serialResponse = "";
+    responseLines.discard();
     restartSerialTimeout();
   }
   /*
@@ -1419,6 +2141,10 @@ void PrinterHandle() {
     }
   }
 
+  // The SD is written after the print has read from it what it needed
+  if (!printFillPending)
+    writeUploadQueue(UPLOAD_WRITE_TIME_US);
+
   SendCommands();
   ReceiveResponses();
   #ifndef DISABLE_TELNET
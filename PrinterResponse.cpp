@@ -0,0 +1,216 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PrinterResponse.h"
+
+ResponseType PrinterResponse::classify(const char *line, uint16_t length, const ResponsePrefix *prefixes, uint8_t count) {
+  for (const ResponsePrefix *prefix = prefixes; prefix < prefixes + count; prefix++)
+    if (line[0] == prefix->text[0] && length >= prefix->length && memcmp(line, prefix->text, prefix->length) == 0)
+      return prefix->type;
+
+  if (length >= 2 && memcmp(line + length - 2, "ok", 2) == 0)
+    return ResponseType::Ok;
+  return ResponseType::Other;
+}
+
+// A word of a response: "label:value", with " /target" after it in temperature reports
+struct ResponseWord {
+  const char *label;
+  uint8_t length;
+  bool hasValue, hasTarget;
+  int32_t value, target;
+
+  inline bool is(const char *name) const {
+    return strlen(name) == length && strncmp(label, name, length) == 0;
+  }
+};
+
+// Reads the word at p and moves p after it, false at the end of the line
+static bool nextWord(const char *&p, ResponseWord &word) {
+  while (isspace(*p))
+    p++;
+  if (!*p)
+    return false;
+
+  word.label = p;
+  while (*p && *p != ':' && !isspace(*p))
+    p++;
+  word.length = p - word.label > 255 ? 255 : p - word.label;
+  word.hasValue = word.hasTarget = false;
+  if (*p != ':')
+    return true;    // Not a label: "ok", "Count"...
+
+  p++;
+  word.hasValue = PrinterResponse::parseCenti(p, word.value);
+  if (word.hasValue) {
+    const char *target = p;
+    while (*target == ' ')
+      target++;
+    if (*target == '/' && PrinterResponse::parseCenti(++target, word.target)) {
+      word.hasTarget = true;
+      p = target;
+    }
+  }
+  while (*p && !isspace(*p))
+    p++;            // What is not a number, like "?" in "W:?"
+  return true;
+}
+
+bool PrinterResponse::parseCenti(const char *&p, int32_t &value) {
+  const char *q = p;
+  const bool negative = *q == '-';
+  if (*q == '-' || *q == '+')
+    q++;
+
+  bool digits = false;
+  int32_t whole = 0;
+  for (; isDigit(*q); q++, digits = true)
+    if (whole < 10000000)
+      whole = whole * 10 + *q - '0';
+  int32_t fraction = 0;
+  if (*q == '.') {
+    // Two decimals, rounded by the third
+    for (uint8_t decimal = 0; isDigit(*++q); decimal++, digits = true) {
+      if (decimal == 0)
+        fraction += (*q - '0') * 10;
+      else if (decimal == 1)
+        fraction += *q - '0';
+      else if (decimal == 2 && *q >= '5')
+        fraction++;
+    }
+  }
+  if (!digits)
+    return false;
+
+  value = negative ? -(whole * 100 + fraction) : whole * 100 + fraction;
+  p = q;
+  return true;
+}
+
+bool PrinterResponse::parseTemperatures(const char *line, TemperatureReport &report) {
+  ResponseWord word;
+  while (nextWord(line, word)) {
+    if (!word.hasValue || word.length == 0)
+      continue;
+
+    int sensor = -1;
+    switch (word.label[0]) {
+      case 'T':
+        if (word.length == 1)
+          sensor = TemperatureReport::ACTIVE;
+        else if (isDigit(word.label[1]) && word.length <= 3) {
+          const int tool = atoi(word.label + 1);
+          if (tool < RESPONSE_MAX_TOOLS)
+            sensor = TemperatureReport::TOOL0 + tool;
+        }
+        break;
+      case 'B':
+        if (word.length == 1)
+          sensor = TemperatureReport::BED;
+        else if (word.is("B@"))
+          report.bedPower = word.value / 100;
+        break;
+      case 'C':
+        if (word.length == 1)
+          sensor = TemperatureReport::CHAMBER;
+        break;
+      case 'P':
+        if (word.length == 1)
+          sensor = TemperatureReport::PROBE;
+        break;
+      case '@':
+        if (word.length == 1)
+          report.activePower = word.value / 100;    // "@0:" and the like of each tool are not kept
+        break;
+      case 'E':
+        if (word.length == 1 && word.value >= 0 && word.value < 12800 && word.value % 100 == 0)
+          report.heatingTool = word.value / 100;
+        break;
+    }
+    if (sensor < 0)
+      continue;
+
+    Temperature &temperature = sensor == TemperatureReport::ACTIVE ? report.active :
+                               sensor == TemperatureReport::BED ? report.bed :
+                               sensor == TemperatureReport::CHAMBER ? report.chamber :
+                               sensor == TemperatureReport::PROBE ? report.probe :
+                               report.tools[sensor - TemperatureReport::TOOL0];
+    temperature.actual = word.value;
+    report.found |= 1 << sensor;
+    if (word.hasTarget) {
+      temperature.target = word.target;
+      report.targets |= 1 << sensor;
+    }
+  }
+
+  return report.found != 0;
+}
+
+bool PrinterResponse::parsePosition(const char *line, PositionReport &report) {
+  static const char axes[] = "XYZE";
+  uint8_t found = 0;
+  ResponseWord word;
+  while (nextWord(line, word) && !word.is("Count")) {
+    if (!word.hasValue || word.length != 1)
+      continue;
+    const char *axis = strchr(axes, word.label[0]);
+    if (axis && *axis) {
+      report.position[axis - axes] = word.value;
+      found |= 1 << (axis - axes);
+    }
+  }
+
+  return found == 0x0f;
+}
+
+bool ResponseLines::push(char ch) {
+  if (complete) {
+    // The line before was used
+    length = 0;
+    complete = truncated = false;
+  }
+  if (ch == '\r')
+    return false;
+  if (ch != '\n') {
+    if (length < RESPONSE_LINE_LENGTH)
+      line[length++] = ch;
+    else
+      truncated = true;
+    return false;
+  }
+
+  line[length] = '\0';
+  complete = true;
+  if (truncated)
+    ++truncatedCount;
+  char *kept = recent[count++ % RESPONSE_RECENT_LINES];
+  strncpy(kept, line, RESPONSE_RECENT_LENGTH);
+  kept[RESPONSE_RECENT_LENGTH] = '\0';
+  return true;
+}
+
+void ResponseLines::discard() {
+  length = 0;
+  complete = truncated = false;
+  line[0] = '\0';
+}
+
+const char *ResponseLines::getRecent(uint8_t n) const {
+  if (n >= RESPONSE_RECENT_LINES || n >= count)
+    return nullptr;
+  return recent[(count - 1 - n) % RESPONSE_RECENT_LINES];
+}
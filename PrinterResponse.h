@@ -0,0 +1,139 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define RESPONSE_MAX_TOOLS  8         // T0: to T7: of a temperature report
+#define RESPONSE_LINE_LENGTH 255      // Characters of a printer line that are kept, the rest is dropped
+#define RESPONSE_RECENT_LINES 4       // Last lines kept for the status
+#define RESPONSE_RECENT_LENGTH 95     // Characters kept of each of them
+
+#include <Arduino.h>
+
+// Centi-degrees
+struct Temperature {
+  int actual, target;
+};
+
+// The sensors of a temperature report like
+// ok T:210.52 /215.00 B:60.20 /60.00 C:30.10 /0.00 P:28.40 /0.00 T0:210.52 /215.00 @:127 B@:0
+struct TemperatureReport {
+  enum Sensor : uint8_t {
+    ACTIVE, BED, CHAMBER, PROBE,      // T:, B:, C:, P:
+    TOOL0                             // T0:, T1: is TOOL0 + 1...
+  };
+
+  Temperature active, bed, chamber, probe;
+  Temperature tools[RESPONSE_MAX_TOOLS];
+  int16_t activePower = -1, bedPower = -1;  // @: and B@:, -1 when not reported
+  int8_t heatingTool = -1;            // E: of the Prusa reports while heating, -1 when not reported
+  uint16_t found = 0, targets = 0;    // Bits of the sensors read, and of the ones with a target
+
+  inline bool has(uint8_t sensor) const {
+    return found & (1 << sensor);
+  }
+
+  inline bool hasTarget(uint8_t sensor) const {
+    return targets & (1 << sensor);
+  }
+};
+
+// Hundredths of mm of an M114 report like
+// X:-33.00 Y:-10.00 Z:5.00 E:37.95 Count X:-3300 Y:-1000 Z:2000
+struct PositionReport {
+  int32_t position[4];                // X, Y, Z and E
+};
+
+// What a line from the printer is, told by how it starts
+enum class ResponseType : uint8_t {
+  Other,
+  Ok,                                 // "ok", also a line ending in it
+  Busy,                               // "echo:busy: processing"
+  Error,                              // "Error:...", "!! ..." of Klipper
+  Resend,                             // "Resend: 12", "rs N12"
+  Wait,                               // "wait", idle with nothing to do
+  Action,                             // "//action:pause", "// action:pause" and the like, for the host
+  Temperature,                        // "T:...", " T:...", "B:...", to be parsed
+  Position,                           // "X:...", to be parsed
+  MeatPack,                           // "[MP] PV01 ON ESP"
+  ColdExtrusion,                      // "echo: cold extrusion prevented"
+  UnknownCommand                      // "echo:Unknown command: \"...\""
+};
+
+// How the lines of a type start. Several of a type are fine, a longer prefix
+// goes before a shorter one starting the same.
+struct ResponsePrefix {
+  const char *text;
+  uint8_t length;
+  ResponseType type;
+};
+
+#define RESPONSE_PREFIX(text, type) { text, sizeof(text) - 1, ResponseType::type }
+
+// Parsers of the printer responses, in one pass over the line and without
+// allocating: the values go straight to fixed point.
+class PrinterResponse {
+  public:
+    // By the count prefixes of a firmware, checked only when their first byte matches
+    static ResponseType classify(const char *line, uint16_t length, const ResponsePrefix *prefixes, uint8_t count);
+    // Temperatures of a line, false if it has none
+    static bool parseTemperatures(const char *line, TemperatureReport &report);
+    // The position before "Count", false if it does not have all the axes
+    static bool parsePosition(const char *line, PositionReport &report);
+    // A decimal number in hundredths, rounded, moving p after it. False if there are no digits.
+    static bool parseCenti(const char *&p, int32_t &value);
+};
+
+// Assembles the lines received from the printer in a fixed buffer, so a
+// stream of echo lines does not grow or fragment the heap, and keeps the
+// last ones for the status. Longer lines are cut and counted.
+class ResponseLines {
+  private:
+    char line[RESPONSE_LINE_LENGTH + 1] = "";
+    uint16_t length = 0;
+    bool complete = false, truncated = false;
+    char recent[RESPONSE_RECENT_LINES][RESPONSE_RECENT_LENGTH + 1];
+    uint32_t count = 0;               // Lines received
+    uint32_t truncatedCount = 0;
+
+  public:
+    // Adds a received character, true when it ends a line
+    bool push(char ch);
+    // Drops the line being received
+    void discard();
+
+    // The last line ended, without its end of line
+    inline const char *getLine() const {
+      return line;
+    }
+
+    inline uint16_t getLength() const {
+      return length;
+    }
+
+    // It was longer than RESPONSE_LINE_LENGTH
+    inline bool isTruncated() const {
+      return truncated;
+    }
+
+    inline uint32_t getTruncatedCount() const {
+      return truncatedCount;
+    }
+
+    // Line n counted back from the last one, nullptr if it is not kept
+    const char *getRecent(uint8_t n) const;
+};
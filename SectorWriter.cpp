@@ -0,0 +1,91 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "SectorWriter.h"
+
+void SectorWriter::begin(const FileWrapper &outFile) {
+  file = outFile;
+  length = 0;
+  size = unsynced = 0;
+  syncTime = millis();
+  failed = false;
+}
+
+size_t SectorWriter::write(const uint8_t *data, size_t len) {
+  if (!file)
+    return 0;
+
+  size_t done = 0;
+  while (done < len) {
+    size_t n;
+    if (length == 0 && len - done >= WRITE_SECTOR_SIZE) {
+      // Whole sectors go to the card from data, without a copy
+      n = (len - done) / WRITE_SECTOR_SIZE * WRITE_SECTOR_SIZE;
+      writeOut(data + done, n);
+    }
+    else {
+      n = min((size_t)(WRITE_BUFFER_SIZE - length), len - done);
+      memcpy(buffer + length, data + done, n);
+      length += n;
+      if (length == WRITE_BUFFER_SIZE) {
+        writeOut(buffer, length);
+        length = 0;
+      }
+    }
+    done += n;
+  }
+  size += len;
+
+  if (unsynced >= WRITE_SYNC_BYTES || (unsynced > 0 && millis() - syncTime >= WRITE_SYNC_MS))
+    sync();
+
+  return failed ? 0 : len;
+}
+
+void SectorWriter::writeOut(const uint8_t *data, size_t len) {
+  if (file.write(data, len) != len)
+    failed = true;
+  unsynced += len;
+}
+
+void SectorWriter::sync() {
+  file.flush();
+  unsynced = 0;
+  syncTime = millis();
+}
+
+bool SectorWriter::flush() {
+  if (!file)
+    return false;
+
+  if (length > 0) {
+    writeOut(buffer, length);
+    length = 0;
+  }
+  sync();
+
+  return !failed;
+}
+
+bool SectorWriter::close() {
+  bool ok = flush();
+  if (ok && file.size() > size)
+    ok = file.truncate(size);
+  file.close();
+
+  return ok;
+}
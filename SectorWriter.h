@@ -0,0 +1,57 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define WRITE_SECTOR_SIZE 512
+#define WRITE_BUFFER_SIZE 2048        // Whole sectors written at a time
+#define WRITE_SYNC_BYTES  65536       // Directory entry and FAT updated after this many bytes...
+#define WRITE_SYNC_MS     2000        // ...or this time, not on every write
+
+#include "FileWrapper.h"
+
+// Writes a file that is being received in pieces of any size. The pieces are
+// gathered in a buffer so the card is written in whole aligned sectors, and
+// synced only now and then and at the end.
+class SectorWriter {
+  private:
+    FileWrapper file;
+    uint8_t buffer[WRITE_BUFFER_SIZE];
+    uint16_t length = 0;
+    uint32_t size = 0, unsynced = 0, syncTime = 0;
+    bool failed = false;
+
+    void writeOut(const uint8_t *data, size_t len);
+    void sync();
+
+  public:
+    // The file is written from its position, a sector boundary
+    void begin(const FileWrapper &outFile);
+    size_t write(const uint8_t *data, size_t len);
+    // Writes what is buffered and syncs, false when something could not be written
+    bool flush();
+    // Also truncates a preallocated file to what was written
+    bool close();
+
+    inline operator bool() {
+      return file;
+    }
+
+    inline FileWrapper &getFile() {
+      return file;
+    }
+};
@@ -23,8 +23,10 @@ StorageFS storageFS;
 
 bool StorageFS::hasSD;
 unsigned int StorageFS::maxPathLength;
+uint32_t StorageFS::clusterSize;
+uint32_t StorageFS::freeClusters;
 
-FileWrapper StorageFS::open(const String path, const char *openMode) {
+FileWrapper StorageFS::open(const String path, const char *openMode, uint32_t preallocate) {
   FileWrapper file;
 
   /*if (openMode == NULL || openMode[0] == '\0')
@@ -32,10 +34,21 @@ FileWrapper StorageFS::open(const String path, const char *openMode) {
 
   if (hasSD) {
     #if defined(ESP8266)
+      uint32_t oldSize = 0;   // Its clusters are freed
+      if (openMode[0] == 'w' && file.sdFile.open(path.c_str(), sdfat::FILE_READ)) {
+        oldSize = file.sdFile.isFile() ? file.sdFile.fileSize() : 0;
+        file.sdFile.close();
+      }
+      if (openMode[0] == 'w' && preallocate > 0) {
+        SD.remove(path.c_str());   // It has to be a new file
+        file.sdFile.createContiguous(path.c_str(), preallocate);
+      }
       // NOTE: Needs improvement
-      file.sdFile.open(path.c_str(), openMode[0] == 'w' 
-                                                   ? (sdfat::O_WRITE | sdfat::O_CREAT | sdfat::O_TRUNC) :
+      if (!file.sdFile)
+        file.sdFile.open(path.c_str(), openMode[0] == 'w' 
+                                                   ? (sdfat::O_WRITE | sdfat::O_CREAT | sdfat::O_TRUNC | (openMode[1] == '+' ? sdfat::O_READ : 0)) :
                                 openMode[0] == 'a' ? (sdfat::O_WRITE | sdfat::O_CREAT | sdfat::O_APPEND | sdfat::O_SYNC) : 
+                                openMode[1] == '+' ? sdfat::O_RDWR :
                                                       sdfat::FILE_READ);
       file.sdFile.dateTimeCallback([](uint16_t* date, uint16_t* time) {
         uint16_t year = 2023;
@@ -56,6 +69,12 @@ FileWrapper StorageFS::open(const String path, const char *openMode) {
     
       if (file.sdFile && file.sdFile.isDir())
         file.sdFile.rewind();
+      else if (file.sdFile && (openMode[0] != 'r' || openMode[1] == '+')) {
+        // Charged as it is now, and again as it is at close()
+        resized(oldSize, file.sdFile.fileSize());
+        file.written = true;
+        file.charged = file.sdFile.fileSize();
+      }
     #elif defined(ESP32)
       file.sdFile = SD.open(path, openMode);
     #endif
@@ -77,8 +96,15 @@ FileWrapper StorageFS::open(const String path, const char *openMode) {
 }
 
 bool StorageFS::remove(const String filename) {
-  if (hasSD)
-    return SD.remove(filename.c_str());
+  if (hasSD) {
+    FileWrapper file = open(filename);
+    const uint32_t size = file && !file.isDirectory() ? file.size() : 0;
+    file.close();
+    if (!SD.remove(filename.c_str()))
+      return false;
+    resized(size, 0);
+    return true;
+  }
   /*else if (hasSPIFFS)
     SPIFFS.remove(filename);*/
   return false;
@@ -92,3 +118,41 @@ bool StorageFS::rename(const String filename, const String newfilename) {
     SPIFFS.rename(filename, newfilename);*/
   return false;
 }
+
+bool StorageFS::mkdir(const String path) {
+  if (hasSD && SD.mkdir(path.c_str())) {
+    resized(0, 1);   // Its first cluster of entries
+    return true;
+  }
+  return false;
+}
+
+uint64_t StorageFS::getFreeSpace() {
+  #if defined(ESP8266)
+    if (hasSD)
+      return (uint64_t)freeClusters * clusterSize;
+  #elif defined(ESP32)
+    if (hasSD)
+      return SD.totalBytes() - SD.usedBytes();   // FatFs keeps the count of free clusters
+  #endif
+  return 0;
+}
+
+void StorageFS::resized(uint32_t oldSize, uint32_t newSize) {
+  if (!clusterSize)
+    return;
+  const uint32_t oldClusters = ((uint64_t)oldSize + clusterSize - 1) / clusterSize;
+  const uint32_t newClusters = ((uint64_t)newSize + clusterSize - 1) / clusterSize;
+  if (newClusters > oldClusters)
+    freeClusters -= min(freeClusters, newClusters - oldClusters);
+  else
+    freeClusters += oldClusters - newClusters;
+}
+
+bool StorageFS::readSectors(uint32_t sector, uint8_t *data, size_t count) {
+  #if defined(ESP8266)
+    if (hasSD)
+      return SD.card()->readBlocks(sector, data, count);
+  #endif
+  return false;
+}
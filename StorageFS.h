@@ -26,6 +26,8 @@ class StorageFS {
   private:
     static bool hasSD;
     static unsigned int maxPathLength;
+    static uint32_t clusterSize;
+    static uint32_t freeClusters;       // Counted at mount, then kept as the files written change size
 
   public:
     inline static void begin(const bool fastSD) {
@@ -37,6 +39,11 @@ class StorageFS {
       #endif
       if (hasSD)
         maxPathLength = 255;
+      #if defined(ESP8266)
+        // Scanning the FAT takes seconds on a big card, it is only done here
+        clusterSize = hasSD ? SD.blocksPerCluster() * 512 : 0;
+        freeClusters = hasSD ? SD.freeClusterCount() : 0;
+      #endif
       /*else {
         #if defined(ESP8266)
           hasSPIFFS = SPIFFS.begin();
@@ -75,9 +82,16 @@ class StorageFS {
       return hasSD;
     }
 
-    static FileWrapper open(const String path, const char *openMode = "r");
+    // With preallocate, a "w" file is created in consecutive clusters of that size, to be truncated at the end
+    static FileWrapper open(const String path, const char *openMode = "r", uint32_t preallocate = 0);
     static bool remove(const String filename);
     static bool rename(const String filename, const String newfilename);
+    static bool mkdir(const String path);
+    static uint64_t getFreeSpace();
+    // A file written or removed went from oldSize to newSize bytes
+    static void resized(uint32_t oldSize, uint32_t newSize);
+    // Reads sectors of the card, bypassing the file system
+    static bool readSectors(uint32_t sector, uint8_t *data, size_t count);
 };
 
 extern StorageFS storageFS;
@@ -68,3 +68,21 @@ inline void telnetSend(const String line) {
    telnetClient.println(line);
 #endif
 }
+
+// Same as above without building a String, for every line received from the printer
+inline void telnetSend(const char *line) {
+#ifndef DISABLE_TELNET
+  if (telnetClient && telnetClient.connected())
+    telnetClient.println(line);
+#endif
+}
+
+// And for every line sent to it
+inline void telnetSend(const char prefix, const char *line) {
+#ifndef DISABLE_TELNET
+  if (telnetClient && telnetClient.connected()) {
+    telnetClient.print(prefix);
+    telnetClient.println(line);
+  }
+#endif
+}
@@ -0,0 +1,152 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "UploadQueue.h"
+
+bool UploadQueue::begin(AsyncClient *tcpClient, const String &name, size_t length) {
+  uint8_t *const data = isActive() ? nullptr : (uint8_t *)malloc(UPLOAD_QUEUE_SIZE);
+  if (!data) {
+    lock();
+    refused = tcpClient;
+    unlock();
+    return false;
+  }
+
+  filename = name;
+  contentLength = length;
+  lock();
+  buffer = data;
+  head = tail = 0;
+  owner = client = tcpClient;
+  refused = nullptr;
+  holding = complete = failed = false;
+  waiting = nullptr;
+  active = true;
+  unlock();
+
+  return true;
+}
+
+bool UploadQueue::push(const AsyncClient *tcpClient, const uint8_t *data, size_t len) {
+  lock();
+  const bool dropped = failed || !active || owner != tcpClient;
+  const bool fits = len <= UPLOAD_QUEUE_SIZE - (tail - head);
+  const size_t at = tail % UPLOAD_QUEUE_SIZE;
+  const uint32_t room = UPLOAD_QUEUE_SIZE - (tail - head) - (fits ? len : 0);
+  failed |= !dropped && !fits;
+  unlock();
+  if (dropped)
+    return true;
+  if (!fits)
+    return false;
+
+  const size_t first = min(len, (size_t)UPLOAD_QUEUE_SIZE - at);
+  memcpy(buffer + at, data, first);
+  memcpy(buffer, data + first, len - first);
+
+  lock();
+  tail += len;
+  // A whole window in flight has to fit in what is left
+  if (client && room < UPLOAD_TCP_WINDOW) {
+    client->ackLater();
+    holding = true;
+  }
+  unlock();
+
+  return true;
+}
+
+void UploadQueue::finish(const AsyncClient *tcpClient) {
+  lock();
+  if (active && owner == tcpClient)
+    complete = true;
+  unlock();
+}
+
+void UploadQueue::disconnect(AsyncClient *tcpClient) {
+  lock();
+  if (active && owner == tcpClient) {
+    client = nullptr;
+    waiting = nullptr;
+    failed |= !complete;
+    complete = true;
+  }
+  unlock();
+}
+
+bool UploadQueue::isRefused(const AsyncClient *tcpClient) {
+  lock();
+  const bool is = refused && refused == tcpClient;
+  unlock();
+  return is;
+}
+
+bool UploadQueue::respondLater(AsyncWebServerRequest *request) {
+  lock();
+  const bool later = active && owner == request->client();
+  if (later)
+    waiting = request;
+  unlock();
+  return later;
+}
+
+size_t UploadQueue::size() {
+  lock();
+  const size_t n = tail - head;
+  unlock();
+  return n;
+}
+
+size_t UploadQueue::peek(const uint8_t *&data) {
+  const size_t at = head % UPLOAD_QUEUE_SIZE;
+  data = buffer + at;
+  return min(size(), (size_t)UPLOAD_QUEUE_SIZE - at);
+}
+
+void UploadQueue::pop(size_t len) {
+  lock();
+  head += min(len, (size_t)(tail - head));
+  AsyncClient *const held = holding && UPLOAD_QUEUE_SIZE - (tail - head) >= UPLOAD_TCP_WINDOW ? client : nullptr;
+  if (held)
+    holding = false;
+  unlock();
+
+  // Everything put off, the TCP layer caps it to the lengths it kept
+  if (held)
+    held->ack(SIZE_MAX);
+}
+
+void UploadQueue::fail() {
+  lock();
+  failed = true;
+  unlock();
+  pop(SIZE_MAX);
+}
+
+AsyncWebServerRequest *UploadQueue::end() {
+  lock();
+  AsyncWebServerRequest *const request = waiting;
+  uint8_t *const data = buffer;
+  buffer = nullptr;
+  active = false;
+  owner = client = nullptr;
+  waiting = nullptr;
+  head = tail = 0;
+  unlock();
+  free(data);
+  return request;
+}
@@ -0,0 +1,121 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#define UPLOAD_QUEUE_SIZE 8192        // Received bytes waiting to be written to the card, from the heap while an upload runs
+#define UPLOAD_TCP_WINDOW 5840        // lwIP TCP_WND, bytes the sender can have in flight
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+
+// Bytes of an upload received by the TCP callbacks, until loop() writes them
+// to the card. Segments are acknowledged only while the queue has room for a
+// whole window more, so the sender waits instead of overflowing it. The TCP
+// layer keeps the lengths of the segments put off, form headers included, and
+// they are all acknowledged once there is room again.
+//
+// The callbacks push and loop() peeks and pops. On ESP32 they run in different
+// tasks: the indices and the state change in a critical section, and the bytes
+// between the indices belong to one side only.
+class UploadQueue {
+  private:
+    uint8_t *buffer = nullptr;
+    uint32_t head = 0, tail = 0;      // Bytes taken and pushed since begin()
+    const AsyncClient *owner = nullptr;         // Of the upload, the bytes of others are not taken
+    const AsyncClient *refused = nullptr;       // Of the last upload begin() did not take
+    AsyncClient *client = nullptr;              // To acknowledge, until its connection closes
+    AsyncWebServerRequest *waiting = nullptr;   // Answered once the upload is written
+    bool holding = false;             // Segments of client are not acknowledged yet
+    bool active = false;              // From begin() until loop() calls end()
+    bool complete = false;            // No more bytes will come
+    bool failed = false;              // The bytes are dropped, the upload will not be stored
+    #ifdef ESP32
+      portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    #endif
+
+    inline void lock() {
+      #ifdef ESP32
+        portENTER_CRITICAL(&mux);
+      #endif
+    }
+
+    inline void unlock() {
+      #ifdef ESP32
+        portEXIT_CRITICAL(&mux);
+      #endif
+    }
+
+  public:
+    // Set by begin(), then only read until end()
+    String filename;
+    size_t contentLength = 0;
+
+    // From the TCP callbacks
+
+    // Starts an upload from tcpClient, nullptr if unknown. False when the last
+    // one is still being written or there is no heap for the queue.
+    bool begin(AsyncClient *tcpClient, const String &name, size_t length);
+    // False, and the upload fails, when the bytes of tcpClient do not fit. Once
+    // it failed they are dropped.
+    bool push(const AsyncClient *tcpClient, const uint8_t *data, size_t len);
+    // The last bytes of tcpClient were pushed
+    void finish(const AsyncClient *tcpClient);
+    // The connection of tcpClient is closed, the upload fails if it did not end
+    void disconnect(AsyncClient *tcpClient);
+    // The last upload of tcpClient was not taken
+    bool isRefused(const AsyncClient *tcpClient);
+    // Keeps request to be answered by loop() once the upload is written, false
+    // when it already was
+    bool respondLater(AsyncWebServerRequest *request);
+
+    // From loop()
+
+    // Gives the first bytes, as many as are consecutive in the buffer
+    size_t peek(const uint8_t *&data);
+    // Drops the first len bytes, and acknowledges the held segments when a window fits
+    void pop(size_t len);
+    // Drops the bytes from now on
+    void fail();
+    // Frees the queue once the upload is written or dropped, returns the
+    // request waiting for the response if any
+    AsyncWebServerRequest *end();
+
+    inline bool isActive() {
+      lock();
+      const bool is = active;
+      unlock();
+      return is;
+    }
+
+    // No more bytes will come: they were all pushed, or the connection closed
+    inline bool isComplete() {
+      lock();
+      const bool is = complete;
+      unlock();
+      return is;
+    }
+
+    inline bool isFailed() {
+      lock();
+      const bool is = failed;
+      unlock();
+      return is;
+    }
+
+    size_t size();
+};
@@ -0,0 +1,53 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Plays the role of NeoWirelessPrinting.ino for the host build: the same
+// globals and defines, without HomeThingManager (WiFi, OTA, MDNS).
+// Include it from exactly one translation unit per binary.
+
+#pragma once
+
+#include <Arduino.h>
+
+#define DISABLE_LOGGING
+#define DISABLE_TELNET
+#define DISABLE_WEBOFTHINGS
+
+#include <ESPDateTime.h>
+#include <ESPAsyncWebServer.h>
+#include <ArduinoJson.h>
+#include <WiFiClient.h>
+
+// Global vars
+uint32_t ms = 0; // Milliseconds saved on this var
+
+AsyncWebServer webServer(80);
+
+class HostWiFiService {
+  public:
+    inline IPAddress getCurrentIP() { return IPAddress(192, 168, 4, 1); }
+};
+HostWiFiService WiFiService;
+
+#include "../Telnet.hpp"
+#include "../Printer.hpp"
+
+// One pass of loop(), without ThingManager.handle()
+inline void NativeLoop() {
+  ms = millis();
+  PrinterHandle();
+}
@@ -0,0 +1,509 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PrinterSimulator.h"
+#include "MeatPack.h"
+
+#define NS_PER_US 1000ULL
+#define NS_PER_MS 1000000ULL
+#define NS_PER_S  1000000000ULL
+
+PrinterSimulator::PrinterSimulator(HardwareSerial &serial, const Config &config) : serial(serial), cfg(config) {
+  byteNs = 10 * NS_PER_S / cfg.baud;   // 8N1
+  now = HostClock::getMicros() * NS_PER_US;
+  resetStats();
+}
+
+void PrinterSimulator::resetStats() {
+  st = Stats();
+  printNs = idleNs = gapNs = plannerBlockNs = 0;
+  printStarted = false;
+}
+
+PrinterSimulator::Stats PrinterSimulator::stats() const {
+  Stats s = st;
+  s.printUs = printNs / NS_PER_US;
+  s.idleUs = idleNs / NS_PER_US;
+  s.plannerBlockUs = plannerBlockNs / NS_PER_US;
+  return s;
+}
+
+void PrinterSimulator::update() {
+  // What the firmware wrote since the last update leaves now; at another baud it is garbage
+  const std::string written = serial.takeWritten();
+  if (serial.baudRate() == cfg.baud) {
+    for (const char c : written) {
+      inFreeNs = max(inFreeNs, now) + byteNs;
+      inFlight.emplace_back(inFreeNs, (uint8_t)c);
+    }
+  }
+
+  advanceTo(HostClock::getMicros() * NS_PER_US);
+}
+
+void PrinterSimulator::send(const std::string &text) {
+  for (const char c : text) {
+    outFreeNs = max(outFreeNs, now) + byteNs;
+    outFlight.emplace_back(outFreeNs, (uint8_t)c);
+  }
+}
+
+// As Marlin ok_to_send(): the command being acknowledged still counts in B, and
+// N is the line number of the command at the read index of the buffer, which for
+// the ok after a Resend is the next one to run (or the last one run if none)
+void PrinterSimulator::sendOk(const bool resend) {
+  if (!cfg.advancedOk) {
+    send("ok\n");
+    return;
+  }
+  int32_t number = currentLineNumber;
+  if (resend && !processing && !blocking && !commandLineNumbers.empty())
+    number = commandLineNumbers.front();
+  char str[48];
+  int len = snprintf(str, sizeof(str), "ok");
+  if (number >= 0)
+    len += snprintf(str + len, sizeof(str) - len, " N%d", (int)number);
+  snprintf(str + len, sizeof(str) - len, " P%d B%d\n", (int)(cfg.plannerDepth - planner.size()),
+           (int)(cfg.bufsize - commandQueue.size() - 1));
+  send(str);
+}
+
+std::string PrinterSimulator::temperatureReport() const {
+  char str[96];
+  snprintf(str, sizeof(str), "T:%.2f /%.2f B:%.2f /%.2f @:0 B@:0",
+           hotend.actual, hotend.target, bed.actual, bed.target);
+  return str;
+}
+
+void PrinterSimulator::advanceTo(const uint64_t t) {
+  for (;;) {
+    // Everything that happens at once
+    receive();
+    if (!processing && !blocking && !isHalted)
+      startCommand();
+    if (!moving && !planner.empty())
+      startBlock();
+    while (!outFlight.empty() && outFlight.front().first <= now) {
+      const uint8_t c = outFlight.front().second;
+      serial.inject(&c, 1);
+      outFlight.pop_front();
+      st.bytesSent++;
+    }
+
+    const uint64_t next = nextEvent();
+    if (next > t)
+      break;
+    integrate(next - now);
+    now = next;
+
+    // Timed events
+    if (processing && processDoneNs <= now)
+      finishCommand();
+    if (moving && blockDoneNs <= now) {
+      planner.pop_front();
+      moving = false;
+      st.moves++;
+      printNs = now - firstMoveNs;
+    }
+    if (blocking && blockingDoneNs <= now) {
+      blocking = heatingWait = false;
+      sendOk();
+    }
+    else if (blocking && nextBusyNs <= now) {
+      send(heatingWait ? " " + temperatureReport() + " W:?\n" : "echo:busy: processing\n");
+      nextBusyNs = now + (heatingWait ? NS_PER_S : cfg.busyIntervalMs * NS_PER_MS);
+    }
+    if (autoreportMs && nextAutoreportNs <= now) {
+      send(" " + temperatureReport() + "\n");
+      nextAutoreportNs = now + autoreportMs * NS_PER_MS;
+    }
+  }
+
+  integrate(t - now);
+  now = t;
+}
+
+uint64_t PrinterSimulator::nextEvent() const {
+  uint64_t next = UINT64_MAX;
+  if (!inFlight.empty())
+    next = min(next, inFlight.front().first);
+  if (!outFlight.empty())
+    next = min(next, outFlight.front().first);
+  if (processing)
+    next = min(next, processDoneNs);
+  if (moving)
+    next = min(next, blockDoneNs);
+  if (blocking)
+    next = min(next, min(blockingDoneNs, nextBusyNs));
+  if (autoreportMs)
+    next = min(next, nextAutoreportNs);
+  return max(next, now);
+}
+
+void PrinterSimulator::integrate(const uint64_t dt) {
+  if (!dt)
+    return;
+  if (printStarted) {
+    if (!moving && !blocking && planner.empty())
+      gapNs += dt;
+    plannerBlockNs += planner.size() * dt;
+  }
+
+  const float step = cfg.heatRate * dt / NS_PER_S;
+  for (Heater *h : { &hotend, &bed }) {
+    const float goal = h->target > 0 ? h->target : 20.0;
+    h->actual = h->actual < goal ? min(h->actual + step, goal) : max(h->actual - step, goal);
+  }
+}
+
+void PrinterSimulator::receive() {
+  while (!inFlight.empty() && inFlight.front().first <= now) {
+    st.bytesReceived++;
+    uint8_t c = inFlight.front().second;
+    const bool corrupt = cfg.corruptEvery && st.bytesReceived % cfg.corruptEvery == 0;
+    if (corrupt)
+      c ^= 1 << (st.bytesReceived / cfg.corruptEvery % 8);
+    if (rxBuffer.size() >= cfg.rxBufferSize)
+      st.rxOverflows++;
+    else {
+      rxBuffer.push_back(c);
+      rxCorrupt.push_back(corrupt);
+    }
+    inFlight.pop_front();
+  }
+
+  // Like get_serial_commands(): only while there is room in the command queue
+  while (!rxBuffer.empty() && commandQueue.size() + (processing || blocking ? 1 : 0) < cfg.bufsize) {
+    const uint8_t c = rxBuffer.front();
+    const bool corrupt = rxCorrupt.front();
+    rxBuffer.pop_front();
+    rxCorrupt.pop_front();
+    receiveByte(c, corrupt);
+  }
+}
+
+// As MeatPack::handle_rx_char(): two signal bytes and a command, or data
+void PrinterSimulator::receiveByte(const uint8_t c, const bool corrupt) {
+  if (!cfg.meatPack) {
+    lineChar(c, corrupt);
+    return;
+  }
+  if (c == MEATPACK_SIGNAL) {
+    if (mpSignals) {
+      mpCommandNext = true;
+      mpSignals = 0;
+    }
+    else
+      ++mpSignals;
+    return;
+  }
+  if (mpCommandNext) {
+    mpCommandNext = false;
+    if (c == MeatPack::EnablePacking)
+      mpActive = true;
+    else if (c == MeatPack::DisablePacking || c == MeatPack::ResetAll) {
+      mpActive = false;
+      mpLiterals = mpSecond = 0;
+    }
+    send(std::string("[MP] PV01 ") + (mpActive ? "ON" : "OFF") + " ESP\n");
+    return;
+  }
+  if (mpSignals) {
+    mpSignals = 0;
+    unpack(MEATPACK_SIGNAL, corrupt);   // A single one is two unpacked characters
+  }
+  unpack(c, corrupt);
+}
+
+// As MeatPack::handle_rx_char_inner()
+void PrinterSimulator::unpack(const uint8_t c, const bool corrupt) {
+  static const char table[] = "0123456789. \nGX";
+  if (!mpActive) {
+    lineChar(c, corrupt);
+    return;
+  }
+  if (mpLiterals) {
+    lineChar(c, corrupt);
+    if (mpSecond) {
+      lineChar(mpSecond, corrupt);
+      mpSecond = 0;
+    }
+    --mpLiterals;
+    return;
+  }
+  const uint8_t low = c & 0xF, high = c >> 4;
+  if (low == 0xF) {
+    ++mpLiterals;
+    if (high == 0xF)
+      ++mpLiterals;
+    else
+      mpSecond = table[high];
+  }
+  else {
+    lineChar(table[low], corrupt);
+    if (table[low] != '\n') {
+      if (high == 0xF)
+        ++mpLiterals;
+      else
+        lineChar(table[high], corrupt);
+    }
+  }
+}
+
+void PrinterSimulator::lineChar(const char c, const bool corrupt) {
+  if (c != '\n') {
+    lineBuffer += c;
+    lineCorrupt.push_back(corrupt);
+    return;
+  }
+
+  std::string line;
+  line.swap(lineBuffer);
+  const size_t executed = min(line.find('*'), line.size());   // The checksum and what follows it are not run
+  const bool corruptLine = std::find(lineCorrupt.begin(), lineCorrupt.begin() + executed, true) != lineCorrupt.begin() + executed;
+  lineCorrupt.clear();
+  if (!checkLine(line))
+    return;
+  if (corruptLine)
+    st.corruptCommands++;
+
+  const size_t comment = line.find(';');
+  if (comment != std::string::npos)
+    line.erase(comment);
+  while (!line.empty() && isspace((unsigned char)line.back()))
+    line.pop_back();
+  if (!line.empty()) {
+    commandQueue.push_back(line);
+    commandLineNumbers.push_back(receivedLineNumber);
+  }
+}
+
+// Like Marlin get_serial_commands(): validates and strips "N<line> " and "*<checksum>".
+// A bad line is answered with Error, Resend and ok, dropping what was in the RX buffer.
+bool PrinterSimulator::checkLine(std::string &line) {
+  const size_t star = line.find('*');
+  const char *error = nullptr;
+  receivedLineNumber = -1;
+  if (line[0] == 'N') {
+    const uint32_t number = strtoul(line.c_str() + 1, nullptr, 10);
+    if (number != lastLineNumber + 1 && line.find("M110") == std::string::npos)
+      error = "Line Number is not Last Line Number+1, Last Line: ";
+    else if (star == std::string::npos)
+      error = "No Checksum with line number, Last Line: ";
+    else {
+      uint8_t checksum = 0;
+      for (size_t i = 0; i < star; i++)
+        checksum ^= line[i];
+      if (checksum != strtoul(line.c_str() + star + 1, nullptr, 10))
+        error = "checksum mismatch, Last Line: ";
+    }
+    if (!error) {
+      lastLineNumber = receivedLineNumber = number;
+      const size_t space = line.find(' ');
+      line.erase(0, space == std::string::npos ? line.size() : space + 1);
+    }
+  }
+  else if (star != std::string::npos)
+    error = "No Line Number with checksum, Last Line: ";
+
+  if (error) {
+    send("Error:" + std::string(error) + std::to_string(lastLineNumber) + "\n");
+    rxBuffer.clear();
+    rxCorrupt.clear();
+    send("Resend: " + std::to_string(lastLineNumber + 1) + "\n");
+    sendOk(true);
+    st.resends++;
+    return false;
+  }
+  const size_t checksum = line.find('*');
+  if (checksum != std::string::npos)
+    line.erase(checksum);
+  return true;
+}
+
+static bool isCommand(const std::string &line, const char *code) {
+  const size_t n = strlen(code);
+  return line.compare(0, n, code) == 0 && (line.size() == n || !isdigit((unsigned char)line[n]));
+}
+
+void PrinterSimulator::startCommand() {
+  if (commandQueue.empty())
+    return;
+  const std::string &line = commandQueue.front();
+  const bool move = isCommand(line, "G0") || isCommand(line, "G1") || isCommand(line, "G2") || isCommand(line, "G3");
+  const bool sync = isCommand(line, "G28") || isCommand(line, "G29") || isCommand(line, "G4") || isCommand(line, "M400") ||
+                    isCommand(line, "M109") || isCommand(line, "M190");
+  if (move && planner.size() >= cfg.plannerDepth)
+    return;
+  if (sync && (moving || !planner.empty()))
+    return;
+
+  current = line;
+  currentLineNumber = commandLineNumbers.front();
+  commandQueue.pop_front();
+  commandLineNumbers.pop_front();
+  processing = true;
+  processDoneNs = now + cfg.commandTimeUs * NS_PER_US;
+}
+
+void PrinterSimulator::startBlock() {
+  if (!printStarted) {
+    printStarted = true;
+    firstMoveNs = now;
+  }
+  else if (gapNs) {
+    idleNs += gapNs;
+    st.starvations++;
+  }
+  gapNs = 0;
+  moving = true;
+  blockDoneNs = now + planner.front();
+}
+
+void PrinterSimulator::startBlocking(const uint64_t duration, const bool heating) {
+  // Time waiting for this command to arrive was the printer starving too
+  if (printStarted && gapNs) {
+    idleNs += gapNs;
+    st.starvations++;
+  }
+  gapNs = 0;
+  blocking = true;
+  heatingWait = heating;
+  blockingDoneNs = now + duration;
+  nextBusyNs = now + (heating ? NS_PER_S : cfg.busyIntervalMs * NS_PER_MS);
+}
+
+bool PrinterSimulator::parseParam(const std::string &line, const char letter, float &value) {
+  for (size_t i = 1; i < line.size(); i++) {
+    if (line[i] == letter && line[i - 1] == ' ') {
+      value = atof(line.c_str() + i + 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t PrinterSimulator::moveDuration(const std::string &line, const bool absolute) {
+  static const char axes[] = { 'X', 'Y', 'Z', 'E' };
+  float delta[4] = { 0, 0, 0, 0 };
+  float value;
+  for (int i = 0; i < 4; i++) {
+    if (parseParam(line, axes[i], value)) {
+      const bool abs = i == 3 ? absolute && !relativeE : absolute;
+      delta[i] = abs ? value - pos[i] : value;
+      pos[i] += delta[i];
+    }
+  }
+  if (parseParam(line, 'F', value) && value > 0)
+    feedrate = value;
+
+  if (cfg.moveTimeUs)
+    return cfg.moveTimeUs * NS_PER_US;
+  float distance = sqrtf(delta[0]*delta[0] + delta[1]*delta[1] + delta[2]*delta[2]);
+  if (distance == 0)
+    distance = fabsf(delta[3]);
+  return (uint64_t)(distance / (feedrate / 60.0) * NS_PER_S);
+}
+
+void PrinterSimulator::finishCommand() {
+  processing = false;
+  st.commands++;
+  if (cfg.errorAtCommand >= 0 && st.commands == (uint32_t)cfg.errorAtCommand) {
+    send("Error:Printer halted. kill() called!\n");
+    isHalted = true;
+    return;
+  }
+
+  const std::string &line = current;
+  float value;
+  if (isCommand(line, "G0") || isCommand(line, "G1") || isCommand(line, "G2") || isCommand(line, "G3")) {
+    planner.push_back(moveDuration(line, !relative));
+    sendOk();
+  }
+  else if (isCommand(line, "G28")) {
+    pos[0] = pos[1] = pos[2] = 0;
+    startBlocking(cfg.homeTimeMs * NS_PER_MS, false);
+  }
+  else if (isCommand(line, "G29"))
+    startBlocking(2 * cfg.homeTimeMs * NS_PER_MS, false);
+  else if (isCommand(line, "G4")) {
+    uint64_t duration = 0;
+    if (parseParam(line, 'P', value))
+      duration = value * NS_PER_MS;
+    else if (parseParam(line, 'S', value))
+      duration = value * NS_PER_S;
+    startBlocking(duration, false);
+  }
+  else if (isCommand(line, "M109") || isCommand(line, "M190")) {
+    Heater &h = line[2] == '0' ? hotend : bed;
+    if (parseParam(line, 'S', value) || parseParam(line, 'R', value))
+      h.target = value;
+    const float goal = h.target > 0 ? h.target : 20.0;
+    startBlocking(fabsf(goal - h.actual) / cfg.heatRate * NS_PER_S, true);
+  }
+  else if (isCommand(line, "M104") || isCommand(line, "M140")) {
+    if (parseParam(line, 'S', value))
+      (line[2] == '0' ? hotend : bed).target = value;
+    sendOk();
+  }
+  else if (isCommand(line, "M105"))
+    send("ok " + temperatureReport() + "\n");
+  else if (isCommand(line, "M155")) {
+    autoreportMs = parseParam(line, 'S', value) ? value * 1000 : 0;
+    nextAutoreportNs = now + autoreportMs * NS_PER_MS;
+    sendOk();
+  }
+  else if (isCommand(line, "M115")) {
+    char str[512];
+    snprintf(str, sizeof(str),
+      "FIRMWARE_NAME:Marlin 2.0.9.3 (Simulated) SOURCE_CODE_URL:github.com/MarlinFirmware/Marlin PROTOCOL_VERSION:1.0 "
+      "MACHINE_TYPE:%s EXTRUDER_COUNT:%d UUID:cede2a2f-41a2-4748-9b12-c55c62f367ff\n"
+      "Cap:SERIAL_XON_XOFF:0\n"
+      "Cap:EEPROM:1\n"
+      "Cap:AUTOREPORT_TEMP:%d\n"
+      "Cap:PROGRESS:%d\n"
+      "Cap:PRINT_JOB:1\n"
+      "Cap:BUILD_PERCENT:%d\n"
+      "Cap:SOFTWARE_POWER:0\n"
+      "Cap:ARCS:1\n"
+      "Cap:MEATPACK:%d\n",
+      cfg.machineType, cfg.extruders, cfg.autoreportTempCap, cfg.progressCap, cfg.buildPercentCap, cfg.meatPack);
+    send(str);
+    sendOk();
+  }
+  else {
+    if (isCommand(line, "G90"))
+      relative = relativeE = false;
+    else if (isCommand(line, "G91"))
+      relative = relativeE = true;
+    else if (isCommand(line, "M82"))
+      relativeE = false;
+    else if (isCommand(line, "M83"))
+      relativeE = true;
+    else if (isCommand(line, "M110") && parseParam(line, 'N', value))
+      lastLineNumber = value;
+    else if (line[0] != 'G' && line[0] != 'M' && line[0] != 'T')
+      send("echo:Unknown command: \"" + line + "\"\n");
+    else if (isCommand(line, "G92")) {
+      static const char axes[] = { 'X', 'Y', 'Z', 'E' };
+      for (int i = 0; i < 4; i++)
+        if (parseParam(line, axes[i], value))
+          pos[i] = value;
+    }
+    sendOk();
+  }
+}
@@ -0,0 +1,160 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// A Marlin-like printer on the other end of the host Serial.
+//
+// Bytes travel at the configured baud in both directions. Received bytes wait
+// in an RX buffer until there is room in the BUFSIZE command queue, then they
+// are unpacked if MeatPack is on and gathered into lines; commands are
+// processed one at a time and moves go to a planner of BLOCK_BUFFER_SIZE
+// blocks that executes them in real (virtual) time. "ok" is sent when a
+// command has been processed, so a full planner delays it, as on the real
+// firmware. Call update() after every loop() pass.
+
+#pragma once
+
+#include <Arduino.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+class PrinterSimulator {
+  public:
+    struct Config {
+      const char *machineType = "Simulated Marlin";
+      uint8_t extruders = 1;
+      bool autoreportTempCap = true;
+      bool progressCap = false;
+      bool buildPercentCap = false;
+      bool advancedOk = true;            // ADVANCED_OK: "ok P<planner free> B<buffer free>"
+      bool meatPack = false;             // MEATPACK_ON_SERIAL_PORT_1, reported as Cap:MEATPACK
+
+      uint32_t baud = 115200;
+      uint16_t rxBufferSize = 128;       // RX_BUFFER_SIZE
+      uint8_t bufsize = 4;               // BUFSIZE, commands waiting to be processed including the current one
+      uint8_t plannerDepth = 16;         // BLOCK_BUFFER_SIZE
+
+      uint32_t commandTimeUs = 500;      // Parsing and planning one command
+      uint32_t moveTimeUs = 0;           // Fixed time per move, 0 to use distance and feedrate
+      uint32_t homeTimeMs = 5000;        // G28
+      float heatRate = 5.0;              // Degrees per second, up or down
+      uint32_t busyIntervalMs = 2000;    // HOST_KEEPALIVE_INTERVAL
+
+      int32_t errorAtCommand = -1;       // Halt with "Error:" when processing this command number
+      uint32_t corruptEvery = 0;         // Flip a bit of every Nth received byte, 0 for a clean line
+    };
+
+    struct Stats {
+      uint32_t commands;                 // Processed commands (those acknowledged with ok)
+      uint32_t moves;                    // Moves executed by the planner
+      uint64_t printUs;                  // From the first move start to the last move end
+      uint64_t idleUs;                   // Planner empty between moves, not counting blocking commands
+      uint32_t starvations;              // Times the planner ran dry and later got more moves
+      uint64_t plannerBlockUs;           // Integral of planner blocks over time, for the average fill
+      uint32_t rxOverflows;              // Bytes lost because the RX buffer was full
+      uint32_t resends;                  // Lines rejected by line number or checksum and asked again
+      uint32_t corruptCommands;          // Commands executed with a corrupted byte
+      uint32_t bytesReceived, bytesSent;
+    };
+
+    PrinterSimulator(HardwareSerial &serial, const Config &config);
+    PrinterSimulator(HardwareSerial &serial) : PrinterSimulator(serial, Config()) {}
+
+    void update();
+    void resetStats();
+    Stats stats() const;
+
+    inline bool halted() const { return isHalted; }
+    inline size_t plannerBlocks() const { return planner.size(); }
+    inline float hotendTemperature() const { return hotend.actual; }
+
+  private:
+    struct Heater {
+      float actual = 20.0, target = 0.0;
+    };
+    typedef std::deque<std::pair<uint64_t, uint8_t>> Wire;   // Arrival time (ns) of each byte
+
+    HardwareSerial &serial;
+    Config cfg;
+    Stats st;
+    uint64_t printNs, idleNs, gapNs, plannerBlockNs;
+
+    uint64_t now = 0;                    // ns
+    uint64_t byteNs;
+
+    // ESP -> printer
+    Wire inFlight;
+    uint64_t inFreeNs = 0;
+    std::deque<uint8_t> rxBuffer;
+    std::deque<bool> rxCorrupt;          // For each byte in rxBuffer
+    std::string lineBuffer;              // The line being received
+    std::vector<bool> lineCorrupt;
+    uint32_t lastLineNumber = 0;
+
+    // MeatPack decoder, as Marlin meatpack.cpp
+    bool mpActive = false, mpCommandNext = false;
+    uint8_t mpSignals = 0, mpLiterals = 0;
+    char mpSecond = 0;
+    std::deque<std::string> commandQueue;
+    std::deque<int32_t> commandLineNumbers;  // -1 for the commands received without one
+
+    // Command being processed
+    std::string current;
+    int32_t currentLineNumber = -1, receivedLineNumber = -1;
+    bool processing = false;
+    uint64_t processDoneNs = 0;
+    bool blocking = false, heatingWait = false;
+    uint64_t blockingDoneNs = 0, nextBusyNs = 0;
+
+    // Planner, each block is its duration. The front one is executing.
+    std::deque<uint64_t> planner;
+    bool moving = false;
+    uint64_t blockDoneNs = 0;
+    bool printStarted = false;
+    uint64_t firstMoveNs = 0;
+
+    // Machine state
+    float pos[4] = { 0, 0, 0, 0 };
+    float feedrate = 1500;
+    bool relative = false, relativeE = false;
+    Heater hotend, bed;
+    uint32_t autoreportMs = 0;
+    uint64_t nextAutoreportNs = 0;
+    bool isHalted = false;
+
+    // printer -> ESP
+    Wire outFlight;
+    uint64_t outFreeNs = 0;
+
+    void send(const std::string &text);
+    void sendOk(bool resend = false);
+    std::string temperatureReport() const;
+    void advanceTo(uint64_t t);
+    uint64_t nextEvent() const;
+    void integrate(uint64_t dt);
+    void receive();
+    void receiveByte(uint8_t c, bool corrupt);
+    void unpack(uint8_t c, bool corrupt);
+    void lineChar(char c, bool corrupt);
+    bool checkLine(std::string &line);
+    void startCommand();
+    void finishCommand();
+    void startBlock();
+    void startBlocking(uint64_t duration, bool heating);
+    uint64_t moveDuration(const std::string &line, bool absolute);
+    static bool parseParam(const std::string &line, char letter, float &value);
+};
@@ -0,0 +1,329 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host (Linux) stand-in for the ESP8266 Arduino core.
+// Only what the printer logic uses is here, with the same semantics as the core.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <string>
+
+using std::min;
+using std::max;
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define LOW   0
+#define HIGH  1
+
+// Virtual clock: millis() only moves when the test or benchmark says so
+class HostClock {
+  private:
+    static uint64_t nowMicros;
+  public:
+    static inline uint32_t get() { return nowMicros / 1000; }
+    static inline void set(const uint32_t value) { nowMicros = (uint64_t)value * 1000; }
+    static inline void advance(const uint32_t value) { nowMicros += (uint64_t)value * 1000; }
+    static inline uint64_t getMicros() { return nowMicros; }
+    static inline void advanceMicros(const uint64_t value) { nowMicros += value; }
+};
+
+inline uint32_t millis() { return HostClock::get(); }
+inline uint32_t micros() { return HostClock::getMicros(); }
+inline void delay(const unsigned long value) { HostClock::advance(value); }
+inline void yield() {}
+
+inline bool isDigit(const int c) { return isdigit(c) != 0; }
+inline bool isAlpha(const int c) { return isalpha(c) != 0; }
+inline bool isSpace(const int c) { return isspace(c) != 0; }
+
+class String {
+  private:
+    std::string buffer;
+    static char dummy;
+
+    static std::string fromInteger(unsigned long long value, const bool negative, const unsigned char base) {
+      char str[66];
+      char *p = str + sizeof(str) - 1;
+      *p = '\0';
+      do {
+        const int digit = value % base;
+        *--p = digit < 10 ? '0' + digit : 'a' + digit - 10;
+        value /= base;
+      } while (value);
+      if (negative)
+        *--p = '-';
+      return std::string(p);
+    }
+
+    static std::string fromSigned(const long long value, const unsigned char base) {
+      if (base == DEC)
+        return fromInteger(value < 0 ? -(unsigned long long)value : value, value < 0, base);
+      return fromInteger((unsigned long)value, false, base);
+    }
+
+    static std::string fromDouble(const double value, const unsigned char decimalPlaces) {
+      char str[64];
+      snprintf(str, sizeof(str), "%.*f", decimalPlaces, value);
+      return std::string(str);
+    }
+
+  public:
+    String(const char *cstr = "") : buffer(cstr ? cstr : "") {}
+    String(const char *cstr, const size_t length) : buffer(cstr, length) {}
+    String(const std::string &str) : buffer(str) {}
+    explicit String(const char c) : buffer(1, c) {}
+    explicit String(const unsigned char value, const unsigned char base = DEC) : buffer(fromInteger(value, false, base)) {}
+    explicit String(const int value, const unsigned char base = DEC) : buffer(fromSigned(value, base)) {}
+    explicit String(const unsigned int value, const unsigned char base = DEC) : buffer(fromInteger(value, false, base)) {}
+    explicit String(const long value, const unsigned char base = DEC) : buffer(fromSigned(value, base)) {}
+    explicit String(const unsigned long value, const unsigned char base = DEC) : buffer(fromInteger(value, false, base)) {}
+    explicit String(const long long value, const unsigned char base = DEC) : buffer(fromSigned(value, base)) {}
+    explicit String(const unsigned long long value, const unsigned char base = DEC) : buffer(fromInteger(value, false, base)) {}
+    explicit String(const float value, const unsigned char decimalPlaces = 2) : buffer(fromDouble(value, decimalPlaces)) {}
+    explicit String(const double value, const unsigned char decimalPlaces = 2) : buffer(fromDouble(value, decimalPlaces)) {}
+
+    inline unsigned int length() const { return buffer.length(); }
+    inline bool isEmpty() const { return buffer.empty(); }
+    inline const char *c_str() const { return buffer.c_str(); }
+    inline const char *begin() const { return buffer.c_str(); }
+    inline const char *end() const { return buffer.c_str() + buffer.length(); }
+    inline bool reserve(const unsigned int size) { buffer.reserve(size); return true; }
+
+    inline char charAt(const unsigned int index) const { return index < buffer.length() ? buffer[index] : 0; }
+    inline void setCharAt(const unsigned int index, const char c) { if (index < buffer.length()) buffer[index] = c; }
+    inline char operator[](const unsigned int index) const { return charAt(index); }
+    inline char &operator[](const unsigned int index) {
+      if (index >= buffer.length()) {
+        dummy = 0;
+        return dummy;
+      }
+      return buffer[index];
+    }
+
+    inline bool concat(const String &str) { buffer += str.buffer; return true; }
+    inline bool concat(const char *cstr) { if (cstr) buffer += cstr; return true; }
+    inline bool concat(const char *cstr, const unsigned int length) { buffer.append(cstr, length); return true; }
+    inline bool concat(const char c) { buffer += c; return true; }
+    template<typename T> inline bool concat(const T value) { return concat(String(value)); }
+
+    template<typename T> inline String &operator+=(const T &value) { concat(value); return *this; }
+
+    inline int compareTo(const String &str) const { return buffer.compare(str.buffer); }
+    inline bool equals(const String &str) const { return buffer == str.buffer; }
+    inline bool equals(const char *cstr) const { return buffer == (cstr ? cstr : ""); }
+    inline bool equalsIgnoreCase(const String &str) const {
+      return buffer.length() == str.buffer.length() && strcasecmp(buffer.c_str(), str.buffer.c_str()) == 0;
+    }
+    inline bool operator==(const String &str) const { return equals(str); }
+    inline bool operator==(const char *cstr) const { return equals(cstr); }
+    inline bool operator!=(const String &str) const { return !equals(str); }
+    inline bool operator!=(const char *cstr) const { return !equals(cstr); }
+    inline bool operator<(const String &str) const { return compareTo(str) < 0; }
+
+    inline bool startsWith(const String &prefix, const unsigned int offset = 0) const {
+      return offset + prefix.length() <= length() && buffer.compare(offset, prefix.length(), prefix.buffer) == 0;
+    }
+    inline bool endsWith(const String &suffix) const {
+      return suffix.length() <= length() && buffer.compare(length() - suffix.length(), suffix.length(), suffix.buffer) == 0;
+    }
+
+    inline int indexOf(const char c, const unsigned int fromIndex = 0) const {
+      const size_t pos = buffer.find(c, fromIndex);
+      return pos == std::string::npos ? -1 : (int)pos;
+    }
+    inline int indexOf(const String &str, const unsigned int fromIndex = 0) const {
+      if (fromIndex >= length())
+        return -1;
+      const size_t pos = buffer.find(str.buffer, fromIndex);
+      return pos == std::string::npos ? -1 : (int)pos;
+    }
+    inline int lastIndexOf(const char c) const { return lastIndexOf(c, length() - 1); }
+    inline int lastIndexOf(const char c, const unsigned int fromIndex) const {
+      if (fromIndex >= length())
+        return -1;
+      const size_t pos = buffer.rfind(c, fromIndex);
+      return pos == std::string::npos ? -1 : (int)pos;
+    }
+    inline int lastIndexOf(const String &str) const { return lastIndexOf(str, length() - str.length()); }
+    inline int lastIndexOf(const String &str, const unsigned int fromIndex) const {
+      if (str.length() == 0 || str.length() > length() || fromIndex >= length())
+        return -1;
+      const size_t pos = buffer.rfind(str.buffer, fromIndex);
+      return pos == std::string::npos ? -1 : (int)pos;
+    }
+
+    inline String substring(const unsigned int beginIndex) const { return substring(beginIndex, length()); }
+    inline String substring(unsigned int left, unsigned int right) const {
+      if (left > right)
+        std::swap(left, right);
+      if (left >= length())
+        return String();
+      if (right > length())
+        right = length();
+      return String(buffer.substr(left, right - left));
+    }
+
+    inline void replace(const char find, const char replace) { std::replace(buffer.begin(), buffer.end(), find, replace); }
+    inline void replace(const String &find, const String &replace) {
+      if (find.length() == 0)
+        return;
+      size_t pos = 0;
+      while ((pos = buffer.find(find.buffer, pos)) != std::string::npos) {
+        buffer.replace(pos, find.length(), replace.buffer);
+        pos += replace.length();
+      }
+    }
+    inline void remove(const unsigned int index) { if (index < length()) buffer.erase(index); }
+    inline void remove(const unsigned int index, const unsigned int count) { if (index < length()) buffer.erase(index, count); }
+    inline void toLowerCase() { for (char &c : buffer) c = tolower(c); }
+    inline void toUpperCase() { for (char &c : buffer) c = toupper(c); }
+    inline void trim() {
+      const size_t first = buffer.find_first_not_of(" \t\r\n\f\v");
+      if (first == std::string::npos) {
+        buffer.clear();
+        return;
+      }
+      buffer = buffer.substr(first, buffer.find_last_not_of(" \t\r\n\f\v") - first + 1);
+    }
+
+    inline long toInt() const { return atol(buffer.c_str()); }
+    inline float toFloat() const { return atof(buffer.c_str()); }
+    inline double toDouble() const { return atof(buffer.c_str()); }
+
+    inline void toCharArray(char *buf, const unsigned int bufsize, const unsigned int index = 0) const {
+      if (!bufsize || !buf)
+        return;
+      if (index >= length()) {
+        buf[0] = 0;
+        return;
+      }
+      const unsigned int n = min(bufsize - 1, length() - index);
+      memcpy(buf, buffer.c_str() + index, n);
+      buf[n] = 0;
+    }
+
+    friend inline String operator+(const String &lhs, const String &rhs) { return String(lhs.buffer + rhs.buffer); }
+    friend inline String operator+(const String &lhs, const char *rhs) { return String(lhs.buffer + rhs); }
+    friend inline String operator+(const char *lhs, const String &rhs) { return String(lhs + rhs.buffer); }
+    friend inline String operator+(const String &lhs, const char rhs) { return String(lhs.buffer + rhs); }
+    friend inline String operator+(const String &lhs, const int rhs) { return lhs + String(rhs); }
+    friend inline String operator+(const String &lhs, const unsigned int rhs) { return lhs + String(rhs); }
+    friend inline String operator+(const String &lhs, const long rhs) { return lhs + String(rhs); }
+    friend inline String operator+(const String &lhs, const unsigned long rhs) { return lhs + String(rhs); }
+    friend inline String operator+(const String &lhs, const float rhs) { return lhs + String(rhs); }
+    friend inline String operator+(const String &lhs, const double rhs) { return lhs + String(rhs); }
+    friend inline bool operator==(const char *lhs, const String &rhs) { return rhs.equals(lhs); }
+    friend inline bool operator!=(const char *lhs, const String &rhs) { return !rhs.equals(lhs); }
+};
+
+class Print {
+  public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size) {
+      size_t n = 0;
+      while (size--)
+        n += write(*buffer++);
+      return n;
+    }
+    inline size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+    inline size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+
+    inline size_t print(const String &s) { return write((const uint8_t *)s.c_str(), s.length()); }
+    inline size_t print(const char *str) { return write(str); }
+    inline size_t print(const char c) { return write((uint8_t)c); }
+    template<typename T> inline size_t print(const T value, const int base = DEC) { return print(String(value, base)); }
+    inline size_t print(const double value, const int digits = 2) { return print(String(value, digits)); }
+
+    inline size_t println() { return write("\r\n"); }
+    template<typename T> inline size_t println(const T &value) { size_t n = print(value); return n + println(); }
+    template<typename T> inline size_t println(const T value, const int base) { size_t n = print(value, base); return n + println(); }
+
+    size_t printf(const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+};
+
+class Stream : public Print {
+  protected:
+    unsigned long _timeout = 1000;
+
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    inline void setTimeout(const unsigned long timeout) { _timeout = timeout; }
+
+    inline size_t readBytes(char *buffer, size_t length) {
+      size_t count = 0;
+      int c;
+      while (count < length && (c = read()) >= 0)
+        buffer[count++] = (char)c;
+      return count;
+    }
+
+    // There is no real device behind these so a negative read() is the end of data, not a timeout
+    inline String readString() {
+      String ret;
+      int c;
+      while ((c = read()) >= 0)
+        ret += (char)c;
+      return ret;
+    }
+
+    inline String readStringUntil(const char terminator) {
+      String ret;
+      int c;
+      while ((c = read()) >= 0 && (char)c != terminator)
+        ret += (char)c;
+      return ret;
+    }
+};
+
+class EspClass {
+  public:
+    uint32_t freeHeap = 40000;
+
+    inline uint32_t getFreeHeap() { return freeHeap; }
+    inline uint32_t getChipId() { return 0x00c0ffee; }
+    inline void restart() {}
+};
+
+extern EspClass ESP;
+
+#include "HardwareSerial.h"
+#include "MD5Builder.h"
@@ -0,0 +1,391 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Small heap based JSON tree with the ArduinoJson 6 syntax used by the sketch.
+// Reading a missing member does not create it, assigning does.
+
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+struct JsonNode {
+  enum Type { Null, Bool, Integer, Float, Text, Array, Object } type = Null;
+  bool boolean = false;
+  long long integer = 0;
+  double real = 0;
+  std::string text;
+  std::vector<std::pair<std::string, std::shared_ptr<JsonNode>>> members;
+  std::vector<std::shared_ptr<JsonNode>> items;
+
+  JsonNode *member(const std::string &key, const bool create) {
+    if (type == Object) {
+      for (auto &m : members)
+        if (m.first == key)
+          return m.second.get();
+    }
+    if (!create)
+      return nullptr;
+    if (type != Object) {
+      *this = JsonNode();
+      type = Object;
+    }
+    members.emplace_back(key, std::make_shared<JsonNode>());
+    return members.back().second.get();
+  }
+
+  JsonNode *item(const size_t index, const bool create) {
+    if (type == Array && index < items.size())
+      return items[index].get();
+    if (!create)
+      return nullptr;
+    if (type != Array) {
+      *this = JsonNode();
+      type = Array;
+    }
+    while (items.size() <= index)
+      items.push_back(std::make_shared<JsonNode>());
+    return items[index].get();
+  }
+
+  void serialize(std::string &out) const {
+    char str[32];
+    switch (type) {
+      case Null: out += "null"; break;
+      case Bool: out += boolean ? "true" : "false"; break;
+      case Integer: snprintf(str, sizeof(str), "%lld", integer); out += str; break;
+      case Float: snprintf(str, sizeof(str), "%.9g", real); out += str; break;
+      case Text:
+        out += '"';
+        for (char c : text) {
+          switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default: out += c;
+          }
+        }
+        out += '"';
+        break;
+      case Array:
+        out += '[';
+        for (size_t i = 0; i < items.size(); i++) {
+          if (i) out += ',';
+          items[i]->serialize(out);
+        }
+        out += ']';
+        break;
+      case Object:
+        out += '{';
+        for (size_t i = 0; i < members.size(); i++) {
+          if (i) out += ',';
+          out += '"' + members[i].first + "\":";
+          members[i].second->serialize(out);
+        }
+        out += '}';
+        break;
+    }
+  }
+};
+
+class JsonVariant {
+  protected:
+    std::function<JsonNode *(bool)> resolve;
+
+  public:
+    JsonVariant() : resolve([](bool) { return (JsonNode *)nullptr; }) {}
+    explicit JsonVariant(std::function<JsonNode *(bool)> resolver) : resolve(resolver) {}
+
+    inline JsonVariant operator[](const char *key) const {
+      auto parent = resolve;
+      std::string k(key);
+      return JsonVariant([parent, k](bool create) -> JsonNode * {
+        JsonNode *node = parent(create);
+        return node ? node->member(k, create) : nullptr;
+      });
+    }
+    inline JsonVariant operator[](const String &key) const { return (*this)[key.c_str()]; }
+    inline JsonVariant operator[](const int index) const {
+      auto parent = resolve;
+      return JsonVariant([parent, index](bool create) -> JsonNode * {
+        JsonNode *node = parent(create);
+        return node ? node->item(index, create) : nullptr;
+      });
+    }
+
+    template<typename T> JsonVariant &operator=(const T &value) {
+      JsonNode *node = resolve(true);
+      *node = JsonNode();
+      if constexpr (std::is_same<T, bool>::value) {
+        node->type = JsonNode::Bool;
+        node->boolean = value;
+      } else if constexpr (std::is_integral<T>::value || std::is_enum<T>::value) {
+        node->type = JsonNode::Integer;
+        node->integer = value;
+      } else if constexpr (std::is_floating_point<T>::value) {
+        node->type = JsonNode::Float;
+        node->real = value;
+      } else if constexpr (std::is_same<T, String>::value) {
+        node->type = JsonNode::Text;
+        node->text = value.c_str();
+      } else if constexpr (std::is_convertible<T, const char *>::value) {
+        node->type = JsonNode::Text;
+        node->text = value;
+      } else {
+        static_assert(std::is_base_of<JsonVariant, T>::value, "unsupported JSON value");
+        const JsonNode *src = value.resolve(false);
+        if (src)
+          *node = *src;
+      }
+      return *this;
+    }
+    inline JsonVariant &operator=(const JsonVariant &value) { return operator=<JsonVariant>(value); }
+    JsonVariant(const JsonVariant &) = default;
+
+    inline bool isNull() const { return resolve(false) == nullptr || resolve(false)->type == JsonNode::Null; }
+    inline size_t size() const {
+      const JsonNode *node = resolve(false);
+      return !node ? 0 : node->type == JsonNode::Array ? node->items.size() : node->members.size();
+    }
+
+    inline operator const char *() const {
+      const JsonNode *node = resolve(false);
+      return node && node->type == JsonNode::Text ? node->text.c_str() : nullptr;
+    }
+    inline operator String() const {
+      const JsonNode *node = resolve(false);
+      if (!node)
+        return String("null");
+      if (node->type == JsonNode::Text)
+        return String(node->text.c_str());
+      std::string out;
+      node->serialize(out);
+      return String(out.c_str());
+    }
+    inline long long asInteger() const {
+      const JsonNode *node = resolve(false);
+      return !node ? 0 : node->type == JsonNode::Integer ? node->integer :
+                         node->type == JsonNode::Float ? (long long)node->real :
+                         node->type == JsonNode::Bool ? node->boolean : 0;
+    }
+    inline double asFloat() const {
+      const JsonNode *node = resolve(false);
+      return node && node->type == JsonNode::Float ? node->real : asInteger();
+    }
+
+    template<typename T> T as() const {
+      if constexpr (std::is_same<T, String>::value)
+        return operator String();
+      else if constexpr (std::is_same<T, const char *>::value)
+        return operator const char *();
+      else if constexpr (std::is_same<T, bool>::value)
+        return asInteger() != 0;
+      else if constexpr (std::is_integral<T>::value)
+        return (T)asInteger();
+      else if constexpr (std::is_floating_point<T>::value)
+        return (T)asFloat();
+      else
+        return T(resolve);
+    }
+
+    friend inline bool operator==(const JsonVariant &lhs, const String &rhs) {
+      const char *str = lhs;
+      return str && rhs == str;
+    }
+    friend inline bool operator==(const JsonVariant &lhs, const char *rhs) { return lhs == String(rhs); }
+
+    class iterator {
+      private:
+        std::function<JsonNode *(bool)> parent;
+        size_t index;
+      public:
+        iterator(std::function<JsonNode *(bool)> p, size_t i) : parent(p), index(i) {}
+        inline bool operator!=(const iterator &other) const { return index != other.index; }
+        inline iterator &operator++() { ++index; return *this; }
+        inline JsonVariant operator*() const { return JsonVariant(parent)[(int)index]; }
+    };
+    inline iterator begin() const { return iterator(resolve, 0); }
+    inline iterator end() const {
+      const JsonNode *node = resolve(false);
+      return iterator(resolve, node && node->type == JsonNode::Array ? node->items.size() : 0);
+    }
+
+    inline std::string serialize() const {
+      std::string out;
+      const JsonNode *node = resolve(false);
+      if (node)
+        node->serialize(out);
+      else
+        out = "null";
+      return out;
+    }
+};
+
+typedef JsonVariant JsonObject;
+typedef JsonVariant JsonArray;
+
+class DynamicJsonDocument : public JsonVariant {
+  private:
+    std::shared_ptr<JsonNode> root;
+    size_t _capacity;
+
+  public:
+    DynamicJsonDocument(const size_t capacity) : root(std::make_shared<JsonNode>()), _capacity(capacity) {
+      JsonNode *node = root.get();
+      resolve = [node](bool) { return node; };
+    }
+    DynamicJsonDocument(const DynamicJsonDocument &) = delete;
+
+    inline size_t capacity() const { return _capacity; }
+    inline void clear() { *root = JsonNode(); }
+    inline JsonNode &node() { return *root; }
+};
+
+class DeserializationError {
+  public:
+    enum Code { Ok, EmptyInput, IncompleteInput, InvalidInput } code;
+
+    DeserializationError(const Code c = Ok) : code(c) {}
+    inline explicit operator bool() const { return code != Ok; }
+    inline const char *c_str() const {
+      static const char *names[] = { "Ok", "EmptyInput", "IncompleteInput", "InvalidInput" };
+      return names[code];
+    }
+};
+
+class JsonParser {
+  private:
+    const char *p, *end;
+
+    inline void skip() { while (p < end && isspace((unsigned char)*p)) ++p; }
+
+    DeserializationError::Code parseString(std::string &out) {
+      ++p;
+      while (p < end && *p != '"') {
+        char c = *p++;
+        if (c == '\\' && p < end) {
+          c = *p++;
+          switch (c) {
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'u': p = min(p + 4, end); c = '?'; break;
+          }
+        }
+        out += c;
+      }
+      if (p >= end)
+        return DeserializationError::IncompleteInput;
+      ++p;
+      return DeserializationError::Ok;
+    }
+
+  public:
+    JsonParser(const char *text, const size_t length) : p(text), end(text + length) {}
+
+    DeserializationError::Code parse(JsonNode &node) {
+      skip();
+      if (p >= end)
+        return DeserializationError::IncompleteInput;
+      DeserializationError::Code err;
+      if (*p == '{') {
+        node.type = JsonNode::Object;
+        ++p;
+        skip();
+        if (p < end && *p == '}') { ++p; return DeserializationError::Ok; }
+        while (p < end) {
+          skip();
+          if (p >= end || *p != '"')
+            return DeserializationError::InvalidInput;
+          std::string key;
+          if ((err = parseString(key)))
+            return err;
+          skip();
+          if (p >= end || *p++ != ':')
+            return DeserializationError::InvalidInput;
+          node.members.emplace_back(key, std::make_shared<JsonNode>());
+          if ((err = parse(*node.members.back().second)))
+            return err;
+          skip();
+          if (p < end && *p == ',') { ++p; continue; }
+          if (p < end && *p == '}') { ++p; return DeserializationError::Ok; }
+          return p >= end ? DeserializationError::IncompleteInput : DeserializationError::InvalidInput;
+        }
+        return DeserializationError::IncompleteInput;
+      }
+      if (*p == '[') {
+        node.type = JsonNode::Array;
+        ++p;
+        skip();
+        if (p < end && *p == ']') { ++p; return DeserializationError::Ok; }
+        while (p < end) {
+          node.items.push_back(std::make_shared<JsonNode>());
+          if ((err = parse(*node.items.back())))
+            return err;
+          skip();
+          if (p < end && *p == ',') { ++p; continue; }
+          if (p < end && *p == ']') { ++p; return DeserializationError::Ok; }
+          return p >= end ? DeserializationError::IncompleteInput : DeserializationError::InvalidInput;
+        }
+        return DeserializationError::IncompleteInput;
+      }
+      if (*p == '"') {
+        node.type = JsonNode::Text;
+        return parseString(node.text);
+      }
+      if (end - p >= 4 && strncmp(p, "true", 4) == 0) { node.type = JsonNode::Bool; node.boolean = true; p += 4; return DeserializationError::Ok; }
+      if (end - p >= 5 && strncmp(p, "false", 5) == 0) { node.type = JsonNode::Bool; p += 5; return DeserializationError::Ok; }
+      if (end - p >= 4 && strncmp(p, "null", 4) == 0) { p += 4; return DeserializationError::Ok; }
+      std::string number;
+      while (p < end && (isdigit((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.' || *p == 'e' || *p == 'E'))
+        number += *p++;
+      if (number.empty())
+        return DeserializationError::InvalidInput;
+      if (number.find_first_of(".eE") != std::string::npos) {
+        node.type = JsonNode::Float;
+        node.real = atof(number.c_str());
+      } else {
+        node.type = JsonNode::Integer;
+        node.integer = atoll(number.c_str());
+      }
+      return DeserializationError::Ok;
+    }
+};
+
+inline DeserializationError deserializeJson(DynamicJsonDocument &doc, const String &input) {
+  doc.clear();
+  if (input.length() == 0)
+    return DeserializationError(DeserializationError::EmptyInput);
+  JsonParser parser(input.c_str(), input.length());
+  return DeserializationError(parser.parse(doc.node()));
+}
+
+inline size_t serializeJson(const JsonVariant &doc, Print &output) {
+  const std::string text = doc.serialize();
+  return output.write((const uint8_t *)text.c_str(), text.length());
+}
+
+inline size_t serializeJson(const JsonVariant &doc, String &output) {
+  output = String(doc.serialize().c_str());
+  return output.length();
+}
@@ -0,0 +1,321 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// In-process stand-in for ESPAsyncWebServer: the routes registered by the
+// sketch are kept and a test can run a request through them, including the
+// chunked upload callbacks, and read back what would have been sent.
+
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+#include <memory>
+#include <vector>
+
+enum WebRequestMethod {
+  HTTP_GET     = 0b00000001,
+  HTTP_POST    = 0b00000010,
+  HTTP_DELETE  = 0b00000100,
+  HTTP_PUT     = 0b00001000,
+  HTTP_PATCH   = 0b00010000,
+  HTTP_HEAD    = 0b00100000,
+  HTTP_OPTIONS = 0b01000000,
+  HTTP_ANY     = 0b01111111,
+};
+typedef uint8_t WebRequestMethodComposite;
+
+class AsyncWebServerRequest;
+
+// Receiving side of the connection: the segments whose acknowledgement was
+// put off with ackLater() keep the sender's window closed until ack().
+class AsyncClient {
+  private:
+    bool _ackPcb = true;
+    size_t _rxAckLen = 0;
+
+  public:
+    inline void ackLater() { _ackPcb = false; }
+    inline size_t ack(size_t len) {
+      if (len > _rxAckLen)
+        len = _rxAckLen;
+      _rxAckLen -= len;
+      return len;
+    }
+
+    // Host only
+    static const size_t WINDOW = 5840;   // lwIP TCP_WND
+    inline size_t window() const { return _rxAckLen < WINDOW ? WINDOW - _rxAckLen : 0; }
+    inline void beginSegment() { _ackPcb = true; }
+    inline void endSegment(const size_t len) {
+      if (!_ackPcb)
+        _rxAckLen += len;
+    }
+};
+
+typedef std::function<size_t(uint8_t *buffer, size_t maxLen, size_t index)> AwsResponseFiller;
+typedef std::function<void(AsyncWebServerRequest *request)> ArRequestHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest *request, const String &filename, size_t index, uint8_t *data, size_t len, bool final)> ArUploadHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)> ArBodyHandlerFunction;
+typedef std::function<void()> ArDisconnectHandler;
+
+class AsyncWebParameter {
+  private:
+    String _name, _value;
+    bool _isForm;
+
+  public:
+    AsyncWebParameter(const String &name, const String &value, const bool form = false) : _name(name), _value(value), _isForm(form) {}
+    inline const String &name() const { return _name; }
+    inline const String &value() const { return _value; }
+    inline size_t size() const { return _value.length(); }
+    inline bool isPost() const { return _isForm; }
+    inline bool isFile() const { return false; }
+};
+
+class AsyncWebHeader {
+  private:
+    String _name, _value;
+
+  public:
+    AsyncWebHeader(const String &name, const String &value) : _name(name), _value(value) {}
+    inline const String &name() const { return _name; }
+    inline const String &value() const { return _value; }
+};
+
+class AsyncWebServerResponse {
+  protected:
+    int _code = 200;
+    String _contentType;
+    std::vector<AsyncWebHeader> _headers;
+
+  public:
+    virtual ~AsyncWebServerResponse() {}
+    inline void setCode(const int code) { _code = code; }
+    inline void addHeader(const String &name, const String &value) { _headers.emplace_back(name, value); }
+
+    // Host only
+    inline int code() const { return _code; }
+    inline const String &contentType() const { return _contentType; }
+    virtual std::string content() = 0;
+};
+
+class AsyncBasicResponse : public AsyncWebServerResponse {
+  private:
+    std::string _content;
+
+  public:
+    AsyncBasicResponse(const int code, const String &contentType, const String &content) : _content(content.c_str()) {
+      _code = code;
+      _contentType = contentType;
+    }
+    std::string content() override { return _content; }
+};
+
+class AsyncResponseStream : public AsyncWebServerResponse, public Print {
+  private:
+    std::string _content;
+
+  public:
+    AsyncResponseStream(const String &contentType) { _contentType = contentType; }
+    size_t write(const uint8_t c) override { _content += (char)c; return 1; }
+    size_t write(const uint8_t *data, const size_t len) override { _content.append((const char *)data, len); return len; }
+    using Print::write;
+    std::string content() override { return _content; }
+};
+
+// Pulls the filler the way the library does, one TCP window at a time
+class AsyncCallbackResponse : public AsyncWebServerResponse {
+  private:
+    AwsResponseFiller _filler;
+    size_t _length;
+    bool _chunked;
+
+  public:
+    static const size_t WINDOW = 1460;
+
+    AsyncCallbackResponse(const String &contentType, const size_t len, AwsResponseFiller filler, const bool chunked)
+        : _filler(filler), _length(len), _chunked(chunked) {
+      _contentType = contentType;
+    }
+    inline bool chunked() const { return _chunked; }
+    std::string content() override {
+      std::string out;
+      uint8_t buffer[WINDOW];
+      size_t index = 0;
+      while (_chunked || index < _length) {
+        const size_t maxLen = _chunked ? WINDOW : min(WINDOW, _length - index);
+        const size_t n = _filler(buffer, maxLen, index);
+        if (n == 0 || n > maxLen)
+          break;
+        out.append((const char *)buffer, n);
+        index += n;
+      }
+      return out;
+    }
+};
+
+class AsyncWebServerRequest {
+  private:
+    WebRequestMethod _method;
+    String _url;
+    std::vector<AsyncWebParameter> _params;
+    std::vector<AsyncWebHeader> _headers;
+    size_t _contentLength = 0;
+    std::unique_ptr<AsyncWebServerResponse> _response;
+    AsyncClient _client;
+    ArDisconnectHandler _onDisconnect;
+
+  public:
+    void *_tempObject = nullptr;
+
+    AsyncWebServerRequest(const WebRequestMethod method, const String &url) : _method(method) {
+      const int q = url.indexOf('?');
+      _url = q == -1 ? url : url.substring(0, q);
+      if (q == -1)
+        return;
+      String query = url.substring(q + 1);
+      while (query.length() > 0) {
+        int amp = query.indexOf('&');
+        String pair = amp == -1 ? query : query.substring(0, amp);
+        query = amp == -1 ? String() : query.substring(amp + 1);
+        const int eq = pair.indexOf('=');
+        _params.emplace_back(eq == -1 ? pair : pair.substring(0, eq), eq == -1 ? String() : pair.substring(eq + 1));
+      }
+    }
+
+    inline WebRequestMethod method() const { return _method; }
+    inline const String &url() const { return _url; }
+    inline size_t contentLength() const { return _contentLength; }
+    inline AsyncClient *client() { return &_client; }
+    inline void onDisconnect(ArDisconnectHandler fn) { _onDisconnect = fn; }
+
+    inline size_t params() const { return _params.size(); }
+    inline AsyncWebParameter *getParam(const size_t num) { return num < _params.size() ? &_params[num] : nullptr; }
+    inline AsyncWebParameter *getParam(const String &name, const bool post = false, const bool file = false) {
+      for (auto &p : _params)
+        if (p.name() == name && p.isPost() == post)
+          return &p;
+      return nullptr;
+    }
+    inline bool hasParam(const String &name, const bool post = false, const bool file = false) { return getParam(name, post, file) != nullptr; }
+
+    inline bool hasHeader(const String &name) const { return getHeader(name) != nullptr; }
+    inline const AsyncWebHeader *getHeader(const String &name) const {
+      for (auto &h : _headers)
+        if (h.name().equalsIgnoreCase(name))
+          return &h;
+      return nullptr;
+    }
+
+    inline bool authenticate(const char *username, const char *password) { return true; }
+    inline void requestAuthentication() { send(401, "text/plain", ""); }
+    inline void redirect(const String &url) {
+      send(302, "text/plain", "");
+      _response->addHeader("Location", url);
+    }
+
+    inline void send(AsyncWebServerResponse *response) { _response.reset(response); }
+    inline void send(const int code, const String &contentType = String(), const String &content = String()) {
+      send(new AsyncBasicResponse(code, contentType, content));
+    }
+    inline AsyncResponseStream *beginResponseStream(const String &contentType, const size_t bufferSize = 1460) {
+      return new AsyncResponseStream(contentType);
+    }
+    inline AsyncWebServerResponse *beginResponse(const String &contentType, const size_t len, AwsResponseFiller callback) {
+      return new AsyncCallbackResponse(contentType, len, callback, false);
+    }
+    inline AsyncWebServerResponse *beginChunkedResponse(const String &contentType, AwsResponseFiller callback) {
+      return new AsyncCallbackResponse(contentType, 0, callback, true);
+    }
+
+    // Host only
+    inline void addParam(const String &name, const String &value, const bool form = false) { _params.emplace_back(name, value, form); }
+    inline void addHeader(const String &name, const String &value) { _headers.emplace_back(name, value); }
+    inline void setContentLength(const size_t length) { _contentLength = length; }
+    inline AsyncWebServerResponse *response() { return _response.get(); }
+    inline void disconnect() {
+      if (_onDisconnect)
+        _onDisconnect();
+      _onDisconnect = nullptr;
+    }
+};
+
+class AsyncWebServer {
+  private:
+    struct Route {
+      String uri;
+      WebRequestMethodComposite method;
+      ArRequestHandlerFunction onRequest;
+      ArUploadHandlerFunction onUpload;
+      ArBodyHandlerFunction onBody;
+    };
+    std::vector<Route> routes;
+
+    inline Route *find(AsyncWebServerRequest &request) {
+      for (auto &r : routes)
+        if (r.uri == request.url() && (r.method & request.method()))
+          return &r;
+      return nullptr;
+    }
+
+  public:
+    AsyncWebServer(const uint16_t port) {}
+    inline void begin() {}
+    inline void end() {}
+    inline void reset() { routes.clear(); }
+
+    inline void on(const char *uri, const WebRequestMethodComposite method, ArRequestHandlerFunction onRequest,
+                   ArUploadHandlerFunction onUpload = nullptr, ArBodyHandlerFunction onBody = nullptr) {
+      routes.push_back({ uri, method, onRequest, onUpload, onBody });
+    }
+
+    // Host only: runs the request handler, after feeding the body or the
+    // uploaded file through their callbacks in chunks of chunkSize bytes.
+    // With idle, an uploaded chunk waits for room in the TCP window, running
+    // idle() meanwhile, as the sender would, and a response put off by the
+    // handler is waited for the same way.
+    bool handle(AsyncWebServerRequest &request, const String &filename = String(),
+                const uint8_t *data = nullptr, const size_t len = 0, const size_t chunkSize = 1436,
+                std::function<void()> idle = nullptr) {
+      Route *route = find(request);
+      if (!route)
+        return false;
+      request.setContentLength(len);
+      if (data && route->onUpload) {
+        size_t index = 0;
+        do {
+          const size_t n = min(chunkSize, len - index);
+          for (uint32_t waits = 0; idle && request.client()->window() < n && waits < 1000000; waits++)
+            idle();
+          request.client()->beginSegment();
+          route->onUpload(&request, filename, index, (uint8_t *)data + index, n, index + n >= len);
+          request.client()->endSegment(n);
+          index += n;
+        } while (index < len);
+      }
+      else if (data && route->onBody) {
+        for (size_t index = 0; index < len; index += chunkSize)
+          route->onBody(&request, (uint8_t *)data + index, min(chunkSize, len - index), index, len);
+      }
+      if (!request.response())
+        route->onRequest(&request);
+      for (uint32_t waits = 0; idle && !request.response() && waits < 1000000; waits++)
+        idle();   // A response sent later, from loop()
+      request.disconnect();
+      return true;
+    }
+};
@@ -0,0 +1,42 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+class DateFormatter {
+  public:
+    static constexpr const char *COMPAT = "%Y%m%d_%H%M%S";
+};
+
+// Wall time derived from the virtual clock so runs are repeatable
+class DateTimeClass {
+  public:
+    time_t epoch = 1672531200;   // 2023-01-01 00:00:00 UTC
+
+    inline bool isTimeValid() { return true; }
+    inline time_t getTime() { return epoch + millis() / 1000; }
+    inline String format(const char *fmt) {
+      char str[64];
+      const time_t now = getTime();
+      strftime(str, sizeof(str), fmt, gmtime(&now));
+      return String(str);
+    }
+};
+
+extern DateTimeClass DateTime;
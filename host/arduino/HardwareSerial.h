@@ -0,0 +1,61 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <deque>
+
+// Serial port whose other end is the test: it feeds what the printer "says"
+// with inject() and collects what the firmware sent with takeWritten().
+class HardwareSerial : public Stream {
+  private:
+    std::deque<uint8_t> rx;
+    std::string tx;
+    unsigned long baud = 0;
+
+  public:
+    inline void begin(const unsigned long baudRate) { baud = baudRate; }
+    inline void end() { baud = 0; rx.clear(); }
+    inline unsigned long baudRate() { return baud; }
+    inline operator bool() { return baud != 0; }
+
+    int available() override { return rx.size(); }
+    int read() override {
+      if (rx.empty())
+        return -1;
+      const uint8_t c = rx.front();
+      rx.pop_front();
+      return c;
+    }
+    int peek() override { return rx.empty() ? -1 : rx.front(); }
+
+    size_t write(const uint8_t c) override { tx += (char)c; return 1; }
+    size_t write(const uint8_t *buffer, const size_t size) override { tx.append((const char *)buffer, size); return size; }
+    using Print::write;
+
+    // Host side of the wire
+    inline void inject(const char *data) { while (*data) rx.push_back((uint8_t)*data++); }
+    inline void inject(const uint8_t *data, size_t size) { rx.insert(rx.end(), data, data + size); }
+    inline size_t written() const { return tx.size(); }
+    inline std::string takeWritten() {
+      std::string ret;
+      ret.swap(tx);
+      return ret;
+    }
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,39 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Same digests as the core's MD5Builder so file ids match the device
+class MD5Builder {
+  private:
+    uint32_t state[4];
+    uint64_t count;
+    uint8_t block[64];
+    uint8_t digest[16];
+
+    void transform(const uint8_t *data);
+
+  public:
+    void begin();
+    void add(const uint8_t *data, uint16_t len);
+    inline void add(const char *data) { add((const uint8_t *)data, strlen(data)); }
+    inline void add(const String &data) { add((const uint8_t *)data.c_str(), data.length()); }
+    void calculate();
+    void getBytes(uint8_t *output);
+    void getChars(char *output);
+    String toString();
+};
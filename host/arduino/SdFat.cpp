@@ -0,0 +1,423 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <SdFat.h>
+
+// The sdfat:: open flags, under names the POSIX O_* macros included below do not replace
+static const sdfat::oflag_t SD_CREAT = sdfat::O_CREAT, SD_EXCL = sdfat::O_EXCL,
+                            SD_TRUNC = sdfat::O_TRUNC, SD_APPEND = sdfat::O_APPEND;
+
+// After SdFat.h: the POSIX O_* macros would clash with the sdfat:: constants
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <set>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+namespace sdfat {
+
+HostStats hostStats;
+
+static std::string hostRoot;
+static SdSpiCard sdCard;
+static uint32_t nextBlock = 0x10000;   // Where the next contiguous file is placed
+
+std::map<std::string, SdFat::Extent> SdFat::contiguousFiles;
+
+static const uint32_t CLUSTER_SIZE = 64 * SECTOR_SIZE;
+
+void (*File::dateTime)(uint16_t *date, uint16_t *time) = nullptr;
+
+// The entries of each host directory as FAT would keep them: a file keeps its
+// entry until it is removed, a new one takes the first free entry.
+static std::map<std::string, std::vector<std::string>> dirTables;   // Empty names for free entries
+
+// Brought up to date with the files made or removed, also on the host directly
+static std::vector<std::string> &dirEntries(std::string hostDir, const bool update = true) {
+  while (hostDir.size() > 1 && hostDir.back() == '/')
+    hostDir.pop_back();
+  std::vector<std::string> &entries = dirTables[hostDir];
+  if (!update)
+    return entries;
+
+  std::set<std::string> names;
+  DIR *d = ::opendir(hostDir.c_str());
+  struct dirent *entry;
+  while (d && (entry = ::readdir(d)))
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+      names.insert(entry->d_name);
+  if (d)
+    ::closedir(d);
+  for (std::string &name : entries)
+    if (!name.empty() && !names.erase(name))
+      name.clear();
+  for (const std::string &name : names) {
+    auto free = std::find(entries.begin(), entries.end(), std::string());
+    if (free != entries.end())
+      *free = name;
+    else
+      entries.push_back(name);
+  }
+  return entries;
+}
+
+// The entry of name in hostDir, counting the entries read to find it
+static int findEntry(const std::string &hostDir, const std::string &name) {
+  const std::vector<std::string> &entries = dirEntries(hostDir);
+  auto it = std::find(entries.begin(), entries.end(), name);
+  hostStats.dirReads += it == entries.end() ? entries.size() : it - entries.begin() + 1;
+  return it == entries.end() ? -1 : it - entries.begin();
+}
+
+void SdFat::setHostRoot(const char *directory) {
+  hostRoot = directory ? directory : "";
+  while (hostRoot.size() > 1 && hostRoot.back() == '/')
+    hostRoot.pop_back();
+}
+
+std::string SdFat::hostPath(const char *path) {
+  std::string p = path ? path : "";
+  if (p.empty() || p[0] != '/')
+    p = "/" + p;
+  return hostRoot + p;
+}
+
+bool SdFat::begin(uint8_t csPin, uint32_t maxSck) {
+  struct stat st;
+  return !hostRoot.empty() && ::stat(hostRoot.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+bool SdFat::exists(const char *path) {
+  struct stat st;
+  return ::stat(hostPath(path).c_str(), &st) == 0;
+}
+
+bool SdFat::mkdir(const char *path, bool pFlag) {
+  return ::mkdir(hostPath(path).c_str(), 0755) == 0;
+}
+
+bool SdFat::remove(const char *path) {
+  contiguousFiles.erase(hostPath(path));
+  return ::unlink(hostPath(path).c_str()) == 0;
+}
+
+bool SdFat::rename(const char *oldPath, const char *newPath) {
+  // Like FAT, renaming over an existing file fails
+  if (exists(newPath))
+    return false;
+  if (::rename(hostPath(oldPath).c_str(), hostPath(newPath).c_str()) != 0)
+    return false;
+  auto extent = contiguousFiles.find(hostPath(oldPath));
+  if (extent != contiguousFiles.end()) {
+    contiguousFiles[hostPath(newPath)] = extent->second;
+    contiguousFiles.erase(extent);
+  }
+  return true;
+}
+
+SdSpiCard *SdFat::card() {
+  return &sdCard;
+}
+
+bool SdSpiCard::readBlocks(uint32_t block, uint8_t *dst, size_t count) {
+  for (auto &file : SdFat::contiguousFiles) {
+    const SdFat::Extent &extent = file.second;
+    if (block >= extent.bgnBlock && block + count <= extent.bgnBlock + extent.blocks) {
+      const int fd = ::open(file.first.c_str(), O_RDONLY);
+      if (fd < 0)
+        return false;
+      memset(dst, 0, count * SECTOR_SIZE);
+      const ssize_t n = ::pread(fd, dst, count * SECTOR_SIZE, (off_t)(block - extent.bgnBlock) * SECTOR_SIZE);
+      ::close(fd);
+      hostStats.readCalls++;
+      hostStats.sectorReads += count;
+      return n >= 0;
+    }
+  }
+  return false;
+}
+
+bool SdFat::rmdir(const char *path) {
+  return ::rmdir(hostPath(path).c_str()) == 0;
+}
+
+uint32_t SdFat::freeClusterCount() {
+  hostStats.freeScans++;
+  struct statvfs vfs;
+  if (::statvfs(hostRoot.c_str(), &vfs) != 0)
+    return 0;
+  return (uint64_t)vfs.f_bavail * vfs.f_frsize / (sectorsPerCluster() * SECTOR_SIZE);
+}
+
+bool File::openHostPath(const std::string &hostFile, oflag_t oflag) {
+  close();
+  struct stat st;
+  const bool exists = ::stat(hostFile.c_str(), &st) == 0;
+  if (exists && S_ISDIR(st.st_mode)) {
+    if (oflag & O_WRITE)
+      return false;
+    dir = true;
+    dirPos = 0;
+  } else {
+    if (!exists && !(oflag & SD_CREAT))
+      return false;
+    if (exists && (oflag & SD_CREAT) && (oflag & SD_EXCL))
+      return false;
+    int posix = (oflag & O_WRITE) ? ((oflag & O_READ) ? O_RDWR : O_WRONLY) : O_RDONLY;
+    if (oflag & SD_CREAT) posix |= O_CREAT;
+    if (oflag & SD_TRUNC) posix |= O_TRUNC;
+    if (oflag & SD_APPEND) posix |= O_APPEND;
+    fd = ::open(hostFile.c_str(), posix, 0644);
+    if (fd < 0)
+      return false;
+    dir = false;
+    fileSizeCache = (oflag & SD_TRUNC) ? 0 : (::fstat(fd, &st) == 0 ? st.st_size : 0);
+  }
+  path = hostFile;
+  flags = oflag;
+  pos = (oflag & SD_APPEND) ? fileSizeCache : 0;
+  cacheSector = lastCluster = UINT32_MAX;
+  return true;
+}
+
+bool File::createContiguous(const char *filePath, uint32_t size) {
+  if (hostRoot.empty() || size == 0 || !openHostPath(SdFat::hostPath(filePath), O_READ | O_WRITE | SD_CREAT | SD_EXCL))
+    return false;
+  if (::ftruncate(fd, size) != 0) {
+    close();
+    return false;
+  }
+  fileSizeCache = size;
+  const uint32_t blocks = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE * (CLUSTER_SIZE / SECTOR_SIZE);
+  SdFat::contiguousFiles[path] = { nextBlock, blocks };
+  nextBlock += blocks;
+  return true;
+}
+
+bool File::contiguousRange(uint32_t *bgnBlock, uint32_t *endBlock) {
+  auto extent = SdFat::contiguousFiles.find(path);
+  if (!isFile() || extent == SdFat::contiguousFiles.end())
+    return false;
+  *bgnBlock = extent->second.bgnBlock;
+  *endBlock = extent->second.bgnBlock + extent->second.blocks - 1;
+  return true;
+}
+
+bool File::truncate(uint32_t length) {
+  if (!isFile() || !(flags & O_WRITE) || length > fileSizeCache || ::ftruncate(fd, length) != 0)
+    return false;
+  fileSizeCache = length;
+  if (pos > length)
+    pos = length;
+  cacheSector = UINT32_MAX;
+  // The clusters after the new end are freed
+  auto extent = SdFat::contiguousFiles.find(path);
+  if (extent != SdFat::contiguousFiles.end())
+    extent->second.blocks = (length + CLUSTER_SIZE - 1) / CLUSTER_SIZE * (CLUSTER_SIZE / SECTOR_SIZE);
+  return true;
+}
+
+bool File::open(const char *filePath, oflag_t oflag) {
+  if (hostRoot.empty())
+    return false;
+  // Each directory of the path is searched for the next name
+  const std::string hostFile = SdFat::hostPath(filePath);
+  int index = 0;
+  for (size_t slash = hostRoot.size(); slash < hostFile.size(); ) {
+    const size_t next = std::min(hostFile.find('/', slash + 1), hostFile.size());
+    if (next > slash + 1)
+      index = findEntry(hostFile.substr(0, slash), hostFile.substr(slash + 1, next - slash - 1));
+    slash = next;
+  }
+  if (!openHostPath(hostFile, oflag))
+    return false;
+  if (index < 0)    // Just created
+    index = findEntry(hostFile.substr(0, hostFile.find_last_of('/')), hostFile.substr(hostFile.find_last_of('/') + 1));
+  dirIdx = index < 0 ? 0 : index;
+  return true;
+}
+
+bool File::openNext(File *dirFile, oflag_t oflag) {
+  if (!dirFile || !dirFile->dir)
+    return false;
+  const std::vector<std::string> &entries = dirEntries(dirFile->path, dirFile->dirPos == 0);
+  while (dirFile->dirPos < entries.size()) {
+    const uint16_t index = dirFile->dirPos++;
+    hostStats.dirReads++;
+    if (!entries[index].empty() && openHostPath(dirFile->path + "/" + entries[index], oflag)) {
+      dirIdx = index;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool File::open(File *dirFile, uint16_t index, oflag_t oflag) {
+  if (!dirFile || !dirFile->dir)
+    return false;
+  const std::vector<std::string> &entries = dirEntries(dirFile->path);
+  hostStats.dirReads++;
+  if (index >= entries.size() || entries[index].empty() || !openHostPath(dirFile->path + "/" + entries[index], oflag))
+    return false;
+  dirIdx = index;
+  return true;
+}
+
+bool File::close() {
+  if (!isOpen())
+    return false;
+  if (fd >= 0)
+    ::close(fd);
+  fd = -1;
+  dir = false;
+  return true;
+}
+
+void File::rewind() {
+  dirPos = 0;
+  pos = 0;
+}
+
+bool File::fillCache(uint32_t sector) {
+  if (cacheSector == sector)
+    return true;
+  const ssize_t n = ::pread(fd, cache, SECTOR_SIZE, (off_t)sector * SECTOR_SIZE);
+  if (n < 0)
+    return false;
+  hostStats.sectorReads++;
+  cacheSector = sector;
+  return true;
+}
+
+int File::read() {
+  uint8_t b;
+  return read(&b, 1) == 1 ? b : -1;
+}
+
+int File::read(void *buf, size_t nbyte) {
+  if (fd < 0 || !(flags & O_READ))
+    return -1;
+  hostStats.readCalls++;
+  uint8_t *dst = (uint8_t *)buf;
+  size_t done = 0;
+  nbyte = min(nbyte, (size_t)(fileSizeCache - min(pos, fileSizeCache)));
+  while (done < nbyte) {
+    if (pos / CLUSTER_SIZE != lastCluster) {
+      // Following the cluster chain
+      lastCluster = pos / CLUSTER_SIZE;
+      hostStats.fatLookups++;
+    }
+    const uint32_t offset = pos % SECTOR_SIZE;
+    if (offset == 0 && nbyte - done >= SECTOR_SIZE) {
+      // Whole sectors bypass the cache, as SdFat does
+      const size_t n = min((nbyte - done) / SECTOR_SIZE * SECTOR_SIZE, (size_t)(CLUSTER_SIZE - pos % CLUSTER_SIZE));
+      const ssize_t r = ::pread(fd, dst + done, n, pos);
+      if (r <= 0)
+        break;
+      hostStats.sectorReads += (r + SECTOR_SIZE - 1) / SECTOR_SIZE;
+      done += r;
+      pos += r;
+      continue;
+    }
+    if (!fillCache(pos / SECTOR_SIZE))
+      break;
+    const size_t n = min((size_t)(SECTOR_SIZE - offset), nbyte - done);
+    memcpy(dst + done, cache + offset, n);
+    done += n;
+    pos += n;
+  }
+  return done;
+}
+
+int File::peek() {
+  const uint32_t p = pos;
+  const int c = read();
+  pos = p;
+  return c;
+}
+
+int File::available() {
+  if (fd < 0 || pos >= fileSizeCache)
+    return 0;
+  const uint32_t n = fileSizeCache - pos;
+  return n > 0X7FFF ? 0X7FFF : n;
+}
+
+size_t File::write(const void *buf, size_t nbyte) {
+  if (fd < 0 || !(flags & O_WRITE))
+    return -1;
+  hostStats.writeCalls++;
+  if (flags & SD_APPEND)
+    pos = fileSizeCache;
+  const ssize_t n = ::pwrite(fd, buf, nbyte, pos);
+  if (n < 0)
+    return -1;
+  hostStats.sectorWrites += (pos % SECTOR_SIZE + n + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  pos += n;
+  // Growing past its clusters, the file takes whatever cluster is free
+  auto extent = SdFat::contiguousFiles.find(path);
+  if (extent != SdFat::contiguousFiles.end() && pos > extent->second.blocks * SECTOR_SIZE)
+    SdFat::contiguousFiles.erase(extent);
+  if (pos > fileSizeCache)
+    fileSizeCache = pos;
+  cacheSector = UINT32_MAX;
+  return n;
+}
+
+bool File::sync() {
+  if (fd < 0)
+    return false;
+  if (flags & O_WRITE)
+    hostStats.syncs++;
+  return true;
+}
+
+bool File::seekSet(uint32_t position) {
+  if (!isOpen() || dir || position > fileSizeCache)
+    return false;
+  pos = position;
+  return true;
+}
+
+bool File::getName(char *name, size_t size) {
+  if (!isOpen() || size == 0)
+    return false;
+  const size_t slash = path.find_last_of('/');
+  const std::string base = slash == std::string::npos ? path : path.substr(slash + 1);
+  strncpy(name, base.c_str(), size - 1);
+  name[size - 1] = 0;
+  return true;
+}
+
+bool File::dirEntry(dir_t *dst) {
+  struct stat st;
+  if (!isOpen() || ::stat(path.c_str(), &st) != 0)
+    return false;
+  memset(dst, 0, sizeof(*dst));
+  struct tm t;
+  localtime_r(&st.st_mtime, &t);
+  dst->creationDate = dst->lastWriteDate = FAT_DATE(t.tm_year + 1900, t.tm_mon + 1, t.tm_mday);
+  dst->creationTime = dst->lastWriteTime = FAT_TIME(t.tm_hour, t.tm_min, t.tm_sec);
+  dst->attributes = dir ? 0x10 : 0;
+  dst->fileSize = dir ? 0 : fileSizeCache;
+  return true;
+}
+
+}
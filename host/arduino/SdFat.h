@@ -0,0 +1,176 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The subset of SdFat 1.x (namespaced as in the ESP8266 core) used by FileWrapper
+// and StorageFS, backed by a directory of the host. Like SdFat, reads go through
+// a 512 bytes sector cache and a File is a plain value: copies are independent
+// cursors and nothing is closed behind your back.
+
+#pragma once
+
+#include <Arduino.h>
+#include <map>
+
+#define SS 15
+#define SD_SCK_MHZ(maxMhz) (1000000UL*(maxMhz))
+#define SPI_HALF_SPEED 2
+#define SPI_FULL_SPEED 1
+
+namespace sdfat {
+
+typedef int oflag_t;
+
+const oflag_t O_READ   = 0x01;
+const oflag_t O_RDONLY = O_READ;
+const oflag_t O_WRITE  = 0x02;
+const oflag_t O_RDWR   = O_READ | O_WRITE;
+const oflag_t O_APPEND = 0x04;
+const oflag_t O_SYNC   = 0x08;
+const oflag_t O_TRUNC  = 0x10;
+const oflag_t O_CREAT  = 0x20;
+const oflag_t O_EXCL   = 0x40;
+
+const oflag_t FILE_READ  = O_READ;
+const oflag_t FILE_WRITE = O_RDWR | O_CREAT | O_APPEND;
+
+const size_t SECTOR_SIZE = 512;
+
+struct dir_t {
+  uint8_t name[11];
+  uint8_t attributes;
+  uint16_t creationTime;
+  uint16_t creationDate;
+  uint16_t lastWriteTime;
+  uint16_t lastWriteDate;
+  uint32_t fileSize;
+};
+
+static inline uint16_t FAT_DATE(uint16_t year, uint8_t month, uint8_t day) {
+  year -= 1980;
+  return year > 127 || month > 12 || day > 31 ? 0 : year << 9 | month << 5 | day;
+}
+static inline uint16_t FAT_YEAR(uint16_t fatDate) { return 1980 + (fatDate >> 9); }
+static inline uint8_t FAT_MONTH(uint16_t fatDate) { return (fatDate >> 5) & 0XF; }
+static inline uint8_t FAT_DAY(uint16_t fatDate) { return fatDate & 0X1F; }
+static inline uint16_t FAT_TIME(uint8_t hour, uint8_t minute, uint8_t second) {
+  return hour > 23 || minute > 59 || second > 59 ? 0 : hour << 11 | minute << 5 | second >> 1;
+}
+static inline uint8_t FAT_HOUR(uint16_t fatTime) { return fatTime >> 11; }
+static inline uint8_t FAT_MINUTE(uint16_t fatTime) { return (fatTime >> 5) & 0X3F; }
+static inline uint8_t FAT_SECOND(uint16_t fatTime) { return 2*(fatTime & 0X1F); }
+
+// Counters to see what the card would have been asked to do
+struct HostStats {
+  uint32_t sectorReads, sectorWrites, syncs, readCalls, writeCalls;
+  uint32_t fatLookups;    // Clusters File::read() had to find in the FAT
+  uint32_t dirReads;      // Directory entries read to find or list files
+  uint32_t freeScans;     // Times the FAT was scanned for free clusters
+};
+extern HostStats hostStats;
+
+class File {
+  private:
+    std::string path;
+    int fd = -1;
+    bool dir = false;
+    uint16_t dirPos = 0;        // Next entry of a directory for openNext()
+    uint16_t dirIdx = 0;        // Entry of this file in its directory
+    oflag_t flags = 0;
+    uint32_t pos = 0;
+    uint32_t fileSizeCache = 0;
+    uint32_t cacheSector = UINT32_MAX;
+    uint32_t lastCluster = UINT32_MAX;
+    uint8_t cache[SECTOR_SIZE];
+
+    static void (*dateTime)(uint16_t *date, uint16_t *time);
+
+    bool fillCache(uint32_t sector);
+    bool openHostPath(const std::string &hostPath, oflag_t oflag);
+
+  public:
+    bool open(const char *path, oflag_t oflag = O_RDONLY);
+    // Creates a file of size bytes in consecutive clusters, open for O_RDWR
+    bool createContiguous(const char *path, uint32_t size);
+    // The first and last blocks of a file in consecutive clusters
+    bool contiguousRange(uint32_t *bgnBlock, uint32_t *endBlock);
+    bool truncate(uint32_t length);
+    bool openNext(File *dirFile, oflag_t oflag = O_RDONLY);
+    // Opens the file of entry index of dirFile, without looking for its name
+    bool open(File *dirFile, uint16_t index, oflag_t oflag = O_RDONLY);
+    inline uint16_t dirIndex() const { return dirIdx; }
+    bool close();
+    inline bool isOpen() const { return fd >= 0 || dir; }
+    inline operator bool() const { return isOpen(); }
+    inline bool isDir() const { return dir; }
+    inline bool isFile() const { return isOpen() && !dir; }
+
+    int read();
+    int read(void *buf, size_t nbyte);
+    int peek();
+    int available();
+    size_t write(const void *buf, size_t nbyte);
+    inline size_t write(uint8_t b) { return write(&b, 1); }
+    bool sync();
+
+    bool seekSet(uint32_t pos);
+    inline bool seekCur(int32_t offset) { return seekSet(pos + offset); }
+    inline uint32_t curPosition() const { return pos; }
+    inline uint32_t fileSize() const { return fileSizeCache; }
+    void rewind();
+
+    bool getName(char *name, size_t size);
+    bool dirEntry(dir_t *dst);
+
+    static inline void dateTimeCallback(void (*dateTimeFunction)(uint16_t *date, uint16_t *time)) {
+      dateTime = dateTimeFunction;
+    }
+
+    // Host only: the file this one is backed by
+    inline const std::string &hostPath() const { return path; }
+};
+
+class SdSpiCard {
+  public:
+    bool readBlocks(uint32_t block, uint8_t *dst, size_t count);
+};
+
+class SdFat {
+  public:
+    bool begin(uint8_t csPin = SS, uint32_t maxSck = SD_SCK_MHZ(50));
+    bool exists(const char *path);
+    bool mkdir(const char *path, bool pFlag = true);
+    bool remove(const char *path);
+    bool rename(const char *oldPath, const char *newPath);
+    bool rmdir(const char *path);
+    uint32_t freeClusterCount();
+    inline uint8_t sectorsPerCluster() { return 64; }
+    inline uint8_t blocksPerCluster() { return sectorsPerCluster(); }
+    SdSpiCard *card();
+    inline uint32_t clusterCount() { return freeClusterCount(); }
+
+    // Host only: the directory that plays the role of the card.
+    // begin() fails when it is not set, as if there was no card.
+    static void setHostRoot(const char *directory);
+    static std::string hostPath(const char *path);
+    // Host only: files made by createContiguous(), by host path, and their blocks
+    struct Extent {
+      uint32_t bgnBlock, blocks;
+    };
+    static std::map<std::string, Extent> contiguousFiles;
+};
+
+}
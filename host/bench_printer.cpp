@@ -0,0 +1,354 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Streams a G-code file through handlePrint() -> CommandQueue -> SendCommands()
+// to the simulated Marlin printer and reports how well its planner was kept fed.
+//
+//   bench_printer [options] [file.gcode]
+//     --baud N         serial baud of the printer (115200)
+//     --planner N      BLOCK_BUFFER_SIZE (16)
+//     --bufsize N      BUFSIZE (4)
+//     --command-us N   printer time to parse and plan a command (500)
+//     --move-us N      fixed time per move, 0 for feedrate based (0)
+//     --loop-us N      time taken by each loop() pass (100)
+//     --layers N       layers of the generated file when none is given (200)
+//     --no-advanced-ok the printer answers plain "ok" without P and B
+//     --meatpack       the printer supports MeatPack
+//     --checksums      send line numbers and checksums
+//     --corrupt-every N flip a bit of every Nth byte received by the printer (0)
+//     --no-compact     print the file as it is, without the compacted copy made on upload
+//     --gzip           store the file gzip-compressed and inflate it while printing
+//     --parse N        time N passes of the response parsers over typical lines
+//                      against the String-based ones they replaced, then exit
+//
+// Without a file a synthetic one is generated: 5 mm circles cut in 1 degree
+// segments (under 0.1 mm) at 60 mm/s with slicer-like comments, the kind of
+// G-code that starves planners.
+
+#include "NativeSketch.h"
+#include "PrinterSimulator.h"
+
+#include <chrono>
+#include <new>
+#include <string>
+
+static std::string sdRoot;
+
+// Heap allocations, for the parsers that should not make any. GCC takes the
+// free() of the replaced operator delete for a mismatch once it is inlined.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+static uint64_t allocations = 0;
+
+void *operator new(size_t size) {
+  ++allocations;
+  if (void *p = malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+// The temperature and position parsers before PrinterResponse, one String
+// search, substring and toFloat() per sensor
+namespace legacy {
+  static bool isFloat(const String value) {
+    for (uint i = 0; i < value.length(); ++i) {
+      char ch = value[i];
+      if (ch != ' ' && ch != '.' && ch != '-' && !isDigit(ch))
+        return false;
+    }
+    return true;
+  }
+
+  static bool parseTemp(const String response, const String whichTemp, Temperature *temperature) {
+    int tpos = response.indexOf(whichTemp + ":");
+    if (tpos != -1) {
+      int slashpos = response.indexOf(" /", tpos);
+      int spacepos = response.indexOf(" ", slashpos + 1);
+      if (slashpos != -1 && spacepos != -1) {
+        String actual = response.substring(tpos + whichTemp.length() + 1, slashpos);
+        String target = response.substring(slashpos + 2, spacepos);
+        if (isFloat(actual) && isFloat(target)) {
+          temperature->actual = actual.toFloat()*100;
+          temperature->target = target.toFloat()*100;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  static bool parsePrusaHeatingTemp(const String response, const String whichTemp, Temperature *temperature) {
+    int tpos = response.indexOf(whichTemp + ":");
+    if (tpos != -1) {
+      int spacepos = response.indexOf(" ", tpos);
+      if (spacepos == -1)
+        spacepos = response.length();
+      String actual = response.substring(tpos + whichTemp.length() + 1, spacepos);
+      if (isFloat(actual)) {
+        temperature->actual = actual.toFloat()*100;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool parseTemperatures(const String response, Temperature *tools, uint8_t extruders, Temperature &bed) {
+    bool tempResponse;
+    if (extruders == 1)
+      tempResponse = parseTemp(response, "T", &tools[0]);
+    else {
+      tempResponse = false;
+      for (int t = 0; t < extruders; t++)
+        tempResponse |= parseTemp(response, "T" + String(t), &tools[t]);
+    }
+    tempResponse |= parseTemp(response, "B", &bed);
+    if (!tempResponse) {
+      Temperature heating;
+      int e = parsePrusaHeatingTemp(response, "E", &heating) ? heating.actual/100 : -1;
+      tempResponse = e >= 0 && e < MAX_SUPPORTED_EXTRUDERS && parsePrusaHeatingTemp(response, "T", &tools[e]);
+      tempResponse |= parsePrusaHeatingTemp(response, "B", &bed);
+    }
+    return tempResponse;
+  }
+
+  static bool parsePosition(const String response) {
+    return response.indexOf("X:") != -1 && response.indexOf("Y:") != -1 &&
+           response.indexOf("Z:") != -1 && response.indexOf("E:") != -1;
+  }
+}
+
+// What M105, M155 autoreports, Prusa heating and M114 answer
+static void benchParsers(uint32_t passes) {
+  static const char *const lines[] = {
+    "ok T:210.52 /215.00 B:60.20 /60.00 @:127 B@:0\n",
+    "T:210.52 /215.00 B:60.20 /60.00 @:127 B@:0\n",
+    "ok T:200.00 /200.00 B:60.00 /60.00 T0:200.00 /200.00 T1:150.25 /170.00 @:64 B@:0 @0:64 @1:127\n",
+    "T:180.3 E:0 B:55.1\n",
+    "X:-33.00 Y:-10.00 Z:5.00 E:37.95 Count X:-3300 Y:-1000 Z:2000\n",
+  };
+  const uint8_t extruders[] = { 1, 1, 2, 1, 1 };
+  const size_t count = sizeof(lines) / sizeof(lines[0]);
+
+  // The lines arrive in a String, as ReceiveResponses() keeps them
+  std::vector<String> responses;
+  for (const char *line : lines)
+    responses.push_back(line);
+
+  Temperature tools[MAX_SUPPORTED_EXTRUDERS], bed;
+  uint32_t found = 0;
+  uint64_t before = allocations;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t pass = 0; pass < passes; pass++)
+    for (size_t i = 0; i < count; i++)
+      found += legacy::parseTemperatures(responses[i], tools, extruders[i], bed) || legacy::parsePosition(responses[i]);
+  const double legacySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  const uint64_t legacyAllocations = allocations - before;
+
+  before = allocations;
+  start = std::chrono::steady_clock::now();
+  for (uint32_t pass = 0; pass < passes; pass++)
+    for (size_t i = 0; i < count; i++) {
+      fwExtruders = extruders[i];
+      found += parseTemperatures(responses[i].c_str()) || parsePosition(responses[i].c_str());
+    }
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  const uint64_t newAllocations = allocations - before;
+
+  const double lineCount = (double)passes * count;
+  printf("lines:          %u passes of %u, %u parsed\n", passes, (unsigned)count, found);
+  printf("String parsers: %.3f us/line, %.1f allocations/line\n", legacySeconds * 1e6 / lineCount, legacyAllocations / lineCount);
+  printf("one pass:       %.3f us/line, %.1f allocations/line (%.1fx faster)\n", seconds * 1e6 / lineCount,
+         newAllocations / lineCount, legacySeconds / seconds);
+}
+
+static void generateGcode(const std::string &path, const int layers) {
+  FILE *f = fopen(path.c_str(), "wb");
+  fprintf(f, ";FLAVOR:Marlin\n;Generated with the benchmark\nM140 S60\nM104 S200\nG28 ;Home\nM190 S60\nM109 S200\n");
+  float e = 0;
+  for (int layer = 0; layer < layers; layer++) {
+    fprintf(f, ";LAYER:%d\nG0 F6000 Z%.2f\n;TYPE:WALL-OUTER\nG1 F3600\n", layer, 0.2 + layer * 0.2);
+    for (int i = 0; i <= 360; i++) {
+      e += 0.0035;
+      fprintf(f, "G1 X%.3f Y%.3f E%.5f\n", 100 + 5 * cos(i * M_PI / 180), 100 + 5 * sin(i * M_PI / 180), e);
+    }
+  }
+  fprintf(f, "M104 S0\nM140 S0\n;End of Gcode\n");
+  fclose(f);
+}
+
+static void copyFile(const char *from, const std::string &to) {
+  std::string cmd = std::string("cp '") + from + "' '" + to + "'";
+  if (system(cmd.c_str()) != 0) {
+    fprintf(stderr, "cannot copy %s\n", from);
+    exit(1);
+  }
+}
+
+// What handleUpload() does while the file is received
+static uint32_t compactFile(const char *path) {
+  GcodeCompactor compactor;
+  FileWrapper file = storageFS.open(path);
+  compactor.begin("/bench.tmp");
+  uint8_t buf[1460];    // A TCP segment
+  int n;
+  while ((n = file.read(buf, sizeof(buf))) > 0)
+    compactor.write(buf, n);
+  file.close();
+  if (!compactor.finish() || !compactor.install(path)) {
+    fprintf(stderr, "cannot compact %s\n", path);
+    exit(1);
+  }
+  FileWrapper compacted = storageFS.open(GcodeCompactor::cachePath(path));
+  const uint32_t size = compacted.size();
+  compacted.close();
+  return size;
+}
+
+int main(int argc, char **argv) {
+  PrinterSimulator::Config cfg;
+  uint32_t loopUs = 100;
+  int layers = 200;
+  const char *gcode = nullptr;
+  bool compact = true, gzip = false;
+  uint32_t parsePasses = 0;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (arg == "--baud" && hasValue) cfg.baud = atol(argv[++i]);
+    else if (arg == "--planner" && hasValue) cfg.plannerDepth = atoi(argv[++i]);
+    else if (arg == "--bufsize" && hasValue) cfg.bufsize = atoi(argv[++i]);
+    else if (arg == "--command-us" && hasValue) cfg.commandTimeUs = atol(argv[++i]);
+    else if (arg == "--move-us" && hasValue) cfg.moveTimeUs = atol(argv[++i]);
+    else if (arg == "--loop-us" && hasValue) loopUs = atol(argv[++i]);
+    else if (arg == "--layers" && hasValue) layers = atoi(argv[++i]);
+    else if (arg == "--no-advanced-ok") cfg.advancedOk = false;
+    else if (arg == "--meatpack") cfg.meatPack = true;
+    else if (arg == "--checksums") useChecksums = true;
+    else if (arg == "--corrupt-every" && hasValue) cfg.corruptEvery = atol(argv[++i]);
+    else if (arg == "--no-compact") compact = false;
+    else if (arg == "--gzip") gzip = true;
+    else if (arg == "--parse" && hasValue) parsePasses = atol(argv[++i]);
+    else if (arg[0] != '-') gcode = argv[i];
+    else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 2;
+    }
+  }
+  if (parsePasses > 0) {
+    benchParsers(parsePasses);
+    return 0;
+  }
+
+  // Heating up is not what is measured here
+  cfg.heatRate = 1000;
+
+  char tmpl[] = "/tmp/nwp-bench-XXXXXX";
+  sdRoot = mkdtemp(tmpl);
+  sdfat::SdFat::setHostRoot(sdRoot.c_str());
+
+  const std::string gcodePath = sdRoot + "/bench.gcode";
+  if (gcode)
+    copyFile(gcode, gcodePath);
+  else
+    generateGcode(gcodePath, layers);
+
+  PrinterSimulator printer(Serial, cfg);
+  PrinterSetup();
+
+  // Detection and greeting
+  for (uint32_t t = 0; t < 60000000 && !printerConnected; t += loopUs) {
+    NativeLoop();
+    HostClock::advanceMicros(loopUs);
+    printer.update();
+  }
+  if (!printerConnected) {
+    fprintf(stderr, "printer not detected\n");
+    return 1;
+  }
+  for (int i = 0; i < 1000; i++) {
+    NativeLoop();
+    HostClock::advanceMicros(loopUs);
+    printer.update();
+  }
+
+  uint32_t gcodeSize = 0;
+  if (gzip) {
+    FileWrapper plain = storageFS.open("/bench.gcode");
+    gcodeSize = plain.size();
+    plain.close();
+    std::string cmd = "gzip -9 '" + gcodePath + "'";
+    if (system(cmd.c_str()) != 0) {
+      fprintf(stderr, "cannot compress %s\n", gcodePath.c_str());
+      return 1;
+    }
+    compact = false;
+    ESP.freeHeap = 100000;    // The 32 KB window, as on an ESP32
+  }
+  uploadedFullname = gzip ? "/bench.gcode.gz" : "/bench.gcode";
+  FileWrapper file = storageFS.open(uploadedFullname);
+  uploadedFileSize = file.size();
+  file.close();
+  const uint32_t compactSize = compact ? compactFile("/bench.gcode") : 0;
+
+  printer.resetStats();
+  sdfat::hostStats = sdfat::HostStats();
+  startPrint = true;
+  uint32_t loops = 0;
+  const uint64_t startUs = HostClock::getMicros();
+  const auto start = std::chrono::steady_clock::now();
+  while (startPrint || isPrinting || !commandQueue.isEmpty() || printer.plannerBlocks()) {
+    if (HostClock::getMicros() - startUs > 3600 * 1000000ULL) {
+      fprintf(stderr, "stalled at line %u\n", lastPrintedLine);
+      return 1;
+    }
+    NativeLoop();
+    ++loops;
+    HostClock::advanceMicros(loopUs);
+    printer.update();
+  }
+  const double hostSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  const double simSeconds = (HostClock::getMicros() - startUs) / 1e6;
+  const PrinterSimulator::Stats s = printer.stats();
+
+  printf("printer:        %u baud, planner %u blocks, BUFSIZE %u, %u us/command, loop %u us%s\n",
+         cfg.baud, cfg.plannerDepth, cfg.bufsize, cfg.commandTimeUs, loopUs, cfg.advancedOk ? ", ADVANCED_OK" : "");
+  printf("file:           %u bytes, %u commands, %u moves\n", (unsigned)uploadedFileSize, s.commands, s.moves);
+  if (compact)
+    printf("compacted:      %u bytes (%.1f%%)\n", compactSize, 100.0 * compactSize / uploadedFileSize);
+  if (gzip)
+    printf("gzip:           %u bytes inflated (%.1f%%)\n", gcodeSize, 100.0 * uploadedFileSize / gcodeSize);
+  printf("print time:     %.2f s (%.1f lines/s)\n", simSeconds, s.commands / simSeconds);
+  printf("printer idle:   %.2f s (%.1f%% of %.2f s moving), %u starvations\n",
+         s.idleUs / 1e6, s.printUs ? 100.0 * s.idleUs / s.printUs : 0.0, s.printUs / 1e6, s.starvations);
+  printf("planner fill:   %.2f blocks average\n", s.printUs ? (double)s.plannerBlockUs / s.printUs : 0.0);
+  printf("queue starved:  %u times, %u of %u loop passes (%.1f%%)\n", queueStarvations, queueStarvedPasses, loops, 100.0 * queueStarvedPasses / loops);
+  printf("serial:         %u bytes to printer, %u from printer, %u lost\n", s.bytesReceived, s.bytesSent, s.rxOverflows);
+  printf("transport:      %s%s, %u resends, %u corrupted commands executed\n",
+         useChecksums ? "line numbers and checksums" : "plain", meatPackActive ? ", MeatPack" : "", s.resends, s.corruptCommands);
+  printf("SD reads:       %u calls, %u sectors\n", sdfat::hostStats.readCalls, sdfat::hostStats.sectorReads);
+  printf("host CPU:       %.3f s (%.2f us/line)\n", hostSeconds, hostSeconds * 1e6 / s.commands);
+
+  std::string cleanup = "rm -rf '" + sdRoot + "'";
+  return system(cleanup.c_str()) == 0 ? 0 : 1;
+}
@@ -0,0 +1,2187 @@
+/*
+ * This file is part of Neo Wireless Printing (https://github.com/Anyeos/NeoWirelessPrinting).
+ * Copyright (c) 2023 Andrés G. Schwartz (Anyeos).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "NativeSketch.h"
+#include "PrinterSimulator.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+static int failures = 0, checks = 0;
+
+#define CHECK(cond) do { \
+    ++checks; \
+    if (!(cond)) { \
+      ++failures; \
+      printf("  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+    } \
+  } while (0)
+
+#define CHECK_EQ(a, b) do { \
+    ++checks; \
+    if (!((a) == (b))) { \
+      ++failures; \
+      printf("  %s:%d: CHECK_EQ(%s, %s) failed\n", __FILE__, __LINE__, #a, #b); \
+    } \
+  } while (0)
+
+static const char *M115_MARLIN =
+  "FIRMWARE_NAME:Marlin 2.0.7.2 (Github) SOURCE_CODE_URL:github.com/MarlinFirmware/Marlin PROTOCOL_VERSION:1.0 "
+  "MACHINE_TYPE:Ender-3 Pro EXTRUDER_COUNT:1 UUID:cede2a2f-41a2-4748-9b12-c55c62f367ff\n"
+  "Cap:SERIAL_XON_XOFF:0\n"
+  "Cap:EEPROM:1\n"
+  "Cap:AUTOREPORT_TEMP:1\n"
+  "Cap:PROGRESS:0\n"
+  "Cap:BUILD_PERCENT:0\n"
+  "ok\n";
+
+static std::string sdRoot;
+
+static void writeSdFile(const char *name, const std::string &content) {
+  FILE *f = fopen((sdRoot + name).c_str(), "wb");
+  fwrite(content.data(), 1, content.size(), f);
+  fclose(f);
+}
+
+static std::string readSdFile(const char *name) {
+  std::string content;
+  FILE *f = fopen((sdRoot + name).c_str(), "rb");
+  if (!f)
+    return content;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    content.append(buf, n);
+  fclose(f);
+  return content;
+}
+
+static std::vector<std::string> splitLines(const std::string &text) {
+  std::vector<std::string> lines;
+  size_t start = 0, eol;
+  while ((eol = text.find('\n', start)) != std::string::npos) {
+    std::string line = text.substr(start, eol - start);
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    lines.push_back(line);
+    start = eol + 1;
+  }
+  return lines;
+}
+
+// Acknowledges everything the firmware wrote since the last call
+static std::vector<std::string> acknowledge() {
+  std::vector<std::string> lines = splitLines(Serial.takeWritten());
+  for (const std::string &line : lines)
+    Serial.inject(line == "M115" ? M115_MARLIN : "ok\n");
+  return lines;
+}
+
+static void resetPrinter() {
+  commandQueue.clear();
+  Serial.takeWritten();
+  while (Serial.read() >= 0);
+  printerUsedBuffer = 0;
+  isPrinting = startPrint = printPause = cancelPrint = restartPrint = false;
+}
+
+// Receives content in pieces, with a loop() pass after each, until it is written
+static void upload(const char *filename, const std::string &content, AsyncWebServerRequest *request = nullptr,
+                   const size_t piece = 1460) {
+  size_t index = 0;
+  do {
+    const size_t len = std::min(piece, content.size() - index);
+    handleUpload(request, filename, index, (uint8_t *)content.data() + index, len, index + len == content.size());
+    writeUploadQueue(UPLOAD_WRITE_TIME_US);
+    index += len;
+  } while (index < content.size());
+  while (uploadQueue.isActive())
+    writeUploadQueue(UPLOAD_WRITE_TIME_US);
+}
+
+static void testCommandQueue() {
+  commandQueue.clear();
+  CHECK(commandQueue.isEmpty());
+  CHECK_EQ(commandQueue.getFreeBytes(), COMMAND_BUFFER_SIZE - 2);
+  CHECK(!commandQueue.push(""));
+
+  // "G1 Xnn" takes 8 bytes: fill the buffer
+  const int fits = COMMAND_BUFFER_SIZE / 8;
+  for (int i = 0; i < fits; i++)
+    CHECK(commandQueue.push("G1 X" + String(10 + i % 90)));
+  CHECK(!commandQueue.push("G1 X100"));
+  CHECK_EQ(commandQueue.getCount(), fits);
+  CHECK_EQ(commandQueue.getUsedBytes(), fits * 8);
+  CHECK_EQ(commandQueue.getFreeBytes(), 0);
+
+  CHECK(commandQueue.peekSend() == "G1 X10");
+  CHECK(commandQueue.popSend() == "G1 X10");
+  const CommandView sent = commandQueue.popSend();
+  CHECK(sent == "G1 X11");
+  CHECK_EQ(sent.length(), 6u);
+  CHECK(!commandQueue.isAckEmpty());
+  CHECK(commandQueue.popAcknowledge() == "G1 X10");
+  CHECK(commandQueue.popAcknowledge() == "G1 X11");
+  CHECK(commandQueue.isAckEmpty());
+  CHECK(commandQueue.popAcknowledge().isEmpty());
+  CHECK_EQ(commandQueue.getFreeBytes(), 14);
+
+  // A command that does not fit at the end goes to the start
+  commandQueue.clear();
+  CHECK(!commandQueue.push(std::string(COMMAND_MAX_LENGTH + 1, 'X').c_str()));
+  const std::string first = "M117 " + std::string(95, 'a'), second = "M117 " + std::string(95, 'b');
+  const int longFits = COMMAND_BUFFER_SIZE / 102;
+  for (int i = 0; i < longFits; i++)
+    CHECK(commandQueue.push(first.c_str()));
+  CHECK_EQ(commandQueue.getFreeBytes(), COMMAND_BUFFER_SIZE - longFits * 102 - 2);
+  CHECK(!commandQueue.push(second.c_str()));
+  commandQueue.popSend();
+  commandQueue.popAcknowledge();
+  CHECK(commandQueue.push(second.c_str()));
+  CHECK_EQ(commandQueue.getUsedBytes(), COMMAND_BUFFER_SIZE);
+  CHECK_EQ(commandQueue.getFreeBytes(), 0);
+  for (int i = 1; i < longFits; i++) {
+    CHECK(commandQueue.popSend() == first.c_str());
+    commandQueue.popAcknowledge();
+  }
+  CHECK_EQ(commandQueue.getUsedBytes(), 102);
+  CHECK(commandQueue.popSend() == second.c_str());
+  CHECK(commandQueue.popAcknowledge() == second.c_str());
+  CHECK_EQ(commandQueue.getUsedBytes(), 0);
+  CHECK_EQ(commandQueue.getAcknowledgedCount(), commandQueue.getPushedCount());
+
+  // Sequence numbers tell what was done, dropped commands never will be
+  const uint32_t pushed = commandQueue.getPushedCount();
+  commandQueue.push("G1 X1");
+  commandQueue.push("G1 X2");
+  commandQueue.popSend();
+  commandQueue.popAcknowledge();
+  CHECK_EQ(commandQueue.getPushedCount(), pushed + 2);
+  CHECK_EQ(commandQueue.getAcknowledgedCount(), pushed + 1);
+  commandQueue.clear();
+  CHECK(commandQueue.isEmpty());
+  CHECK_EQ(commandQueue.getAcknowledgedCount(), pushed + 2);
+}
+
+static void testParseTemperatures() {
+  fwExtruders = 1;
+  CHECK(parseTemperatures("ok T:210.5 /215.0 B:60.2 /60.0 @:127 B@:0\n"));
+  CHECK_EQ(toolTemperature[0].actual, 21050);
+  CHECK_EQ(toolTemperature[0].target, 21500);
+  CHECK_EQ(bedTemperature.actual, 6020);
+  CHECK_EQ(bedTemperature.target, 6000);
+
+  // Prusa heating report
+  firmware = &FirmwareDialect::get(FirmwareType::Prusa);
+  CHECK(parseTemperatures("T:180.3 E:0 B:55.1\n"));
+  CHECK_EQ(toolTemperature[0].actual, 18030);
+  firmware = &FirmwareDialect::get(FirmwareType::Marlin);
+
+  CHECK(!parseTemperatures("echo:busy: processing\n"));
+  CHECK(parsePosition("X:-33.00 Y:-10.00 Z:5.00 E:37.95 Count X:-3300 Y:-1000 Z:2000\n"));
+  CHECK(!parsePosition("X:-33.00 Y:-10.00 Z:5.00 Count X:-3300 Y:-1000 Z:2000 E:0\n"));
+  CHECK(!parseTemperatures("X:1.00 Y:2.00 Z:3.00 E:4.00 Count A:100 B:200 Z:300\n"));
+
+  // The last line of the report, and several extruders
+  CHECK(parseTemperatures("T:18.03 /0.00 B:22.5 /0.0\n"));
+  CHECK_EQ(toolTemperature[0].actual, 1803);
+  CHECK_EQ(bedTemperature.target, 0);
+  fwExtruders = 2;
+  CHECK(parseTemperatures("ok T:200.00 /200.00 B:60.00 /60.00 T0:200.00 /200.00 T1:150.25 /170.00 @:64 B@:0 @0:64 @1:127\n"));
+  CHECK_EQ(toolTemperature[0].actual, 20000);
+  CHECK_EQ(toolTemperature[1].actual, 15025);
+  CHECK_EQ(toolTemperature[1].target, 17000);
+  firmware = &FirmwareDialect::get(FirmwareType::Prusa);
+  CHECK(parseTemperatures("T:175.0 E:1 W:?\n"));
+  CHECK_EQ(toolTemperature[1].actual, 17500);
+  CHECK_EQ(toolTemperature[0].actual, 20000);
+  firmware = &FirmwareDialect::get(FirmwareType::Marlin);
+  fwExtruders = 1;
+
+  // Every sensor, to centi-degrees rounded
+  TemperatureReport report;
+  CHECK(PrinterResponse::parseTemperatures("ok T:21.456 /0.00 B:-5.5 /60 C:30.10 /0.00 P:28.4 T3:99.995 /100 @:127 B@:0 W:?", report));
+  CHECK(report.has(TemperatureReport::ACTIVE) && report.has(TemperatureReport::BED) && report.has(TemperatureReport::CHAMBER));
+  CHECK(report.has(TemperatureReport::PROBE) && !report.hasTarget(TemperatureReport::PROBE));
+  CHECK(report.has(TemperatureReport::TOOL0 + 3) && !report.has(TemperatureReport::TOOL0));
+  CHECK_EQ(report.active.actual, 2146);
+  CHECK_EQ(report.bed.actual, -550);
+  CHECK_EQ(report.bed.target, 6000);
+  CHECK_EQ(report.chamber.actual, 3010);
+  CHECK_EQ(report.probe.actual, 2840);
+  CHECK_EQ(report.tools[3].actual, 10000);
+  CHECK_EQ(report.activePower, 127);
+  CHECK_EQ(report.bedPower, 0);
+  CHECK_EQ(report.heatingTool, -1);
+  TemperatureReport none;
+  CHECK(!PrinterResponse::parseTemperatures("ok N12 P15 B3", none));
+  CHECK(!PrinterResponse::parseTemperatures("T:abc /def", none));
+
+  PositionReport position;
+  CHECK(PrinterResponse::parsePosition("X:-33.00 Y:10.5 Z:5.00 E:37.957 Count X:-3300 Y:1050 Z:2000", position));
+  CHECK(position.position[0] == -3300 && position.position[1] == 1050 && position.position[2] == 500 && position.position[3] == 3796);
+}
+
+static void testResponseLines() {
+  ResponseLines lines;
+  CHECK(lines.getRecent(0) == nullptr);
+  bool ended = false;
+  for (const char ch : std::string("ok T:20.0 /0.0\r\n"))
+    ended = lines.push(ch);
+  CHECK(ended);
+  CHECK(strcmp(lines.getLine(), "ok T:20.0 /0.0") == 0);
+  CHECK_EQ(lines.getLength(), 14);
+  CHECK(!lines.isTruncated());
+
+  // Longer lines are cut and counted
+  const std::string longLine(RESPONSE_LINE_LENGTH + 20, 'e');
+  for (const char ch : longLine + "\n")
+    lines.push(ch);
+  CHECK(lines.isTruncated());
+  CHECK_EQ(lines.getLength(), RESPONSE_LINE_LENGTH);
+  CHECK_EQ(lines.getTruncatedCount(), 1u);
+  CHECK_EQ(strlen(lines.getRecent(0)), (size_t)RESPONSE_RECENT_LENGTH);
+
+  // Only the last lines are kept, a line being received can be dropped
+  for (int i = 0; i < 10; i++)
+    for (const char ch : "echo:line " + std::to_string(i) + "\n")
+      lines.push(ch);
+  for (const char ch : std::string("partial"))
+    lines.push(ch);
+  lines.discard();
+  for (const char ch : std::string("ok\n"))
+    lines.push(ch);
+  CHECK(strcmp(lines.getLine(), "ok") == 0);
+  CHECK(strcmp(lines.getRecent(0), "ok") == 0);
+  CHECK(strcmp(lines.getRecent(1), "echo:line 9") == 0);
+  CHECK(strcmp(lines.getRecent(RESPONSE_RECENT_LINES - 1), ("echo:line " + std::to_string(11 - RESPONSE_RECENT_LINES)).c_str()) == 0);
+  CHECK(lines.getRecent(RESPONSE_RECENT_LINES) == nullptr);
+
+  // Echo floods go through the buffer, the status has the last lines
+  resetPrinter();
+  printerConnected = true;
+  commandQueue.push("G29");
+  const uint32_t g29 = commandQueue.getPushedCount();
+  NativeLoop();
+  Serial.takeWritten();
+  for (int i = 0; i < 500; i++)
+    Serial.inject(("echo:Bed X: 10.000 Y: " + std::to_string(i) + ".000 Z: 0.125\n").c_str());
+  Serial.inject("ok\n");
+  NativeLoop();
+  CHECK(commandQueue.getAcknowledgedCount() == g29);
+  CHECK(getLastResponse() == "echo:Bed X: 10.000 Y: 497.000 Z: 0.125\necho:Bed X: 10.000 Y: 498.000 Z: 0.125\n"
+                             "echo:Bed X: 10.000 Y: 499.000 Z: 0.125\nok");
+}
+
+static void testClassifyResponses() {
+  const struct {
+    const char *line;
+    ResponseType type;
+  } lines[] = {
+    { "ok", ResponseType::Ok },
+    { "ok N12 P15 B3", ResponseType::Ok },
+    { "ok T:210.5 /215.0 B:60.2 /60.0", ResponseType::Ok },
+    { "echo:settings stored ok", ResponseType::Ok },
+    { " T:210.5 /215.0 B:60.2 /60.0 @:127", ResponseType::Temperature },
+    { "T:180.3 E:0 B:55.1", ResponseType::Temperature },
+    { "X:-33.00 Y:-10.00 Z:5.00 E:37.95 Count X:-3300 Y:-1000 Z:2000", ResponseType::Position },
+    { "echo:busy: processing", ResponseType::Busy },
+    { "echo:busy: paused for user", ResponseType::Busy },
+    { "Error:checksum mismatch, Last Line: 1", ResponseType::Error },
+    { "Resend: 2", ResponseType::Resend },
+    { "rs N2", ResponseType::Resend },
+    { "wait", ResponseType::Wait },
+    { "//action:pause", ResponseType::Action },
+    { "[MP] PV01 ON ESP", ResponseType::MeatPack },
+    { "echo: cold extrusion prevented", ResponseType::ColdExtrusion },
+    { "echo:Unknown command: \"X1\"", ResponseType::UnknownCommand },
+    { "echo:Active Extruder: 0", ResponseType::Other },
+    { "", ResponseType::Other },
+    { "o", ResponseType::Other },
+  };
+  bool classified = true;
+  for (const auto &test : lines) {
+    const bool ok = FirmwareDialect::get(FirmwareType::Marlin).classify(test.line, strlen(test.line)) == test.type;
+    if (!ok)
+      printf("  %s\n", test.line);
+    classified &= ok;
+  }
+  CHECK(classified);
+
+  // Host actions pause, resume and cancel the print
+  resetPrinter();
+  printerConnected = true;
+  isPrinting = true;
+  Serial.inject("//action:paused\n");
+  ReceiveResponses();
+  CHECK(printPause);
+  Serial.inject("//action:resume\n");
+  ReceiveResponses();
+  CHECK(!printPause);
+  Serial.inject("//action:notification Filament runout\n");
+  ReceiveResponses();
+  CHECK(!printPause && !cancelPrint);
+  Serial.inject("//action:cancel\n");
+  ReceiveResponses();
+  CHECK(cancelPrint);
+  resetPrinter();
+
+  // "wait" with commands in flight: their oks were lost
+  useChecksums = false;
+  fwAdvancedOkCap = false;
+  commandQueue.push("G1 X1");
+  SendCommands();
+  CHECK(Serial.takeWritten() == "G1 X1\r\n");
+  Serial.inject("wait\n");
+  ReceiveResponses();
+  CHECK(commandQueue.isAckEmpty());
+  Serial.inject("wait\n");
+  ReceiveResponses();
+  CHECK(commandQueue.isEmpty());
+  resetPrinter();
+}
+
+static void testGcodeReader() {
+  std::string content =
+    ";FLAVOR:Marlin\r\n"
+    "\r\n"
+    "  G28 ; home\r\n"
+    "(old style comment)\n"
+    "G1 X10 (inline) Y10\t\n"
+    "   \n"
+    ";" + std::string(600, 'c') + "\n" +
+    "G1 " + std::string(300, 'X') + "\n";
+  // Lines across block boundaries
+  std::vector<std::string> moves;
+  for (int i = 0; i < 200; i++) {
+    moves.push_back("G1 X" + std::to_string(i) + " Y" + std::to_string(i * 7) + " E" + std::to_string(i * 0.01));
+    content += moves.back() + (i % 3 ? " ;move\n" : "\n");
+  }
+  content += "M84";   // No end of line
+  writeSdFile("/reader.gcode", content);
+
+  GcodeReader reader;
+  sdfat::hostStats = sdfat::HostStats();
+  CHECK(reader.open(storageFS.open("/reader.gcode")));
+  CHECK(reader.readLine() == "G28");
+  CHECK_EQ(reader.getLineNumber(), 3u);
+  const CommandView move = reader.readLine();
+  CHECK(move == "G1 X10  Y10");
+  CHECK_EQ(move.length(), 11u);
+  bool same = true;
+  for (const std::string &expected : moves)
+    same &= reader.readLine() == expected.c_str();
+  CHECK(same);
+  CHECK(!reader.isEnd());
+  CHECK(reader.readLine() == "M84");
+  CHECK(reader.isEnd());
+  CHECK(reader.readLine().isEmpty());
+  CHECK_EQ(reader.getPosition(), content.size());
+  CHECK_EQ(reader.getLineNumber(), 209u);
+  // Whole blocks, read once
+  CHECK_EQ(sdfat::hostStats.sectorReads, (content.size() + 511) / 512);
+  CHECK(sdfat::hostStats.readCalls <= (content.size() + 511) / 512 + 1);
+  reader.close();
+
+  // Starting in the middle of the file
+  const size_t pos = content.find(moves[100]);
+  CHECK(reader.open(storageFS.open("/reader.gcode"), pos));
+  CHECK(reader.readLine() == moves[100].c_str());
+  reader.close();
+  CHECK(!reader.open(storageFS.open("/missing.gcode")));
+}
+
+static void testDetectPrinter() {
+  resetPrinter();
+  printerConnected = false;
+  for (int i = 0; i < 20 && !printerConnected; i++) {
+    NativeLoop();
+    acknowledge();
+    HostClock::advance(10);
+  }
+  CHECK(printerConnected);
+  CHECK(fwMachineType == "Ender-3 Pro");
+  CHECK_EQ(fwExtruders, 1);
+  CHECK(fwAutoreportTempCap);
+  CHECK(!fwProgressCap);
+
+  // Let the greeting (M117, M300, M155) go through
+  for (int i = 0; i < 20; i++) {
+    NativeLoop();
+    acknowledge();
+  }
+  CHECK(commandQueue.isEmpty());
+  CHECK(autoreportTempEnabled);
+}
+
+// Detects a printer answering M115 with m115, the lines it was sent
+static std::vector<std::string> detectFirmware(const char *m115) {
+  resetPrinter();
+  printerConnected = false;
+  std::vector<std::string> sent;
+  for (int i = 0; i < 60 && (!printerConnected || !commandQueue.isEmpty()); i++) {
+    NativeLoop();
+    for (const std::string &line : splitLines(Serial.takeWritten())) {
+      Serial.inject(line == "M115" ? m115 : "ok\n");
+      sent.push_back(line);
+    }
+    HostClock::advance(10);
+  }
+  return sent;
+}
+
+static void testFirmwareDialects() {
+  // Prusa: heating reports without targets, "// action:"
+  detectFirmware("FIRMWARE_NAME:Prusa-Firmware 3.13.2 based on Marlin FIRMWARE_URL:https://github.com/prusa3d/Prusa-Firmware "
+                 "PROTOCOL_VERSION:1.0 MACHINE_TYPE:Prusa i3 MK3S EXTRUDER_COUNT:1 UUID:00000000-0000-0000-0000-000000000000\n"
+                 "Cap:AUTOREPORT_TEMP:1\nok\n");
+  CHECK(printerConnected);
+  CHECK(firmware->type == FirmwareType::Prusa);
+  CHECK(fwMachineType == "Prusa i3 MK3S");
+  CHECK(fwAutoreportTempCap);
+  CHECK(parseTemperatures("T:180.3 E:0 W:?"));
+  CHECK_EQ(toolTemperature[0].actual, 18030);
+  isPrinting = true;
+  Serial.inject("// action:paused\n");
+  ReceiveResponses();
+  CHECK(printPause);
+  resetPrinter();
+
+  // Marlin reports the targets while heating too
+  detectFirmware(M115_MARLIN);
+  CHECK(firmware->type == FirmwareType::Marlin);
+  CHECK(!parseTemperatures("T:180.3 E:0 B:55.1"));
+  CHECK(firmware->classify("// action:paused", 16) == ResponseType::Other);
+
+  // Klipper: no machine type, numbered tools, no line numbers, errors that do not stop it
+  useChecksums = true;
+  std::vector<std::string> sent = detectFirmware("ok FIRMWARE_NAME:Klipper FIRMWARE_VERSION:v0.11.0-12-g5e2e3f8d\n");
+  CHECK(printerConnected);
+  CHECK(firmware->type == FirmwareType::Klipper);
+  CHECK(fwMachineType == "Klipper");
+  CHECK(!fwAutoreportTempCap);
+  CHECK(std::none_of(sent.begin(), sent.end(), [](const std::string &line) { return line.find("M110") != std::string::npos; }));
+  commandQueue.push("G1 X1");
+  SendCommands();
+  CHECK(Serial.takeWritten() == "G1 X1\r\n");
+  Serial.inject("ok\n");
+  ReceiveResponses();
+  CHECK(parseTemperatures("ok B:60.0 /60.0 T0:200.0 /210.0"));
+  CHECK_EQ(toolTemperature[0].target, 21000);
+  CHECK_EQ(bedTemperature.actual, 6000);
+  isPrinting = true;
+  Serial.inject("!! Move out of range: 300.000 0.000 0.200 [0.000]\n");
+  ReceiveResponses();
+  CHECK(!cancelPrint);
+  resetPrinter();
+  useChecksums = false;
+
+  // RepRapFirmware: a space after the colons, errors about a command
+  detectFirmware("FIRMWARE_NAME: RepRapFirmware for Duet 2 WiFi/Ethernet FIRMWARE_VERSION: 3.4.1 "
+                 "ELECTRONICS: Duet WiFi 1.02 or later FIRMWARE_DATE: 2022-06-01\nok\n");
+  CHECK(printerConnected);
+  CHECK(firmware->type == FirmwareType::RepRapFirmware);
+  CHECK(fwMachineType == "RepRapFirmware for Duet 2 WiFi/Ethernet");
+  isPrinting = true;
+  Serial.inject("Error: G0/G1: insufficient axes homed\n");
+  ReceiveResponses();
+  CHECK(!cancelPrint);
+  resetPrinter();
+
+  // Packing is asked for from any firmware that reports it, and its answer is read
+  for (const char *name : { "Marlin 2.1.2", "Prusa-Firmware 3.13.2", "RepRapFirmware 3.4.1", "Klipper" }) {
+    detectFirmware(("FIRMWARE_NAME:" + std::string(name) + "\nCap:MEATPACK:1\nok\n").c_str());
+    CHECK(printerConnected);
+    CHECK(strstr(name, firmware->name) == name);
+    CHECK(firmware->classify("[MP] PV01 ON ESP", 16) == ResponseType::MeatPack);
+    CHECK(meatPackRequested);
+    Serial.inject("[MP] PV01 ON ESP\n");
+    ReceiveResponses();
+    CHECK(meatPackActive);
+    CHECK(!meatPackRequested);
+    fwMeatPackCap = meatPackActive = meatPackRequested = false;
+  }
+  CHECK(FirmwareDialect::get(FirmwareType::Prusa).classify("wait", 4) == ResponseType::Wait);
+
+  detectFirmware(M115_MARLIN);
+  CHECK(firmware->type == FirmwareType::Marlin);
+  CHECK(fwAutoreportTempCap);
+}
+
+static void testPrintFile() {
+  resetPrinter();
+  const std::string content =
+    "; generated by test\n"
+    "G28 ; home\n"
+    "\n"
+    "(old style comment)\n"
+    "G1 X10 Y10 F3000\r\n"
+    "M104 S200\n"
+    "G1 X20 Y10 E1.5\n";
+  writeSdFile("/part.gcode", content);
+  uploadedFullname = "/part.gcode";
+  uploadedFileSize = content.size();
+  startPrint = true;
+
+  std::vector<std::string> sent;
+  for (int i = 0; i < 100 && (startPrint || isPrinting || !commandQueue.isEmpty()); i++) {
+    NativeLoop();
+    for (const std::string &line : acknowledge())
+      sent.push_back(line);
+    HostClock::advance(5);
+  }
+  CHECK(!isPrinting);
+  CHECK(commandQueue.isEmpty());
+
+  std::vector<std::string> gcode;
+  for (const std::string &line : sent)
+    if (line[0] == 'G' || line.compare(0, 4, "M104") == 0)
+      gcode.push_back(line);
+  CHECK_EQ(gcode.size(), 4u);
+  if (gcode.size() == 4) {
+    CHECK(gcode[0] == "G28");
+    CHECK(gcode[1] == "G1 X10 Y10 F3000");
+    CHECK(gcode[2] == "M104 S200");
+    CHECK(gcode[3] == "G1 X20 Y10 E1.5");
+  }
+  CHECK(sent.back() == "M117 Complete");
+  CHECK(printCompletion >= 99.9);
+}
+
+static void testGcodeCompactor() {
+  resetPrinter();
+  std::string content =
+    ";FLAVOR:Marlin\r\n"
+    "\r\n"
+    "G28 ; home\r\n"
+    "G1  X10.500\tY0.000 E.0100 F3000.0 (inline)\n"
+    "G1 X-0.00 Y2. Z1.20E3\n"
+    "M117 Layer  1.50\n"
+    ";" + std::string(600, 'c') + "\n";
+  std::vector<std::string> expected = { "G28", "G1 X10.5 Y0 E.01 F3000", "G1 X-0 Y2 Z1.20E3", "M117 Layer  1.50" };
+  for (int i = 0; i < 300; i++) {
+    content += ";TYPE:WALL\nG1 X" + std::to_string(i) + ".250 Y" + std::to_string(i * 7) + ".000 E" + std::to_string(i * 0.01) + "\n";
+    expected.push_back("G1 X" + std::to_string(i) + ".25 Y" + std::to_string(i * 7) + " E" + std::to_string(i * 0.01));
+    while (expected.back().back() == '0')
+      expected.back().pop_back();
+    if (expected.back().back() == '.')
+      expected.back().pop_back();
+  }
+  content += ";end\nM84";   // No end of line
+
+  // Received in small pieces, as an upload does
+  upload("compact.gcode", content, nullptr, 7);
+  expected.push_back("M84");
+  CHECK(uploadedFullname == "/compact.gcode");
+  CHECK(readSdFile("/compact.gcode") == content);
+  const std::string compacted = readSdFile(GCODE_CACHE_DIR "/compact.gcode");
+  std::string joined;
+  for (const std::string &line : expected)
+    joined += line + "\n";
+  CHECK(compacted == joined);
+  CHECK(compacted.size() < content.size() / 2);
+
+  // Read back with original positions
+  GcodeReader reader;
+  CHECK(GcodeCompactor::open(reader, "/compact.gcode", content.size()));
+  CHECK(reader.isCompacted());
+  bool same = true, forward = true;
+  uint32_t lastPos = 0;
+  for (const std::string &line : expected) {
+    same &= reader.readLine() == line.c_str();
+    forward &= reader.getPosition() >= lastPos && reader.getPosition() <= content.size();
+    lastPos = reader.getPosition();
+  }
+  CHECK(same);
+  CHECK(forward);
+  CHECK(reader.readLine().isEmpty());
+  CHECK(reader.isEnd());
+  CHECK_EQ(reader.getPosition(), content.size());
+  CHECK_EQ(reader.getLineNumber(), 609u);
+  reader.close();
+  // The copy of a different file is not used
+  CHECK(!GcodeCompactor::open(reader, "/compact.gcode", content.size() + 1));
+  CHECK(!GcodeCompactor::open(reader, "/missing.gcode", content.size()));
+
+  // Printing streams the compacted copy
+  startPrint = true;
+  std::vector<std::string> sent;
+  for (int i = 0; i < 2000 && (startPrint || isPrinting || !commandQueue.isEmpty()); i++) {
+    NativeLoop();
+    for (const std::string &line : acknowledge())
+      if (line[0] == 'G' || line == "M84")
+        sent.push_back(line);
+    HostClock::advance(5);
+  }
+  CHECK(!isPrinting);
+  CHECK_EQ(sent.size(), expected.size() - 1);
+  CHECK(sent.size() > 2 && sent[1] == expected[1]);
+  CHECK(printCompletion >= 99.9);
+  CHECK_EQ(lastPrintedLine, 609u);
+
+  // A new upload replaces the copy
+  upload("compact.gcode", "G28 ;home\nG1 X1.0\n", nullptr, 10);
+  CHECK(readSdFile(GCODE_CACHE_DIR "/compact.gcode") == "G28\nG1 X1\n");
+  CHECK(GcodeCompactor::open(reader, "/compact.gcode", 18));
+  reader.close();
+  // Deleting a file deletes its copy
+  GcodeCompactor::remove("/compact.gcode");
+  CHECK(!GcodeCompactor::open(reader, "/compact.gcode", 18));
+}
+
+// Compresses with the system gzip, as a browser or slicer would
+static std::string gzipped(const std::string &content, const char *options) {
+  writeSdFile("/plain.gcode", content);
+  std::string result;
+  FILE *p = popen(("gzip -c " + std::string(options) + " '" + sdRoot + "/plain.gcode'").c_str(), "r");
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), p)) > 0)
+    result.append(buf, n);
+  pclose(p);
+  remove((sdRoot + "/plain.gcode").c_str());
+  return result;
+}
+
+static std::string inflated;
+
+static bool inflate(GzipInflater &inflater, const std::string &gz, size_t chunk) {
+  inflated.clear();
+  if (!inflater.begin([](const uint8_t *data, size_t len) {
+        inflated.append((const char *)data, len);
+      }, [](uint32_t position, uint8_t *data, size_t len) {
+        if (position + len > inflated.size())
+          return false;
+        memcpy(data, inflated.data() + position, len);
+        return true;
+      }))
+    return false;
+  bool ok = true;
+  for (size_t index = 0; ok && index < gz.size(); index += chunk) {
+    const size_t len = std::min(chunk, gz.size() - index);
+    ok = inflater.write((const uint8_t *)gz.data() + index, len, index + len == gz.size());
+  }
+  return ok && inflater.isDone();
+}
+
+static void testUploadWrites() {
+  resetPrinter();
+  std::string content;
+  for (int i = 0; content.size() < 100000; i++)
+    content += "G1 X" + std::to_string(i % 200) + ".5 Y" + std::to_string(i * 3 % 200) + " E" + std::to_string(i) + "\n";
+
+  // TCP sized pieces are written to the card in whole sectors
+  SectorWriter writer;
+  sdfat::hostStats = sdfat::HostStats();
+  writer.begin(storageFS.open("/sectors.bin", "w"));
+  bool accepted = true;
+  for (size_t index = 0; index < content.size(); index += 1460) {
+    const size_t len = std::min<size_t>(1460, content.size() - index);
+    accepted &= writer.write((const uint8_t *)content.data() + index, len) == len;
+  }
+  CHECK(accepted);
+  CHECK(writer.close());
+  CHECK(readSdFile("/sectors.bin") == content);
+  CHECK_EQ(sdfat::hostStats.sectorWrites, (content.size() + 511) / 512);
+  CHECK_EQ(sdfat::hostStats.syncs, content.size() / WRITE_SYNC_BYTES + 1);
+  SD.remove("/sectors.bin");
+
+  // Synced every WRITE_SYNC_BYTES and at the end, not on every piece
+  sdfat::hostStats = sdfat::HostStats();
+  upload("sectors.gcode", content);
+  CHECK(readSdFile("/sectors.gcode") == content);
+  CHECK_EQ(sdfat::hostStats.syncs, content.size() / WRITE_SYNC_BYTES + 2);   // And the file index
+
+  // A slow upload is synced from time to time
+  sdfat::hostStats = sdfat::HostStats();
+  for (size_t index = 0; index < 20000; index += 1460) {
+    const size_t len = std::min<size_t>(1460, 20000 - index);
+    handleUpload(nullptr, "slow.gcode", index, (uint8_t *)content.data() + index, len, index + len == 20000);
+    HostClock::advance(1000);
+    writeUploadQueue(UPLOAD_WRITE_TIME_US);   // The loop() pass
+  }
+  CHECK(readSdFile("/slow.gcode") == content.substr(0, 20000));
+  CHECK(sdfat::hostStats.syncs >= 14000 / WRITE_SYNC_MS - 1);
+
+  // The "true" and "false" parts sent by Cura do not reach the card
+  handleUpload(nullptr, "print.gcode", 0, (uint8_t *)"true", 4, true);
+  handleUpload(nullptr, "select.gcode", 0, (uint8_t *)"false", 5, true);
+  CHECK(uploadedFullname == "/slow.gcode");
+  for (const char *name : { "/tmp0", "/tmp1", "/tmp2", "/tmp3", "/print.gcode", "/select.gcode" })
+    CHECK(!SD.exists(name));
+}
+
+static void testContiguousUpload() {
+  resetPrinter();
+  std::string content = ";FLAVOR:Marlin\n";
+  for (int i = 0; content.size() < 60000; i++)
+    content += "G1 X" + std::to_string(i % 200) + ".25 Y" + std::to_string(i * 3 % 200) + " E" + std::to_string(i) + " ; move\n";
+
+  // The form is a little bigger than the file: both copies are allocated for it and truncated at the end
+  AsyncWebServerRequest request(HTTP_POST, "/api/files/local");
+  request.setContentLength(content.size() + 300);
+  const uint64_t freeSpace = storageFS.getFreeSpace(), cluster = SD.blocksPerCluster() * 512;
+  sdfat::hostStats = sdfat::HostStats();
+  upload("raw.gcode", content, &request);
+  CHECK(!uploadRejected);
+  CHECK(readSdFile("/raw.gcode") == content);
+
+  // Counted as the files are written, without scanning the FAT again
+  CHECK_EQ(sdfat::hostStats.freeScans, 0u);
+  CHECK(storageFS.getFreeSpace() <= freeSpace - (content.size() + cluster - 1) / cluster * cluster);
+  writeSdFile("/spare.gcode", content);
+  const uint64_t beforeRemove = storageFS.getFreeSpace();
+  CHECK(storageFS.remove("/spare.gcode"));
+  CHECK_EQ(storageFS.getFreeSpace(), beforeRemove + 2 * cluster);
+  uint32_t first, last;
+  FileWrapper file = storageFS.open("/raw.gcode");
+  CHECK(file.contiguousRange(first, last));
+  CHECK_EQ(file.size(), content.size());
+  file.close();
+  GcodeReader reader;
+  CHECK(GcodeCompactor::open(reader, "/raw.gcode", content.size()));
+  CHECK(reader.isRaw());
+  reader.close();
+
+  // Read with raw multi-block reads, no FAT lookups, as the file system would
+  GcodeReader plain;
+  writeSdFile("/fragmented.gcode", content);
+  CHECK(plain.open(storageFS.open("/fragmented.gcode")));
+  CHECK(!plain.isRaw());
+  sdfat::hostStats = sdfat::HostStats();
+  CHECK(reader.open(storageFS.open("/raw.gcode")));
+  CHECK(reader.isRaw());
+  bool same = true;
+  while (!plain.isEnd())
+    same &= strcmp(reader.readLine().c_str(), plain.readLine().c_str()) == 0;
+  CHECK(same);
+  CHECK(reader.readLine().isEmpty());
+  CHECK(reader.isEnd());
+  CHECK_EQ(reader.getPosition(), content.size());
+  reader.close();
+  plain.close();
+  const uint32_t plainLookups = sdfat::hostStats.fatLookups;
+  CHECK(plainLookups >= content.size() / (64 * 512));
+  sdfat::hostStats = sdfat::HostStats();
+  CHECK(reader.open(storageFS.open("/raw.gcode")));
+  while (!reader.readLine().isEmpty());
+  CHECK_EQ(sdfat::hostStats.fatLookups, 0u);
+  CHECK_EQ(sdfat::hostStats.sectorReads, (content.size() + 511) / 512);
+  CHECK_EQ(sdfat::hostStats.readCalls, (content.size() + GCODE_RAW_BLOCKS * 512 - 1) / (GCODE_RAW_BLOCKS * 512));
+  reader.close();
+
+  // Rejected before anything is written when the card cannot take it
+  AsyncWebServerRequest big(HTTP_POST, "/api/files/local");
+  big.setContentLength(storageFS.getFreeSpace() + 1);
+  upload("big.gcode", content.substr(0, 2920), &big);
+  CHECK(uploadRejected);
+  CHECK(uploadedFullname == "/raw.gcode");
+  for (const char *name : { "/tmp0", "/tmp1", "/tmp2", "/tmp3", "/big.gcode" })
+    CHECK(!SD.exists(name));
+  AsyncWebServerRequest done(HTTP_POST, "/api/files/local");
+  CHECK(webServer.handle(done));
+  CHECK(done.response() && done.response()->code() == 507);
+  uploadRejected = false;
+}
+
+static void testGzipUpload() {
+  resetPrinter();
+  // 20 KB of lines seen twice: the second time is copied from further back than a 16 KB window
+  std::string block, content;
+  uint32_t seed = 1;
+  for (int i = 0; block.size() < 20000; i++) {
+    seed = seed * 1103515245 + 12345;
+    block += "G1 X" + std::to_string(seed % 2000 / 10.0).substr(0, 6) + " Y" + std::to_string(seed / 7 % 2000) + " E" + std::to_string(i) + "\n";
+  }
+  content = ";FLAVOR:Marlin\n" + block + "M117 again\n" + block + "M84\n";
+  const std::string gz = gzipped(content, "-9");
+  CHECK(GzipInflater::isGzip((const uint8_t *)gz.data(), gz.size()));
+  CHECK(!GzipInflater::isGzip((const uint8_t *)content.data(), content.size()));
+
+  GzipInflater inflater;
+  CHECK(inflate(inflater, gz, 1));
+  CHECK(inflated == content);
+  CHECK_EQ(inflater.getSize(), content.size());
+  CHECK_EQ(inflater.getWindowSize(), 16384u);
+  CHECK(inflater.getHistoryReads() > 0);
+  ESP.freeHeap = 100000;
+  CHECK(inflate(inflater, gz, 333));
+  CHECK(inflated == content);
+  CHECK_EQ(inflater.getWindowSize(), 32768u);
+  CHECK_EQ(inflater.getHistoryReads(), 0u);
+  ESP.freeHeap = 10000;
+  CHECK(!inflate(inflater, gz, 333));
+  ESP.freeHeap = 40000;
+  // Random bytes go in stored blocks; header with the file name
+  std::string noise;
+  for (int i = 0; i < 3000; i++) {
+    seed = seed * 1103515245 + 12345;
+    noise += (char)(seed >> 16);
+  }
+  CHECK(inflate(inflater, gzipped(noise, "-N"), 7));
+  CHECK(inflated == noise);
+  std::string bad = gz;
+  bad[bad.size() - 6] ^= 1;   // CRC
+  CHECK(!inflate(inflater, bad, 333));
+  CHECK(inflater.failed());
+  CHECK(!inflate(inflater, gz.substr(0, gz.size() - 1), 333));
+  inflater.end();
+
+  // Uploaded in pieces, the SD gets the inflated file and its compacted copy
+  upload("zipped.gcode.gz", gz);
+  CHECK(uploadedFullname == "/zipped.gcode");
+  CHECK_EQ(uploadedFileSize, content.size());
+  CHECK(readSdFile("/zipped.gcode") == content);
+  GcodeReader reader;
+  CHECK(GcodeCompactor::open(reader, "/zipped.gcode", content.size()));
+  CHECK(reader.isCompacted());
+  size_t commands = 0;
+  while (!reader.readLine().isEmpty())
+    ++commands;
+  CHECK_EQ(commands, splitLines(content).size() - 1);
+  reader.close();
+
+  // A damaged one is not stored
+  upload("bad.gcode.gz", bad);
+  CHECK(readSdFile("/bad.gcode").empty());
+  CHECK(!GcodeCompactor::open(reader, "/bad.gcode", content.size()));
+}
+
+static void testGzipPrint() {
+  resetPrinter();
+  std::string content = ";FLAVOR:Marlin\n";
+  for (int i = 0; i < 3000; i++)
+    content += "G1 X" + std::to_string(i % 200) + " Y" + std::to_string(i * 7 % 200) + " E" + std::to_string(i) + " ; move\n";
+  content += "M84";
+  const std::string gz = gzipped(content, "-9");
+  writeSdFile("/packed.gcode.gz", gz);
+
+  // Read as the plain file is
+  ESP.freeHeap = 100000;
+  GcodeReader reader, plain;
+  writeSdFile("/plain.gcode", content);
+  CHECK(reader.open(storageFS.open("/packed.gcode.gz")));
+  CHECK(reader.isGzip());
+  CHECK(plain.open(storageFS.open("/plain.gcode")));
+  bool same = true;
+  while (!plain.isEnd()) {
+    same &= strcmp(reader.readLine().c_str(), plain.readLine().c_str()) == 0;
+    same &= reader.getLineNumber() == plain.getLineNumber();
+  }
+  CHECK(same);
+  CHECK(reader.readLine().isEmpty());
+  CHECK(reader.isEnd());
+  CHECK(!reader.failed());
+  CHECK_EQ(reader.getPosition(), gz.size());
+  CHECK(reader.getCompletion(gz.size()) >= 99.9);
+  reader.close();
+  plain.close();
+  // A deflate stream is only read from its start
+  CHECK(!reader.open(storageFS.open("/packed.gcode.gz"), gz.size() / 2, 1500));
+  // Without heap for a 32 KB window it cannot be read, and the print tells why
+  ESP.freeHeap = 40000;
+  CHECK(!GcodeReader::canInflate());
+  CHECK(!reader.open(storageFS.open("/packed.gcode.gz")));
+  CHECK(reader.isOutOfMemory());
+  uploadedFullname = "/packed.gcode.gz";
+  uploadedFileSize = gz.size();
+  startPrint = true;
+  std::vector<std::string> told;
+  for (int i = 0; i < 10; i++) {
+    NativeLoop();
+    for (const std::string &line : acknowledge())
+      told.push_back(line);
+  }
+  CHECK(!isPrinting);
+  CHECK(std::count(told.begin(), told.end(), "M117 No memory to inflate file") == 1);
+
+  // Printed with progress in the compressed file
+  ESP.freeHeap = 100000;
+  uploadedFullname = "/packed.gcode.gz";
+  uploadedFileSize = gz.size();
+  startPrint = true;
+  size_t commands = 0;
+  bool forward = true, checkpointed = false;
+  float lastCompletion = 0;
+  for (int i = 0; i < 20000 && (startPrint || isPrinting || !commandQueue.isEmpty()); i++) {
+    NativeLoop();
+    for (const std::string &line : acknowledge())
+      if (line[0] == 'G' || line == "M84")
+        ++commands;
+    forward &= filePos <= gz.size() && printCompletion >= lastCompletion && printCompletion <= 100;
+    lastCompletion = printCompletion;
+    checkpointed |= (bool)checkpoint;
+    HostClock::advance(5);
+  }
+  CHECK(!isPrinting);
+  CHECK(!checkpointed);   // Its positions cannot be resumed
+  CHECK_EQ(commands, 3001u);
+  CHECK(forward);
+  CHECK_EQ(filePos, gz.size());
+  CHECK(printCompletion >= 99.9);
+  CHECK_EQ(lastPrintedLine, 3002u);
+
+  // A checkpoint of it, left by an older firmware, is not resumed
+  PrintCheckpoint old;
+  CHECK(old.begin("/packed.gcode.gz", gz.size(), gz.size() / 2, 1500));
+  CHECK(old.save(60, GcodeState()));
+  recoverPrint = true;
+  std::vector<std::string> resumed;
+  for (int i = 0; i < 10; i++) {
+    NativeLoop();
+    for (const std::string &line : acknowledge())
+      resumed.push_back(line);
+  }
+  CHECK(!isPrinting);
+  CHECK(std::count(resumed.begin(), resumed.end(), "M117 Can't open file") == 1);
+  CHECK(std::none_of(resumed.begin(), resumed.end(), [](const std::string &line) { return line[0] == 'G'; }));
+  storageFS.remove(CHECKPOINT_PATH);
+
+  // A damaged file ends the print with an error
+  std::string bad = gz;
+  bad[bad.size() / 2] ^= 0x55;
+  writeSdFile("/packed.gcode.gz", bad);
+  startPrint = true;
+  std::vector<std::string> sent;
+  for (int i = 0; i < 20000 && (startPrint || isPrinting || !commandQueue.isEmpty()); i++) {
+    NativeLoop();
+    for (const std::string &line : acknowledge())
+      sent.push_back(line);
+    HostClock::advance(5);
+  }
+  CHECK(!isPrinting);
+  CHECK(!sent.empty() && sent.back() == "M117 Error inflating file");
+  ESP.freeHeap = 40000;
+}
+
+static void testReceiveTimeout() {
+  resetPrinter();
+  printerConnected = true;
+  commandQueue.push("G4 S10");
+  NativeLoop();
+  CHECK(!commandQueue.isAckEmpty());
+  HostClock::advance(KEEPALIVE_INTERVAL + 1);
+  NativeLoop();
+  // Connected: the command is still waiting for its ok
+  CHECK(!commandQueue.isAckEmpty());
+  Serial.inject("ok\n");
+  NativeLoop();
+  CHECK(commandQueue.isAckEmpty());
+
+  printerConnected = false;
+  commandQueue.push("M115");
+  SendCommands();
+  HostClock::advance(KEEPALIVE_INTERVAL + 1);
+  ms = millis();
+  ReceiveResponses();
+  CHECK(commandQueue.isEmpty());
+  printerConnected = true;
+}
+
+static void testAdvancedOk() {
+  resetPrinter();
+  printerConnected = true;
+  fwAdvancedOkCap = false;
+  printerBufsize = 1;
+  for (int i = 1; i <= 6; i++)
+    commandQueue.push("G1 X" + String(i));
+
+  // Plain ok: one command at a time
+  for (int i = 0; i < 5; i++)
+    NativeLoop();
+  CHECK_EQ(splitLines(Serial.takeWritten()).size(), 1u);
+  Serial.inject("ok\n");
+  for (int i = 0; i < 5; i++)
+    NativeLoop();
+  CHECK(!fwAdvancedOkCap);
+  CHECK_EQ(commandQueue.getSentCount(), 1);
+
+  // "B3" means BUFSIZE 4: keep 4 in flight
+  Serial.inject("ok P15 B3\n");
+  for (int i = 0; i < 5; i++)
+    NativeLoop();
+  CHECK(fwAdvancedOkCap);
+  CHECK_EQ(printerPlannerFree, 15);
+  CHECK_EQ(printerBufferFree, 3);
+  CHECK_EQ(printerBufsize, 4);
+  CHECK_EQ(commandQueue.getSentCount(), 4);
+  CHECK_EQ(splitLines(Serial.takeWritten()).size(), 5u);
+
+  // The window is the last B: commands of the printer itself (its LCD, its SD) take slots too
+  for (int i = 7; i <= 10; i++)
+    commandQueue.push("G1 X" + String(i));
+  Serial.inject("ok P15 B0\nok P15 B0\n");
+  for (int i = 0; i < 5; i++)
+    NativeLoop();
+  CHECK_EQ(printerSlotsFree, 0);
+  CHECK_EQ(commandQueue.getSentCount(), 3);
+  CHECK_EQ(splitLines(Serial.takeWritten()).size(), 1u);
+  // An ok without them frees one
+  Serial.inject("ok\n");
+  for (int i = 0; i < 5; i++)
+    NativeLoop();
+  CHECK_EQ(commandQueue.getSentCount(), 3);
+  CHECK_EQ(splitLines(Serial.takeWritten()).size(), 1u);
+
+  // A temperature report is not mistaken for it
+  CHECK(!parseAdvancedOk("ok T:210.5 /215.0 B:60.2 /60.0 @:127 B@:0\n"));
+  CHECK(parseAdvancedOk("ok N120 P0 B0\n"));
+  CHECK_EQ(printerPlannerFree, 0);
+
+  fwAdvancedOkCap = false;
+  printerBufsize = printerSlotsFree = 1;
+}
+
+// Runs the sketch against the simulator until the print ends or timeoutMs passes
+static void runSimulated(PrinterSimulator &printer, const uint32_t timeoutMs) {
+  const uint64_t end = HostClock::getMicros() + timeoutMs * 1000ULL;
+  while ((startPrint || isPrinting || !commandQueue.isEmpty() || printer.plannerBlocks()) && HostClock::getMicros() < end) {
+    NativeLoop();
+    HostClock::advanceMicros(100);
+    printer.update();
+  }
+}
+
+static void testSimulatedPrint() {
+  resetPrinter();
+  std::string content = "G28\nM109 S200\nG1 F3000\n";
+  for (int i = 0; i < 200; i++)
+    content += "G1 X" + std::to_string(10 + i % 2) + " Y" + std::to_string(i) + " E" + std::to_string(i) + "\n";
+  writeSdFile("/sim.gcode", content);
+
+  PrinterSimulator::Config cfg;
+  cfg.heatRate = 100;
+  PrinterSimulator printer(Serial, cfg);
+  uploadedFullname = "/sim.gcode";
+  uploadedFileSize = content.size();
+  startPrint = true;
+  runSimulated(printer, 60000);
+  CHECK(!isPrinting);
+  CHECK(commandQueue.isEmpty());
+  CHECK_EQ(printer.stats().moves, 201u);
+  CHECK(printer.hotendTemperature() >= 199);
+  CHECK_EQ(printer.stats().rxOverflows, 0u);
+  CHECK(!printer.halted());
+  CHECK(queueStarvations <= 1);    // Only once the whole file was read
+
+  // A halted printer cancels the print
+  resetPrinter();
+  cfg.errorAtCommand = 50;
+  PrinterSimulator failing(Serial, cfg);
+  startPrint = true;
+  runSimulated(failing, 60000);
+  CHECK(failing.halted());
+  CHECK(!isPrinting);
+  CHECK(failing.stats().moves < 100);
+}
+
+static void testUploadQueue() {
+  // The sender only sends into the window, the queue never runs out of room. The
+  // segments also carry the form headers, the TCP layer acknowledges them too.
+  UploadQueue queue;
+  AsyncClient client, other;
+  CHECK(queue.begin(&client, "queued.gcode", 0));
+  CHECK(queue.isActive());
+  CHECK(!queue.begin(&other, "other.gcode", 0));
+  CHECK(queue.isRefused(&other));
+  CHECK(!queue.isRefused(&client));
+  std::string content;
+  for (int i = 0; content.size() < 50000; i++)
+    content += "G1 X" + std::to_string(i % 200) + " Y" + std::to_string(i % 70) + "\n";
+  std::string written;
+  size_t sent = 0;
+  bool accepted = true, held = false;
+  while (written.size() < content.size()) {
+    while (sent < content.size() && client.window() >= 1460) {
+      const size_t header = sent == 0 ? 180 : 0;
+      const size_t len = std::min<size_t>(1460 - header, content.size() - sent);
+      client.beginSegment();
+      accepted &= queue.push(&client, (const uint8_t *)content.data() + sent, len);
+      CHECK(queue.push(&other, (const uint8_t *)"G28\n", 4));   // Not taken
+      client.endSegment(header + len + (sent + len == content.size() ? 46 : 0));
+      sent += len;
+      held |= client.window() < AsyncClient::WINDOW;
+    }
+    const uint8_t *data;
+    const size_t len = std::min<size_t>(1000, queue.peek(data));
+    written.append((const char *)data, len);
+    queue.pop(len);
+  }
+  queue.finish(&client);
+  CHECK(accepted);
+  CHECK(held);
+  CHECK(written == content);
+  CHECK_EQ(queue.size(), 0u);
+  CHECK(queue.isComplete());
+  CHECK(!queue.isFailed());
+  CHECK_EQ(client.window(), AsyncClient::WINDOW);
+  CHECK(queue.end() == nullptr);
+  CHECK(!queue.isActive());
+
+  // Too many bytes fail the upload, the rest are dropped and acknowledged
+  CHECK(queue.begin(&client, "fast.gcode", 0));
+  CHECK(!queue.isRefused(&client));
+  CHECK(!queue.push(&client, (const uint8_t *)content.data(), UPLOAD_QUEUE_SIZE + 1));
+  CHECK(queue.isFailed());
+  client.beginSegment();
+  CHECK(queue.push(&client, (const uint8_t *)content.data(), 1460));
+  client.endSegment(1460);
+  CHECK_EQ(client.window(), AsyncClient::WINDOW);
+  CHECK_EQ(queue.size(), 0u);
+  queue.disconnect(&client);
+  CHECK(queue.isComplete());
+  queue.end();
+
+  // Another upload is turned away while one is written
+  AsyncWebServerRequest first(HTTP_POST, "/api/files/local"), second(HTTP_POST, "/api/files/local");
+  handleUpload(&first, "first.gcode", 0, (uint8_t *)"G28\n", 4, false);
+  CHECK(webServer.handle(second, "second.gcode", (const uint8_t *)"G28\nG1 X2\n", 10));
+  CHECK(second.response() && second.response()->code() == 409);
+  handleUpload(&first, "first.gcode", 4, (uint8_t *)"G1 X1\n", 6, true);
+  while (uploadQueue.isActive())
+    writeUploadQueue(UPLOAD_WRITE_TIME_US);
+  CHECK(readSdFile("/first.gcode") == "G28\nG1 X1\n");
+  CHECK(!SD.exists("/second.gcode"));
+
+  // The next job is uploaded while a print runs: the print reads first, the loop writes the upload
+  resetPrinter();
+  std::string print = "G28\nG1 F3000\n";
+  for (int i = 0; i < 1500; i++)
+    print += "G1 X" + std::to_string(10 + i % 2) + " Y" + std::to_string(i % 200) + " E" + std::to_string(i) + "\n";
+  writeSdFile("/running.gcode", print);
+  PrinterSimulator::Config cfg;
+  cfg.moveTimeUs = 20000;
+  PrinterSimulator printer(Serial, cfg);
+  uploadedFullname = "/running.gcode";
+  uploadedFileSize = print.size();
+  startPrint = true;
+  auto pass = [&]() {
+    NativeLoop();
+    HostClock::advanceMicros(100);
+    printer.update();
+  };
+  for (int i = 0; i < 1000; i++)
+    pass();
+  CHECK(isPrinting);
+  const uint32_t overflows = uploadOverflows;
+  sdfat::hostStats = sdfat::HostStats();
+  AsyncWebServerRequest request(HTTP_POST, "/api/files/local");
+  CHECK(webServer.handle(request, "next.gcode", (const uint8_t *)content.data(), content.size(), 1460, pass));
+  CHECK(request.response() && request.response()->code() == 201);
+  CHECK_EQ(uploadOverflows, overflows);
+  CHECK(readSdFile("/next.gcode") == content);
+  CHECK(uploadedFullname == "/next.gcode");
+  CHECK(isPrinting);
+
+  // The file being printed is not replaced or removed under the print
+  AsyncWebServerRequest replace(HTTP_POST, "/api/files/local");
+  CHECK(webServer.handle(replace, "running.gcode", (const uint8_t *)content.data(), 20000, 1460, pass));
+  CHECK(replace.response() && replace.response()->code() == 409);
+  CHECK(readSdFile("/running.gcode") == print);
+  CHECK(uploadedFullname == "/next.gcode");
+  CHECK(fileIndex.add("/running.gcode"));
+  const int32_t running = fileIndex.find("/running.gcode");
+  FileIndexEntry entry;
+  CHECK(running >= 0 && fileIndex.get(running, entry));
+  AsyncWebServerRequest remove(HTTP_GET, "/files/delete?id=" + FileIndex::getId(running, entry));
+  CHECK(webServer.handle(remove));
+  CHECK(remove.response() && remove.response()->code() == 409);
+  CHECK(readSdFile("/running.gcode") == print);
+  uploadedFileSize = print.size();
+  runSimulated(printer, 600000);
+  CHECK(!isPrinting);
+  CHECK_EQ(printer.stats().moves, 1501u);
+  CHECK(queueStarvations <= 1);
+  CHECK_EQ(printer.stats().rxOverflows, 0u);
+}
+
+// Runs a GET of the file API and parses its JSON
+static void getFiles(const String &url, DynamicJsonDocument &doc) {
+  AsyncWebServerRequest request(HTTP_GET, url);
+  CHECK(webServer.handle(request));
+  CHECK(request.response() && !deserializeJson(doc, request.response()->content().c_str()));
+}
+
+static void testFileIndex() {
+  std::set<std::string> names;
+  for (int i = 0; i < 150; i++) {
+    const std::string name = "part" + std::to_string(i) + (i % 10 == 0 ? "-with-a-name-longer-than-the-hundred-and-fifteen-characters-a-record-holds-so-it-is-read-from-the-directory-entry" : "") + ".gcode";
+    writeSdFile(("/" + name).c_str(), "G28\n" + std::string(i, 'G') + "\n");
+    names.insert(name);
+  }
+  writeSdFile("/notes.txt", "not G-code\n");
+
+  // Built once, then a page costs a few index reads and no directory scan
+  CHECK(fileIndex.begin());
+  CHECK(fileIndex.isStale());
+  DynamicJsonDocument doc(4096);
+  getFiles("/files/list", doc);
+  CHECK(!fileIndex.isStale());
+  const uint16_t others = fileIndex.getCount() - names.size();   // Left by the other tests
+  sdfat::hostStats = sdfat::HostStats();
+  getFiles("/files/list?i=" + String((int)doc["next"].asInteger()), doc);
+  CHECK_EQ(doc["files"].size(), (size_t)MAX_FILES_PER_LIST);
+  size_t longNames = 0;
+  for (size_t i = 0; i < doc["files"].size(); i++)
+    longNames += doc["files"][(int)i]["name"].as<String>().length() > FILE_INDEX_NAME_LENGTH;
+  CHECK_EQ(sdfat::hostStats.dirReads, longNames);   // Only to read the whole long names
+  // Two binary searches for the directory in the order by name, then an order and a record read per file
+  const uint32_t steps = 2 * (32 - __builtin_clz(fileIndex.getCount()));
+  CHECK(sdfat::hostStats.sectorReads <= 2 * (steps + MAX_FILES_PER_LIST));
+
+  // Paging lists every G-code file once, whole names included
+  std::set<std::string> listed;
+  std::map<std::string, String> ids;
+  for (long long next = 0; ; ) {
+    getFiles("/files/list?i=" + String((int)next), doc);
+    if (doc["files"].size() == 0)
+      break;
+    for (size_t i = 0; i < doc["files"].size(); i++) {
+      const std::string name = doc["files"][(int)i]["name"].as<String>().c_str();
+      if (!names.count(name))
+        continue;
+      CHECK(!listed.count(name));
+      listed.insert(name);
+      ids[name] = doc["files"][(int)i]["id"].as<String>();
+      CHECK_EQ(doc["files"][(int)i]["size"].asInteger(), (long long)readSdFile(("/" + name).c_str()).size());
+    }
+    next = doc["next"].asInteger();
+  }
+  CHECK(listed == names);
+
+  // Found by id with a single index read and directory entry
+  const String longName = "part20-with-a-name-longer-than-the-hundred-and-fifteen-characters-a-record-holds-so-it-is-read-from-the-directory-entry.gcode";
+  sdfat::hostStats = sdfat::HostStats();
+  const int32_t record = fileIndex.findId(ids[longName.c_str()]);
+  FileIndexEntry entry;
+  CHECK(record >= 0 && fileIndex.get(record, entry) && fileIndex.getName(entry) == longName);
+  CHECK_EQ(sdfat::hostStats.dirReads, 2u);   // The entry of the id, then the one with the whole name
+  getFiles("/files/choose?id=" + ids[longName.c_str()], doc);
+  CHECK(doc["files"][0]["name"] == longName);
+  CHECK(uploadedFullname == "/" + longName);
+
+  // Deleted and uploaded files update the index, the other ids stay
+  getFiles("/files/delete?id=" + ids["part7.gcode"], doc);
+  CHECK(doc["files"][0]["id"] == ids["part7.gcode"]);
+  CHECK(!SD.exists("/part7.gcode"));
+  CHECK_EQ(fileIndex.getCount(), others + 149);
+  CHECK_EQ(fileIndex.find("/part7.gcode"), -1);
+  getFiles("/files/delete?id=" + ids["part7.gcode"], doc);
+  CHECK(doc["files"].size() == 0);
+  upload("fresh.gcode", "G28\nG1 X1\n");
+  CHECK_EQ(fileIndex.getCount(), others + 150);
+  const int32_t fresh = fileIndex.find("/fresh.gcode");
+  CHECK(fresh >= 0 && fileIndex.get(fresh, entry) && entry.size == 10);
+  upload("fresh.gcode", "G28\nG1 X1 Y2\n");
+  CHECK_EQ(fileIndex.find("/fresh.gcode"), fresh);
+  CHECK(fileIndex.get(fresh, entry) && entry.size == 13);
+  CHECK_EQ(fileIndex.getCount(), others + 150);
+  CHECK(!fileIndex.isStale());
+  getFiles("/files/choose?id=" + ids["part8.gcode"], doc);
+  CHECK(doc["files"][0]["name"] == "part8.gcode");
+
+  // Kept across a restart, and rebuilt when the card was changed on a PC
+  CHECK(fileIndex.begin());
+  CHECK(!fileIndex.isStale());
+  CHECK_EQ(fileIndex.getCount(), others + 150);
+  SD.remove("/part9.gcode");
+  writeSdFile("/pc.gcode", "G28\n");
+  CHECK(fileIndex.begin());
+  CHECK(fileIndex.isStale());
+  CHECK(fileIndex.refresh());
+  CHECK_EQ(fileIndex.getCount(), others + 150);
+  CHECK_EQ(fileIndex.find("/part9.gcode"), -1);
+  CHECK(fileIndex.find("/pc.gcode") >= 0);
+  CHECK_EQ(fileIndex.find("/fresh.gcode"), fresh);
+  getFiles("/files/choose?id=" + ids["part11.gcode"], doc);
+  CHECK(doc["files"][0]["name"] == "part11.gcode");
+
+  // An id that is not the file of its directory entry any more makes it stale
+  SD.remove("/part12.gcode");
+  writeSdFile("/part12.gcode", "G28\nG28\n");
+  getFiles("/files/delete?id=" + ids["part12.gcode"], doc);
+  CHECK(doc["files"].size() == 0);
+  CHECK(SD.exists("/part12.gcode"));
+  CHECK(fileIndex.isStale());
+
+  for (const std::string &name : names)
+    SD.remove(("/" + name).c_str());
+  for (const char *name : { "/notes.txt", "/pc.gcode", "/fresh.gcode" })
+    SD.remove(name);
+  CHECK(fileIndex.begin());
+  CHECK(fileIndex.refresh());
+  CHECK_EQ(fileIndex.getCount(), others);
+}
+
+static void testFileListStream() {
+  std::set<std::string> names;
+  for (int i = 0; i < 120; i++) {
+    const std::string name = "list" + std::to_string(i) + (i % 7 == 0 ? "-named-\"like this\"-with-a-name-longer-than-the-hundred-and-fifteen-characters-a-record-holds-so-it-is-read-from-the-directory" : "") + ".gcode";
+    writeSdFile(("/" + name).c_str(), "G28\n");
+    names.insert(name);
+  }
+  CHECK(fileIndex.begin());
+
+  // The whole library in one chunked response
+  AsyncWebServerRequest request(HTTP_GET, "/files/list?n=0");
+  CHECK(webServer.handle(request));
+  AsyncCallbackResponse *response = static_cast<AsyncCallbackResponse *>(request.response());
+  CHECK(response && response->chunked());
+  const std::string json = response->content();
+  CHECK(json.size() > 2 * AsyncCallbackResponse::WINDOW);
+  DynamicJsonDocument doc(65536);
+  CHECK(!deserializeJson(doc, json.c_str()));
+  CHECK_EQ(doc["files"].size(), (size_t)fileIndex.getCount());
+  std::set<std::string> listed;
+  for (size_t i = 0; i < doc["files"].size(); i++)
+    if (names.count(doc["files"][(int)i]["name"].as<String>().c_str()))
+      listed.insert(doc["files"][(int)i]["name"].as<String>().c_str());
+  CHECK(listed == names);
+  CHECK_EQ(doc["next"].asInteger(), (long long)fileIndex.getCount());
+  getFiles("/files/list?n=0&i=" + String((int)doc["next"].asInteger()), doc);
+  CHECK(doc["files"].size() == 0 && doc["next"].asInteger() == fileIndex.getCount());
+
+  // The same bytes whatever room the response buffer has
+  for (size_t room : { 1, 7, 100 }) {
+    FileListStream list(FileListQuery{});
+    std::string out;
+    uint8_t buffer[100];
+    bool fits = true;
+    for (size_t n; (n = list.read(buffer, room)) > 0; ) {
+      fits = fits && n <= room;
+      out.append((const char *)buffer, n);
+    }
+    CHECK(fits && out == json);
+  }
+
+  // Pages of any size
+  getFiles("/files/list?n=25", doc);
+  CHECK_EQ(doc["files"].size(), 25u);
+  getFiles("/files/list", doc);
+  CHECK_EQ(doc["files"].size(), (size_t)MAX_FILES_PER_LIST);
+
+  for (const std::string &name : names)
+    SD.remove(("/" + name).c_str());
+  CHECK(fileIndex.begin());
+  CHECK(fileIndex.refresh());
+}
+
+// Lists a directory whole with the query given
+static std::vector<std::string> listFiles(const String &query, DynamicJsonDocument &doc) {
+  std::vector<std::string> names;
+  getFiles("/files/list?n=0&" + query, doc);
+  for (size_t i = 0; i < doc["files"].size(); i++)
+    names.push_back(doc["files"][(int)i]["name"].as<String>().c_str());
+  return names;
+}
+
+static bool sortedIgnoringCase(const std::vector<std::string> &names) {
+  for (size_t i = 1; i < names.size(); i++)
+    if (strcasecmp(names[i - 1].c_str(), names[i].c_str()) > 0)
+      return false;
+  return true;
+}
+
+static void testFileFolders() {
+  // A card of a print farm: jobs in folders, and a hidden one left out
+  SD.mkdir("/jobs");
+  SD.mkdir("/jobs/farm");
+  SD.mkdir("/.hidden");
+  writeSdFile("/.hidden/secret.gcode", "G28\n");
+  writeSdFile("/jobs/readme.gcode", "G28\n");
+  std::vector<std::string> farm;
+  for (int i = 0; i < 40; i++) {
+    const std::string name = (i % 2 ? "Benchy-" : "bracket-") + std::to_string(i) + ".gcode";
+    writeSdFile(("/jobs/farm/" + name).c_str(), "G28\n" + std::string(100 + (i * 37) % 50, 'G') + "\n");
+    farm.push_back(name);
+  }
+  CHECK(fileIndex.begin());
+  CHECK(fileIndex.isStale());
+
+  // Each directory by itself, its directories first
+  DynamicJsonDocument doc(16384);
+  std::vector<std::string> names = listFiles("", doc);
+  CHECK(names.size() > 0 && names[0] == "jobs" && doc["files"][0]["dir"].asInteger() == 1);
+  CHECK(std::find(names.begin(), names.end(), ".hidden") == names.end());
+  CHECK(std::find(names.begin(), names.end(), ".cache") == names.end());
+  CHECK(listFiles("d=/jobs", doc) == std::vector<std::string>({ "farm", "readme.gcode" }));
+  names = listFiles("d=/jobs/farm/", doc);
+  CHECK_EQ(names.size(), farm.size());
+  CHECK(sortedIgnoringCase(names));
+  CHECK(std::is_permutation(names.begin(), names.end(), farm.begin()));
+  AsyncWebServerRequest missing(HTTP_GET, "/files/list?d=/jobs/nowhere");
+  CHECK(webServer.handle(missing));
+  CHECK_EQ(missing.response()->code(), 404);
+
+  // By size or date, either way
+  listFiles("d=/jobs/farm&s=size", doc);
+  bool ascending = true;
+  for (size_t i = 1; i < doc["files"].size(); i++)
+    ascending = ascending && doc["files"][(int)i - 1]["size"].asInteger() <= doc["files"][(int)i]["size"].asInteger();
+  CHECK(ascending);
+  listFiles("d=/jobs/farm&s=size&r=1", doc);
+  bool descending = true;
+  for (size_t i = 1; i < doc["files"].size(); i++)
+    descending = descending && doc["files"][(int)i - 1]["size"].asInteger() >= doc["files"][(int)i]["size"].asInteger();
+  CHECK(descending);
+  listFiles("d=/jobs/farm&s=date", doc);
+  for (size_t i = 1; i < doc["files"].size(); i++)
+    ascending = ascending && doc["files"][(int)i - 1]["date"].asInteger() <= doc["files"][(int)i]["date"].asInteger();
+  CHECK(ascending);
+
+  // Searched by prefix, or anywhere in the name, ignoring case
+  names = listFiles("d=/jobs/farm&p=benchy-1", doc);
+  CHECK_EQ(names.size(), 6u);   // 1, 11, 13, 15, 17 and 19
+  CHECK(sortedIgnoringCase(names));
+  for (const std::string &name : names)
+    CHECK(strncasecmp(name.c_str(), "benchy-1", 8) == 0);
+  names = listFiles("d=/jobs/farm&q=T-2", doc);
+  CHECK(names == std::vector<std::string>({ "bracket-2.gcode", "bracket-20.gcode", "bracket-22.gcode", "bracket-24.gcode",
+                                            "bracket-26.gcode", "bracket-28.gcode" }));
+  std::vector<std::string> paged;
+  for (long long next = 0; ; ) {
+    getFiles("/files/list?d=/jobs/farm&q=T-2&n=4&i=" + String((int)next), doc);
+    if (doc["files"].size() == 0)
+      break;
+    for (size_t i = 0; i < doc["files"].size(); i++)
+      paged.push_back(doc["files"][(int)i]["name"].as<String>().c_str());
+    next = doc["next"].asInteger();
+  }
+  CHECK(paged == names);
+  CHECK(listFiles("p=zzz", doc).empty());
+
+  // Chosen and deleted by their path, the orders kept up to date
+  listFiles("d=/jobs/farm&p=Benchy-13", doc);
+  const String id = doc["files"][0]["id"].as<String>();
+  getFiles("/files/choose?id=" + id, doc);
+  CHECK(uploadedFullname == "/jobs/farm/Benchy-13.gcode");
+  getFiles("/files/delete?id=" + id, doc);
+  CHECK(!SD.exists("/jobs/farm/Benchy-13.gcode"));
+  SD.mkdir("/jobs/new");
+  writeSdFile("/jobs/new/Part.gcode", "G28\n");
+  CHECK(fileIndex.add("/jobs/new/Part.gcode"));
+  CHECK(fileIndex.findDirectory("/jobs/new") >= 0);
+  sdfat::hostStats = sdfat::HostStats();
+  names = listFiles("d=/jobs/farm", doc);
+  CHECK_EQ(names.size(), farm.size() - 1);
+  CHECK(sortedIgnoringCase(names));
+  CHECK(listFiles("d=/jobs", doc) == std::vector<std::string>({ "farm", "new", "readme.gcode" }));
+  CHECK(listFiles("d=/jobs/new&s=size", doc) == std::vector<std::string>({ "Part.gcode" }));
+  CHECK_EQ(sdfat::hostStats.writeCalls, 0u);    // Not sorted again
+
+  // Kept across a restart, and rebuilt when files were moved on a PC
+  CHECK(fileIndex.begin());
+  CHECK(!fileIndex.isStale());
+  sdfat::hostStats = sdfat::HostStats();
+  CHECK_EQ(listFiles("d=/jobs/farm&s=date", doc).size(), farm.size() - 1);
+  CHECK_EQ(sdfat::hostStats.writeCalls, 0u);
+  CHECK(SD.rename("/jobs/readme.gcode", "/jobs/farm/readme.gcode"));
+  CHECK(fileIndex.begin());
+  CHECK(fileIndex.isStale());
+  names = listFiles("d=/jobs/farm", doc);
+  CHECK(std::find(names.begin(), names.end(), "readme.gcode") != names.end());
+  CHECK(listFiles("d=/jobs", doc) == std::vector<std::string>({ "farm", "new" }));
+
+  // A folder goes with everything in it
+  CHECK(fileIndex.remove("/jobs/new"));
+  CHECK_EQ(fileIndex.find("/jobs/new/Part.gcode"), -1);
+  CHECK(listFiles("d=/jobs", doc) == std::vector<std::string>({ "farm" }));
+
+  for (const std::string &name : farm)
+    SD.remove(("/jobs/farm/" + name).c_str());
+  for (const char *name : { "/jobs/farm/readme.gcode", "/jobs/new/Part.gcode", "/.hidden/secret.gcode" })
+    SD.remove(name);
+  for (const char *name : { "/jobs/farm", "/jobs/new", "/jobs", "/.hidden" })
+    SD.rmdir(name);
+  CHECK(fileIndex.begin());
+  CHECK(fileIndex.refresh());
+}
+
+static void testFileLibrary() {
+  // Thousands of files, with a heap too short for the hash table and a sort
+  // made of many runs: files are found through the order by name
+  ESP.freeHeap = 30000;
+  SD.mkdir("/library");
+  const int files = 3000;
+  for (int i = 0; i < files; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "/library/job-%05d.gcode", (i * 7919) % files);
+    writeSdFile(name, "G28\n" + std::string(i % 97, 'G') + "\n");
+  }
+  CHECK(fileIndex.begin());
+  CHECK(fileIndex.refresh());
+  DynamicJsonDocument doc(1 << 20);
+  std::vector<std::string> names = listFiles("d=/library", doc);
+  CHECK_EQ(names.size(), (size_t)files);
+  CHECK(std::is_sorted(names.begin(), names.end()));
+  listFiles("d=/library&s=size&r=1", doc);
+  bool descending = doc["files"].size() == (size_t)files;
+  for (size_t i = 1; i < doc["files"].size(); i++)
+    descending = descending && doc["files"][(int)i - 1]["size"].asInteger() >= doc["files"][(int)i]["size"].asInteger();
+  CHECK(descending);
+
+  // A binary search, not a scan of the index
+  const uint32_t steps = 32 - __builtin_clz(fileIndex.getCount());
+  sdfat::hostStats = sdfat::HostStats();
+  CHECK(fileIndex.find("/library/job-01234.gcode") >= 0);
+  CHECK(sdfat::hostStats.sectorReads <= 4 * (steps + 2));
+  sdfat::hostStats = sdfat::HostStats();
+  CHECK(listFiles("d=/library&p=job-0123", doc) == std::vector<std::string>({
+    "job-01230.gcode", "job-01231.gcode", "job-01232.gcode", "job-01233.gcode", "job-01234.gcode",
+    "job-01235.gcode", "job-01236.gcode", "job-01237.gcode", "job-01238.gcode", "job-01239.gcode" }));
+  CHECK(sdfat::hostStats.sectorReads <= 8 * (steps + 2) + 2 * 10);
+
+  // Kept in order by uploads and deletes
+  writeSdFile("/library/job-01234-b.gcode", "G28\n");
+  CHECK(fileIndex.add("/library/job-01234-b.gcode"));
+  SD.remove("/library/job-00007.gcode");
+  CHECK(fileIndex.remove("/library/job-00007.gcode"));
+  names = listFiles("d=/library", doc);
+  CHECK_EQ(names.size(), (size_t)files);
+  CHECK(std::is_sorted(names.begin(), names.end()));
+  CHECK(std::find(names.begin(), names.end(), "job-01234-b.gcode") != names.end());
+
+  for (int i = 0; i < files; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "/library/job-%05d.gcode", i);
+    SD.remove(name);
+  }
+  SD.remove("/library/job-01234-b.gcode");
+  SD.rmdir("/library");
+  ESP.freeHeap = 40000;
+  CHECK(fileIndex.begin());
+  CHECK(fileIndex.refresh());
+}
+
+// The metadata of content, and its layer index as the one of gcodePath when given
+static GcodeMetadata analyze(const std::string &content, size_t chunk, const char *gcodePath = nullptr) {
+  GcodeAnalyzer analyzer;
+  analyzer.begin("/analyzed");
+  for (size_t index = 0; index < content.size(); index += chunk)
+    analyzer.write((const uint8_t *)content.data() + index, std::min(chunk, content.size() - index));
+  const GcodeMetadata metadata = analyzer.finish(content.size());
+  if (gcodePath)
+    analyzer.install(gcodePath);
+  else
+    analyzer.discard();
+  return metadata;
+}
+
+static bool near(double a, double b) {
+  return fabs(a - b) < 0.001;
+}
+
+static void testGcodeAnalyzer() {
+  const std::string cura =
+    ";FLAVOR:Marlin\r\n"
+    ";TIME:3723\r\n"
+    ";Filament used: 1.5m, 0.25m\r\n"
+    ";Layer height: 0.2\r\n"
+    "M140 S60\r\n"
+    "M104 S210 ; hot end\r\n"
+    "M190 S60\r\n"
+    "M109 S215\r\n"
+    "G28\r\n"
+    "G92 E0\r\n"
+    "G1 Z0.3 F3000\r\n"
+    "G1 X10 Y10\r\n"
+    ";LAYER_COUNT:3\r\n"
+    ";LAYER:0\r\n"
+    "G1 X20 Y10 E1\r\n"
+    "G1 X20 Y30 E2\r\n"
+    ";LAYER:1\r\n"
+    "G1 Z0.5\r\n"
+    "G1 X5 Y30 E3\r\n"
+    "G1 E2.5 ; retract\r\n"
+    ";LAYER:2\r\n"
+    "G1 Z0.7\r\n"
+    "G1 E3\r\n"
+    "G1 X5 Y5 E4\r\n"
+    "G1 Z10\r\n"
+    "G1 X100 Y100 ; travel\r\n"
+    "M117 Done X500 E9\r\n"
+    "M104 S0";
+  for (size_t chunk : { (size_t)1, (size_t)7, cura.size() }) {
+    const GcodeMetadata m = analyze(cura, chunk);
+    CHECK_EQ(m.magic, GCODE_METADATA_MAGIC);
+    CHECK_EQ(m.fileSize, cura.size());
+    CHECK_EQ(m.estimatedTime, 3723u);
+    CHECK(near(m.filamentLength, 1750));
+    CHECK(near(m.layerHeight, 0.2));
+    CHECK_EQ(m.layerCount, 3u);
+    CHECK(near(m.extruderTemperature, 210) && near(m.bedTemperature, 60));
+    CHECK(near(m.minX, 5) && near(m.maxX, 20) && near(m.minY, 5) && near(m.maxY, 30));
+    CHECK(near(m.minZ, 0.3) && near(m.maxZ, 0.7));
+  }
+
+  // PrusaSlicer: layer comments and a footer, relative extrusion
+  std::string prusa = "M83\nM190 S55\nM104 S200\n";
+  for (int layer = 0; layer < 4; layer++)
+    prusa += ";LAYER_CHANGE\n;Z:" + std::to_string(0.2 + layer * 0.15) + "\nG1 Z" + std::to_string(0.2 + layer * 0.15) + "\nG1 X1 Y1\nG1 X50 Y1 E2.5\nG1 E-0.8\nG1 X50 Y40 E0.8\n";
+  prusa +=
+    "; filament used [mm] = 1234.5\n"
+    "; filament used [cm3] = 2.97\n"
+    "; filament used [g] = 3.70\n"
+    "; estimated printing time (normal mode) = 1d 1h 2m 3s\n"
+    "; first_layer_height = 0.2\n"
+    "; layer_height = 0.15\n";
+  GcodeMetadata m = analyze(prusa, 13);
+  CHECK_EQ(m.estimatedTime, 90123u);
+  CHECK(near(m.filamentLength, 1234.5) && near(m.filamentVolume, 2.97) && near(m.filamentWeight, 3.7));
+  CHECK(near(m.layerHeight, 0.15));
+  CHECK_EQ(m.layerCount, 4u);
+  CHECK(near(m.extruderTemperature, 200) && near(m.bedTemperature, 55));
+  CHECK(near(m.minX, 1) && near(m.maxX, 50) && near(m.maxY, 40) && near(m.maxZ, 0.65));
+
+  // Without slicer comments the layers come from the moves
+  std::string plain = "G90\nM82\nG92 E0\n";
+  for (int layer = 1; layer <= 5; layer++)
+    plain += "G0 Z" + std::to_string(layer * 0.25) + "\nG1 X10 Y10 E" + std::to_string(layer) + "\nG0 Z20\nG0 X0 Y0\nG0 Z" + std::to_string(layer * 0.25) + "\n";
+  m = analyze(plain, 64);
+  CHECK_EQ(m.estimatedTime, 0u);
+  CHECK_EQ(m.layerCount, 5u);
+  CHECK(near(m.layerHeight, 0.25));
+  CHECK(near(m.maxZ, 1.25));
+  // And with no extruding move there is no box
+  m = analyze("G28\nG1 X10 Y10 Z5\n", 64);
+  CHECK_EQ(m.layerCount, 0u);
+  CHECK(near(m.minX, 0) && near(m.maxX, 0));
+
+  // Taken at upload and given by the job API, until the file is deleted
+  upload("sliced.gcode", cura);
+  DynamicJsonDocument doc(4096);
+  getFiles("/api/job", doc);
+  CHECK_EQ(doc["job"]["estimatedPrintTime"].asInteger(), 3723);
+  CHECK(near(doc["job"]["filament"]["tool0"]["length"].asFloat(), 1750));
+  CHECK_EQ(doc["job"]["analysis"]["layers"].asInteger(), 3);
+  CHECK(near(doc["job"]["analysis"]["printingArea"]["maxY"].asFloat(), 30));
+  GcodeMetadata loaded;
+  CHECK(GcodeAnalyzer::load("/sliced.gcode", cura.size(), loaded));
+  CHECK(!GcodeAnalyzer::load("/sliced.gcode", cura.size() + 1, loaded));
+
+  upload("other.gcode", "G28\nG1 X1\n", nullptr, 4);
+  getFiles("/api/job", doc);
+  CHECK(doc["job"]["estimatedPrintTime"].isNull());
+  CHECK(doc["job"]["filament"] == "");
+  CHECK_EQ(doc["job"]["analysis"]["layers"].asInteger(), 0);
+
+  CHECK(fileIndex.begin());
+  const int32_t record = fileIndex.find("/sliced.gcode");
+  FileIndexEntry entry;
+  CHECK(record >= 0 && fileIndex.get(record, entry));
+  getFiles("/files/delete?id=" + FileIndex::getId(record, entry), doc);
+  CHECK(!GcodeAnalyzer::load("/sliced.gcode", cura.size(), loaded));
+  storageFS.remove("/other.gcode");
+  GcodeCompactor::remove("/other.gcode");
+  GcodeAnalyzer::remove("/other.gcode");
+}
+
+static std::vector<GcodeLayer> readLayers(const char *gcodePath, uint32_t fileSize) {
+  GcodeLayerIndex index;
+  std::vector<GcodeLayer> layers;
+  GcodeLayer layer;
+  if (index.open(gcodePath, fileSize))
+    for (uint32_t n = 0; index.get(n, layer); n++)
+      layers.push_back(layer);
+  index.close();
+  return layers;
+}
+
+static void testGcodeLayers() {
+  // Cura: a slow first layer, then four quick ones
+  std::string cura = ";FLAVOR:Marlin\n;TIME:1000\nM109 S210\nG28\nG92 E0\n";
+  std::vector<size_t> starts;
+  const uint32_t elapsed[] = { 0, 600, 700, 800, 900 };
+  for (int layer = 0; layer < 5; layer++) {
+    if (layer > 0)
+      cura += ";TIME_ELAPSED:" + std::to_string(elapsed[layer]) + ".0\n";
+    starts.push_back(cura.size());
+    cura += ";LAYER:" + std::to_string(layer) + "\nG0 Z" + std::to_string(0.2 * (layer + 1)) + "\n";
+    for (int i = 0; i < 20; i++)
+      cura += "G1 X" + std::to_string(i) + " Y" + std::to_string(layer) + " E" + std::to_string(layer * 20 + i + 1) + "\n";
+  }
+  cura += ";TIME_ELAPSED:1000.0\nM104 S0\n";
+  analyze(cura, 5, "/layers.gcode");
+  std::vector<GcodeLayer> layers = readLayers("/layers.gcode", cura.size());
+  CHECK_EQ(layers.size(), 5u);
+  bool offsets = true, times = true;
+  for (size_t i = 0; i < layers.size(); i++) {
+    offsets &= layers[i].offset == starts[i] && cura.compare(layers[i].offset, 7, ";LAYER:") == 0;
+    times &= layers[i].time == elapsed[i];
+  }
+  CHECK(offsets);
+  CHECK(times);
+  CHECK_EQ(layers[1].line, 5u + 23u);
+  CHECK(readLayers("/layers.gcode", cura.size() + 1).empty());
+
+  GcodeLayerIndex index;
+  CHECK(index.open("/layers.gcode", cura.size()));
+  CHECK_EQ(index.getCount(), 5u);
+  index.update(10, 30);
+  CHECK_EQ(index.getLayer(), 0u);
+  CHECK_EQ(index.getTimeLeft(10, 30), -1);
+  index.update(layers[0].offset, 30);
+  // Halfway through the first layer is 30% of the print by the slicer times
+  const uint32_t middle = (layers[0].offset + layers[1].offset) / 2;
+  index.update(middle, 330);
+  CHECK_EQ(index.getLayer(), 1u);
+  CHECK(fabs(index.getCompletion(middle) - 30) < 0.5);
+  // Printing at the slicer pace since the first layer, heating aside
+  CHECK(abs(index.getTimeLeft(middle, 330) - 700) <= 5);
+  index.update(layers[3].offset, 730);
+  CHECK_EQ(index.getLayer(), 4u);
+  CHECK(fabs(index.getCompletion(layers[3].offset) - 80) < 0.5);
+  // Twice slower than the slicer said, the rest will be too
+  CHECK(abs(index.getTimeLeft(layers[3].offset, 1630) - 400) <= 5);
+  index.update(cura.size(), 2000);
+  CHECK_EQ(index.getLayer(), 5u);
+  CHECK(fabs(index.getCompletion(cura.size()) - 100) < 0.01);
+  CHECK_EQ(index.getTimeLeft(cura.size(), 2000), 0);
+  index.close();
+
+  // PrusaSlicer times from M73, the moves before the first layer comment are not a layer
+  std::string prusa = "M73 P0 R10\nM73 Q0 S11\nG1 Z0.3\nG1 X0 Y0\nG1 X60 Y0 E9 ; purge\n";
+  for (int layer = 0; layer < 3; layer++)
+    prusa += ";LAYER_CHANGE\n;Z:" + std::to_string(0.2 * (layer + 1)) + "\nM73 P" + std::to_string(layer * 30) + " R" + std::to_string(10 - layer * 3) +
+             "\nG1 Z" + std::to_string(0.2 * (layer + 1)) + "\nG1 X10 Y10 E" + std::to_string(10 + layer) + "\n";
+  GcodeMetadata m = analyze(prusa, 64, "/prusa.gcode");
+  CHECK_EQ(m.estimatedTime, 600u);
+  layers = readLayers("/prusa.gcode", prusa.size());
+  CHECK_EQ(layers.size(), 3u);
+  CHECK(layers.size() == 3 && layers[0].time == 0 && layers[1].time == 180 && layers[2].time == 360);
+
+  // Without comments the layers are the heights of the extruding moves, with no times
+  std::string plain = "G92 E0\n";
+  starts.clear();
+  for (int layer = 1; layer <= 4; layer++) {
+    plain += "G0 Z" + std::to_string(layer * 0.3) + "\n";
+    starts.push_back(plain.size());
+    plain += "G1 X10 Y10 E" + std::to_string(layer) + "\nG1 X0 Y0\n";
+  }
+  analyze(plain, 64, "/plain.gcode");
+  layers = readLayers("/plain.gcode", plain.size());
+  CHECK_EQ(layers.size(), 4u);
+  CHECK(layers.size() == 4 && layers[2].offset == starts[2] && layers[3].time == 0);
+  CHECK(index.open("/plain.gcode", plain.size()));
+  index.update(layers[2].offset, 100);
+  index.update(layers[2].offset, 300);
+  CHECK(fabs(index.getCompletion(layers[2].offset) - 50) < 0.01);
+  CHECK_EQ(index.getTimeLeft(layers[2].offset, 300), 200);
+  index.close();
+  for (const char *path : { "/layers.gcode", "/prusa.gcode", "/plain.gcode" })
+    GcodeAnalyzer::remove(path);
+
+  // A print follows its layers, and the job API gives them
+  resetPrinter();
+  upload("layered.gcode", cura);
+  startPrint = true;
+  uint32_t maxLayer = 0;
+  bool increasing = true, checked = false;
+  for (int i = 0; i < 3000 && (startPrint || isPrinting || !commandQueue.isEmpty()); i++) {
+    NativeLoop();
+    acknowledge();
+    if (isPrinting) {
+      increasing &= printLayers.getLayer() >= maxLayer;
+      maxLayer = printLayers.getLayer();
+      if (maxLayer == 2 && !checked) {
+        DynamicJsonDocument doc(4096);
+        getFiles("/api/job", doc);
+        CHECK_EQ(doc["progress"]["layer"].asInteger(), 2);
+        CHECK_EQ(doc["progress"]["layers"].asInteger(), 5);
+        CHECK(doc["progress"]["printTimeLeftOrigin"] == "estimate");
+        CHECK(doc["progress"]["completion"].asFloat() >= 60 && doc["progress"]["completion"].asFloat() <= 70);
+        checked = true;
+      }
+    }
+    HostClock::advance(5);
+  }
+  CHECK(!isPrinting);
+  CHECK(increasing);
+  CHECK(checked);
+  CHECK(printCompletion >= 99.9);
+  storageFS.remove("/layered.gcode");
+  GcodeCompactor::remove("/layered.gcode");
+  GcodeAnalyzer::remove("/layered.gcode");
+}
+
+// The state the lines of content up to offset leave
+static GcodeState stateAt(const std::string &content, size_t offset) {
+  GcodeState state;
+  for (const std::string &line : splitLines(content.substr(0, offset))) {
+    char text[GCODE_MAX_LINE_LENGTH + 1];
+    strcpy(text, line.c_str());
+    text[GcodeReader::strip(text, line.size())] = '\0';
+    state.apply(text);
+  }
+  return state;
+}
+
+static void testPrintCheckpoint() {
+  resetPrinter();
+  std::string content = "M140 S60\nM104 S205\nM190 S60\nM109 S205\nG28\nG90\nM83\nG92 E0\nM106 S128\nG1 Z0.3 F600\n";
+  // Lines and comments of many lengths, the compacted copy is not in step with the file between its map points
+  for (int i = 0; i < 3000; i++)
+    content += "G1 X" + std::to_string(i % 200) + ".000 Y" + std::to_string(i / 200) + " E0.05 F1800 ; extrude" +
+               std::string(i * 7 % 41, '.') + "\n" + (i % 13 == 0 ? ";" + std::string(i % 60, 'c') + "\n" : "") +
+               (i % 500 == 499 ? "G1 Z" + std::to_string(0.3 + (i + 1) / 500 * 0.2) + "\n" : "");
+  content += "M107\nM104 S0\n";
+  upload("long.gcode", content);
+  const std::string compacted = readSdFile(GCODE_CACHE_DIR "/long.gcode");
+  CHECK(!compacted.empty());
+
+  // A second of printing on each pass, cut after 100. It is followed at the start of the lines of the copy it reads.
+  startPrint = true;
+  bool lineStarts = true;
+  for (int i = 0; i < 100; i++) {
+    NativeLoop();
+    acknowledge();
+    HostClock::advance(1000);
+    lineStarts &= checkpoint.getOffset() == 0 || compacted[checkpoint.getOffset() - 1] == '\n';
+  }
+  CHECK(isPrinting);
+  CHECK(lineStarts);
+  const uint32_t cutTime = printTime;
+
+  // The reboot
+  resetPrinter();
+  printerState = GcodeState();
+  loadRecovery();
+  CHECK(recoveryFullname == "/long.gcode");
+  PrintCheckpointRecord record;
+  CHECK(PrintCheckpoint::load(record));
+  CHECK(strcmp(record.path, "/long.gcode") == 0);
+  CHECK_EQ(record.fileSize, content.size());
+  // At most one every CHECKPOINT_INTERVAL, of a line done by the printer
+  CHECK(record.sequence >= 2 && record.sequence <= cutTime / CHECKPOINT_INTERVAL + 1);
+  CHECK(record.printTime <= cutTime && record.printTime + CHECKPOINT_INTERVAL + 1 >= cutTime);
+  CHECK(record.compacted);
+  CHECK(record.offset > 0 && record.offset < compacted.size() && compacted[record.offset - 1] == '\n');
+  CHECK(record.line > 0 && record.line < (uint32_t)std::count(content.begin(), content.end(), '\n'));
+  const GcodeState expected = stateAt(compacted, record.offset);
+  CHECK(memcmp(expected.position, record.state.position, sizeof(expected.position)) == 0);
+  CHECK(record.state.relativeE && !record.state.relative);
+  CHECK(record.state.extruderTarget == 205 && record.state.bedTarget == 60 && record.state.fan == 128);
+  CHECK(record.state.feedrate == 1800);
+
+  // A write cut in the last slot leaves the one before
+  const std::string saved = readSdFile(CHECKPOINT_PATH);
+  std::string torn = saved;
+  torn[(record.sequence % CHECKPOINT_SLOTS) * GCODE_BLOCK_SIZE + 100] ^= 1;
+  writeSdFile(CHECKPOINT_PATH, torn);
+  PrintCheckpointRecord previous;
+  CHECK(PrintCheckpoint::load(previous));
+  CHECK_EQ(previous.sequence, record.sequence - 1);
+  CHECK(previous.compacted && previous.offset > 0 && compacted[previous.offset - 1] == '\n');
+  writeSdFile(CHECKPOINT_PATH, saved);
+
+  DynamicJsonDocument doc(4096);
+  getFiles("/status", doc);
+  CHECK(doc["recovery"]["name"] == "long.gcode");
+  CHECK_EQ(doc["recovery"]["line"].asInteger(), record.line);
+
+  // Resumed: heated, homed in X and Y, back in place, then the next line
+  DynamicJsonDocument command(256);
+  deserializeJson(command, "{\"command\":\"recover\"}");
+  CHECK_EQ(apiJobHandler(command.as<JsonObject>()), 204);
+  std::vector<std::string> sent;
+  for (int i = 0; i < 2000 && (recoverPrint || isPrinting || !commandQueue.isEmpty()); i++) {
+    NativeLoop();
+    for (const std::string &line : acknowledge())
+      sent.push_back(line);
+    HostClock::advance(1000);
+  }
+  CHECK(!isPrinting);
+  const auto g92 = std::find(sent.begin(), sent.end(), "G92 Z" + std::string(String(expected.position[GcodeState::Z], 3).c_str()));
+  CHECK(g92 != sent.end());
+  CHECK(std::find(sent.begin(), g92, "M109 S205") != g92);
+  CHECK(std::find(g92, sent.end(), "G28 X Y") != sent.end());
+  const auto e = std::find(g92, sent.end(), "G92 E" + std::string(String(expected.position[GcodeState::E], 5).c_str()));
+  CHECK(e != sent.end());
+  CHECK(e + 4 < sent.end() && e[1] == "M83" && e[2] == "M106 S128" && e[3] == "G1 F1800");
+  const std::string next = compacted.substr(record.offset, compacted.find('\n', record.offset) - record.offset);
+  CHECK(e + 4 < sent.end() && e[4] == next);
+  CHECK_EQ((size_t)std::count(sent.begin(), sent.end(), "M107"), 1u);
+  CHECK(printCompletion >= 99.9);
+  CHECK(printTime >= record.printTime);
+  // Done, there is nothing to resume
+  CHECK(readSdFile(CHECKPOINT_PATH).empty());
+  CHECK(recoveryFullname == "");
+  loadRecovery();
+  CHECK(recoveryFullname == "");
+  CHECK_EQ(apiJobHandler(command.as<JsonObject>()), 409);
+  storageFS.remove("/long.gcode");
+  GcodeCompactor::remove("/long.gcode");
+  GcodeAnalyzer::remove("/long.gcode");
+}
+
+static void testStartLayer() {
+  resetPrinter();
+  std::string content = "M140 S60\nM190 S60\nM109 S210\nG28\nG92 E0\n";
+  for (int layer = 0; layer < 5; layer++) {
+    content += ";LAYER:" + std::to_string(layer) + "\n" + (layer == 2 ? "M106 S200\n" : "") + "G0 Z" + std::to_string(0.2 * (layer + 1)) + "\n";
+    for (int i = 0; i < 20; i++)
+      content += "G1 X" + std::to_string(i) + " Y" + std::to_string(layer) + " E" + std::to_string(layer * 20 + i + 1) + (i == 0 ? " F1500" : "") + "\n";
+  }
+  content += "M107\nM104 S0\n";
+  upload("fromlayer.gcode", content);
+
+  // Each layer of the index has the state the lines before it leave
+  std::vector<GcodeLayer> layers = readLayers("/fromlayer.gcode", content.size());
+  CHECK_EQ(layers.size(), 5u);
+  bool states = true;
+  for (const GcodeLayer &layer : layers) {
+    const GcodeState expected = stateAt(content, layer.offset);
+    states &= memcmp(&expected, &layer.state, sizeof(expected)) == 0;
+  }
+  CHECK(states);
+  CHECK(layers.size() == 5 && layers[3].state.fan == 200 && layers[3].state.position[GcodeState::E] == 60);
+
+  // Only layers of the index
+  DynamicJsonDocument command(256);
+  deserializeJson(command, "{\"command\":\"start\",\"layer\":6}");
+  CHECK_EQ(apiJobHandler(command.as<JsonObject>()), 400);
+  deserializeJson(command, "{\"command\":\"start\",\"layer\":-1}");
+  CHECK_EQ(apiJobHandler(command.as<JsonObject>()), 400);
+  CHECK(!startPrint);
+
+  // Only with Z homed, or the Z of the printer trusted, as it is not homed again
+  auto sendAll = [](std::initializer_list<const char *> lines) {
+    for (const char *line : lines)
+      commandQueue.push(line);
+    for (int i = 0; i < 20 && !commandQueue.isEmpty(); i++) {
+      NativeLoop();
+      acknowledge();
+    }
+  };
+  zHomed = false;
+  deserializeJson(command, "{\"command\":\"start\",\"layer\":4}");
+  CHECK_EQ(apiJobHandler(command.as<JsonObject>()), 412);
+  sendAll({ "G28 X Y", "M84 S60" });
+  CHECK(!zHomed);
+  sendAll({ "G28" });
+  CHECK(zHomed);
+  sendAll({ "M18 E", "M84 S60", "G280" });
+  CHECK(zHomed);
+  sendAll({ "M18" });
+  CHECK(!zHomed);
+  deserializeJson(command, "{\"command\":\"start\",\"layer\":4,\"trustZ\":true}");
+  CHECK_EQ(apiJobHandler(command.as<JsonObject>()), 204);
+  startPrint = false;   // Not this time
+  sendAll({ "G28 Z" });
+  CHECK(zHomed);
+
+  // From layer 4: heated, homed in X and Y with Z kept, the state back, then its first line
+  deserializeJson(command, "{\"command\":\"start\",\"layer\":4}");
+  CHECK_EQ(apiJobHandler(command.as<JsonObject>()), 204);
+  std::vector<std::string> sent;
+  uint32_t firstLayer = 0;
+  for (int i = 0; i < 2000 && (startPrint || isPrinting || !commandQueue.isEmpty()); i++) {
+    NativeLoop();
+    if (isPrinting && firstLayer == 0)
+      firstLayer = printLayers.getLayer();
+    for (const std::string &line : acknowledge())
+      sent.push_back(line);
+    HostClock::advance(5);
+  }
+  CHECK(!isPrinting);
+  CHECK_EQ(firstLayer, 4u);
+  CHECK(std::find(sent.begin(), sent.end(), "M109 S210") != sent.end());
+  CHECK(std::none_of(sent.begin(), sent.end(), [](const std::string &line) { return line.compare(0, 5, "G92 Z") == 0; }));
+  const auto home = std::find(sent.begin(), sent.end(), "G28 X Y");
+  CHECK(home != sent.end());
+  const auto e = std::find(home, sent.end(), "G92 E60.00000");
+  CHECK(e + 4 < sent.end() && e[1] == "M82" && e[2] == "M106 S200" && e[3] == "G1 F1500" && e[4] == "G0 Z0.800000");
+  CHECK(std::find(sent.begin(), sent.end(), "G1 X19 Y2 E60") == sent.end());
+  CHECK(std::find(sent.begin(), sent.end(), "G1 X19 Y4 E100") != sent.end());
+  CHECK(printCompletion >= 99.9);
+  storageFS.remove("/fromlayer.gcode");
+  GcodeCompactor::remove("/fromlayer.gcode");
+  GcodeAnalyzer::remove("/fromlayer.gcode");
+}
+
+static void testChecksums() {
+  // Line format
+  resetPrinter();
+  printerConnected = useChecksums = true;
+  fwAdvancedOkCap = false;    // One command at a time
+  commandQueue.push("M110 N0");
+  commandQueue.push("G1 X1");
+  NativeLoop();
+  CHECK(Serial.takeWritten() == "N0 M110 N0*125\r\n");
+  Serial.inject("ok\n");
+  NativeLoop();
+  NativeLoop();
+  CHECK(Serial.takeWritten() == "N1 G1 X1*96\r\n");
+  CHECK_EQ(printerUsedBuffer, 13);    // The line as sent, not the command
+  Serial.inject("ok\n");
+  NativeLoop();
+  CHECK(commandQueue.isEmpty());
+  CHECK_EQ(printerUsedBuffer, 0);
+
+  // "Resend:" replays and its ok does not acknowledge anything
+  commandQueue.push("G1 X2");
+  commandQueue.push("G1 X3");
+  NativeLoop();
+  CHECK(Serial.takeWritten() == "N2 G1 X2*96\r\n");
+  Serial.inject("Error:checksum mismatch, Last Line: 1\nResend: 2\nok\n");
+  NativeLoop();
+  CHECK(!cancelPrint);
+  CHECK_EQ(commandQueue.getCount(), 2);
+  NativeLoop();
+  CHECK(Serial.takeWritten() == "N2 G1 X2*96\r\n");
+  Serial.inject("ok\n");
+  NativeLoop();
+  NativeLoop();
+  CHECK(Serial.takeWritten() == "N3 G1 X3*96\r\n");
+  Serial.inject("rs N3\nok\n");
+  NativeLoop();
+  NativeLoop();
+  CHECK(Serial.takeWritten() == "N3 G1 X3*96\r\n");
+  Serial.inject("ok\n");
+  NativeLoop();
+  CHECK(commandQueue.isEmpty());
+
+  // A line older than the ones kept cannot be sent again, the print stops instead of skipping it
+  isPrinting = true;
+  commandQueue.push("G1 X4");
+  SendCommands();
+  CHECK(Serial.takeWritten().compare(0, 9, "N4 G1 X4*") == 0);
+  Serial.inject("Error:Line Number is not Last Line Number+1, Last Line: 1\nResend: 2\nok\n");
+  ReceiveResponses();
+  CHECK(cancelPrint);
+  CHECK_EQ(nextLineNumber, 5u);
+  SendCommands();
+  CHECK(Serial.takeWritten().empty());
+  resetPrinter();
+
+  // A print over a noisy line
+  resetPrinter();
+  std::string content = "G28\nG1 F3000\n";
+  for (int i = 0; i < 200; i++)
+    content += "G1 X" + std::to_string(10 + i % 2) + " Y" + std::to_string(i) + " E" + std::to_string(i) + "\n";
+  writeSdFile("/noisy.gcode", content);
+  PrinterSimulator::Config cfg;
+  cfg.corruptEvery = 500;
+  PrinterSimulator printer(Serial, cfg);
+  commandQueue.push("M110 N0");
+  uploadedFullname = "/noisy.gcode";
+  uploadedFileSize = content.size();
+  startPrint = true;
+  runSimulated(printer, 60000);
+  CHECK(!isPrinting);
+  CHECK(commandQueue.isEmpty());
+  CHECK(printer.stats().resends > 0);
+  CHECK_EQ(printer.stats().corruptCommands, 0u);
+  CHECK_EQ(printer.stats().moves, 201u);
+  useChecksums = false;
+}
+
+static void testMeatPack() {
+  uint8_t packed[MeatPack::maxPackedLength(COMMAND_MAX_LENGTH)];
+  CHECK_EQ(MeatPack::pack("G1 X1", 5, packed), 3u);
+  CHECK(packed[0] == 0x1D && packed[1] == 0xEB && packed[2] == 0xC1);
+  // Other characters follow the byte of their pair
+  CHECK_EQ(MeatPack::pack("M1", 2, packed), 3u);
+  CHECK(packed[0] == 0x1F && packed[1] == 'M' && packed[2] == 0xCC);
+  CHECK_EQ(MeatPack::pack("MT", 2, packed), 4u);
+  CHECK(packed[0] == 0xFF && packed[1] == 'M' && packed[2] == 'T' && packed[3] == 0xCC);
+  const char *move = "G1 X104.982 Y100.872 E0.126 F3600";
+  CHECK_EQ(MeatPack::packedLength(move, strlen(move)), MeatPack::pack(move, strlen(move), packed));
+  CHECK(MeatPack::packedLength(move, strlen(move)) < strlen(move) * 2 / 3);
+
+  // Enabled when detected, the simulated printer unpacks it
+  resetPrinter();
+  printerConnected = false;
+  PrinterSimulator::Config cfg;
+  cfg.heatRate = 100;
+  cfg.meatPack = true;
+  PrinterSimulator printer(Serial, cfg);
+  for (int i = 0; i < 100000 && !(printerConnected && meatPackActive); i++) {
+    NativeLoop();
+    HostClock::advanceMicros(100);
+    printer.update();
+  }
+  CHECK(fwMeatPackCap);
+  CHECK(meatPackActive);
+
+  std::string content = "G28\nM109 S200\nG1 F3000\n";
+  for (int i = 0; i < 200; i++)
+    content += "G1 X" + std::to_string(10 + i % 2) + ".5 Y" + std::to_string(i) + " E" + std::to_string(i) + "\n";
+  writeSdFile("/packed.gcode", content);
+  uploadedFullname = "/packed.gcode";
+  uploadedFileSize = content.size();
+  printer.resetStats();
+  startPrint = true;
+  runSimulated(printer, 60000);
+  CHECK(!isPrinting);
+  CHECK_EQ(printer.stats().moves, 201u);
+  CHECK(!printer.halted());
+  CHECK(printer.stats().bytesReceived < content.size() * 2 / 3);
+
+  fwMeatPackCap = meatPackActive = false;
+}
+
+int main() {
+  char tmpl[] = "/tmp/nwp-sd-XXXXXX";
+  sdRoot = mkdtemp(tmpl);
+  sdfat::SdFat::setHostRoot(sdRoot.c_str());
+  PrinterSetup();
+
+  struct { const char *name; void (*run)(); } tests[] = {
+    { "CommandQueue", testCommandQueue },
+    { "parseTemperatures", testParseTemperatures },
+    { "responseLines", testResponseLines },
+    { "classifyResponses", testClassifyResponses },
+    { "GcodeReader", testGcodeReader },
+    { "detectPrinter", testDetectPrinter },
+    { "firmwareDialects", testFirmwareDialects },
+    { "printFile", testPrintFile },
+    { "GcodeCompactor", testGcodeCompactor },
+    { "uploadWrites", testUploadWrites },
+    { "contiguousUpload", testContiguousUpload },
+    { "gzipUpload", testGzipUpload },
+    { "gzipPrint", testGzipPrint },
+    { "receiveTimeout", testReceiveTimeout },
+    { "advancedOk", testAdvancedOk },
+    { "simulatedPrint", testSimulatedPrint },
+    { "uploadQueue", testUploadQueue },
+    { "fileIndex", testFileIndex },
+    { "fileListStream", testFileListStream },
+    { "fileFolders", testFileFolders },
+    { "fileLibrary", testFileLibrary },
+    { "GcodeAnalyzer", testGcodeAnalyzer },
+    { "GcodeLayers", testGcodeLayers },
+    { "printCheckpoint", testPrintCheckpoint },
+    { "startLayer", testStartLayer },
+    { "checksums", testChecksums },
+    { "MeatPack", testMeatPack },
+  };
+  for (auto &t : tests) {
+    const int before = failures;
+    t.run();
+    printf("%s %s\n", failures == before ? "PASS" : "FAIL", t.name);
+  }
+
+  printf("%d checks, %d failures\n", checks, failures);
+  std::string cleanup = "rm -rf '" + sdRoot + "'";
+  if (system(cleanup.c_str()) != 0)
+    printf("could not remove %s\n", sdRoot.c_str());
+  return failures ? 1 : 0;
+}